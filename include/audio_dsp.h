@@ -0,0 +1,71 @@
+/*
+ * audio_dsp.h - Sample processing kernels for the audio output
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _AUDIO_DSP_H
+#define _AUDIO_DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Gains are fixed point with 12 fractional bits, up to almost 8 */
+#define OTTS_DSP_GAIN_SHIFT 12
+#define OTTS_DSP_GAIN_UNITY (1 << OTTS_DSP_GAIN_SHIFT)
+
+/*
+ * One implementation of the kernels.  The pointers of in and out may
+ * be the same, otherwise the buffers must not overlap.
+ */
+typedef struct {
+	const char *name;
+	/* Swap the bytes of n 16-bit samples in place */
+	void (*swap16) (int16_t * samples, size_t n);
+	/* Multiply n samples by gain, saturating */
+	void (*scale16) (int16_t * out, const int16_t * in, size_t n,
+			 int gain);
+	/* Duplicate each of the frames into two channels, out holds
+	   2 * frames samples and must not be in */
+	void (*mono_to_stereo16) (int16_t * out, const int16_t * in,
+				  size_t frames);
+	/* Convert n samples to floats in [-1, 1) */
+	void (*s16_to_float) (float *out, const int16_t * in, size_t n);
+} otts_dsp_kernels_t;
+
+/* The fastest kernels the processor supports */
+const otts_dsp_kernels_t *otts_dsp(void);
+
+/* The i-th kernels the processor supports, NULL after the last one.
+   The 0th are the plain C ones. */
+const otts_dsp_kernels_t *otts_dsp_kernels(int i);
+
+/* The gain for a volume between OTTS_VOICE_VOLUME_MIN and _MAX */
+int otts_dsp_volume_gain(int volume);
+
+#define otts_dsp_swap16(samples, n) \
+	otts_dsp()->swap16(samples, n)
+#define otts_dsp_scale16(out, in, n, gain) \
+	otts_dsp()->scale16(out, in, n, gain)
+#define otts_dsp_mono_to_stereo16(out, in, frames) \
+	otts_dsp()->mono_to_stereo16(out, in, frames)
+#define otts_dsp_s16_to_float(out, in, n) \
+	otts_dsp()->s16_to_float(out, in, n)
+
+#endif
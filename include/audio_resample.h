@@ -0,0 +1,64 @@
+/*
+ * audio_resample.h - Sample rate conversion for the audio output
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _AUDIO_RESAMPLE_H
+#define _AUDIO_RESAMPLE_H
+
+#include <stdint.h>
+
+/* Values of the AudioResampleQuality option */
+typedef enum {
+	OTTS_RESAMPLE_NONE = 0,	/* No conversion, the device follows
+				   the format of the samples */
+	OTTS_RESAMPLE_FAST = 1,	/* Linear interpolation */
+	OTTS_RESAMPLE_MEDIUM = 2,	/* Short windowed sinc filter */
+	OTTS_RESAMPLE_BEST = 3	/* Long windowed sinc filter */
+} otts_resample_quality_t;
+
+typedef struct otts_resampler otts_resampler_t;
+
+/* The quality named by str, -1 if there is no such quality */
+int otts_resample_quality(const char *str);
+
+/* A converter of interleaved 16-bit frames from in_rate to out_rate */
+otts_resampler_t *otts_resampler_new(otts_resample_quality_t quality,
+				     int channels, int in_rate, int out_rate);
+
+void otts_resampler_free(otts_resampler_t * r);
+
+/* Forget the frames passed so far, for an unrelated stream */
+void otts_resampler_reset(otts_resampler_t * r);
+
+/* The most frames otts_resampler_process() gives for in_frames, or
+   otts_resampler_flush() for 0 */
+int otts_resampler_max_out(otts_resampler_t * r, int in_frames);
+
+/* Convert in_frames of in to out, returns the number of frames put in
+   out.  Some frames are held back until more input comes. */
+int otts_resampler_process(otts_resampler_t * r, int16_t * out,
+			   const int16_t * in, int in_frames);
+
+/* Put the frames held back to out at the end of the stream, returns
+   their number.  The resampler is ready for a new stream afterwards. */
+int otts_resampler_flush(otts_resampler_t * r, int16_t * out);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * modproto.h - binary framing of the output module protocol
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef MODPROTO_H
+#define MODPROTO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Version 1 is the line based text protocol.  Once the module has
+ * answered INIT, openttsd sends "PROTOCOL 2".  A module which accepts
+ * it replies with a 2xx code and from then on both sides only exchange
+ * frames: a fixed header followed by length bytes of payload.  Modules
+ * that don't know the command reply with an error and stay on the
+ * text protocol.
+ *
+ * Every request carries a sequence number which the module copies
+ * into its REPLY frame.  EVENT frames are not bound to any request,
+ * they carry the event code (700 - 705) in arg and the index mark
+ * name, if any, as the payload.  The optional 705 event comes before
+ * the END of a message and carries "first_audio_ms synthesis_ms
+ * audio_ms", the timing of its synthesis.  REPLY frames carry the numeric reply
+ * code in arg and the complete text reply as the payload.
+ *
+ * PREPARE carries the message openttsd expects to send next with
+ * SPEAK, so the module can synthesize it while the current message
+ * is playing.  The module only uses the result if the next SPEAK
+ * carries the same text with the same settings, otherwise it drops
+ * it.  Modules which can't synthesize ahead reply with 300.
+ *
+ * Modules built as plugins run inside openttsd instead, on a thread
+ * started in OTTS_MODULE_PLUGIN_MAIN.  They skip the text protocol,
+ * the reply to the initialization comes as a REPLY frame with
+ * sequence number 0, and QUIT ends the thread instead of the process.
+ *
+ * Besides the frames, openttsd passes the module a cancel descriptor,
+ * OTTS_MODULE_CANCEL_FD for module processes.  Every byte written to
+ * it makes the module stop speaking at once, without waiting for the
+ * requests before the STOP frame which follows it.  Modules which
+ * don't know about it just never read it.
+ */
+
+#define OTTS_MODPROTO_VERSION 2
+
+/* Upper limit on the payload size, anything bigger is a protocol error */
+#define OTTS_FRAME_MAX_LENGTH (16 * 1024 * 1024)
+
+typedef enum {
+	OTTS_OP_REPLY = 1,
+	OTTS_OP_EVENT = 2,
+	OTTS_OP_SPEAK = 3,	/* arg is the SPDMessageType */
+	OTTS_OP_STOP = 4,
+	OTTS_OP_PAUSE = 5,
+	OTTS_OP_SET = 6,
+	OTTS_OP_AUDIO = 7,
+	OTTS_OP_LOGLEVEL = 8,
+	OTTS_OP_DEBUG = 9,
+	OTTS_OP_LIST_VOICES = 10,
+	OTTS_OP_QUIT = 11,
+	OTTS_OP_PREPARE = 12	/* arg is the SPDMessageType */
+} otts_opcode_t;
+
+#define OTTS_MODULE_CANCEL_FD 3
+
+/* Entry point of output module plugins, returns when openttsd sends
+   QUIT or closes in_fd.  The plugin writes its log to logfilename. */
+#define OTTS_MODULE_PLUGIN_MAIN otts_module_plugin_main
+#define OTTS_MODULE_PLUGIN_MAIN_STR "otts_module_plugin_main"
+
+typedef int (*otts_module_plugin_main_t) (int in_fd, int out_fd,
+					  int cancel_fd,
+					  char *configfilename,
+					  char *logfilename);
+
+typedef struct {
+	uint32_t length;	/* Payload length in bytes */
+	uint16_t opcode;
+	uint16_t arg;
+	uint32_t seq;
+} otts_frame_header_t;
+
+/* Writes a complete frame, returns 0 on success or -1 on error */
+int otts_frame_write(int fd, int opcode, int arg, uint32_t seq,
+		     const char *data, size_t len);
+
+/* Reads a complete frame.  The payload is returned in *data as a
+   null terminated string allocated with g_malloc().  Returns 0 on
+   success or -1 on error or end of file. */
+int otts_frame_read(int fd, otts_frame_header_t * header, char **data);
+
+#endif /* MODPROTO_H */
@@ -25,6 +25,7 @@
 #define __OPENTTS_AUDIO_PLUGIN_H
 
 #define AUDIO_PLUGIN_ENTRY_STR "audio_plugin_get"
+#define AUDIO_STREAM_ENTRY_STR "audio_stream_ops_get"
 
 /* Tell indent to ignore the following ifdef. */
 /* *INDENT-OFF* */
@@ -46,6 +47,14 @@ typedef struct {
 	signed short *samples;
 } AudioTrack;
 
+/* Format of the frames written to a stream, the samples are in the
+   byte order of the AudioID */
+typedef struct {
+	int bits;
+	int num_channels;
+	int sample_rate;
+} AudioStreamFormat;
+
 struct audio_plugin;
 
 typedef struct {
@@ -69,6 +78,35 @@ typedef struct audio_plugin {
 	char const *(*get_playcmd) (void);
 } audio_plugin_t;
 
+/*
+ * Stream operations.  audio_plugin_t is allocated by the plugins, so
+ * it can't grow without breaking the plugins built before: a backend
+ * with streams returns them from a separate entry point,
+ * AUDIO_STREAM_ENTRY_STR, and the backends without it have none.
+ *
+ * Any of them may be NULL if the backend doesn't have it.
+ * open_stream sets the stream up for frames in _format_, it may be
+ * called again for a new format once the stream was drained.  write
+ * takes as many of the _count_ frames as there is room for and
+ * returns their number.  It doesn't block, except in backends which
+ * can't tell the room and have no poll_fd.  drain waits until all the
+ * frames were played, drop discards the frames not played yet and may
+ * be called from another thread to interrupt drain or play.  delay
+ * returns the number of frames written but not played yet.  poll_fd
+ * returns a descriptor and the events to poll it for, which tell when
+ * write takes frames again, or -1 if there is no such descriptor.
+ *
+ * New operations get an entry point of their own in the same way.
+ */
+typedef struct audio_stream_ops {
+	int (*open_stream) (AudioID * id, AudioStreamFormat format);
+	int (*write) (AudioID * id, const void *frames, int count);
+	int (*drain) (AudioID * id);
+	int (*drop) (AudioID * id);
+	int (*delay) (AudioID * id);
+	int (*poll_fd) (AudioID * id, short *events);
+} audio_stream_ops_t;
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 }
@@ -44,8 +44,13 @@ typedef struct otts_synth_plugin {
     SPDVoice ** (* list_voices) (void);
     size_t  (* pause) (void);
     void (* close) (int status);
+    /* Optional, synthesize the message the next speak() is likely
+       to get ahead of time.  NULL if not supported. */
+    int  (* prepare) (char *data, size_t bytes, SPDMessageType type);
 } otts_synth_plugin_t;
 
+otts_synth_plugin_t *SYNTH_PLUGIN_ENTRY(void);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -38,9 +38,11 @@
 #include <alsa/asoundlib.h>
 
 #define AUDIO_PLUGIN_ENTRY otts_alsa_LTX_audio_plugin_get
+#define AUDIO_STREAM_ENTRY otts_alsa_LTX_audio_stream_ops_get
 #include <opentts/opentts_audio_plugin.h>
 #include <opentts/opentts_types.h>
 #include<logging.h>
+#include <audio_dsp.h>
 
 typedef struct {
 	AudioID id;
@@ -48,12 +50,22 @@ typedef struct {
 	snd_pcm_hw_params_t *alsa_hw_params;	/* parameters of sound */
 	snd_pcm_sw_params_t *alsa_sw_params;	/* parameters of playback */
 	snd_pcm_uframes_t alsa_buffer_size;
+	snd_pcm_uframes_t alsa_period_size;
 	pthread_mutex_t alsa_pcm_mutex;	/* mutex to guard the state of the device */
 	pthread_mutex_t alsa_pipe_mutex;	/* mutex to guard the stop pipes */
 	int alsa_stop_pipe[2];	/* Pipe for communication about stop requests */
 	int alsa_fd_count;	/* Counter of descriptors to poll */
 	struct pollfd *alsa_poll_fds;	/* Descriptors to poll */
 	int alsa_opened;	/* 1 between snd_pcm_open and _close, 0 otherwise */
+	int alsa_playing;	/* 1 while alsa_play() runs, 0 otherwise */
+	int alsa_configured;	/* 1 if the device is set up for the format below */
+	int alsa_bits;		/* format of the tracks the device is set up for */
+	int alsa_rate;
+	int alsa_channels;
+	int alsa_use_mmap;	/* 1 to write to the buffer of the device directly */
+	int alsa_mmap;		/* 1 if the device is set up for mmap access */
+	void *alsa_scratch;	/* frames with the volume applied */
+	size_t alsa_scratch_size;
 	char *alsa_device_name;	/* the name of the device to open */
 } alsa_id_t;
 
@@ -164,18 +176,79 @@ static int _alsa_open(alsa_id_t * id)
 	}
 
 	/* Allocate space for hw_params (description of the sound parameters) */
+	if ((err = snd_pcm_hw_params_malloc(&id->alsa_hw_params)) < 0) {
+		audio_log(OTTS_LOG_CRIT,
+			  "alsa: Cannot allocate hardware parameter structure (%s)",
+			  snd_strerror(err));
+		snd_pcm_close(id->alsa_pcm);
+		return -1;
+	}
+
 	/* Allocate space for sw_params (description of the sound parameters) */
 	audio_log(OTTS_LOG_WARN, "alsa: Allocating new sw_params structure");
 	if ((err = snd_pcm_sw_params_malloc(&id->alsa_sw_params)) < 0) {
 		audio_log(OTTS_LOG_CRIT,
 			  "alsa: Cannot allocate hardware parameter structure (%s)",
 			  snd_strerror(err));
+		snd_pcm_hw_params_free(id->alsa_hw_params);
+		snd_pcm_close(id->alsa_pcm);
 		return -1;
 	}
 
+	/* Create the pipe for communication about stop requests */
+	if (pipe(id->alsa_stop_pipe)) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Stop pipe creation failed (%s)",
+			  strerror(errno));
+		goto failed;
+	}
+	fcntl(id->alsa_stop_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(id->alsa_stop_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(id->alsa_stop_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	/* Find how many descriptors we will get for poll() */
+	id->alsa_fd_count = snd_pcm_poll_descriptors_count(id->alsa_pcm);
+	if (id->alsa_fd_count <= 0) {
+		audio_log(OTTS_LOG_CRIT,
+			  "alsa: Invalid poll descriptors count returned from ALSA.");
+		goto failed_pipe;
+	}
+
+	/* Create and fill in struct pollfd *alsa_poll_fds with ALSA descriptors */
+	id->alsa_poll_fds =
+	    g_malloc((id->alsa_fd_count + 1) * sizeof(struct pollfd));
+	if ((err =
+	     snd_pcm_poll_descriptors(id->alsa_pcm, id->alsa_poll_fds,
+				      id->alsa_fd_count)) < 0) {
+		audio_log(OTTS_LOG_CRIT,
+			  "alsa: Unable to obtain poll descriptors for playback: %s\n",
+			  snd_strerror(err));
+		g_free(id->alsa_poll_fds);
+		id->alsa_poll_fds = NULL;
+		goto failed_pipe;
+	}
+
+	/* Join a pollfd for requests by alsa_stop() to the ALSAs ones */
+	id->alsa_poll_fds[id->alsa_fd_count].fd = id->alsa_stop_pipe[0];
+	id->alsa_poll_fds[id->alsa_fd_count].events = POLLIN;
+	id->alsa_poll_fds[id->alsa_fd_count].revents = 0;
+	id->alsa_fd_count++;
+
+	id->alsa_playing = 0;
+	id->alsa_configured = 0;
+	id->alsa_opened = 1;
+
 	audio_log(OTTS_LOG_ERR, "alsa: Opening ALSA device ... success");
 
 	return 0;
+
+failed_pipe:
+	close(id->alsa_stop_pipe[0]);
+	close(id->alsa_stop_pipe[1]);
+failed:
+	snd_pcm_sw_params_free(id->alsa_sw_params);
+	snd_pcm_hw_params_free(id->alsa_hw_params);
+	snd_pcm_close(id->alsa_pcm);
+	return -1;
 }
 
 /* 
@@ -197,11 +270,16 @@ static int _alsa_close(alsa_id_t * id)
 	if ((err = snd_pcm_close(id->alsa_pcm)) < 0) {
 		audio_log(OTTS_LOG_WARN, "alsa: Cannot close ALSA device (%s)",
 			  snd_strerror(err));
+		pthread_mutex_unlock(&id->alsa_pipe_mutex);
 		return -1;
 	}
 
+	snd_pcm_hw_params_free(id->alsa_hw_params);
 	snd_pcm_sw_params_free(id->alsa_sw_params);
 
+	close(id->alsa_stop_pipe[0]);
+	close(id->alsa_stop_pipe[1]);
+
 	g_free(id->alsa_poll_fds);
 	id->alsa_poll_fds = NULL;
 	pthread_mutex_unlock(&id->alsa_pipe_mutex);
@@ -217,7 +295,9 @@ static int _alsa_close(alsa_id_t * id)
   (char*) pars[0] ... null-terminated string containing the name
                       of the device to be used for sound output
                       on ALSA
-  (void*) pars[1] ... =NULL
+  (char*) pars[8] ... "1" to write the frames directly into the
+                      buffer of the device through mmap, if it
+                      supports that, NULL or "0" otherwise
 */
 static AudioID *alsa_open(void **pars, logging_func log)
 {
@@ -242,7 +322,11 @@ static AudioID *alsa_open(void **pars, logging_func log)
 	audio_log(OTTS_LOG_ERR, "alsa: Opening ALSA sound output");
 
 	alsa_id->alsa_device_name = g_strdup(pars[1]);
+	alsa_id->alsa_use_mmap = pars[8] != NULL && atoi(pars[8]) != 0;
+	alsa_id->alsa_mmap = 0;
 	alsa_id->alsa_poll_fds = NULL;
+	alsa_id->alsa_scratch = NULL;
+	alsa_id->alsa_scratch_size = 0;
 
 	ret = _alsa_open(alsa_id);
 	if (ret) {
@@ -272,6 +356,7 @@ static int alsa_close(AudioID * id)
 	}
 	audio_log(OTTS_LOG_ERR, "alsa: ALSA closed.");
 
+	g_free(alsa_id->alsa_scratch);
 	g_free(alsa_id->alsa_device_name);
 	g_free(alsa_id);
 	id = NULL;
@@ -352,480 +437,651 @@ int wait_for_poll(alsa_id_t * id, struct pollfd *alsa_poll_fds,
 	}
 }
 
-#define ERROR_EXIT()\
-    g_free(track_volume.samples); \
-    audio_log(OTTS_LOG_CRIT, "alsa_play() abnormal exit"); \
-    _alsa_close(alsa_id); \
-    return -1;
-
-/* Play the track _track_ (see opentts_audio_plugin.h) using the id->alsa_pcm device and
- id-hw_params parameters. This is a blocking function, however, it's possible
- to interrupt playing from a different thread with alsa_stop(). alsa_play
- returns after and immediatelly after the whole sound was played on the
- speakers.
-
- The idea is that we get the ALSA file descriptors and we will poll() to see
- when alsa is ready for more input while sleeping in the meantime. We will
- additionally poll() for one more descriptor used by alsa_stop() to notify the
- thread with alsa_play() that the stop of the playback is requested. The
- variable can_be_stopped is used for very simple synchronization between the
- two threads. */
-static int alsa_play(AudioID * id, AudioTrack track)
+/*
+ Set up the device for frames in the format _track_.  Playback continues
+ without a new setup as long as the format of the tracks doesn't change.
+*/
+static int alsa_configure(alsa_id_t * id, AudioStreamFormat * track,
+			  snd_pcm_format_t format)
 {
-	snd_pcm_format_t format;
-	int bytes_per_sample;
-	int num_bytes;
-	alsa_id_t *alsa_id = (alsa_id_t *) id;
-
-	signed short *output_samples;
-
-	AudioTrack track_volume;
-	float real_volume;
-	int i;
-
-	int err;
-	int ret;
-
-	snd_pcm_uframes_t framecount;
-	snd_pcm_uframes_t period_size;
-	size_t samples_per_period;
-	size_t silent_samples;
-	size_t volume_size;
+	snd_pcm_uframes_t boundary;
 	unsigned int sr;
+	int err;
 
-	snd_pcm_state_t state;
-
-	struct pollfd alsa_stop_pipe_pfd;
+	id->alsa_configured = 0;
 
-	if (alsa_id == NULL) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Invalid device passed to alsa_play()");
+	/* Initialize hw_params on our pcm */
+	if ((err = snd_pcm_hw_params_any(id->alsa_pcm, id->alsa_hw_params)) < 0) {
+		audio_log(OTTS_LOG_CRIT,
+			  "alsa: Cannot initialize hardware parameter structure (%s)",
+			  snd_strerror(err));
 		return -1;
 	}
 
-	pthread_mutex_lock(&alsa_id->alsa_pipe_mutex);
-
-	audio_log(OTTS_LOG_WARN, "alsa: Start of playback on ALSA");
-
-	/* Is it not an empty track? */
-	/* Passing an empty track is not an error */
-	if (track.samples == NULL) {
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
-		return 0;
+	/* Set access mode, bitrate, sample rate and channels.  Not all
+	   devices can be mapped, these are written to as usual. */
+	id->alsa_mmap = 0;
+	if (id->alsa_use_mmap) {
+		audio_log(OTTS_LOG_INFO,
+			  "alsa: Setting access type to MMAP_INTERLEAVED");
+		err = snd_pcm_hw_params_set_access(id->alsa_pcm,
+						   id->alsa_hw_params,
+						   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		if (err == 0)
+			id->alsa_mmap = 1;
+		else
+			audio_log(OTTS_LOG_WARN,
+				  "alsa: Device can't be mapped (%s), writing to it instead",
+				  snd_strerror(err));
+	}
+	if (!id->alsa_mmap) {
+		audio_log(OTTS_LOG_INFO,
+			  "alsa: Setting access type to INTERLEAVED");
+		err = snd_pcm_hw_params_set_access(id->alsa_pcm,
+						   id->alsa_hw_params,
+						   SND_PCM_ACCESS_RW_INTERLEAVED);
+	}
+	if (err < 0) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Cannot set access type (%s)",
+			  snd_strerror(err));
+		return -1;
 	}
 
-	/*
-	 * The system could have suspended to RAM between two calls
-	 * to alsa_play, in which case, the state of the device will
-	 * be SND_PCM_STATE_SUSPENDED.  We have to recover from that
-	 * state before we do anything else with the pcm handle.
-	 */
-	state = snd_pcm_state(alsa_id->alsa_pcm);
-	if (state == SND_PCM_STATE_SUSPENDED) {
-		err = suspend(alsa_id);
-		if (err != 0) {
-			/* Fatal error: can't recover from suspend. */
-			audio_log(OTTS_LOG_CRIT,
-				  "alsa: Audio playback could not be resumed after a recent suspend.");
-			pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
-			return -1;
-		}
+	audio_log(OTTS_LOG_INFO, "alsa: Setting sample format to %s",
+		  snd_pcm_format_name(format));
+	if ((err =
+	     snd_pcm_hw_params_set_format(id->alsa_pcm, id->alsa_hw_params,
+					  format)) < 0) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Cannot set sample format (%s)",
+			  snd_strerror(err));
+		return -1;
 	}
 
-	/* Allocate space for hw_params (description of the sound parameters) */
-	audio_log(OTTS_LOG_WARN, "alsa: Allocating new hw_params structure");
-	if ((err = snd_pcm_hw_params_malloc(&alsa_id->alsa_hw_params)) < 0) {
-		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Cannot allocate hardware parameter structure (%s)",
+	audio_log(OTTS_LOG_INFO, "alsa: Setting sample rate to %i",
+		  track->sample_rate);
+	sr = track->sample_rate;
+	if ((err =
+	     snd_pcm_hw_params_set_rate_near(id->alsa_pcm, id->alsa_hw_params,
+					     &sr, 0)) < 0) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Cannot set sample rate (%s)",
 			  snd_strerror(err));
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 		return -1;
 	}
 
-	/* Initialize hw_params on our pcm */
+	audio_log(OTTS_LOG_INFO, "alsa: Setting channel count to %i",
+		  track->num_channels);
 	if ((err =
-	     snd_pcm_hw_params_any(alsa_id->alsa_pcm,
-				   alsa_id->alsa_hw_params)) < 0) {
-		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Cannot initialize hardware parameter structure (%s)",
+	     snd_pcm_hw_params_set_channels(id->alsa_pcm, id->alsa_hw_params,
+					    track->num_channels)) < 0) {
+		audio_log(OTTS_LOG_INFO, "alsa: cannot set channel count (%s)",
 			  snd_strerror(err));
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 		return -1;
 	}
 
-	/* Create the pipe for communication about stop requests */
-	if (pipe(alsa_id->alsa_stop_pipe)) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Stop pipe creation failed (%s)",
-			  strerror(errno));
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+	audio_log(OTTS_LOG_INFO,
+		  "alsa: Setting hardware parameters on the ALSA device");
+	if ((err = snd_pcm_hw_params(id->alsa_pcm, id->alsa_hw_params)) < 0) {
+		audio_log(OTTS_LOG_INFO, "alsa: cannot set parameters (%s) state=%s",
+			  snd_strerror(err),
+			  snd_pcm_state_name(snd_pcm_state(id->alsa_pcm)));
 		return -1;
 	}
 
-	/* Find how many descriptors we will get for poll() */
-	alsa_id->alsa_fd_count =
-	    snd_pcm_poll_descriptors_count(alsa_id->alsa_pcm);
-	if (alsa_id->alsa_fd_count <= 0) {
+	if ((err =
+	     snd_pcm_hw_params_get_buffer_size(id->alsa_hw_params,
+					       &id->alsa_buffer_size)) < 0) {
 		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Invalid poll descriptors count returned from ALSA.");
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+			  "alsa: Unable to get buffer size for playback: %s\n",
+			  snd_strerror(err));
 		return -1;
 	}
+	audio_log(OTTS_LOG_INFO, "alsa: Buffer size on ALSA device is %d bytes",
+		  (int)id->alsa_buffer_size);
 
-	/* Create and fill in struct pollfd *alsa_poll_fds with ALSA descriptors */
-	alsa_id->alsa_poll_fds =
-	    g_malloc((alsa_id->alsa_fd_count + 1) * sizeof(struct pollfd));
+	/* Get period size. */
+	snd_pcm_hw_params_get_period_size(id->alsa_hw_params,
+					  &id->alsa_period_size, 0);
+
+	/* Get the current swparams */
 	if ((err =
-	     snd_pcm_poll_descriptors(alsa_id->alsa_pcm, alsa_id->alsa_poll_fds,
-				      alsa_id->alsa_fd_count)) < 0) {
+	     snd_pcm_sw_params_current(id->alsa_pcm, id->alsa_sw_params)) < 0) {
 		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Unable to obtain poll descriptors for playback: %s\n",
+			  "alsa: Unable to determine current swparams for playback: %s\n",
 			  snd_strerror(err));
-		g_free(alsa_id->alsa_poll_fds);
-		alsa_id->alsa_poll_fds = NULL;
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 		return -1;
 	}
 
-	/* Create a new pollfd structure for requests by alsa_stop() */
-	alsa_stop_pipe_pfd.fd = alsa_id->alsa_stop_pipe[0];
-	alsa_stop_pipe_pfd.events = POLLIN;
-	alsa_stop_pipe_pfd.revents = 0;
+	/* The device runs dry after the last track.  Let ALSA overwrite
+	   what was played with silence, so that it doesn't play the old
+	   samples again until the underrun is noticed. */
+	snd_pcm_sw_params_get_boundary(id->alsa_sw_params, &boundary);
+	snd_pcm_sw_params_set_silence_threshold(id->alsa_pcm,
+						id->alsa_sw_params, 0);
+	snd_pcm_sw_params_set_silence_size(id->alsa_pcm, id->alsa_sw_params,
+					   boundary);
+	if ((err = snd_pcm_sw_params(id->alsa_pcm, id->alsa_sw_params)) < 0) {
+		audio_log(OTTS_LOG_CRIT,
+			  "alsa: Unable to set sw params for playback: %s\n",
+			  snd_strerror(err));
+		return -1;
+	}
 
-	/* Join this our own pollfd to the ALSAs ones */
-	alsa_id->alsa_poll_fds[alsa_id->alsa_fd_count] = alsa_stop_pipe_pfd;
-	alsa_id->alsa_fd_count++;
+	id->alsa_bits = track->bits;
+	id->alsa_rate = track->sample_rate;
+	id->alsa_channels = track->num_channels;
+	id->alsa_configured = 1;
 
-	alsa_id->alsa_opened = 1;
-	pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+	return 0;
+}
 
-	/* Report current state */
-	state = snd_pcm_state(alsa_id->alsa_pcm);
-	audio_log(OTTS_LOG_INFO, "alsa: PCM state before setting audio parameters: %s",
-		  snd_pcm_state_name(state));
+/*
+ Wait until at most _frames_ frames are left to be played on the device
+ or alsa_stop() was called.  Returns 0 when the frames were played, +1 if
+ a request to stop the sound output was received and a negative value
+ on error.
+*/
+static int alsa_wait_queued(alsa_id_t * id, snd_pcm_uframes_t frames)
+{
+	struct pollfd *stop_pfd = &id->alsa_poll_fds[id->alsa_fd_count - 1];
+	snd_pcm_sframes_t delay;
+	int timeout;
+	int ret;
 
-	/* Choose the correct format */
-	if (track.bits == 16) {
-		switch (alsa_id->id.format) {
+	while (snd_pcm_state(id->alsa_pcm) == SND_PCM_STATE_RUNNING) {
+		if (snd_pcm_delay(id->alsa_pcm, &delay) < 0)
+			return 0;
+		if (delay <= (snd_pcm_sframes_t) frames)
+			return 0;
+
+		timeout = (delay - frames) * 1000 / id->alsa_rate + 1;
+		stop_pfd->revents = 0;
+		ret = poll(stop_pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (ret > 0 && (stop_pfd->revents & POLLIN)) {
+			audio_log(OTTS_LOG_INFO,
+				  "alsa: alsa_wait_queued: stop requested");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* The ALSA sample format for tracks of _bits_ bits */
+static int alsa_format(alsa_id_t * id, int bits, snd_pcm_format_t * format)
+{
+	if (bits == 16) {
+		switch (id->id.format) {
 		case SPD_AUDIO_LE:
-			format = SND_PCM_FORMAT_S16_LE;
+			*format = SND_PCM_FORMAT_S16_LE;
 			break;
 		case SPD_AUDIO_BE:
-			format = SND_PCM_FORMAT_S16_BE;
+			*format = SND_PCM_FORMAT_S16_BE;
 			break;
 		}
-		bytes_per_sample = 2;
-	} else if (track.bits == 8) {
-		bytes_per_sample = 1;
-		format = SND_PCM_FORMAT_S8;
+	} else if (bits == 8) {
+		*format = SND_PCM_FORMAT_S8;
 	} else {
 		audio_log(OTTS_LOG_CRIT,
 			  "alsa: Unsupported sound data format, track.bits = %d",
-			  track.bits);
+			  bits);
 		return -1;
 	}
+	return 0;
+}
 
-	/* Set access mode, bitrate, sample rate and channels */
-	audio_log(OTTS_LOG_INFO, "alsa: Setting access type to INTERLEAVED");
-	if ((err = snd_pcm_hw_params_set_access(alsa_id->alsa_pcm,
-						alsa_id->alsa_hw_params,
-						SND_PCM_ACCESS_RW_INTERLEAVED)
-	    ) < 0) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Cannot set access type (%s)",
-			  snd_strerror(err));
+/*
+ Set the stream up for frames in _format_.  Nothing is done if the device
+ is set up for the format already.  Otherwise what is still playing is
+ let finish first.  Returns 0 on success, +1 if alsa_stop() was called
+ while waiting for the previous frames and -1 on error.
+*/
+static int alsa_open_stream(AudioID * id, AudioStreamFormat format)
+{
+	alsa_id_t *alsa_id = (alsa_id_t *) id;
+	snd_pcm_format_t pcm_format;
+	int err;
+
+	if (alsa_id == NULL || !alsa_id->alsa_opened)
 		return -1;
-	}
 
-	audio_log(OTTS_LOG_INFO, "alsa: Setting sample format to %s",
-		  snd_pcm_format_name(format));
-	if ((err =
-	     snd_pcm_hw_params_set_format(alsa_id->alsa_pcm,
-					  alsa_id->alsa_hw_params,
-					  format)) < 0) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Cannot set sample format (%s)",
-			  snd_strerror(err));
+	if (alsa_id->alsa_configured && alsa_id->alsa_bits == format.bits
+	    && alsa_id->alsa_rate == format.sample_rate
+	    && alsa_id->alsa_channels == format.num_channels)
+		return 0;
+
+	if (alsa_format(alsa_id, format.bits, &pcm_format) != 0)
 		return -1;
+
+	if (alsa_id->alsa_configured) {
+		/* Let the previous frames finish first */
+		err = alsa_wait_queued(alsa_id, 0);
+		if (err == 1)
+			return 1;
 	}
+	snd_pcm_drop(alsa_id->alsa_pcm);
 
-	audio_log(OTTS_LOG_INFO, "alsa: Setting sample rate to %i", track.sample_rate);
-	sr = track.sample_rate;
-	if ((err =
-	     snd_pcm_hw_params_set_rate_near(alsa_id->alsa_pcm,
-					     alsa_id->alsa_hw_params, &sr,
-					     0)) < 0) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Cannot set sample rate (%s)",
-			  snd_strerror(err));
+	return alsa_configure(alsa_id, &format, pcm_format);
+}
 
-		return -1;
+/*
+ The _count_ frames with the volume of the device applied.  At full volume
+ these are the frames themselves, otherwise they are scaled into the
+ scratch buffer of the device, in fixed point.
+*/
+static const void *alsa_apply_volume(alsa_id_t * id, const void *frames,
+				     int count)
+{
+	int num_samples;
+	size_t size;
+	int gain;
+	int i;
+
+	if (id->id.volume >= OTTS_VOICE_VOLUME_MAX)
+		return frames;
+
+	num_samples = count * id->alsa_channels;
+	size = num_samples * (id->alsa_bits / 8);
+	if (size > id->alsa_scratch_size) {
+		id->alsa_scratch = g_realloc(id->alsa_scratch, size);
+		id->alsa_scratch_size = size;
 	}
 
-	audio_log(OTTS_LOG_INFO, "alsa: Setting channel count to %i", track.num_channels);
-	if ((err =
-	     snd_pcm_hw_params_set_channels(alsa_id->alsa_pcm,
-					    alsa_id->alsa_hw_params,
-					    track.num_channels)) < 0) {
-		audio_log(OTTS_LOG_INFO, "alsa: cannot set channel count (%s)",
-			  snd_strerror(err));
-		return -1;
+	gain = otts_dsp_volume_gain(id->id.volume);
+
+	if (id->alsa_bits == 16) {
+		otts_dsp_scale16(id->alsa_scratch, frames, num_samples, gain);
+	} else {
+		const signed char *in = frames;
+		signed char *out = id->alsa_scratch;
+
+		for (i = 0; i < num_samples; i++)
+			out[i] = (in[i] * gain) >> OTTS_DSP_GAIN_SHIFT;
 	}
 
-	audio_log(OTTS_LOG_INFO, "alsa: Setting hardware parameters on the ALSA device");
-	if ((err =
-	     snd_pcm_hw_params(alsa_id->alsa_pcm,
-			       alsa_id->alsa_hw_params)) < 0) {
-		audio_log(OTTS_LOG_INFO, "alsa: cannot set parameters (%s) state=%s",
-			  snd_strerror(err),
-			  snd_pcm_state_name(snd_pcm_state(alsa_id->alsa_pcm)));
-		return -1;
+	return id->alsa_scratch;
+}
+
+/*
+ Copy _count_ frames into the mapped buffer of the device, applying the
+ volume on the way.  This isn't zero-copy, the frames are still copied
+ once, but it is one copy fewer than scaling them into the scratch
+ buffer and handing that to snd_pcm_writei().
+ The room may come in several pieces where the buffer wraps around.
+ Returns the number of frames written or a negative ALSA error code.
+*/
+static snd_pcm_sframes_t alsa_mmap_write(alsa_id_t * id, const void *frames,
+					 snd_pcm_uframes_t count)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, n;
+	snd_pcm_uframes_t written = 0;
+	snd_pcm_sframes_t committed;
+	int frame_size = id->alsa_channels * (id->alsa_bits / 8);
+	const char *src = frames;
+	int num_samples;
+	int gain;
+	char *dst;
+	int err;
+	int i;
+
+	gain = otts_dsp_volume_gain(id->id.volume);
+
+	while (written < count) {
+		n = count - written;
+		err = snd_pcm_mmap_begin(id->alsa_pcm, &areas, &offset, &n);
+		if (err < 0)
+			return written > 0 ? written : err;
+		if (n == 0)
+			break;
+
+		/* Interleaved, so all the channels share the first area */
+		dst = (char *)areas[0].addr + areas[0].first / 8
+		    + offset * (areas[0].step / 8);
+		num_samples = n * id->alsa_channels;
+
+		if (id->id.volume >= OTTS_VOICE_VOLUME_MAX) {
+			memcpy(dst, src, n * frame_size);
+		} else if (id->alsa_bits == 16) {
+			otts_dsp_scale16((int16_t *) dst,
+					 (const int16_t *)src, num_samples,
+					 gain);
+		} else {
+			const signed char *in = (const signed char *)src;
+			signed char *out = (signed char *)dst;
+
+			for (i = 0; i < num_samples; i++)
+				out[i] = (in[i] * gain) >> OTTS_DSP_GAIN_SHIFT;
+		}
+
+		committed = snd_pcm_mmap_commit(id->alsa_pcm, offset, n);
+		if (committed < 0)
+			return written > 0 ? written : committed;
+		written += committed;
+		src += committed * frame_size;
+		if ((snd_pcm_uframes_t) committed != n)
+			break;
 	}
 
-	/* Get the current swparams */
-	if ((err =
-	     snd_pcm_sw_params_current(alsa_id->alsa_pcm,
-				       alsa_id->alsa_sw_params)) < 0) {
-		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Unable to determine current swparams for playback: %s\n",
-			  snd_strerror(err));
+	/* Unlike snd_pcm_writei(), committing doesn't start the device */
+	if (written > 0
+	    && snd_pcm_state(id->alsa_pcm) == SND_PCM_STATE_PREPARED
+	    && (err = snd_pcm_start(id->alsa_pcm)) < 0)
+		return err;
+
+	return written;
+}
+
+/*
+ Write as many of the _count_ frames as there is room for in the buffer
+ of the device, with the volume applied.  Never blocks.  Returns the
+ number of frames written or -1 on error.
+*/
+static int alsa_write(AudioID * id, const void *frames, int count)
+{
+	alsa_id_t *alsa_id = (alsa_id_t *) id;
+	snd_pcm_sframes_t avail;
+	snd_pcm_state_t state;
+	const void *samples;
+	int ret;
+
+	if (alsa_id == NULL || !alsa_id->alsa_configured)
 		return -1;
+	if (count <= 0)
+		return 0;
+
+	pthread_mutex_lock(&alsa_id->alsa_pipe_mutex);
+
+	/* The device ran dry after the previous frames or was stopped */
+	state = snd_pcm_state(alsa_id->alsa_pcm);
+	if (state == SND_PCM_STATE_XRUN || state == SND_PCM_STATE_SETUP) {
+		audio_log(OTTS_LOG_INFO, "alsa: Preparing device for playback");
+		if ((ret = snd_pcm_prepare(alsa_id->alsa_pcm)) < 0) {
+			audio_log(OTTS_LOG_CRIT,
+				  "alsa: Cannot prepare audio interface for playback (%s)",
+				  snd_strerror(ret));
+			pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+			return -1;
+		}
 	}
-	//    audio_log("Checking buffer size");
-	if ((err =
-	     snd_pcm_hw_params_get_buffer_size(alsa_id->alsa_hw_params,
-					       &(alsa_id->alsa_buffer_size))) <
-	    0) {
-		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Unable to get buffer size for playback: %s\n",
-			  snd_strerror(err));
+
+	avail = snd_pcm_avail_update(alsa_id->alsa_pcm);
+	if (avail == -EPIPE) {
+		ret = xrun(alsa_id);
+		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+		return ret;
+	} else if (avail == -ESTRPIPE) {
+		ret = suspend(alsa_id);
+		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+		return ret;
+	} else if (avail < 0) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Cannot get free space (%s)",
+			  snd_strerror(avail));
+		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 		return -1;
 	}
-	audio_log(OTTS_LOG_INFO, "alsa: Buffer size on ALSA device is %d bytes",
-		  (int)alsa_id->alsa_buffer_size);
+	if (count > avail)
+		count = avail;
+	if (count == 0) {
+		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+		return 0;
+	}
 
-	/* This is probably better left for the device driver to decide */
-	/* allow the transfer when at least period_size samples can be processed */
-	/*    err = snd_pcm_sw_params_set_avail_min(id->alsa_pcm, id->alsa_sw_params, id->alsa_buffer_size/4);
-	   if (err < 0) {
-	   audio_log(OTTS_LOG_CRIT, "alsa: Unable to set avail min for playback: %s\n", snd_strerror(err));
-	   return err;
-	   } */
+	if (alsa_id->alsa_mmap) {
+		ret = alsa_mmap_write(alsa_id, frames, count);
+	} else {
+		samples = alsa_apply_volume(alsa_id, frames, count);
+		ret = snd_pcm_writei(alsa_id->alsa_pcm, samples, count);
+	}
 
-	/* Get period size. */
-	snd_pcm_hw_params_get_period_size(alsa_id->alsa_hw_params, &period_size,
-					  0);
-
-	/* Calculate size of silence at end of buffer. */
-	samples_per_period = period_size * track.num_channels;
-	//    audio_log("samples per period = %i", samples_per_period);
-	//    audio_log("num_samples = %i", track.num_samples);
-	silent_samples =
-	    samples_per_period - (track.num_samples % samples_per_period);
-	//    audio_log("silent samples = %i", silent_samples);
-
-	audio_log(OTTS_LOG_INFO, "alsa: Preparing device for playback");
-	if ((err = snd_pcm_prepare(alsa_id->alsa_pcm)) < 0) {
+	if (ret == -EAGAIN || ret == -EBUSY) {
+		ret = 0;
+	} else if (ret == -EPIPE) {
+		ret = xrun(alsa_id);
+	} else if (ret == -ESTRPIPE) {
+		ret = suspend(alsa_id);
+	} else if (ret < 0) {
 		audio_log(OTTS_LOG_CRIT,
-			  "alsa: Cannot prepare audio interface for playback (%s)",
-			  snd_strerror(err));
+			  "alsa: Write to audio interface failed (%s)",
+			  snd_strerror(ret));
+		alsa_id->alsa_configured = 0;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+
+	return ret;
+}
 
+/*
+ Mark the start of a blocking call, so that alsa_stop() interrupts it
+ through the stop pipe.
+*/
+static int alsa_begin_wait(alsa_id_t * id)
+{
+	pthread_mutex_lock(&id->alsa_pipe_mutex);
+	if (!id->alsa_opened) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Device is not open");
+		pthread_mutex_unlock(&id->alsa_pipe_mutex);
 		return -1;
 	}
+	id->alsa_playing = 1;
+	pthread_mutex_unlock(&id->alsa_pipe_mutex);
+	return 0;
+}
 
-	/* Calculate space needed to round up to nearest period size. */
-	volume_size = bytes_per_sample * (track.num_samples + silent_samples);
-	audio_log(OTTS_LOG_INFO, "alsa: volume size = %i", (int)volume_size);
-
-	/* Create a copy of track with adjusted volume. */
-	audio_log(OTTS_LOG_INFO, "alsa: Making copy of track and adjusting volume");
-	track_volume = track;
-	track_volume.samples = (short *)g_malloc(volume_size);
-	real_volume = (float)(alsa_id->id.volume - OTTS_VOICE_VOLUME_MIN)
-	    / (float)(OTTS_VOICE_VOLUME_MAX - OTTS_VOICE_VOLUME_MIN);
-	for (i = 0; i <= track.num_samples - 1; i++)
-		track_volume.samples[i] = track.samples[i] * real_volume;
+/*
+ End of the blocking call.  Drop what is still to be played if alsa_stop()
+ was called meanwhile or _failed_ is set.  Returns -1 if the drop failed.
+*/
+static int alsa_end_wait(alsa_id_t * id, int failed)
+{
+	char buf;
+	int ret = 0;
+	int err;
 
-	if (silent_samples > 0) {
-		u_int16_t silent16;
-		u_int8_t silent8;
+	pthread_mutex_lock(&id->alsa_pipe_mutex);
+	id->alsa_playing = 0;
 
-		/* Fill remaining space with silence */
-		audio_log(OTTS_LOG_INFO,
-			  "alsa: Filling with silence up to the period size, silent_samples=%d",
-			  (int)silent_samples);
-		/* TODO: This hangs.  Why?
-		   snd_pcm_format_set_silence(format,
-		   track_volume.samples + (track.num_samples * bytes_per_sample), silent_samples);
-		 */
-		switch (bytes_per_sample) {
-		case 2:
-			silent16 = snd_pcm_format_silence_16(format);
-			for (i = 0; i < silent_samples; i++)
-				track_volume.samples[track.num_samples + i] =
-				    silent16;
-			break;
-		case 1:
-			silent8 = snd_pcm_format_silence(format);
-			for (i = 0; i < silent_samples; i++)
-				track_volume.samples[track.num_samples + i] =
-				    silent8;
-			break;
+	if (read(id->alsa_stop_pipe[0], &buf, 1) > 0 || failed) {
+		while (read(id->alsa_stop_pipe[0], &buf, 1) > 0) ;
+		err = snd_pcm_drop(id->alsa_pcm);
+		if (err < 0) {
+			audio_log(OTTS_LOG_CRIT, "alsa: snd_pcm_drop() failed: %s",
+				  snd_strerror(err));
+			ret = -1;
 		}
 	}
+	pthread_mutex_unlock(&id->alsa_pipe_mutex);
+
+	return ret;
+}
+
+/* Wait until all the frames written to the stream were played */
+static int alsa_drain(AudioID * id)
+{
+	alsa_id_t *alsa_id = (alsa_id_t *) id;
+	int err;
+
+	if (alsa_id == NULL || !alsa_id->alsa_configured)
+		return -1;
+
+	if (alsa_begin_wait(alsa_id) != 0)
+		return -1;
+
+	audio_log(OTTS_LOG_INFO, "alsa: Draining...");
+	err = alsa_wait_queued(alsa_id, 0);
+
+	if (alsa_end_wait(alsa_id, err < 0) != 0 || err < 0)
+		return -1;
+	return 0;
+}
+
+/* Number of frames written and not played yet */
+static int alsa_delay(AudioID * id)
+{
+	alsa_id_t *alsa_id = (alsa_id_t *) id;
+	snd_pcm_sframes_t delay;
+	snd_pcm_state_t state;
+	int ret = 0;
+
+	if (alsa_id == NULL || !alsa_id->alsa_configured)
+		return -1;
+
+	pthread_mutex_lock(&alsa_id->alsa_pipe_mutex);
+	state = snd_pcm_state(alsa_id->alsa_pcm);
+	if ((state == SND_PCM_STATE_RUNNING || state == SND_PCM_STATE_PREPARED)
+	    && snd_pcm_delay(alsa_id->alsa_pcm, &delay) == 0 && delay > 0)
+		ret = delay;
+	pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+
+	return ret;
+}
+
+/*
+ The descriptor of the device to poll for room in the buffer.  ALSA
+ devices polled through several descriptors have none.
+*/
+static int alsa_poll_fd(AudioID * id, short *events)
+{
+	alsa_id_t *alsa_id = (alsa_id_t *) id;
+
+	/* The last descriptor is the stop pipe */
+	if (alsa_id == NULL || alsa_id->alsa_fd_count != 2)
+		return -1;
+
+	*events = alsa_id->alsa_poll_fds[0].events;
+	return alsa_id->alsa_poll_fds[0].fd;
+}
+
+/* Play the track _track_ (see opentts_audio_plugin.h) using the id->alsa_pcm device and
+ id-hw_params parameters. This is a blocking function, however, it's possible
+ to interrupt playing from a different thread with alsa_stop().
+
+ alsa_play() writes the track to the stream of the device.  The stream
+ stays set up and running between the calls as long as the tracks come in
+ the same format, so that the tracks of a message are played without gaps.
+ alsa_play() doesn't drain the device, it returns when no more than one
+ period of the track is left to be played.  If no other track follows,
+ the device just runs dry.
+
+ The idea is that we get the ALSA file descriptors and we will poll() to see
+ when alsa is ready for more input while sleeping in the meantime. We will
+ additionally poll() for one more descriptor used by alsa_stop() to notify the
+ thread with alsa_play() that the stop of the playback is requested. */
+static int alsa_play(AudioID * id, AudioTrack track)
+{
+	alsa_id_t *alsa_id = (alsa_id_t *) id;
+	AudioStreamFormat format;
+	char *output_samples;
+	int frame_bytes;
+	int num_frames;
+	int failed = 0;
+	int err;
+	int ret;
+
+	snd_pcm_state_t state;
+
+	if (alsa_id == NULL) {
+		audio_log(OTTS_LOG_CRIT, "alsa: Invalid device passed to alsa_play()");
+		return -1;
+	}
 
-	/* Loop until all samples are played on the device. */
-	output_samples = track_volume.samples;
-	num_bytes = (track.num_samples + silent_samples) * bytes_per_sample;
-	//    audio_log("alsa: Still %d bytes left to be played", num_bytes);
-	while (num_bytes > 0) {
-
-		/* Write as much samples as possible */
-		framecount = num_bytes / bytes_per_sample / track.num_channels;
-		if (framecount < period_size)
-			framecount = period_size;
-
-		/* Report current state state */
-		state = snd_pcm_state(alsa_id->alsa_pcm);
-		//      audio_log("PCM state before writei: %s",
-		//          snd_pcm_state_name(state));
-
-		/* audio_log("snd_pcm_writei() called") */
-		ret =
-		    snd_pcm_writei(alsa_id->alsa_pcm, output_samples,
-				   framecount);
-		//        audio_log("Sent %d of %d remaining bytes", ret*bytes_per_sample, num_bytes);
-
-		if (ret == -EAGAIN) {
-			audio_log(OTTS_LOG_INFO, "alsa: Warning: Forced wait!");
-			snd_pcm_wait(alsa_id->alsa_pcm, 100);
-		} else if (ret == -EPIPE) {
-			if (xrun(alsa_id) != 0)
-				ERROR_EXIT();
-		} else if (ret == -ESTRPIPE) {
-			if (suspend(alsa_id) != 0)
-				ERROR_EXIT();
-		} else if (ret == -EBUSY) {
-			audio_log(OTTS_LOG_INFO, "alsa: WARNING: sleeping while PCM BUSY");
-			usleep(100);
-			continue;
-		} else if (ret < 0) {
+	/* Is it not an empty track? */
+	/* Passing an empty track is not an error */
+	if (track.samples == NULL)
+		return 0;
+
+	if (alsa_begin_wait(alsa_id) != 0)
+		return -1;
+
+	audio_log(OTTS_LOG_WARN, "alsa: Start of playback on ALSA");
+
+	/*
+	 * The system could have suspended to RAM between two calls
+	 * to alsa_play, in which case, the state of the device will
+	 * be SND_PCM_STATE_SUSPENDED.  We have to recover from that
+	 * state before we do anything else with the pcm handle.
+	 */
+	state = snd_pcm_state(alsa_id->alsa_pcm);
+	if (state == SND_PCM_STATE_SUSPENDED) {
+		err = suspend(alsa_id);
+		if (err != 0) {
+			/* Fatal error: can't recover from suspend. */
 			audio_log(OTTS_LOG_CRIT,
-				  "alsa: Write to audio interface failed (%s)",
-				  snd_strerror(ret));
-			ERROR_EXIT();
+				  "alsa: Audio playback could not be resumed after a recent suspend.");
+			failed = 1;
+			goto terminate;
 		}
+	}
 
-		if (ret > 0) {
-			/* Update counter of bytes left and move the data pointer */
-			num_bytes -=
-			    ret * bytes_per_sample * track.num_channels;
-			output_samples +=
-			    ret * bytes_per_sample * track.num_channels / 2;
+	format.bits = track.bits;
+	format.num_channels = track.num_channels;
+	format.sample_rate = track.sample_rate;
+	err = alsa_open_stream(id, format);
+	if (err == 1) {
+		audio_log(OTTS_LOG_INFO, "alsa: Playback stopped");
+		goto terminate;
+	} else if (err != 0) {
+		failed = 1;
+		goto terminate;
+	}
+
+	/* Loop until all samples are written to the device. */
+	output_samples = (char *)track.samples;
+	frame_bytes = track.bits / 8 * track.num_channels;
+	num_frames = track.num_samples / track.num_channels;
+	while (num_frames > 0) {
+		ret = alsa_write(id, output_samples, num_frames);
+		if (ret < 0) {
+			failed = 1;
+			goto terminate;
 		}
 
-		/* Report current state */
-		state = snd_pcm_state(alsa_id->alsa_pcm);
-		//      audio_log("PCM state before polling: %s",
-		//          snd_pcm_state_name(state));
+		/* Update counter of frames left and move the data pointer */
+		num_frames -= ret;
+		output_samples += ret * frame_bytes;
+		if (num_frames <= 0)
+			break;
 
 		err =
 		    wait_for_poll(alsa_id, alsa_id->alsa_poll_fds,
 				  alsa_id->alsa_fd_count, 0);
 		if (err < 0) {
 			audio_log(OTTS_LOG_CRIT, "alsa: Wait for poll() failed\n");
-			ERROR_EXIT();
+			failed = 1;
+			goto terminate;
 		} else if (err == 1) {
 			audio_log(OTTS_LOG_INFO, "alsa: Playback stopped");
-
-			/* Drop the playback on the sound device (probably
-			   still in progress up till now) */
-			err = snd_pcm_drop(alsa_id->alsa_pcm);
-			if (err < 0) {
-				audio_log(OTTS_LOG_CRIT, "alsa: snd_pcm_drop() failed: %s",
-					  snd_strerror(err));
-				return -1;
-			}
-
 			goto terminate;
 		}
-
-		if (num_bytes <= 0)
-			break;
-//      audio_log("ALSA ready for more samples");
-
-		/* Stop requests can be issued again */
 	}
 
-	audio_log(OTTS_LOG_INFO, "alsa: Draining...");
-
-	/* We want to next "device ready" notification only after the buffer is
-	   already empty */
-	err =
-	    snd_pcm_sw_params_set_avail_min(alsa_id->alsa_pcm,
-					    alsa_id->alsa_sw_params,
-					    alsa_id->alsa_buffer_size);
-	if (err < 0) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Unable to set avail min for playback: %s\n",
-			  snd_strerror(err));
-		return err;
-	}
-	/* write the parameters to the playback device */
-	err = snd_pcm_sw_params(alsa_id->alsa_pcm, alsa_id->alsa_sw_params);
-	if (err < 0) {
-		audio_log(OTTS_LOG_CRIT, "alsa: Unable to set sw params for playback: %s\n",
-			  snd_strerror(err));
-		return -1;
-	}
-
-	err =
-	    wait_for_poll(alsa_id, alsa_id->alsa_poll_fds,
-			  alsa_id->alsa_fd_count, 1);
+	/* Leave the last period playing, the next track may follow it
+	   without a gap */
+	err = alsa_wait_queued(alsa_id, alsa_id->alsa_period_size);
 	if (err < 0) {
 		audio_log(OTTS_LOG_CRIT, "alsa: Wait for poll() failed\n");
-		return -1;
-	} else if (err == 1) {
-		audio_log(OTTS_LOG_INFO, "alsa: Playback stopped while draining");
-
-		/* Drop the playback on the sound device (probably
-		   still in progress up till now) */
-		err = snd_pcm_drop(alsa_id->alsa_pcm);
-		if (err < 0) {
-			audio_log(OTTS_LOG_CRIT, "alsa: snd_pcm_drop() failed: %s",
-				  snd_strerror(err));
-			return -1;
-		}
+		failed = 1;
 	}
-	audio_log(OTTS_LOG_INFO, "lsa: Draining terminated");
 
 terminate:
-	/* Terminating (successfully or after a stop) */
-	if (track_volume.samples != NULL)
-		g_free(track_volume.samples);
-
-	err = snd_pcm_drop(alsa_id->alsa_pcm);
-	if (err < 0) {
-		audio_log(OTTS_LOG_CRIT, "alsa: snd_pcm_drop() failed: %s",
-			  snd_strerror(err));
-		return -1;
+	/* Terminating (successfully, after an error or after a stop) */
+	if (failed) {
+		audio_log(OTTS_LOG_CRIT, "alsa_play() abnormal exit");
+		alsa_id->alsa_configured = 0;
 	}
-
-	audio_log(OTTS_LOG_WARN, "alsa: Freeing HW parameters");
-	snd_pcm_hw_params_free(alsa_id->alsa_hw_params);
-
-	pthread_mutex_lock(&alsa_id->alsa_pipe_mutex);
-	alsa_id->alsa_opened = 0;
-	close(alsa_id->alsa_stop_pipe[0]);
-	close(alsa_id->alsa_stop_pipe[1]);
-
-	g_free(alsa_id->alsa_poll_fds);
-	alsa_id->alsa_poll_fds = NULL;
-	pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+	if (alsa_end_wait(alsa_id, failed) != 0)
+		failed = 1;
 
 	audio_log(OTTS_LOG_ERR, "alsa: End of playback on ALSA");
 
-	return 0;
+	return failed ? -1 : 0;
 }
 
-#undef ERROR_EXIT
-
 /*
- Stop the playback on the device and interrupt alsa_play()
+ Stop the playback on the device and interrupt alsa_play() or
+ alsa_drain().  This is also the drop operation of the stream.
 */
 static int alsa_stop(AudioID * id)
 {
@@ -839,7 +1095,7 @@ static int alsa_stop(AudioID * id)
 		return 0;
 
 	pthread_mutex_lock(&alsa_id->alsa_pipe_mutex);
-	if (alsa_id->alsa_opened) {
+	if (alsa_id->alsa_playing) {
 		/* This constant is arbitrary */
 		buf = 42;
 
@@ -849,6 +1105,9 @@ static int alsa_stop(AudioID * id)
 				  "alsa: Can't write stop request to pipe, err %d: %s",
 				  errno, strerror(errno));
 		}
+	} else if (alsa_id->alsa_opened) {
+		/* The end of the last track may still be playing */
+		snd_pcm_drop(alsa_id->alsa_pcm);
 	}
 	pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 
@@ -859,7 +1118,7 @@ static int alsa_stop(AudioID * id)
   Set volume
 
   Comments: It's not possible to set individual track volume with Alsa, so we
-   handle volume in alsa_play() by multiplication of each sample.
+   handle volume in alsa_write() by scaling each sample.
 */
 static int alsa_set_volume(AudioID * id, int volume)
 {
@@ -889,5 +1148,23 @@ audio_plugin_t *alsa_plugin_get(void)
 
 audio_plugin_t *AUDIO_PLUGIN_ENTRY(void)
     __attribute__ ((weak, alias("alsa_plugin_get")));
+
+/* The stream operations, looked up separately from the plugin */
+static audio_stream_ops_t alsa_stream_ops = {
+	alsa_open_stream,
+	alsa_write,
+	alsa_drain,
+	alsa_stop,
+	alsa_delay,
+	alsa_poll_fd
+};
+
+audio_stream_ops_t *alsa_stream_ops_get(void)
+{
+	return &alsa_stream_ops;
+}
+
+audio_stream_ops_t *AUDIO_STREAM_ENTRY(void)
+    __attribute__ ((weak, alias("alsa_stream_ops_get")));
 #undef MSG
 #undef ERR
@@ -32,6 +32,7 @@
 #include <glib.h>
 
 #define AUDIO_PLUGIN_ENTRY otts_libao_LTX_audio_plugin_get
+#define AUDIO_STREAM_ENTRY otts_libao_LTX_audio_stream_ops_get
 #include <opentts/opentts_audio_plugin.h>
 #include<logging.h>
 
@@ -44,6 +45,7 @@ static volatile int ao_stop_playback = 0;
 static int default_driver;
 
 ao_device *device = NULL;
+static AudioStreamFormat device_format;
 
 static AudioID *libao_open(void **pars, logging_func log)
 {
@@ -59,85 +61,140 @@ static AudioID *libao_open(void **pars, logging_func log)
 	return id;
 }
 
-static int libao_play(AudioID * id, AudioTrack track)
+/*
+ Open the device for frames in _format_, unless it is open for them
+ already.
+*/
+static int libao_open_stream(AudioID * id, AudioStreamFormat format)
 {
-	int bytes_per_sample;
-
-	int num_bytes;
-
-	int outcnt = 0;
-
-	signed short *output_samples;
-
-	int i;
-
-	ao_sample_format format;
+	ao_sample_format ao_format;
 
 	if (id == NULL)
 		return -1;
-	if (track.samples == NULL || track.num_samples <= 0)
+
+	if (format.bits != 16 && format.bits != 8) {
+		audio_log(OTTS_LOG_WARN, "libao: Unrecognized sound data format.\n");
+		return -10;
+	}
+
+	if (device != NULL && device_format.bits == format.bits
+	    && device_format.num_channels == format.num_channels
+	    && device_format.sample_rate == format.sample_rate)
 		return 0;
 
+	if (device != NULL) {
+		ao_close(device);
+		device = NULL;
+	}
+
 	/* Zero the whole ao_sample_format structure. */
-	memset(&format, '\0', sizeof(ao_sample_format));
+	memset(&ao_format, '\0', sizeof(ao_sample_format));
 
 	/* Choose the correct format */
-	format.bits = track.bits;
-	if (track.bits == 16) {
-		bytes_per_sample = 2;
+	ao_format.bits = format.bits;
+	if (format.bits == 16) {
 		switch (id->format) {
 		case SPD_AUDIO_LE:
-			format.byte_format = AO_FMT_LITTLE;
+			ao_format.byte_format = AO_FMT_LITTLE;
 			break;
 		case SPD_AUDIO_BE:
-			format.byte_format = AO_FMT_BIG;
+			ao_format.byte_format = AO_FMT_BIG;
 			break;
 		}
-	} else if (track.bits == 8)
-		bytes_per_sample = 1;
-	else {
-		audio_log(OTTS_LOG_WARN, "libao: Unrecognized sound data format.\n");
-		return -10;
 	}
-	format.channels = track.num_channels;
-	format.rate = track.sample_rate;
-	audio_log(OTTS_LOG_NOTICE, "libao: Starting playback");
-	output_samples = track.samples;
-	num_bytes = track.num_samples * bytes_per_sample;
-	if (device == NULL)
-		device = ao_open_live(default_driver, &format, NULL);
+	ao_format.channels = format.num_channels;
+	ao_format.rate = format.sample_rate;
+
+	device = ao_open_live(default_driver, &ao_format, NULL);
 	if (device == NULL) {
 		audio_log(OTTS_LOG_ERR, "libao: error opening libao dev");
 		return -2;
 	}
-	audio_log(OTTS_LOG_NOTICE, "libao: bytes to play: %d, (%f secs)", num_bytes,
-		  (((float)(num_bytes) / 2) / (float)track.sample_rate));
+	device_format = format;
+
+	return 0;
+}
+
+/*
+ Play up to AO_SEND_BYTES of the frames.  libao has no non-blocking
+ output, this returns once the driver took the frames.
+*/
+static int libao_write(AudioID * id, const void *frames, int count)
+{
+	int frame_bytes;
+
+	if (id == NULL || device == NULL)
+		return -1;
+
+	frame_bytes = device_format.bits / 8 * device_format.num_channels;
+	if (count * frame_bytes > AO_SEND_BYTES)
+		count = AO_SEND_BYTES / frame_bytes;
+	if (count <= 0)
+		return 0;
+
+	if (!ao_play(device, (char *)frames, count * frame_bytes)) {
+		ao_close(device);
+		device = NULL;
+		audio_log(OTTS_LOG_NOTICE,
+			  "libao: ao_play() - closing device - re-open it in next run\n");
+		return -1;
+	}
+
+	return count;
+}
+
+/* libao can only wait for the frames by closing the device */
+static int libao_drain(AudioID * id)
+{
+	if (device != NULL) {
+		ao_close(device);
+		device = NULL;
+	}
+	return 0;
+}
+
+static int libao_play(AudioID * id, AudioTrack track)
+{
+	AudioStreamFormat format;
+	char *output_samples;
+	int num_frames;
+	int frame_bytes;
+	int ret;
+
+	if (id == NULL)
+		return -1;
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	format.bits = track.bits;
+	format.num_channels = track.num_channels;
+	format.sample_rate = track.sample_rate;
+	ret = libao_open_stream(id, format);
+	if (ret != 0)
+		return ret;
+
+	audio_log(OTTS_LOG_NOTICE, "libao: Starting playback");
+	output_samples = (char *)track.samples;
+	num_frames = track.num_samples / track.num_channels;
+	frame_bytes = track.bits / 8 * track.num_channels;
+	audio_log(OTTS_LOG_NOTICE, "libao: frames to play: %d, (%f secs)",
+		  num_frames, (float)num_frames / (float)track.sample_rate);
 
 	ao_stop_playback = 0;
-	outcnt = 0;
-	i = 0;
-
-	while ((outcnt < num_bytes) && !ao_stop_playback) {
-		if ((num_bytes - outcnt) > AO_SEND_BYTES)
-			i = AO_SEND_BYTES;
-		else
-			i = (num_bytes - outcnt);
-
-		if (!ao_play(device, (char *)output_samples + outcnt, i)) {
-			ao_close(device);
-			device = NULL;
-			audio_log(OTTS_LOG_NOTICE,
-				  "libao: ao_play() - closing device - re-open it in next run\n");
+	while ((num_frames > 0) && !ao_stop_playback) {
+		ret = libao_write(id, output_samples, num_frames);
+		if (ret < 0)
 			return -1;
-		}
-		outcnt += i;
+		num_frames -= ret;
+		output_samples += ret * frame_bytes;
 	}
 
 	return 0;
 
 }
 
-/* stop the libao_play() loop */
+/* stop the libao_play() loop, this is also the drop operation of the
+   stream, what the driver took already is still played */
 static int libao_stop(AudioID * id)
 {
 
@@ -188,3 +245,21 @@ audio_plugin_t *libao_plugin_get(void)
 
 audio_plugin_t *AUDIO_PLUGIN_ENTRY(void)
     __attribute__ ((weak, alias("libao_plugin_get")));
+
+/* The stream operations, looked up separately from the plugin */
+static audio_stream_ops_t libao_stream_ops = {
+	libao_open_stream,
+	libao_write,
+	libao_drain,
+	libao_stop,
+	NULL,
+	NULL
+};
+
+audio_stream_ops_t *libao_stream_ops_get(void)
+{
+	return &libao_stream_ops;
+}
+
+audio_stream_ops_t *AUDIO_STREAM_ENTRY(void)
+    __attribute__ ((weak, alias("libao_stream_ops_get")));
@@ -36,12 +36,15 @@
 #include <unistd.h>		/* for open, close */
 #include <sys/ioctl.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include <sys/soundcard.h>
 #include <logging.h>
 #include <glib.h>
+#include <audio_dsp.h>
 
 #define AUDIO_PLUGIN_ENTRY otts_oss_LTX_audio_plugin_get
+#define AUDIO_STREAM_ENTRY otts_oss_LTX_audio_stream_ops_get
 #include <opentts/opentts_audio_plugin.h>
 #include <opentts/opentts_types.h>
 
@@ -52,6 +55,8 @@ typedef struct {
 	pthread_mutex_t fd_mutex;
 	pthread_cond_t pt_cond;
 	pthread_mutex_t pt_mutex;
+	AudioStreamFormat format;	/* format the open device is set to */
+	int frame_bytes;	/* 0 if the device is not set up */
 } oss_id_t;
 
 static int _oss_open(oss_id_t * id);
@@ -88,6 +93,7 @@ static int _oss_close(oss_id_t * id)
 	pthread_mutex_lock(&id->fd_mutex);
 	close(id->fd);
 	id->fd = -1;
+	id->frame_bytes = 0;
 	pthread_mutex_unlock(&id->fd_mutex);
 	return 0;
 }
@@ -118,6 +124,8 @@ static AudioID *oss_open(void **pars, logging_func log)
 	pthread_cond_init(&oss_id->pt_cond, NULL);
 	pthread_mutex_init(&oss_id->pt_mutex, NULL);
 
+	oss_id->frame_bytes = 0;
+
 	/* Test if it's possible to access the device */
 	ret = _oss_open(oss_id);
 	if (ret) {
@@ -148,27 +156,15 @@ static int _oss_sync(oss_id_t * id)
 	return 0;
 }
 
-static int oss_play(AudioID * id, AudioTrack track)
+/*
+ Open the device, if it is not open, and set it to _format_.  The device
+ stays open until the stream is drained.
+*/
+static int oss_open_stream(AudioID * id, AudioStreamFormat format)
 {
-	int ret, ret2;
-	struct timeval now;
-	struct timespec timeout;
-	float lenght;
-	int r;
-	int format, oformat, channels, speed;
-	int bytes_per_sample;
-	int num_bytes;
-	signed short *output_samples;
-	float delay = 0;
-	float DELAY = 0.1;	/* in seconds */
-	audio_buf_info info;
-	int bytes;
-	float real_volume;
-	int i;
-	int re;
 	oss_id_t *oss_id = (oss_id_t *) id;
-
-	AudioTrack track_volume;
+	int ret;
+	int oformat, channels, speed;
 
 	if (oss_id == NULL)
 		return -1;
@@ -176,40 +172,40 @@ static int oss_play(AudioID * id, AudioTrack track)
 	/* Open the sound device. This is necessary for OSS so that the
 	   application doesn't prevent others from accessing /dev/dsp when
 	   it doesn't play anything. */
-	ret = _oss_open(oss_id);
-	if (ret)
-		return -2;
-
-	/* Create a copy of track with the adjusted volume */
-	track_volume = track;
-	track_volume.samples =
-	    (short *)g_malloc(sizeof(short) * track.num_samples);
-	real_volume = (float)(id->volume - OTTS_VOICE_VOLUME_MIN)
-	    / (float)(OTTS_VOICE_VOLUME_MAX - OTTS_VOICE_VOLUME_MIN);
-	for (i = 0; i <= track.num_samples - 1; i++)
-		track_volume.samples[i] = track.samples[i] * real_volume;
+	if (oss_id->fd < 0) {
+		ret = _oss_open(oss_id);
+		if (ret)
+			return -2;
+	} else if (oss_id->frame_bytes != 0
+		   && oss_id->format.bits == format.bits
+		   && oss_id->format.num_channels == format.num_channels
+		   && oss_id->format.sample_rate == format.sample_rate) {
+		return 0;
+	} else {
+		/* The format can only change once the device played
+		   everything */
+		ioctl(oss_id->fd, SNDCTL_DSP_SYNC, 0);
+	}
+	oss_id->frame_bytes = 0;
 
 	/* Choose the correct format */
-	if (track.bits == 16) {
-		format = AFMT_S16_NE;
-		bytes_per_sample = 2;
-	} else if (track.bits == 8) {
-		bytes_per_sample = 1;
-		format = AFMT_S8;
+	if (format.bits == 16) {
+		oformat = AFMT_S16_NE;
+	} else if (format.bits == 8) {
+		oformat = AFMT_S8;
 	} else {
 		audio_log(OTTS_LOG_ERR, "oss: Unrecognized sound data format.\n");
 		_oss_close(oss_id);
 		return -10;
 	}
 
-	oformat = format;
-	ret = ioctl(oss_id->fd, SNDCTL_DSP_SETFMT, &format);
+	ret = ioctl(oss_id->fd, SNDCTL_DSP_SETFMT, &oformat);
 	if (ret == -1) {
 		perror("OSS ERROR: format");
 		_oss_close(oss_id);
 		return -1;
 	}
-	if (format != oformat) {
+	if (oformat != (format.bits == 16 ? AFMT_S16_NE : AFMT_S8)) {
 		audio_log(OTTS_LOG_CRIT,
 			  "oss: Device doesn't support 16-bit sound format.\n");
 		_oss_close(oss_id);
@@ -217,35 +213,163 @@ static int oss_play(AudioID * id, AudioTrack track)
 	}
 
 	/* Choose the correct number of channels */
-	channels = track.num_channels;
+	channels = format.num_channels;
 	ret = ioctl(oss_id->fd, SNDCTL_DSP_CHANNELS, &channels);
 	if (ret == -1) {
 		perror("OSS ERROR: channels");
 		_oss_close(oss_id);
 		return -3;
 	}
-	if (channels != track.num_channels) {
+	if (channels != format.num_channels) {
 		audio_log(OTTS_LOG_ERR, "oss: Device doesn't support stereo sound.\n");
 		_oss_close(oss_id);
 		return -4;
 	}
 
 	/* Choose the correct sample rate */
-	speed = track.sample_rate;
+	speed = format.sample_rate;
 	ret = ioctl(oss_id->fd, SNDCTL_DSP_SPEED, &speed);
 	if (ret == -1) {
 		audio_log(OTTS_LOG_CRIT,
 			  "OSS ERROR: Can't set sample rate %d nor any similar.",
-			  track.sample_rate);
+			  format.sample_rate);
 		_oss_close(oss_id);
 		return -5;
 	}
-	if (speed != track.sample_rate) {
+	if (speed != format.sample_rate) {
 		audio_log(OTTS_LOG_CRIT,
 			  "oss: Device doesn't support bitrate %d, using %d instead.\n",
-			  track.sample_rate, speed);
+			  format.sample_rate, speed);
 	}
 
+	oss_id->format = format;
+	oss_id->frame_bytes = format.bits / 8 * format.num_channels;
+
+	return 0;
+}
+
+/*
+ Write as many of the _count_ frames as fit in the free space of the
+ device, with the volume applied.  OSS doesn't support non-blocking
+ write, so the free space is checked first and write() returns at once.
+ Returns the number of frames written or a negative value on error.
+*/
+static int oss_write(AudioID * id, const void *frames, int count)
+{
+	oss_id_t *oss_id = (oss_id_t *) id;
+	audio_buf_info info;
+	int gain;
+	void *samples;
+	int num_samples;
+	int bytes;
+	int ret;
+	int i;
+
+	if (oss_id == NULL || oss_id->fd < 0 || oss_id->frame_bytes == 0)
+		return -1;
+
+	ret = ioctl(oss_id->fd, SNDCTL_DSP_GETOSPACE, &info);
+	if (ret == -1) {
+		perror("OSS ERROR: GETOSPACE");
+		return -5;
+	}
+
+	bytes = count * oss_id->frame_bytes;
+	if (bytes > info.bytes)
+		bytes = info.bytes - info.bytes % oss_id->frame_bytes;
+	if (bytes <= 0)
+		return 0;
+
+	/* Create a copy of the frames with the adjusted volume */
+	num_samples = bytes / (oss_id->format.bits / 8);
+	samples = g_malloc(bytes);
+	gain = otts_dsp_volume_gain(id->volume);
+	if (oss_id->format.bits == 16) {
+		otts_dsp_scale16(samples, frames, num_samples, gain);
+	} else {
+		for (i = 0; i < num_samples; i++)
+			((signed char *)samples)[i] =
+			    (((const signed char *)frames)[i] * gain)
+			    >> OTTS_DSP_GAIN_SHIFT;
+	}
+
+	ret = write(oss_id->fd, samples, bytes);
+	g_free(samples);
+
+	/* Handle write() errors */
+	if (ret < 0) {
+		perror("audio");
+		return -6;
+	}
+
+	return ret / oss_id->frame_bytes;
+}
+
+/* Wait until everything was played and close the device */
+static int oss_drain(AudioID * id)
+{
+	oss_id_t *oss_id = (oss_id_t *) id;
+	int ret;
+
+	if (oss_id == NULL || oss_id->fd < 0)
+		return 0;
+
+	ret = ioctl(oss_id->fd, SNDCTL_DSP_SYNC, 0);
+	_oss_close(oss_id);
+
+	return ret == -1 ? -1 : 0;
+}
+
+/* Number of frames written and not played yet */
+static int oss_delay(AudioID * id)
+{
+	oss_id_t *oss_id = (oss_id_t *) id;
+	int bytes;
+
+	if (oss_id == NULL || oss_id->fd < 0 || oss_id->frame_bytes == 0)
+		return -1;
+
+	if (ioctl(oss_id->fd, SNDCTL_DSP_GETODELAY, &bytes) == -1)
+		return -1;
+
+	return bytes / oss_id->frame_bytes;
+}
+
+static int oss_poll_fd(AudioID * id, short *events)
+{
+	oss_id_t *oss_id = (oss_id_t *) id;
+
+	if (oss_id == NULL)
+		return -1;
+
+	*events = POLLOUT;
+	return oss_id->fd;
+}
+
+static int oss_play(AudioID * id, AudioTrack track)
+{
+	int ret;
+	struct timeval now;
+	struct timespec timeout;
+	float lenght;
+	int r;
+	int num_frames;
+	char *output_samples;
+	float delay = 0;
+	float DELAY = 0.1;	/* in seconds */
+	AudioStreamFormat format;
+	oss_id_t *oss_id = (oss_id_t *) id;
+
+	if (oss_id == NULL)
+		return -1;
+
+	format.bits = track.bits;
+	format.num_channels = track.num_channels;
+	format.sample_rate = track.sample_rate;
+	ret = oss_open_stream(id, format);
+	if (ret)
+		return ret;
+
 	/* Is it not an empty track? */
 	if (track.samples == NULL) {
 		_oss_close(oss_id);
@@ -256,75 +380,33 @@ static int oss_play(AudioID * id, AudioTrack track)
 	   In the meantime, wait in pthread_cond_timedwait for more data
 	   or for interruption. */
 	audio_log(OTTS_LOG_INFO, "oss: Starting playback");
-	output_samples = track_volume.samples;
-	num_bytes = track.num_samples * bytes_per_sample;
-	audio_log(OTTS_LOG_INFO, "oss: bytes to play: %d, (%f secs)", num_bytes,
-		  (((float)(num_bytes) / 2) / (float)track.sample_rate));
-	while (num_bytes > 0) {
-
-		/* OSS doesn't support non-blocking write, so lets check how much data
-		   can we write so that write() returns immediatelly */
-		re = ioctl(oss_id->fd, SNDCTL_DSP_GETOSPACE, &info);
-		if (re == -1) {
-			perror("OSS ERROR: GETOSPACE");
+	output_samples = (char *)track.samples;
+	num_frames = track.num_samples / track.num_channels;
+	audio_log(OTTS_LOG_INFO, "oss: frames to play: %d, (%f secs)", num_frames,
+		  (float)num_frames / (float)track.sample_rate);
+	r = ETIMEDOUT;
+	while (num_frames > 0) {
+
+		ret = oss_write(id, output_samples, num_frames);
+		if (ret < 0) {
 			_oss_close(oss_id);
-			return -5;
+			return ret;
 		}
 
-		/* If there is not enough space for a single fragment, try later.
+		/* If there is not enough space for a single frame, try later.
 		   (This shouldn't happen, it has very bad effect on synchronization!) */
-		if (info.fragments == 0) {
+		if (ret == 0) {
 			audio_log(OTTS_LOG_INFO,
 				  "oss: WARNING: There is not enough space for a single fragment, looping");
 			usleep(100);
 			continue;
 		}
 
-		audio_log(OTTS_LOG_INFO,
-			  "oss: There is space for %d more fragments, fragment size is %d bytes",
-			  info.fragments, info.fragsize);
+		num_frames -= ret;
+		output_samples += ret * oss_id->frame_bytes;
 
-		bytes = info.fragments * info.fragsize;
-		ret =
-		    write(oss_id->fd, output_samples,
-			  num_bytes > bytes ? bytes : num_bytes);
-
-		/* Handle write() errors */
-		if (ret <= 0) {
-			perror("audio");
-			_oss_close(oss_id);
-			return -6;
-		}
-
-		num_bytes -= ret;
-		output_samples += ret / 2;
-
-		audio_log(OTTS_LOG_INFO, "oss: %d bytes written to OSS, %d remaining", ret,
-			  num_bytes);
-
-		/* If there is some more data that is less than a
-		   full fragment, we need to write it immediatelly so
-		   that it doesn't cause buffer underruns later. */
-		if ((num_bytes > 0)
-		    && (num_bytes < info.fragsize)
-		    && (bytes + num_bytes < info.bytes)) {
-
-			audio_log(OTTS_LOG_INFO,
-				  "oss: Writing the rest of the data (%d bytes) to OSS, not a full fragment",
-				  num_bytes);
-
-			ret2 = write(oss_id->fd, output_samples, num_bytes);
-			num_bytes -= ret2;
-			output_samples += ret2 / 2;
-			ret += ret2;
-		}
-
-		/* Handle write() errors */
-		if (ret <= 0) {
-			perror("audio");
-			_oss_close(oss_id);
-			return -6;
-		}
+		audio_log(OTTS_LOG_INFO, "oss: %d frames written to OSS, %d remaining", ret,
+			  num_frames);
 
 		/* Some timing magic... 
 		   We need to wait for the time computed from the number of
@@ -336,7 +418,7 @@ static int oss_play(AudioID * id, AudioTrack track)
 		 */
 		audio_log(OTTS_LOG_INFO, "oss: Now we will try to wait");
 		pthread_mutex_lock(&oss_id->pt_mutex);
-		lenght = (((float)(ret) / 2) / (float)track.sample_rate);
+		lenght = (float)ret / (float)track.sample_rate;
 		if (!delay) {
 			delay = lenght > DELAY ? DELAY : lenght;
 			lenght -= delay;
@@ -347,13 +429,9 @@ static int oss_play(AudioID * id, AudioTrack track)
 		timeout.tv_sec = now.tv_sec + (int)lenght;
 		timeout.tv_nsec =
 		    now.tv_usec * 1000 + (lenght - (int)lenght) * 1000000000;
-		//audio_log(OTTS_LOG_DEBUG, "oss: waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//    now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
 
 		timeout.tv_sec += timeout.tv_nsec / 1000000000;
 		timeout.tv_nsec = timeout.tv_nsec % 1000000000;
-		//      audio_log("6, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//  now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
 		r = pthread_cond_timedwait(&oss_id->pt_cond, &oss_id->pt_mutex,
 					   &timeout);
 		pthread_mutex_unlock(&oss_id->pt_mutex);
@@ -379,21 +457,14 @@ static int oss_play(AudioID * id, AudioTrack track)
 		gettimeofday(&now, NULL);
 		timeout.tv_sec = now.tv_sec;
 		timeout.tv_nsec = now.tv_usec * 1000 + delay * 1000000000;
-		// audio_log("6, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//          now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
 		timeout.tv_sec += timeout.tv_nsec / 1000000000;
 		timeout.tv_nsec = timeout.tv_nsec % 1000000000;
-		// audio_log("6, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//          now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
 		r = pthread_cond_timedwait(&oss_id->pt_cond, &oss_id->pt_mutex,
 					   &timeout);
 		pthread_mutex_unlock(&oss_id->pt_mutex);
 	}
 	audio_log(OTTS_LOG_INFO, "oss: End of wait");
 
-	if (track_volume.samples != NULL)
-		g_free(track_volume.samples);
-
 	/* Flush all the buffers */
 	_oss_sync(oss_id);
 
@@ -406,7 +477,8 @@ static int oss_play(AudioID * id, AudioTrack track)
 	return 0;
 }
 
-/* Stop the playback on the device and interrupt oss_play */
+/* Stop the playback on the device and interrupt oss_play, this is
+   also the drop operation of the stream */
 static int oss_stop(AudioID * id)
 {
 	int ret;
@@ -482,5 +554,23 @@ audio_plugin_t *oss_plugin_get(void)
 
 audio_plugin_t *AUDIO_PLUGIN_ENTRY(void)
     __attribute__ ((weak, alias("oss_plugin_get")));
+
+/* The stream operations, looked up separately from the plugin */
+static audio_stream_ops_t oss_stream_ops = {
+	oss_open_stream,
+	oss_write,
+	oss_drain,
+	oss_stop,
+	oss_delay,
+	oss_poll_fd
+};
+
+audio_stream_ops_t *oss_stream_ops_get(void)
+{
+	return &oss_stream_ops;
+}
+
+audio_stream_ops_t *AUDIO_STREAM_ENTRY(void)
+    __attribute__ ((weak, alias("oss_stream_ops_get")));
 #undef MSG
 #undef ERR
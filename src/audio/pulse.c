@@ -43,6 +43,7 @@
 #include <pulse/error.h>
 
 #define AUDIO_PLUGIN_ENTRY otts_pulse_LTX_audio_plugin_get
+#define AUDIO_STREAM_ENTRY otts_pulse_LTX_audio_stream_ops_get
 #include <opentts/opentts_audio_plugin.h>
 #include<logging.h>
 
@@ -151,106 +152,202 @@ static AudioID *pulse_open(void **pars, logging_func log)
 	return (AudioID *) pulse_id;
 }
 
-static int pulse_play(AudioID * id, AudioTrack track)
+/*
+ Connect to the server for frames in _format_, unless the connection is
+ set up for them already.
+*/
+static int pulse_open_stream(AudioID * id, AudioStreamFormat format)
 {
-	pa_sample_format_t format;
-	int bytes_per_sample;
-	int num_bytes;
-	int outcnt = 0;
-	signed short *output_samples;
-	int i;
-	int error;
+	pa_sample_format_t pa_format;
 	pulse_id_t *pulse_id = (pulse_id_t *) id;
 
-	if (id == NULL) {
+	if (id == NULL)
 		return -1;
-	}
-	if (track.samples == NULL || track.num_samples <= 0) {
-		return 0;
-	}
-	audio_log(OTTS_LOG_INFO, "pulse: Starting playback\n");
 
 	/* Choose the correct format */
-	if (track.bits == 16) {
-		bytes_per_sample = 2;
-	} else if (track.bits == 8) {
-		bytes_per_sample = 1;
-	} else {
-		audio_log(OTTS_LOG_WARN,
-			  "pulse: ERROR: Unsupported sound data format, track.bits = %d\n",
-			  track.bits);
-		return -1;
-	}
-
-	if (bytes_per_sample == 2) {
+	if (format.bits == 16) {
 		switch (id->format) {
 		case SPD_AUDIO_LE:
-			format = PA_SAMPLE_S16LE;
+			pa_format = PA_SAMPLE_S16LE;
 			break;
 		case SPD_AUDIO_BE:
-			format = PA_SAMPLE_S16BE;
+			pa_format = PA_SAMPLE_S16BE;
 			break;
 		default:
 			audio_log(OTTS_LOG_WARN, "pulse:invalid format %d",
 				  id->format);
 			return -1;
 		}
+	} else if (format.bits == 8) {
+		pa_format = PA_SAMPLE_U8;
 	} else {
-		format = PA_SAMPLE_U8;
+		audio_log(OTTS_LOG_WARN,
+			  "pulse: ERROR: Unsupported sound data format, track.bits = %d\n",
+			  format.bits);
+		return -1;
 	}
 
-	output_samples = track.samples;
-	num_bytes = track.num_samples * bytes_per_sample;
-
 	/* Insure that the connection is open, and that its parameters
 	 * are suitable for this track. */
 	if (pulse_id->pa_simple == NULL
-	    || pulse_id->current_rate != track.sample_rate
-	    || pulse_id->current_format != format
-	    || pulse_id->current_channels != track.num_channels) {
+	    || pulse_id->current_rate != format.sample_rate
+	    || pulse_id->current_format != pa_format
+	    || pulse_id->current_channels != format.num_channels) {
 		if (pulse_id->pa_simple != NULL) {
 			/* Close the old connection. */
 			pa_simple_free(pulse_id->pa_simple);
+			pulse_id->pa_simple = NULL;
 			audio_log(OTTS_LOG_INFO,
 				  "pulse: Reopenning connection due to change in track parameters sample_rate:%d bps:%d channels:%d\n",
-				  track.sample_rate, track.bits,
-				  track.num_channels);
+				  format.sample_rate, format.bits,
+				  format.num_channels);
 		}
 
-		if (pulse_open_helper(pulse_id, format, track.sample_rate,
-				      track.num_channels) != 0) {
+		if (pulse_open_helper(pulse_id, pa_format, format.sample_rate,
+				      format.num_channels) != 0) {
 			audio_log(OTTS_LOG_ERR,
 				  "pulse: unable to reconnect to server.");
 			return -1;
 		}
 	}
 
-	audio_log(OTTS_LOG_DEBUG, "pulse: bytes to play: %d, (%f secs)\n", num_bytes,
-		  (((float)(num_bytes) / 2) / (float)track.sample_rate));
+	return 0;
+}
+
+/*
+ Send up to PULSE_SEND_BYTES of the frames to the server.  pa_simple
+ can't tell the room in the buffer of the server, this blocks until
+ the server takes the frames.
+*/
+static int pulse_write(AudioID * id, const void *frames, int count)
+{
+	pulse_id_t *pulse_id = (pulse_id_t *) id;
+	int frame_bytes;
+	int error;
+
+	if (id == NULL || pulse_id->pa_simple == NULL)
+		return -1;
+
+	frame_bytes = pa_sample_size_of_format(pulse_id->current_format)
+	    * pulse_id->current_channels;
+	if (count * frame_bytes > PULSE_SEND_BYTES)
+		count = PULSE_SEND_BYTES / frame_bytes;
+	if (count <= 0)
+		return 0;
+
+	if (pa_simple_write(pulse_id->pa_simple, frames, count * frame_bytes,
+			    &error) < 0) {
+		pa_simple_drain(pulse_id->pa_simple, NULL);
+		pa_simple_free(pulse_id->pa_simple);
+		pulse_id->pa_simple = NULL;
+		audio_log(OTTS_LOG_NOTICE,
+			  "pulse: ERROR: Audio: pulse_play(): %s - closing device - re-open it in next run\n",
+			  pa_strerror(error));
+		return -1;
+	}
+	audio_log(OTTS_LOG_INFO, "pulse: wrote %u bytes\n", count * frame_bytes);
+
+	return count;
+}
+
+static int pulse_drain(AudioID * id)
+{
+	pulse_id_t *pulse_id = (pulse_id_t *) id;
+	int error;
+
+	if (id == NULL || pulse_id->pa_simple == NULL)
+		return -1;
+
+	if (pa_simple_drain(pulse_id->pa_simple, &error) < 0) {
+		audio_log(OTTS_LOG_NOTICE, "pulse: drain failed: %s\n",
+			  pa_strerror(error));
+		return -1;
+	}
+	return 0;
+}
+
+/* Drop what the server still has to play, stops pulse_play() too */
+static int pulse_drop(AudioID * id)
+{
+	pulse_id_t *pulse_id = (pulse_id_t *) id;
+	int error;
+
+	if (id == NULL)
+		return -1;
+
+	pulse_id->pa_stop_playback = 1;
+	if (pulse_id->pa_simple != NULL
+	    && pa_simple_flush(pulse_id->pa_simple, &error) < 0) {
+		audio_log(OTTS_LOG_NOTICE, "pulse: flush failed: %s\n",
+			  pa_strerror(error));
+		return -1;
+	}
+	return 0;
+}
+
+/* Number of frames the server didn't play yet */
+static int pulse_delay(AudioID * id)
+{
+	pulse_id_t *pulse_id = (pulse_id_t *) id;
+	pa_usec_t latency;
+	int error;
+
+	if (id == NULL || pulse_id->pa_simple == NULL)
+		return -1;
+
+	latency = pa_simple_get_latency(pulse_id->pa_simple, &error);
+	if (latency == (pa_usec_t) - 1)
+		return -1;
+
+	return latency * pulse_id->current_rate / 1000000;
+}
+
+static int pulse_play(AudioID * id, AudioTrack track)
+{
+	AudioStreamFormat format;
+	char *output_samples;
+	int num_frames;
+	int frame_bytes;
+	int ret;
+	int error;
+	pulse_id_t *pulse_id = (pulse_id_t *) id;
+
+	if (id == NULL) {
+		return -1;
+	}
+	if (track.samples == NULL || track.num_samples <= 0) {
+		return 0;
+	}
+	audio_log(OTTS_LOG_INFO, "pulse: Starting playback\n");
+
+	format.bits = track.bits;
+	format.num_channels = track.num_channels;
+	format.sample_rate = track.sample_rate;
+	if (pulse_open_stream(id, format) != 0)
+		return -1;
+
+	output_samples = (char *)track.samples;
+	num_frames = track.num_samples / track.num_channels;
+	frame_bytes = track.bits / 8 * track.num_channels;
+
+	audio_log(OTTS_LOG_DEBUG, "pulse: frames to play: %d, (%f secs)\n",
+		  num_frames, (float)num_frames / (float)track.sample_rate);
 	pulse_id->pa_stop_playback = 0;
-	outcnt = 0;
-	i = 0;
-	while ((outcnt < num_bytes) && !pulse_id->pa_stop_playback) {
-		if ((num_bytes - outcnt) > PULSE_SEND_BYTES) {
-			i = PULSE_SEND_BYTES;
-		} else {
-			i = (num_bytes - outcnt);
-		}
-		if (pa_simple_write
-		    (pulse_id->pa_simple, ((char *)output_samples) + outcnt, i,
-		     &error) < 0) {
-			pa_simple_drain(pulse_id->pa_simple, NULL);
-			pa_simple_free(pulse_id->pa_simple);
-			pulse_id->pa_simple = NULL;
-			audio_log(OTTS_LOG_NOTICE,
-				  "pulse: ERROR: Audio: pulse_play(): %s - closing device - re-open it in next run\n",
-				  pa_strerror(error));
+	while (num_frames > 0 && !pulse_id->pa_stop_playback) {
+		ret = pulse_write(id, output_samples, num_frames);
+		if (ret < 0)
 			return -1;
-		} else {
-			audio_log(OTTS_LOG_INFO, "pulse: wrote %u bytes\n", i);
-		}
-		outcnt += i;
+		num_frames -= ret;
+		output_samples += ret * frame_bytes;
 	}
+
+	/* The server buffers a good deal of audio, drop it right away
+	   rather than letting it play out after a stop */
+	if (pulse_id->pa_stop_playback
+	    && pa_simple_flush(pulse_id->pa_simple, &error) < 0)
+		audio_log(OTTS_LOG_NOTICE, "pulse: flush failed: %s\n",
+			  pa_strerror(error));
+
 	return 0;
 }
 
@@ -310,3 +407,21 @@ audio_plugin_t *pulse_plugin_get(void)
 
 audio_plugin_t *AUDIO_PLUGIN_ENTRY(void)
     __attribute__ ((weak, alias("pulse_plugin_get")));
+
+/* The stream operations, looked up separately from the plugin */
+static audio_stream_ops_t pulse_stream_ops = {
+	pulse_open_stream,
+	pulse_write,
+	pulse_drain,
+	pulse_drop,
+	pulse_delay,
+	NULL
+};
+
+audio_stream_ops_t *pulse_stream_ops_get(void)
+{
+	return &pulse_stream_ops;
+}
+
+audio_stream_ops_t *AUDIO_STREAM_ENTRY(void)
+    __attribute__ ((weak, alias("pulse_stream_ops_get")));
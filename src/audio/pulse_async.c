@@ -0,0 +1,605 @@
+/*
+ * pulse_async.c -- The asynchronous PulseAudio backend for OpenTTS
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; see the file COPYING.  If not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/*
+ * Unlike the pulse backend, which uses the blocking pa_simple API,
+ * this one runs a pa_threaded_mainloop and writes to a pa_stream only
+ * as much as the server asks for.  The buffer of the server is kept
+ * short with the target length and minimum request given in
+ * milliseconds, so the first frames are heard quickly.  A stop corks
+ * the stream and flushes what the server holds at once.
+ *
+ * All calls into libpulse are made with the lock of the main loop
+ * held.  The callbacks run in the thread of the main loop and only
+ * wake the threads waiting in pa_threaded_mainloop_wait().  The write
+ * callback also writes a byte to a pipe, which is what a module polls
+ * on to know when the stream takes frames again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+#define AUDIO_PLUGIN_ENTRY otts_pulse_async_LTX_audio_plugin_get
+#define AUDIO_STREAM_ENTRY otts_pulse_async_LTX_audio_stream_ops_get
+#include <opentts/opentts_audio_plugin.h>
+#include <opentts/opentts_types.h>
+#include <logging.h>
+#include <audio_dsp.h>
+
+typedef struct {
+	AudioID id;
+	pa_threaded_mainloop *mainloop;
+	pa_context *context;
+	pa_stream *stream;
+	char *server;
+	int target_ms;		/* Length of the buffer of the server */
+	int minreq_ms;		/* Least the server asks for at once */
+	pa_sample_spec spec;
+	int frame_bytes;
+	int corked;
+	volatile int stop;
+	int notify_pipe[2];	/* Written to when the stream takes frames */
+	int16_t *scratch;	/* Frames with the volume applied */
+	size_t scratch_size;
+} pulse_async_id_t;
+
+#define DEFAULT_TARGET_MS 20
+#define DEFAULT_MINREQ_MS 5
+
+static logging_func audio_log;
+
+static char const *pulse_async_play_cmd = "paplay";
+
+static void context_state_cb(pa_context * c, void *userdata)
+{
+	pulse_async_id_t *id = userdata;
+
+	pa_threaded_mainloop_signal(id->mainloop, 0);
+}
+
+static void stream_state_cb(pa_stream * s, void *userdata)
+{
+	pulse_async_id_t *id = userdata;
+
+	pa_threaded_mainloop_signal(id->mainloop, 0);
+}
+
+static void stream_write_cb(pa_stream * s, size_t nbytes, void *userdata)
+{
+	pulse_async_id_t *id = userdata;
+	char c = 0;
+
+	/* A full pipe has a byte waiting already */
+	if (write(id->notify_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+		audio_log(OTTS_LOG_WARN, "pulse_async: Can't write to pipe: %s",
+			  strerror(errno));
+	pa_threaded_mainloop_signal(id->mainloop, 0);
+}
+
+static void success_cb(pa_stream * s, int success, void *userdata)
+{
+	pulse_async_id_t *id = userdata;
+
+	pa_threaded_mainloop_signal(id->mainloop, 0);
+}
+
+/* Wait for the operation to finish unless stopped, with the lock */
+static void wait_operation(pulse_async_id_t * id, pa_operation * op)
+{
+	if (op == NULL)
+		return;
+	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING
+	       && !id->stop)
+		pa_threaded_mainloop_wait(id->mainloop);
+	pa_operation_unref(op);
+}
+
+/* Run the operation without waiting for it */
+static void start_operation(pa_operation * op)
+{
+	if (op != NULL)
+		pa_operation_unref(op);
+}
+
+static void drain_notify_pipe(pulse_async_id_t * id)
+{
+	char buf[64];
+
+	while (read(id->notify_pipe[0], buf, sizeof(buf)) > 0) ;
+}
+
+/* Disconnect the stream, with the lock */
+static void close_stream(pulse_async_id_t * id)
+{
+	if (id->stream == NULL)
+		return;
+	pa_stream_set_state_callback(id->stream, NULL, NULL);
+	pa_stream_set_write_callback(id->stream, NULL, NULL);
+	pa_stream_disconnect(id->stream);
+	pa_stream_unref(id->stream);
+	id->stream = NULL;
+}
+
+static int ms_param(void *par, int def)
+{
+	if (par != NULL && atoi(par) > 0)
+		return atoi(par);
+	return def;
+}
+
+/*
+ Open the PulseAudio backend
+
+ Arguments:
+ pars[3] ... the server, or "default"
+ pars[6] ... the target length of the buffer in ms, 0 for the default
+ pars[7] ... the minimum request in ms, 0 for the default
+*/
+static AudioID *pulse_async_open(void **pars, logging_func log)
+{
+	pulse_async_id_t *id;
+	pa_context_state_t state;
+
+	if (audio_log == NULL)
+		audio_log = log;
+
+	id = g_malloc0(sizeof(pulse_async_id_t));
+	if (pars[3] != NULL && strcmp(pars[3], "default"))
+		id->server = g_strdup(pars[3]);
+	id->target_ms = ms_param(pars[6], DEFAULT_TARGET_MS);
+	id->minreq_ms = ms_param(pars[7], DEFAULT_MINREQ_MS);
+
+	if (pipe(id->notify_pipe)) {
+		audio_log(OTTS_LOG_ERR, "pulse_async: Can't create a pipe");
+		g_free(id->server);
+		g_free(id);
+		return NULL;
+	}
+	fcntl(id->notify_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(id->notify_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(id->notify_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(id->notify_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	id->mainloop = pa_threaded_mainloop_new();
+	if (id->mainloop == NULL)
+		goto failed;
+	id->context = pa_context_new(pa_threaded_mainloop_get_api(id->mainloop),
+				     "OpenTTS");
+	if (id->context == NULL)
+		goto failed;
+	pa_context_set_state_callback(id->context, context_state_cb, id);
+
+	if (pa_threaded_mainloop_start(id->mainloop) < 0)
+		goto failed;
+
+	pa_threaded_mainloop_lock(id->mainloop);
+	if (pa_context_connect(id->context, id->server, PA_CONTEXT_NOFLAGS,
+			       NULL) < 0) {
+		pa_threaded_mainloop_unlock(id->mainloop);
+		goto failed;
+	}
+	for (;;) {
+		state = pa_context_get_state(id->context);
+		if (state == PA_CONTEXT_READY || !PA_CONTEXT_IS_GOOD(state))
+			break;
+		pa_threaded_mainloop_wait(id->mainloop);
+	}
+	pa_threaded_mainloop_unlock(id->mainloop);
+	if (state != PA_CONTEXT_READY)
+		goto failed;
+
+	audio_log(OTTS_LOG_INFO,
+		  "pulse_async: Connected, target length %d ms, minimum request %d ms",
+		  id->target_ms, id->minreq_ms);
+
+	return (AudioID *) id;
+
+failed:
+	audio_log(OTTS_LOG_ERR, "pulse_async: Cannot connect to server: %s",
+		  id->context != NULL ?
+		  pa_strerror(pa_context_errno(id->context)) : "no memory");
+	if (id->mainloop != NULL)
+		pa_threaded_mainloop_stop(id->mainloop);
+	if (id->context != NULL) {
+		pa_context_disconnect(id->context);
+		pa_context_unref(id->context);
+	}
+	if (id->mainloop != NULL)
+		pa_threaded_mainloop_free(id->mainloop);
+	close(id->notify_pipe[0]);
+	close(id->notify_pipe[1]);
+	g_free(id->server);
+	g_free(id);
+	return NULL;
+}
+
+/*
+ Connect a stream for frames in _format_, unless the stream is set up
+ for them already.  The stream starts corked, the first write uncorks
+ it.
+*/
+static int pulse_async_open_stream(AudioID * id, AudioStreamFormat format)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+	pa_sample_spec spec;
+	pa_buffer_attr attr;
+	const pa_buffer_attr *granted;
+	pa_stream_state_t state;
+	int ret = 0;
+
+	if (id == NULL)
+		return -1;
+
+	if (format.bits == 16)
+		spec.format = id->format == SPD_AUDIO_BE ?
+		    PA_SAMPLE_S16BE : PA_SAMPLE_S16LE;
+	else if (format.bits == 8)
+		spec.format = PA_SAMPLE_U8;
+	else {
+		audio_log(OTTS_LOG_WARN,
+			  "pulse_async: Unsupported sample size %d", format.bits);
+		return -1;
+	}
+	spec.rate = format.sample_rate;
+	spec.channels = format.num_channels;
+
+	pa_threaded_mainloop_lock(pulse_id->mainloop);
+	pulse_id->stop = 0;
+
+	if (pulse_id->stream != NULL
+	    && pa_stream_get_state(pulse_id->stream) == PA_STREAM_READY
+	    && pulse_id->spec.format == spec.format
+	    && pulse_id->spec.rate == spec.rate
+	    && pulse_id->spec.channels == spec.channels) {
+		pa_threaded_mainloop_unlock(pulse_id->mainloop);
+		return 0;
+	}
+
+	close_stream(pulse_id);
+	pulse_id->spec = spec;
+	pulse_id->frame_bytes = pa_frame_size(&spec);
+
+	pulse_id->stream = pa_stream_new(pulse_id->context, "playback", &spec,
+					 NULL);
+	if (pulse_id->stream == NULL) {
+		ret = -1;
+		goto out;
+	}
+	pa_stream_set_state_callback(pulse_id->stream, stream_state_cb,
+				     pulse_id);
+	pa_stream_set_write_callback(pulse_id->stream, stream_write_cb,
+				     pulse_id);
+
+	/* Start playing as soon as the first request is filled */
+	attr.maxlength = (uint32_t) - 1;
+	attr.tlength = pa_usec_to_bytes(pulse_id->target_ms
+					* PA_USEC_PER_MSEC, &spec);
+	attr.minreq = pa_usec_to_bytes(pulse_id->minreq_ms
+				       * PA_USEC_PER_MSEC, &spec);
+	attr.prebuf = attr.minreq;
+	attr.fragsize = (uint32_t) - 1;
+
+	if (pa_stream_connect_playback(pulse_id->stream, NULL, &attr,
+				       PA_STREAM_START_CORKED
+				       | PA_STREAM_INTERPOLATE_TIMING
+				       | PA_STREAM_AUTO_TIMING_UPDATE
+				       | PA_STREAM_ADJUST_LATENCY, NULL,
+				       NULL) < 0) {
+		ret = -1;
+		goto out;
+	}
+	pulse_id->corked = 1;
+
+	for (;;) {
+		state = pa_stream_get_state(pulse_id->stream);
+		if (state == PA_STREAM_READY || !PA_STREAM_IS_GOOD(state))
+			break;
+		pa_threaded_mainloop_wait(pulse_id->mainloop);
+	}
+	if (state != PA_STREAM_READY) {
+		ret = -1;
+		goto out;
+	}
+
+	granted = pa_stream_get_buffer_attr(pulse_id->stream);
+	if (granted != NULL)
+		audio_log(OTTS_LOG_INFO,
+			  "pulse_async: Stream of %d Hz, %d channels, buffer %u bytes (%d ms), request %u bytes",
+			  spec.rate, spec.channels, granted->tlength,
+			  (int)(pa_bytes_to_usec(granted->tlength, &spec)
+				/ PA_USEC_PER_MSEC), granted->minreq);
+
+out:
+	if (ret != 0) {
+		audio_log(OTTS_LOG_ERR, "pulse_async: Cannot open stream: %s",
+			  pa_strerror(pa_context_errno(pulse_id->context)));
+		close_stream(pulse_id);
+	}
+	pa_threaded_mainloop_unlock(pulse_id->mainloop);
+	return ret;
+}
+
+/* The frames with the volume applied, in the scratch buffer if needed */
+static const void *apply_volume(pulse_async_id_t * id, const void *frames,
+				size_t bytes)
+{
+	int gain;
+
+	if (id->id.volume >= OTTS_VOICE_VOLUME_MAX
+	    || id->spec.format == PA_SAMPLE_U8)
+		return frames;
+
+	if (bytes > id->scratch_size) {
+		id->scratch = g_realloc(id->scratch, bytes);
+		id->scratch_size = bytes;
+	}
+	gain = otts_dsp_volume_gain(id->id.volume);
+	otts_dsp_scale16(id->scratch, frames, bytes / 2, gain);
+	return id->scratch;
+}
+
+/*
+ Write as many of the _count_ frames as the server asks for.  Never
+ blocks.  Returns the number of frames written or -1 on error.
+*/
+static int pulse_async_write(AudioID * id, const void *frames, int count)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+	size_t bytes;
+	int ret = -1;
+
+	if (id == NULL)
+		return -1;
+
+	drain_notify_pipe(pulse_id);
+
+	pa_threaded_mainloop_lock(pulse_id->mainloop);
+	if (pulse_id->stream == NULL
+	    || pa_stream_get_state(pulse_id->stream) != PA_STREAM_READY)
+		goto out;
+
+	bytes = pa_stream_writable_size(pulse_id->stream);
+	if (bytes == (size_t) - 1)
+		goto out;
+	bytes -= bytes % pulse_id->frame_bytes;
+	if (bytes > (size_t)count * pulse_id->frame_bytes)
+		bytes = (size_t)count * pulse_id->frame_bytes;
+	if (bytes == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (pa_stream_write(pulse_id->stream,
+			    apply_volume(pulse_id, frames, bytes), bytes, NULL,
+			    0, PA_SEEK_RELATIVE) < 0)
+		goto out;
+	if (pulse_id->corked) {
+		start_operation(pa_stream_cork(pulse_id->stream, 0, NULL,
+					       NULL));
+		pulse_id->corked = 0;
+	}
+	ret = bytes / pulse_id->frame_bytes;
+
+out:
+	if (ret < 0)
+		audio_log(OTTS_LOG_NOTICE, "pulse_async: Write failed: %s",
+			  pa_strerror(pa_context_errno(pulse_id->context)));
+	pa_threaded_mainloop_unlock(pulse_id->mainloop);
+	return ret;
+}
+
+/* Wait until the server played everything or the stream is stopped */
+static int pulse_async_drain(AudioID * id)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+
+	if (id == NULL)
+		return -1;
+
+	pa_threaded_mainloop_lock(pulse_id->mainloop);
+	if (pulse_id->stream != NULL && !pulse_id->corked)
+		wait_operation(pulse_id,
+			       pa_stream_drain(pulse_id->stream, success_cb,
+					       pulse_id));
+	pa_threaded_mainloop_unlock(pulse_id->mainloop);
+	return 0;
+}
+
+/*
+ Silence the stream at once: cork it and throw away what the server
+ holds.  Also stops pulse_async_play() and pulse_async_drain().
+*/
+static int pulse_async_stop(AudioID * id)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+
+	if (id == NULL)
+		return -1;
+
+	pa_threaded_mainloop_lock(pulse_id->mainloop);
+	pulse_id->stop = 1;
+	if (pulse_id->stream != NULL
+	    && pa_stream_get_state(pulse_id->stream) == PA_STREAM_READY) {
+		start_operation(pa_stream_cork(pulse_id->stream, 1, NULL, NULL));
+		start_operation(pa_stream_flush(pulse_id->stream, NULL, NULL));
+		pulse_id->corked = 1;
+	}
+	pa_threaded_mainloop_signal(pulse_id->mainloop, 0);
+	pa_threaded_mainloop_unlock(pulse_id->mainloop);
+	return 0;
+}
+
+/* Number of frames written and not heard yet */
+static int pulse_async_delay(AudioID * id)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+	pa_usec_t latency;
+	int negative;
+	int ret = -1;
+
+	if (id == NULL)
+		return -1;
+
+	pa_threaded_mainloop_lock(pulse_id->mainloop);
+	if (pulse_id->stream != NULL
+	    && pa_stream_get_latency(pulse_id->stream, &latency,
+				     &negative) == 0)
+		ret = negative ? 0 : latency * pulse_id->spec.rate / 1000000;
+	pa_threaded_mainloop_unlock(pulse_id->mainloop);
+	return ret;
+}
+
+static int pulse_async_poll_fd(AudioID * id, short *events)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+
+	if (id == NULL)
+		return -1;
+	*events = POLLIN;
+	return pulse_id->notify_pipe[0];
+}
+
+static int pulse_async_play(AudioID * id, AudioTrack track)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+	AudioStreamFormat format;
+	const char *samples;
+	int num_frames;
+	int ret;
+
+	if (id == NULL)
+		return -1;
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	format.bits = track.bits;
+	format.num_channels = track.num_channels;
+	format.sample_rate = track.sample_rate;
+	if (pulse_async_open_stream(id, format) != 0)
+		return -1;
+
+	samples = (const char *)track.samples;
+	num_frames = track.num_samples / track.num_channels;
+
+	while (num_frames > 0 && !pulse_id->stop) {
+		ret = pulse_async_write(id, samples, num_frames);
+		if (ret < 0)
+			return -1;
+		num_frames -= ret;
+		samples += ret * pulse_id->frame_bytes;
+		if (ret == 0) {
+			pa_threaded_mainloop_lock(pulse_id->mainloop);
+			if (!pulse_id->stop
+			    && pa_stream_writable_size(pulse_id->stream) == 0)
+				pa_threaded_mainloop_wait(pulse_id->mainloop);
+			pa_threaded_mainloop_unlock(pulse_id->mainloop);
+		}
+	}
+
+	if (!pulse_id->stop)
+		pulse_async_drain(id);
+
+	return 0;
+}
+
+static int pulse_async_close(AudioID * id)
+{
+	pulse_async_id_t *pulse_id = (pulse_async_id_t *) id;
+
+	if (id == NULL)
+		return -1;
+
+	pa_threaded_mainloop_lock(pulse_id->mainloop);
+	close_stream(pulse_id);
+	pa_context_disconnect(pulse_id->context);
+	pa_context_unref(pulse_id->context);
+	pa_threaded_mainloop_unlock(pulse_id->mainloop);
+	pa_threaded_mainloop_stop(pulse_id->mainloop);
+	pa_threaded_mainloop_free(pulse_id->mainloop);
+
+	close(pulse_id->notify_pipe[0]);
+	close(pulse_id->notify_pipe[1]);
+	g_free(pulse_id->scratch);
+	g_free(pulse_id->server);
+	g_free(pulse_id);
+
+	return 0;
+}
+
+/* The volume is applied in pulse_async_write() by scaling each sample */
+static int pulse_async_set_volume(AudioID * id, int volume)
+{
+	return 0;
+}
+
+static char const *pulse_async_get_playcmd(void)
+{
+	return pulse_async_play_cmd;
+}
+
+static audio_plugin_t pulse_async_functions = {
+	"pulse_async",
+	pulse_async_open,
+	pulse_async_play,
+	pulse_async_stop,
+	pulse_async_close,
+	pulse_async_set_volume,
+	pulse_async_get_playcmd
+};
+
+audio_plugin_t *pulse_async_plugin_get(void)
+{
+	return &pulse_async_functions;
+}
+
+audio_plugin_t *AUDIO_PLUGIN_ENTRY(void)
+    __attribute__ ((weak, alias("pulse_async_plugin_get")));
+
+/* The stream operations, looked up separately from the plugin */
+static audio_stream_ops_t pulse_async_stream_ops = {
+	pulse_async_open_stream,
+	pulse_async_write,
+	pulse_async_drain,
+	pulse_async_stop,
+	pulse_async_delay,
+	pulse_async_poll_fd
+};
+
+audio_stream_ops_t *pulse_async_stream_ops_get(void)
+{
+	return &pulse_async_stream_ops;
+}
+
+audio_stream_ops_t *AUDIO_STREAM_ENTRY(void)
+    __attribute__ ((weak, alias("pulse_async_stream_ops_get")));
@@ -0,0 +1,397 @@
+/*
+ * audio_dsp.c - Sample processing kernels for the audio output
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Every kernel has a plain C version.  On x86 there are SSE2 and AVX2
+ * versions, compiled for their instruction sets with the target
+ * attribute and picked at run time by what the processor supports.
+ * The NEON versions are used where the compiler targets NEON.  All
+ * versions give exactly the same results as the plain C ones, the
+ * vector loops leave the tail of the buffers to the plain C code.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <opentts/opentts_types.h>
+#include <audio_dsp.h>
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define DSP_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DSP_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* --- Plain C --- */
+
+static inline int16_t saturate16(int32_t x)
+{
+	if (x > INT16_MAX)
+		return INT16_MAX;
+	if (x < INT16_MIN)
+		return INT16_MIN;
+	return x;
+}
+
+static void swap16_c(int16_t * samples, size_t n)
+{
+	uint16_t *s = (uint16_t *) samples;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		s[i] = (s[i] << 8) | (s[i] >> 8);
+}
+
+static void scale16_c(int16_t * out, const int16_t * in, size_t n, int gain)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = saturate16((in[i] * gain + (OTTS_DSP_GAIN_UNITY >> 1))
+				    >> OTTS_DSP_GAIN_SHIFT);
+}
+
+static void mono_to_stereo16_c(int16_t * out, const int16_t * in,
+			       size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i < frames; i++)
+		out[2 * i] = out[2 * i + 1] = in[i];
+}
+
+static void s16_to_float_c(float *out, const int16_t * in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+static const otts_dsp_kernels_t kernels_c = {
+	"c",
+	swap16_c,
+	scale16_c,
+	mono_to_stereo16_c,
+	s16_to_float_c
+};
+
+#ifdef DSP_X86
+
+/* --- SSE2 --- */
+
+#define SSE2 __attribute__ ((target("sse2")))
+
+static SSE2 void swap16_sse2(int16_t * samples, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((__m128i *) (samples + i));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i *) (samples + i), x);
+	}
+	swap16_c(samples + i, n - i);
+}
+
+static SSE2 __m128i scale8_sse2(__m128i x, __m128i g, __m128i round)
+{
+	__m128i lo = _mm_mullo_epi16(x, g);
+	__m128i hi = _mm_mulhi_epi16(x, g);
+	__m128i p0 = _mm_unpacklo_epi16(lo, hi);
+	__m128i p1 = _mm_unpackhi_epi16(lo, hi);
+
+	p0 = _mm_srai_epi32(_mm_add_epi32(p0, round), OTTS_DSP_GAIN_SHIFT);
+	p1 = _mm_srai_epi32(_mm_add_epi32(p1, round), OTTS_DSP_GAIN_SHIFT);
+	return _mm_packs_epi32(p0, p1);
+}
+
+static SSE2 void scale16_sse2(int16_t * out, const int16_t * in, size_t n,
+			      int gain)
+{
+	__m128i g = _mm_set1_epi16(gain);
+	__m128i round = _mm_set1_epi32(OTTS_DSP_GAIN_UNITY >> 1);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *) (out + i),
+				 scale8_sse2(x, g, round));
+	}
+	scale16_c(out + i, in + i, n - i, gain);
+}
+
+static SSE2 void mono_to_stereo16_sse2(int16_t * out, const int16_t * in,
+				       size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *) (out + 2 * i),
+				 _mm_unpacklo_epi16(x, x));
+		_mm_storeu_si128((__m128i *) (out + 2 * i + 8),
+				 _mm_unpackhi_epi16(x, x));
+	}
+	mono_to_stereo16_c(out + 2 * i, in + i, frames - i);
+}
+
+static SSE2 void s16_to_float_sse2(float *out, const int16_t * in, size_t n)
+{
+	__m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i x0 = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		__m128i x1 = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(x0), scale));
+		_mm_storeu_ps(out + i + 4,
+			      _mm_mul_ps(_mm_cvtepi32_ps(x1), scale));
+	}
+	s16_to_float_c(out + i, in + i, n - i);
+}
+
+static const otts_dsp_kernels_t kernels_sse2 = {
+	"sse2",
+	swap16_sse2,
+	scale16_sse2,
+	mono_to_stereo16_sse2,
+	s16_to_float_sse2
+};
+
+/* --- AVX2 --- */
+
+#define AVX2 __attribute__ ((target("avx2")))
+
+static AVX2 void swap16_avx2(int16_t * samples, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_loadu_si256((__m256i *) (samples + i));
+		x = _mm256_or_si256(_mm256_slli_epi16(x, 8),
+				    _mm256_srli_epi16(x, 8));
+		_mm256_storeu_si256((__m256i *) (samples + i), x);
+	}
+	swap16_c(samples + i, n - i);
+}
+
+static AVX2 void scale16_avx2(int16_t * out, const int16_t * in, size_t n,
+			      int gain)
+{
+	__m256i g = _mm256_set1_epi16(gain);
+	__m256i round = _mm256_set1_epi32(OTTS_DSP_GAIN_UNITY >> 1);
+	size_t i;
+
+	/* Unpacking and packing both work within the 128-bit lanes, so
+	   the samples come out in their order */
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+		__m256i lo = _mm256_mullo_epi16(x, g);
+		__m256i hi = _mm256_mulhi_epi16(x, g);
+		__m256i p0 = _mm256_unpacklo_epi16(lo, hi);
+		__m256i p1 = _mm256_unpackhi_epi16(lo, hi);
+
+		p0 = _mm256_srai_epi32(_mm256_add_epi32(p0, round),
+				       OTTS_DSP_GAIN_SHIFT);
+		p1 = _mm256_srai_epi32(_mm256_add_epi32(p1, round),
+				       OTTS_DSP_GAIN_SHIFT);
+		_mm256_storeu_si256((__m256i *) (out + i),
+				    _mm256_packs_epi32(p0, p1));
+	}
+	scale16_c(out + i, in + i, n - i, gain);
+}
+
+static AVX2 void mono_to_stereo16_avx2(int16_t * out, const int16_t * in,
+				       size_t frames)
+{
+	size_t i;
+
+	/* Put the 64-bit quarters in the order 0, 2, 1, 3, so that the
+	   lane-wise unpacking takes the samples in their order */
+	for (i = 0; i + 16 <= frames; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+		x = _mm256_permute4x64_epi64(x, 0xd8);
+		_mm256_storeu_si256((__m256i *) (out + 2 * i),
+				    _mm256_unpacklo_epi16(x, x));
+		_mm256_storeu_si256((__m256i *) (out + 2 * i + 16),
+				    _mm256_unpackhi_epi16(x, x));
+	}
+	mono_to_stereo16_c(out + 2 * i, in + i, frames - i);
+}
+
+static AVX2 void s16_to_float_avx2(float *out, const int16_t * in, size_t n)
+{
+	__m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+		__m256i x32 = _mm256_cvtepi16_epi32(x);
+		_mm256_storeu_ps(out + i,
+				 _mm256_mul_ps(_mm256_cvtepi32_ps(x32), scale));
+	}
+	s16_to_float_c(out + i, in + i, n - i);
+}
+
+static const otts_dsp_kernels_t kernels_avx2 = {
+	"avx2",
+	swap16_avx2,
+	scale16_avx2,
+	mono_to_stereo16_avx2,
+	s16_to_float_avx2
+};
+
+#endif /* DSP_X86 */
+
+#ifdef DSP_NEON
+
+/* --- NEON --- */
+
+static void swap16_neon(int16_t * samples, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint8x16_t x = vld1q_u8((uint8_t *) (samples + i));
+		vst1q_u8((uint8_t *) (samples + i), vrev16q_u8(x));
+	}
+	swap16_c(samples + i, n - i);
+}
+
+static void scale16_neon(int16_t * out, const int16_t * in, size_t n,
+			 int gain)
+{
+	int16x4_t g = vdup_n_s16(gain);
+	size_t i;
+
+	/* The rounding narrowing shift saturates like saturate16() */
+	for (i = 0; i + 8 <= n; i += 8) {
+		int16x8_t x = vld1q_s16(in + i);
+		int32x4_t p0 = vmull_s16(vget_low_s16(x), g);
+		int32x4_t p1 = vmull_s16(vget_high_s16(x), g);
+		vst1q_s16(out + i,
+			  vcombine_s16(vqrshrn_n_s32(p0, OTTS_DSP_GAIN_SHIFT),
+				       vqrshrn_n_s32(p1, OTTS_DSP_GAIN_SHIFT)));
+	}
+	scale16_c(out + i, in + i, n - i, gain);
+}
+
+static void mono_to_stereo16_neon(int16_t * out, const int16_t * in,
+				  size_t frames)
+{
+	int16x8x2_t y;
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		y.val[0] = y.val[1] = vld1q_s16(in + i);
+		vst2q_s16(out + 2 * i, y);
+	}
+	mono_to_stereo16_c(out + 2 * i, in + i, frames - i);
+}
+
+static void s16_to_float_neon(float *out, const int16_t * in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		int16x8_t x = vld1q_s16(in + i);
+		float32x4_t f0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+		float32x4_t f1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+		vst1q_f32(out + i, vmulq_n_f32(f0, 1.0f / 32768.0f));
+		vst1q_f32(out + i + 4, vmulq_n_f32(f1, 1.0f / 32768.0f));
+	}
+	s16_to_float_c(out + i, in + i, n - i);
+}
+
+static const otts_dsp_kernels_t kernels_neon = {
+	"neon",
+	swap16_neon,
+	scale16_neon,
+	mono_to_stereo16_neon,
+	s16_to_float_neon
+};
+
+#endif /* DSP_NEON */
+
+/* --- Dispatch --- */
+
+static const otts_dsp_kernels_t *supported[4];
+static int num_supported;
+
+static void find_supported(void)
+{
+	int n = 0;
+
+	supported[n++] = &kernels_c;
+#ifdef DSP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		supported[n++] = &kernels_sse2;
+	if (__builtin_cpu_supports("avx2"))
+		supported[n++] = &kernels_avx2;
+#endif
+#ifdef DSP_NEON
+	supported[n++] = &kernels_neon;
+#endif
+	/* Threads racing here store the same values */
+	num_supported = n;
+}
+
+const otts_dsp_kernels_t *otts_dsp_kernels(int i)
+{
+	if (num_supported == 0)
+		find_supported();
+	if (i < 0 || i >= num_supported)
+		return NULL;
+	return supported[i];
+}
+
+const otts_dsp_kernels_t *otts_dsp(void)
+{
+	static const otts_dsp_kernels_t *best;
+
+	if (best == NULL) {
+		if (num_supported == 0)
+			find_supported();
+		best = supported[num_supported - 1];
+	}
+	return best;
+}
+
+int otts_dsp_volume_gain(int volume)
+{
+	if (volume < OTTS_VOICE_VOLUME_MIN)
+		volume = OTTS_VOICE_VOLUME_MIN;
+	if (volume > OTTS_VOICE_VOLUME_MAX)
+		volume = OTTS_VOICE_VOLUME_MAX;
+
+	return (volume - OTTS_VOICE_VOLUME_MIN) * OTTS_DSP_GAIN_UNITY
+	    / (OTTS_VOICE_VOLUME_MAX - OTTS_VOICE_VOLUME_MIN);
+}
@@ -0,0 +1,298 @@
+/*
+ * audio_resample.c - Sample rate conversion for the audio output
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * A polyphase filter: each output frame is a weighted sum of the taps
+ * input frames around its time, with the weights taken from the row of
+ * a table for the fraction of an input frame the time falls on.  The
+ * fast quality weighs the two nearest frames linearly, the others use
+ * a sinc filter in a Kaiser window, with its cutoff below the Nyquist
+ * frequency of the lower of the two rates.  The filter gets longer by
+ * the ratio of the rates when converting down, so it still spans the
+ * same time of output.
+ *
+ * The input is kept as floats in hist.  The time of the next output
+ * frame is pos + frac / out_rate input frames, pos is an index to hist.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <audio_dsp.h>
+#include <audio_resample.h>
+
+struct otts_resampler {
+	otts_resample_quality_t quality;
+	int channels;
+	int in_rate;
+	int out_rate;
+	int taps;		/* Input frames in one output frame */
+	int phases;		/* Rows of the filter table less one */
+	float *filter;		/* (phases + 1) * taps weights */
+	float *hist;		/* Input frames not used up yet */
+	int hist_len;
+	int hist_size;
+	int pos;
+	int frac;
+};
+
+int otts_resample_quality(const char *str)
+{
+	if (str == NULL || !strcmp(str, "none"))
+		return OTTS_RESAMPLE_NONE;
+	if (!strcmp(str, "fast"))
+		return OTTS_RESAMPLE_FAST;
+	if (!strcmp(str, "medium"))
+		return OTTS_RESAMPLE_MEDIUM;
+	if (!strcmp(str, "best"))
+		return OTTS_RESAMPLE_BEST;
+	return -1;
+}
+
+static int gcd(int a, int b)
+{
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Modified Bessel function of the first kind, for the Kaiser window */
+static double bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	int k;
+
+	for (k = 1; k < 50 && term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void make_filter(otts_resampler_t * r, int base_taps, double rolloff,
+			double beta)
+{
+	double ratio = (double)r->out_rate / r->in_rate;
+	double cutoff = 0.5 * (ratio < 1.0 ? ratio : 1.0) * rolloff;
+	double half;
+	double x, w, sum;
+	int p, k;
+
+	r->taps = base_taps;
+	if (ratio < 1.0 && r->quality != OTTS_RESAMPLE_FAST)
+		r->taps = 2 * (int)ceil(base_taps / ratio / 2);
+	half = r->taps / 2;
+
+	r->filter = g_malloc((r->phases + 1) * r->taps * sizeof(float));
+	for (p = 0; p <= r->phases; p++) {
+		float *row = r->filter + p * r->taps;
+
+		sum = 0;
+		for (k = 0; k < r->taps; k++) {
+			/* Distance of the input frame from the output time */
+			x = (double)p / r->phases - (k - half + 1);
+			if (r->quality == OTTS_RESAMPLE_FAST) {
+				w = 1.0 - fabs(x);
+			} else if (fabs(x) >= half) {
+				w = 0.0;
+			} else {
+				w = x == 0.0 ? 2 * cutoff
+				    : sin(2 * G_PI * cutoff * x) / (G_PI * x);
+				w *= bessel_i0(beta * sqrt(1 - (x / half)
+							   * (x / half)))
+				    / bessel_i0(beta);
+			}
+			row[k] = w;
+			sum += w;
+		}
+		/* Unity gain for a constant signal */
+		for (k = 0; k < r->taps; k++)
+			row[k] /= sum;
+	}
+}
+
+otts_resampler_t *otts_resampler_new(otts_resample_quality_t quality,
+				     int channels, int in_rate, int out_rate)
+{
+	otts_resampler_t *r;
+	int d;
+
+	if (quality == OTTS_RESAMPLE_NONE || channels <= 0 || in_rate <= 0
+	    || out_rate <= 0)
+		return NULL;
+
+	r = g_malloc0(sizeof(otts_resampler_t));
+	d = gcd(in_rate, out_rate);
+	r->quality = quality;
+	r->channels = channels;
+	r->in_rate = in_rate / d;
+	r->out_rate = out_rate / d;
+
+	switch (quality) {
+	case OTTS_RESAMPLE_FAST:
+		r->phases = 256;
+		make_filter(r, 2, 1.0, 0.0);
+		break;
+	case OTTS_RESAMPLE_MEDIUM:
+		r->phases = 128;
+		make_filter(r, 16, 0.90, 6.0);
+		break;
+	default:
+		r->phases = 512;
+		make_filter(r, 48, 0.95, 9.0);
+		break;
+	}
+
+	otts_resampler_reset(r);
+	return r;
+}
+
+void otts_resampler_free(otts_resampler_t * r)
+{
+	if (r == NULL)
+		return;
+	g_free(r->filter);
+	g_free(r->hist);
+	g_free(r);
+}
+
+/* Make room for n more frames in hist */
+static float *hist_grow(otts_resampler_t * r, int n)
+{
+	float *end;
+
+	if (r->hist_len + n > r->hist_size) {
+		r->hist_size = r->hist_len + n;
+		r->hist = g_realloc(r->hist, r->hist_size * r->channels
+				    * sizeof(float));
+	}
+	end = r->hist + r->hist_len * r->channels;
+	r->hist_len += n;
+	return end;
+}
+
+void otts_resampler_reset(otts_resampler_t * r)
+{
+	/* Silence before the first frame, so that the first output
+	   frame falls on it */
+	r->hist_len = 0;
+	r->pos = r->taps / 2 - 1;
+	if (r->pos > 0)
+		memset(hist_grow(r, r->pos), 0,
+		       r->pos * r->channels * sizeof(float));
+	r->frac = 0;
+}
+
+int otts_resampler_max_out(otts_resampler_t * r, int in_frames)
+{
+	return (long)(in_frames + r->taps) * r->out_rate / r->in_rate + 2;
+}
+
+static inline int16_t float_to_s16(float x)
+{
+	x *= 32768.0f;
+	if (x >= 32767.0f)
+		return INT16_MAX;
+	if (x <= -32768.0f)
+		return INT16_MIN;
+	return (int16_t) (x + (x >= 0 ? 0.5f : -0.5f));
+}
+
+/* Compute the output frames whose filter lies within hist */
+static int resample(otts_resampler_t * r, int16_t * out)
+{
+	int half = r->taps / 2;
+	int n = 0;
+	int used;
+	int c, k;
+
+	while (r->pos + half < r->hist_len) {
+		int p = ((long)r->frac * r->phases + r->out_rate / 2)
+		    / r->out_rate;
+		const float *row = r->filter + p * r->taps;
+		const float *x = r->hist + (r->pos - half + 1) * r->channels;
+
+		if (r->channels == 1) {
+			float sum = 0;
+			for (k = 0; k < r->taps; k++)
+				sum += row[k] * x[k];
+			out[n] = float_to_s16(sum);
+		} else {
+			for (c = 0; c < r->channels; c++) {
+				float sum = 0;
+				for (k = 0; k < r->taps; k++)
+					sum += row[k] * x[k * r->channels + c];
+				out[n * r->channels + c] = float_to_s16(sum);
+			}
+		}
+		n++;
+
+		r->frac += r->in_rate;
+		r->pos += r->frac / r->out_rate;
+		r->frac %= r->out_rate;
+	}
+
+	/* Drop the frames no further output frame needs */
+	used = r->pos - half + 1;
+	if (used > r->hist_len)
+		used = r->hist_len;
+	if (used > 0) {
+		memmove(r->hist, r->hist + used * r->channels,
+			(r->hist_len - used) * r->channels * sizeof(float));
+		r->hist_len -= used;
+		r->pos -= used;
+	}
+
+	return n;
+}
+
+int otts_resampler_process(otts_resampler_t * r, int16_t * out,
+			   const int16_t * in, int in_frames)
+{
+	if (in_frames > 0)
+		otts_dsp_s16_to_float(hist_grow(r, in_frames), in,
+				      (size_t)in_frames * r->channels);
+	return resample(r, out);
+}
+
+int otts_resampler_flush(otts_resampler_t * r, int16_t * out)
+{
+	int half = r->taps / 2;
+	int n;
+
+	/* Silence after the last frame, up to the end of the filter of
+	   the output frames that fall before the end of the input */
+	memset(hist_grow(r, half), 0, half * r->channels * sizeof(float));
+	n = resample(r, out);
+	otts_resampler_reset(r);
+	return n;
+}
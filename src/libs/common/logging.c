@@ -117,7 +117,13 @@ static FILE *open_log_file(char *name)
 /* this case existed in openttsd.c but it doesn't make much sense */
 		fp = stdout;
 	} else {
-		fp = fopen(name, "a");
+		/*
+		 * There is no reason for log files to stay open across exec.
+		 * The "e" flag sets FD_CLOEXEC when the file is opened, so a
+		 * module started by another thread meanwhile can't inherit
+		 * it.  The fcntl() covers C libraries which ignore the flag.
+		 */
+		fp = fopen(name, "ae");
 		if (fp == NULL) {
 			perror
 			    ("can't open new log file, using stderr instead.");
@@ -125,8 +131,7 @@ static FILE *open_log_file(char *name)
 		} else {
 			if (chmod(name, S_IRUSR | S_IWUSR))
 				perror("can't change permission of log file");
-/* there is no reason for log files to stay open accross exec so set FD_CLOEXEC */
-fcntl(fileno(fp), F_SETFD, FD_CLOEXEC);
+			fcntl(fileno(fp), F_SETFD, FD_CLOEXEC);
 		}
 	}
 	return fp;
@@ -0,0 +1,123 @@
+/*
+ * modproto.c - binary framing of the output module protocol
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include "modproto.h"
+
+static int read_all(int fd, void *buf, size_t count)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (count > 0) {
+		r = read(fd, p, count);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		count -= r;
+	}
+	return 0;
+}
+
+int otts_frame_write(int fd, int opcode, int arg, uint32_t seq,
+		     const char *data, size_t len)
+{
+	otts_frame_header_t header;
+	struct iovec iov[2];
+	int iovcnt = 1;
+	ssize_t w;
+
+	if (len > OTTS_FRAME_MAX_LENGTH) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	header.length = len;
+	header.opcode = opcode;
+	header.arg = arg;
+	header.seq = seq;
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	if (len > 0) {
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = len;
+		iovcnt = 2;
+	}
+
+	/* Both parts usually go out in a single call, handle short
+	   writes of big payloads anyway */
+	while (iovcnt > 0) {
+		w = writev(fd, iov, iovcnt);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w == -1)
+			return -1;
+		while (iovcnt > 0 && w >= (ssize_t) iov[0].iov_len) {
+			w -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov[0].iov_base = (char *)iov[0].iov_base + w;
+			iov[0].iov_len -= w;
+		}
+	}
+
+	return 0;
+}
+
+int otts_frame_read(int fd, otts_frame_header_t * header, char **data)
+{
+	char *buf;
+
+	*data = NULL;
+
+	if (read_all(fd, header, sizeof(*header)) == -1)
+		return -1;
+
+	if (header->length > OTTS_FRAME_MAX_LENGTH) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	buf = g_malloc(header->length + 1);
+	if (header->length > 0 && read_all(fd, buf, header->length) == -1) {
+		g_free(buf);
+		return -1;
+	}
+	buf[header->length] = 0;
+
+	*data = buf;
+	return 0;
+}
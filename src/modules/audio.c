@@ -44,6 +44,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <pthread.h>
 
@@ -52,34 +53,49 @@
 
 #include <opentts/opentts_types.h>
 #include <logging.h>
+#include <audio_dsp.h>
+#include <audio_resample.h>
 
 typedef audio_plugin_t *(*plugin_entry_func) (void);
-static lt_dlhandle lt_h;
+typedef audio_stream_ops_t *(*stream_entry_func) (void);
 
-/* Open the audio device.
+/*
+ * The audio plugins loaded by this process, indexed by name.  A plugin
+ * stays loaded once it was opened, opening it again only creates a
+ * new device.
+ */
+typedef struct {
+	lt_dlhandle handle;
+	audio_plugin_t const *plugin;
+	audio_stream_ops_t const *stream;	/* NULL if it has none */
+} loaded_plugin_t;
 
-   Arguments:
-   type -- The requested device. Currently AudioOSS or AudioNAS.
-   pars -- and array of pointers to parameters to pass to
-           the device backend, terminated by a NULL pointer.
-           See the source/documentation of each specific backend.
-   error -- a pointer to the string where error description is
-           stored in case of failure (returned AudioID == NULL).
-           Otherwise will contain NULL.
+static GHashTable *loaded_plugins;
+static pthread_mutex_t loaded_plugins_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-   Return value:
-   Newly allocated AudioID structure that can be passed to
-   all other opentts_audio functions, or NULL in case of failure.
+/* The stream operations of the device, a module opens only one */
+static audio_stream_ops_t const *stream_ops;
 
-*/
-AudioID *opentts_audio_open(char *name, void **pars, char **error)
+static AudioStats audio_stats;
+static pthread_mutex_t audio_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Look the plugin up in loaded_plugins, load it if it isn't there */
+static loaded_plugin_t const *load_plugin(char *name, char **error)
 {
-	AudioID *id;
+	loaded_plugin_t *loaded;
+	lt_dlhandle handle;
 	audio_plugin_t const *p;
 	plugin_entry_func fn;
+	stream_entry_func stream_fn;
 	gchar *libname;
 	int ret;
 
+	if (loaded_plugins != NULL) {
+		loaded = g_hash_table_lookup(loaded_plugins, name);
+		if (loaded != NULL)
+			return loaded;
+	}
+
 	/* now check whether dynamic plugin is available */
 	ret = lt_dlinit();
 	if (ret != 0) {
@@ -90,46 +106,309 @@ AudioID *opentts_audio_open(char *name, void **pars, char **error)
 	ret = lt_dlsetsearchpath(PLUGIN_DIR);
 	if (ret != 0) {
 		*error = (char *)g_strdup_printf("lt_dlsetsearchpath() failed");
+		lt_dlexit();
 		return NULL;
 	}
 
 	libname = g_strdup_printf("otts_%s", name);
-	lt_h = lt_dlopenext(libname);
+	handle = lt_dlopenext(libname);
 	g_free(libname);
-	if (NULL == lt_h) {
+	if (NULL == handle) {
 		*error =
 		    (char *)g_strdup_printf("Cannot open plugin %s. error: %s",
 					    name, lt_dlerror());
+		lt_dlexit();
 		return NULL;
 	}
 
-	fn = (plugin_entry_func) lt_dlsym(lt_h, AUDIO_PLUGIN_ENTRY_STR);
+	fn = (plugin_entry_func) lt_dlsym(handle, AUDIO_PLUGIN_ENTRY_STR);
 	if (NULL == fn) {
 		*error = (char *)g_strdup_printf("Cannot find symbol %s",
 						 AUDIO_PLUGIN_ENTRY_STR);
+		lt_dlclose(handle);
+		lt_dlexit();
 		return NULL;
 	}
 
 	p = fn();
 	if (p == NULL || p->name == NULL) {
 		*error = (char *)g_strdup_printf("plugin %s not found", name);
+		lt_dlclose(handle);
+		lt_dlexit();
 		return NULL;
 	}
 
-	id = p->open(pars, log_msg);
+	if (loaded_plugins == NULL)
+		loaded_plugins = g_hash_table_new_full(g_str_hash, g_str_equal,
+						       g_free, g_free);
+	loaded = g_malloc(sizeof(loaded_plugin_t));
+	loaded->handle = handle;
+	loaded->plugin = p;
+	/* Backends built before the streams don't have the entry point */
+	stream_fn = (stream_entry_func) lt_dlsym(handle,
+						 AUDIO_STREAM_ENTRY_STR);
+	loaded->stream = stream_fn != NULL ? stream_fn() : NULL;
+	g_hash_table_insert(loaded_plugins, g_strdup(name), loaded);
+
+	return loaded;
+}
+
+/*
+ * Conversion to one device format.  Unless the resample quality is
+ * "none", the device stays set up for 16-bit frames of DEVICE_CHANNELS
+ * at DEVICE_RATE, which is also what PulseAudio uses by default, and
+ * the tracks and streams in other formats are converted to it.  This
+ * spares setting the device up again, with a gap in the sound, every
+ * time a sound icon and speech of another rate follow each other.
+ *
+ * A module has one audio device, so the state is kept here.  The
+ * frames of a stream that the device didn't take yet wait in out.
+ *
+ * The tracks of a message are one stream to the resampler: it keeps
+ * the frames it has seen across opentts_audio_play() calls in the
+ * same format, so the boundaries between them are converted like any
+ * other frames.  The frames it holds back are played by
+ * opentts_audio_end() at the end of the message.  A new format, a new
+ * stream or opentts_audio_stop() start over.
+ */
+#define DEVICE_RATE 44100
+#define DEVICE_CHANNELS 2
+
+/* Most frames of a stream converted at once */
+#define CONVERT_FRAMES 1024
+
+typedef struct {
+	otts_resample_quality_t quality;
+	int active;		/* The stream or track is converted */
+	int tracks;		/* The resampler holds frames of tracks */
+	AudioStreamFormat in;
+	otts_resampler_t *resampler;
+	int16_t *s16;		/* The input as 16-bit samples */
+	int s16_size;
+	int16_t *resampled;	/* The input at DEVICE_RATE */
+	int resampled_size;
+	int16_t *out;		/* The frames for the device */
+	int out_size;
+	int out_start;
+	int out_frames;
+	volatile int dropped;
+} converter_t;
+
+static converter_t conv;
+
+static AudioStreamFormat device_format(void)
+{
+	AudioStreamFormat format;
+
+	format.bits = 16;
+	format.num_channels = DEVICE_CHANNELS;
+	format.sample_rate = DEVICE_RATE;
+	return format;
+}
+
+static int16_t *conv_buffer(int16_t ** buf, int *size, int samples)
+{
+	if (samples > *size) {
+		*buf = g_realloc(*buf, samples * sizeof(int16_t));
+		*size = samples;
+	}
+	return *buf;
+}
+
+static void conv_reset(void)
+{
+	if (conv.resampler != NULL)
+		otts_resampler_reset(conv.resampler);
+	conv.out_start = 0;
+	conv.out_frames = 0;
+	conv.dropped = 0;
+}
+
+static void conv_free(void)
+{
+	otts_resampler_free(conv.resampler);
+	g_free(conv.s16);
+	g_free(conv.resampled);
+	g_free(conv.out);
+	memset(&conv, 0, sizeof(conv));
+}
+
+/* Set the conversion up for frames in _format_, returns 0 if they
+   are converted and -1 if they go to the device as they are.  The
+   frames seen so far are kept if _keep_ and the format is the same. */
+static int conv_setup(AudioStreamFormat format, int keep)
+{
+	if (keep && conv.active && !conv.dropped
+	    && conv.in.bits == format.bits
+	    && conv.in.num_channels == format.num_channels
+	    && conv.in.sample_rate == format.sample_rate)
+		return 0;
+
+	conv.active = 0;
+	conv.tracks = 0;
+	if (conv.quality == OTTS_RESAMPLE_NONE)
+		return -1;
+	if ((format.bits != 8 && format.bits != 16)
+	    || format.num_channels < 1 || format.num_channels > 2
+	    || format.sample_rate <= 0)
+		return -1;
+
+	if (conv.resampler == NULL
+	    || conv.in.num_channels != format.num_channels
+	    || conv.in.sample_rate != format.sample_rate) {
+		otts_resampler_free(conv.resampler);
+		conv.resampler = NULL;
+		if (format.sample_rate != DEVICE_RATE)
+			conv.resampler =
+			    otts_resampler_new(conv.quality,
+					       format.num_channels,
+					       format.sample_rate, DEVICE_RATE);
+	}
+	conv.in = format;
+	conv.active = 1;
+	conv_reset();
+
+	return 0;
+}
+
+/* Append the converted _count_ frames to out, and the frames held in
+   the resampler if _flush_ */
+static void conv_append(const void *frames, int count, int flush)
+{
+	int channels = conv.in.num_channels;
+	const int16_t *in = frames;
+	int16_t *dst;
+	int max_out;
+	int i;
+
+	if (conv.in.bits == 8) {
+		const unsigned char *u8 = frames;
+
+		in = conv_buffer(&conv.s16, &conv.s16_size, count * channels);
+		for (i = 0; i < count * channels; i++)
+			conv.s16[i] = (u8[i] - 128) << 8;
+	}
+
+	if (conv.resampler != NULL) {
+		max_out = otts_resampler_max_out(conv.resampler, count)
+		    + (flush ? otts_resampler_max_out(conv.resampler, 0) : 0);
+		conv_buffer(&conv.resampled, &conv.resampled_size,
+			    max_out * channels);
+		count = otts_resampler_process(conv.resampler, conv.resampled,
+					       in, count);
+		if (flush)
+			count += otts_resampler_flush(conv.resampler,
+						      conv.resampled
+						      + count * channels);
+		in = conv.resampled;
+	}
+	if (count == 0)
+		return;
+
+	if (conv.out_start > 0) {
+		memmove(conv.out, conv.out + conv.out_start * DEVICE_CHANNELS,
+			conv.out_frames * DEVICE_CHANNELS * sizeof(int16_t));
+		conv.out_start = 0;
+	}
+	conv_buffer(&conv.out, &conv.out_size,
+		    (conv.out_frames + count) * DEVICE_CHANNELS);
+	dst = conv.out + conv.out_frames * DEVICE_CHANNELS;
+
+	if (channels == DEVICE_CHANNELS)
+		memcpy(dst, in, count * DEVICE_CHANNELS * sizeof(int16_t));
+	else
+		otts_dsp_mono_to_stereo16(dst, in, count);
+	conv.out_frames += count;
+}
+
+/* The converted frames in out as a track for the device, out is
+   empty afterwards */
+static AudioTrack conv_track(void)
+{
+	AudioTrack track;
+
+	track.bits = 16;
+	track.num_channels = DEVICE_CHANNELS;
+	track.sample_rate = DEVICE_RATE;
+	track.num_samples = conv.out_frames * DEVICE_CHANNELS;
+	track.samples = conv.out;
+	conv.out_frames = 0;
+	return track;
+}
+
+/* Write as much of out as the device takes, returns -1 on error */
+static int conv_push(AudioID * id)
+{
+	int ret;
+
+	if (conv.dropped) {
+		conv_reset();
+		return 0;
+	}
+	if (conv.out_frames == 0)
+		return 0;
+
+	ret = stream_ops->write(id, conv.out
+				  + conv.out_start * DEVICE_CHANNELS,
+				  conv.out_frames);
+	if (ret < 0)
+		return -1;
+	conv.out_start += ret;
+	conv.out_frames -= ret;
+	return 0;
+}
+
+/* Open the audio device.
+
+   Arguments:
+   type -- The requested device. Currently AudioOSS or AudioNAS.
+   pars -- and array of pointers to parameters to pass to
+           the device backend, terminated by a NULL pointer.
+           See the source/documentation of each specific backend.
+           pars[5] is the resample quality for all of them.
+   error -- a pointer to the string where error description is
+           stored in case of failure (returned AudioID == NULL).
+           Otherwise will contain NULL.
+
+   Return value:
+   Newly allocated AudioID structure that can be passed to
+   all other opentts_audio functions, or NULL in case of failure.
+
+*/
+AudioID *opentts_audio_open(char *name, void **pars, char **error)
+{
+	AudioID *id;
+	loaded_plugin_t const *loaded;
+
+	pthread_mutex_lock(&loaded_plugins_mutex);
+	loaded = load_plugin(name, error);
+	pthread_mutex_unlock(&loaded_plugins_mutex);
+	if (loaded == NULL)
+		return NULL;
+
+	id = loaded->plugin->open(pars, log_msg);
 	if (id == NULL) {
 		*error =
 		    (char *)g_strdup_printf("Couldn't open %s plugin", name);
 		return NULL;
 	}
 
-	id->function = p;
+	id->function = loaded->plugin;
+	stream_ops = loaded->stream;
 #if defined(BYTE_ORDER) && (BYTE_ORDER == BIG_ENDIAN)
 	id->format = SPD_AUDIO_BE;
 #else
 	id->format = SPD_AUDIO_LE;
 #endif
 
+	conv_free();
+	conv.quality = otts_resample_quality(pars[5]);
+	if ((int)conv.quality < 0) {
+		log_msg(OTTS_LOG_WARN, "Unknown resample quality %s, using none",
+			(char *)pars[5]);
+		conv.quality = OTTS_RESAMPLE_NONE;
+	}
+
 	*error = NULL;
 
 	return id;
@@ -156,24 +435,48 @@ AudioID *opentts_audio_open(char *name, void **pars, char **error)
 int opentts_audio_play(AudioID * id, AudioTrack track, AudioFormat format)
 {
 	int ret;
+	struct timeval start, end;
+	AudioStreamFormat track_format;
+	AudioTrack device_track;
+	int held = 0;
 
 	if (id && id->function->play) {
 		/* Only perform byte swapping if the driver in use has given us audio in
 		   an endian format other than what the running CPU supports. */
-		if ((format != id->format) && (track.bits == 16)) {
-			unsigned char *out_ptr, *out_end, c;
-			out_ptr = (unsigned char *)track.samples;
-			out_end =
-			    out_ptr +
-			    track.num_samples * 2 * track.num_channels;
-			while (out_ptr < out_end) {
-				c = out_ptr[0];
-				out_ptr[0] = out_ptr[1];
-				out_ptr[1] = c;
-				out_ptr += 2;
-			}
+		if ((format != id->format) && (track.bits == 16))
+			otts_dsp_swap16(track.samples,
+					track.num_samples * track.num_channels);
+
+		device_track = track;
+		track_format.bits = track.bits;
+		track_format.num_channels = track.num_channels;
+		track_format.sample_rate = track.sample_rate;
+		if (track.samples != NULL && track.num_samples > 0
+		    && conv_setup(track_format, conv.tracks) == 0) {
+			conv.tracks = 1;
+			conv_append(track.samples,
+				    track.num_samples / track.num_channels, 0);
+			device_track = conv_track();
+			/* The resampler may hold all of a short track back */
+			held = device_track.num_samples == 0;
 		}
-		ret = id->function->play(id, track);
+
+		gettimeofday(&start, NULL);
+		if (held)
+			ret = 0;
+		else
+			ret = id->function->play(id, device_track);
+		gettimeofday(&end, NULL);
+
+		pthread_mutex_lock(&audio_stats_mutex);
+		if (audio_stats.first_play.tv_sec == 0)
+			audio_stats.first_play = start;
+		if (track.sample_rate > 0 && track.num_channels > 0)
+			audio_stats.audio_ms += (long)track.num_samples * 1000
+			    / track.num_channels / track.sample_rate;
+		audio_stats.play_ms += (end.tv_sec - start.tv_sec) * 1000
+		    + (end.tv_usec - start.tv_usec) / 1000;
+		pthread_mutex_unlock(&audio_stats_mutex);
 	} else {
 		fprintf(stderr, "Play not supported on this device\n");
 		return -1;
@@ -182,6 +485,30 @@ int opentts_audio_play(AudioID * id, AudioTrack track, AudioFormat format)
 	return ret;
 }
 
+/* Play what the resampler still holds of the tracks of a message, at
+   its end.  The next track starts over.  Returns like
+   opentts_audio_play(). */
+int opentts_audio_end(AudioID * id)
+{
+	AudioTrack track;
+	int ret = 0;
+
+	if (!conv.tracks)
+		return 0;
+	conv.tracks = 0;
+
+	if (!conv.dropped && id != NULL && id->function->play != NULL) {
+		conv_append(NULL, 0, 1);
+		if (conv.out_frames > 0) {
+			track = conv_track();
+			ret = id->function->play(id, track);
+		}
+	}
+	conv_reset();
+
+	return ret;
+}
+
 /* Stop playing the current track on device id
 
 Arguments:
@@ -210,6 +537,11 @@ Comment:
 int opentts_audio_stop(AudioID * id)
 {
 	int ret;
+
+	/* The next track doesn't continue the stopped one, the player
+	   thread resets the resampler */
+	if (conv.tracks)
+		conv.dropped = 1;
 	if (id && id->function->stop) {
 		ret = id->function->stop(id);
 	} else {
@@ -240,14 +572,10 @@ int opentts_audio_close(AudioID * id)
 	if (id && id->function->close) {
 		ret = (id->function->close(id));
 	}
+	conv_free();
+	stream_ops = NULL;
 
-	if (NULL != lt_h) {
-		lt_dlclose(lt_h);
-		lt_h = NULL;
-
-		lt_dlexit();
-	}
-
+	/* The plugin stays loaded for the next opentts_audio_open() */
 	return ret;
 }
 
@@ -294,3 +622,168 @@ char const *opentts_audio_get_playcmd(AudioID * id)
 	}
 	return NULL;
 }
+
+/* Streams
+
+   Instead of playing whole tracks with opentts_audio_play(), a module
+   can write the frames to a stream as they are synthesized:
+
+   opentts_audio_open_stream() sets the stream up for a format, then
+   opentts_audio_write() takes as many frames as there is room for,
+   opentts_audio_poll_fd() tells when there is room again and
+   opentts_audio_drain() waits until everything was played.
+   opentts_audio_drop() discards what was not played yet.
+
+   All of them return -1 if the backend has no streams,
+   opentts_audio_has_stream() tells it in advance.
+*/
+static int stream_rate;
+
+int opentts_audio_has_stream(AudioID * id)
+{
+	return id != NULL && stream_ops != NULL
+	    && stream_ops->open_stream != NULL && stream_ops->write != NULL;
+}
+
+int opentts_audio_open_stream(AudioID * id, AudioStreamFormat format)
+{
+	if (!opentts_audio_has_stream(id))
+		return -1;
+
+	stream_rate = format.sample_rate;
+	if (conv_setup(format, 0) == 0)
+		return stream_ops->open_stream(id, device_format());
+	return stream_ops->open_stream(id, format);
+}
+
+/* Take up to CONVERT_FRAMES of the frames once the device took all
+   of the converted frames before them */
+static int conv_write(AudioID * id, const void *frames, int count)
+{
+	if (conv_push(id) < 0)
+		return -1;
+	if (conv.out_frames > 0)
+		return 0;
+
+	if (count > CONVERT_FRAMES)
+		count = CONVERT_FRAMES;
+	conv_append(frames, count, 0);
+	if (conv_push(id) < 0)
+		return -1;
+	return count;
+}
+
+/* Write the rest of the converted frames, waiting for room in the
+   device as needed */
+static int conv_flush(AudioID * id)
+{
+	struct pollfd pfd;
+
+	conv_append(NULL, 0, 1);
+	while (conv.out_frames > 0) {
+		if (conv_push(id) < 0)
+			return -1;
+		if (conv.out_frames == 0)
+			break;
+		pfd.fd = opentts_audio_poll_fd(id, &pfd.events);
+		if (pfd.fd >= 0)
+			poll(&pfd, 1, 100);
+		else
+			g_usleep(5000);
+	}
+	return 0;
+}
+
+int opentts_audio_write(AudioID * id, const void *frames, int count)
+{
+	int ret;
+	struct timeval start, end;
+
+	if (!opentts_audio_has_stream(id))
+		return -1;
+
+	gettimeofday(&start, NULL);
+	if (conv.active)
+		ret = conv_write(id, frames, count);
+	else
+		ret = stream_ops->write(id, frames, count);
+	gettimeofday(&end, NULL);
+
+	pthread_mutex_lock(&audio_stats_mutex);
+	if (audio_stats.first_play.tv_sec == 0 && ret > 0)
+		audio_stats.first_play = start;
+	if (stream_rate > 0 && ret > 0)
+		audio_stats.audio_ms += (long)ret * 1000 / stream_rate;
+	audio_stats.play_ms += (end.tv_sec - start.tv_sec) * 1000
+	    + (end.tv_usec - start.tv_usec) / 1000;
+	pthread_mutex_unlock(&audio_stats_mutex);
+
+	return ret;
+}
+
+int opentts_audio_drain(AudioID * id)
+{
+	int ret;
+	struct timeval start, end;
+
+	if (id == NULL || stream_ops == NULL || stream_ops->drain == NULL)
+		return -1;
+
+	gettimeofday(&start, NULL);
+	if (conv.active && conv_flush(id) < 0)
+		ret = -1;
+	else
+		ret = stream_ops->drain(id);
+	gettimeofday(&end, NULL);
+
+	pthread_mutex_lock(&audio_stats_mutex);
+	audio_stats.play_ms += (end.tv_sec - start.tv_sec) * 1000
+	    + (end.tv_usec - start.tv_usec) / 1000;
+	pthread_mutex_unlock(&audio_stats_mutex);
+
+	return ret;
+}
+
+int opentts_audio_drop(AudioID * id)
+{
+	if (id == NULL || stream_ops == NULL || stream_ops->drop == NULL)
+		return -1;
+	/* May come from another thread, the writer drops the converted
+	   frames itself */
+	if (conv.active)
+		conv.dropped = 1;
+	return stream_ops->drop(id);
+}
+
+/* Number of frames written to the stream and not played yet */
+int opentts_audio_delay(AudioID * id)
+{
+	int delay;
+
+	if (id == NULL || stream_ops == NULL || stream_ops->delay == NULL)
+		return -1;
+	delay = stream_ops->delay(id);
+	if (delay < 0 || !conv.active)
+		return delay;
+	return (long)(delay + conv.out_frames) * conv.in.sample_rate
+	    / DEVICE_RATE;
+}
+
+/* A descriptor to poll for _events_ until the stream takes frames
+   again, -1 if the backend has none */
+int opentts_audio_poll_fd(AudioID * id, short *events)
+{
+	if (id == NULL || stream_ops == NULL || stream_ops->poll_fd == NULL)
+		return -1;
+	return stream_ops->poll_fd(id, events);
+}
+
+/* Copy the play statistics to stats, if not NULL, and start over */
+void opentts_audio_take_stats(AudioStats * stats)
+{
+	pthread_mutex_lock(&audio_stats_mutex);
+	if (stats != NULL)
+		*stats = audio_stats;
+	memset(&audio_stats, 0, sizeof(audio_stats));
+	pthread_mutex_unlock(&audio_stats_mutex);
+}
@@ -25,12 +25,24 @@
 #ifndef __SPD_AUDIO_H
 #define __SPD_AUDIO_H
 
+#include <sys/time.h>
 #include <opentts/opentts_audio_plugin.h>
 
+/* What opentts_audio_play() did since the last call of
+   opentts_audio_take_stats(), for the timing events of the modules */
+typedef struct {
+	struct timeval first_play;	/* Start of the first track, zero
+					   if nothing was played */
+	long audio_ms;		/* Duration of the audio played */
+	long play_ms;		/* Time spent in opentts_audio_play() */
+} AudioStats;
+
 AudioID *opentts_audio_open(char *name, void **pars, char **error);
 
 int opentts_audio_play(AudioID * id, AudioTrack track, AudioFormat format);
 
+int opentts_audio_end(AudioID * id);
+
 int opentts_audio_stop(AudioID * id);
 
 int opentts_audio_close(AudioID * id);
@@ -39,4 +51,20 @@ int opentts_audio_set_volume(AudioID * id, int volume);
 
 char const *opentts_audio_get_playcmd(AudioID * id);
 
+int opentts_audio_has_stream(AudioID * id);
+
+int opentts_audio_open_stream(AudioID * id, AudioStreamFormat format);
+
+int opentts_audio_write(AudioID * id, const void *frames, int count);
+
+int opentts_audio_drain(AudioID * id);
+
+int opentts_audio_drop(AudioID * id);
+
+int opentts_audio_delay(AudioID * id);
+
+int opentts_audio_poll_fd(AudioID * id, short *events);
+
+void opentts_audio_take_stats(AudioStats * stats);
+
 #endif /* ifndef #__SPD_AUDIO_H */
@@ -530,7 +530,7 @@ static void espeak_close(int status)
 	sem_destroy(espeak_play_semaphore);
 	sem_destroy(espeak_stop_or_pause_semaphore);
 
-	exit(status);
+	module_exit(status);
 }
 
 /* > */
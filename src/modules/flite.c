@@ -48,6 +48,28 @@ static sem_t *flite_semaphore;
 static char **flite_message;
 static SPDMessageType flite_message_type;
 
+/* Lookahead: the first part of the message openttsd announced with
+   PREPARE is synthesized by flite_prepare_thread while the current
+   message is playing */
+static pthread_t flite_prepare_thread;
+static sem_t *flite_prepare_semaphore;
+static pthread_mutex_t flite_prepare_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes synthesis and changes of the voice parameters */
+static pthread_mutex_t flite_synth_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int flite_prepare_generation = 0;
+static char *flite_prepared_message = NULL;
+static int flite_prepared_rate;
+static int flite_prepared_pitch;
+static int flite_prepared_volume;
+static char *flite_prepared_part = NULL;
+static unsigned int flite_prepared_pos;
+static cst_wave *flite_prepared_wave = NULL;
+
+/* The prepared part handed over to the speaking thread by fl_speak() */
+static char *flite_first_part = NULL;
+static unsigned int flite_first_pos;
+static cst_wave *flite_first_wave = NULL;
+
 static int flite_position = 0;
 static int flite_pause_requested = 0;
 static int current_index_mark;
@@ -61,6 +83,8 @@ static void flite_set_volume(signed int pitch);
 
 static void flite_strip_silence(AudioTrack *);
 static void *_flite_speak(void *);
+static void *_flite_prepare(void *);
+static void flite_discard_prepared(void);
 
 /* Voice */
 cst_voice *register_cmu_us_kal();
@@ -136,6 +160,14 @@ static int fl_init(char **status_info)
 		return -1;
 	}
 
+	flite_prepare_semaphore = module_semaphore_init();
+	ret = pthread_create(&flite_prepare_thread, NULL, _flite_prepare, NULL);
+	if (ret != 0) {
+		log_msg(OTTS_LOG_WARN,
+			"Flite: lookahead thread failed, PREPARE disabled\n");
+		flite_prepare_semaphore = NULL;
+	}
+
 	module_audio_id = NULL;
 
 	*status_info = g_strdup("Flite initialized successfully.");
@@ -174,10 +206,30 @@ static int fl_speak(gchar * data, size_t bytes, SPDMessageType msgtype)
 	*flite_message = module_strip_ssml(data);
 	flite_message_type = SPD_MSGTYPE_TEXT;
 
+	/* Take over the first part if it was synthesized ahead of time
+	   for the same text and voice parameters */
+	pthread_mutex_lock(&flite_prepare_mutex);
+	if (flite_prepared_wave != NULL
+	    && !strcmp(flite_prepared_message, *flite_message)
+	    && flite_prepared_rate == msg_settings.rate
+	    && flite_prepared_pitch == msg_settings.pitch
+	    && flite_prepared_volume == msg_settings.volume) {
+		log_msg(OTTS_LOG_INFO, "Using the prepared first part");
+		flite_first_part = flite_prepared_part;
+		flite_first_pos = flite_prepared_pos;
+		flite_first_wave = flite_prepared_wave;
+		flite_prepared_part = NULL;
+		flite_prepared_wave = NULL;
+	}
+	flite_discard_prepared();
+	pthread_mutex_unlock(&flite_prepare_mutex);
+
 	/* Setting voice */
+	pthread_mutex_lock(&flite_synth_mutex);
 	UPDATE_PARAMETER(rate, flite_set_rate);
 	UPDATE_PARAMETER(volume, flite_set_volume);
 	UPDATE_PARAMETER(pitch, flite_set_pitch);
+	pthread_mutex_unlock(&flite_synth_mutex);
 
 	/* Send semaphore signal to the speaking thread */
 	flite_speaking = 1;
@@ -187,11 +239,40 @@ static int fl_speak(gchar * data, size_t bytes, SPDMessageType msgtype)
 	return bytes;
 }
 
+/*
+ * Remember the message openttsd is going to speak next and let the
+ * lookahead thread synthesize its first part.  The voice parameters
+ * in effect now are used, fl_speak() drops the result if the message
+ * comes with different ones.
+ */
+static int fl_prepare(gchar * data, size_t bytes, SPDMessageType msgtype)
+{
+	if (msgtype != SPD_MSGTYPE_TEXT || flite_prepare_semaphore == NULL)
+		return -1;
+
+	pthread_mutex_lock(&flite_prepare_mutex);
+	flite_discard_prepared();
+	flite_prepared_message = module_strip_ssml(data);
+	flite_prepared_rate = msg_settings_old.rate;
+	flite_prepared_pitch = msg_settings_old.pitch;
+	flite_prepared_volume = msg_settings_old.volume;
+	pthread_mutex_unlock(&flite_prepare_mutex);
+
+	sem_post(flite_prepare_semaphore);
+
+	return bytes;
+}
+
 static int fl_stop(void)
 {
 	int ret;
 	log_msg(OTTS_LOG_NOTICE, "flite: stop()\n");
 
+	/* Whatever was prepared, the queues have changed */
+	pthread_mutex_lock(&flite_prepare_mutex);
+	flite_discard_prepared();
+	pthread_mutex_unlock(&flite_prepare_mutex);
+
 	flite_stopped = 1;
 	if (module_audio_id) {
 		log_msg(OTTS_LOG_NOTICE, "Stopping audio");
@@ -231,19 +312,94 @@ static void fl_close(int status)
 	}
 
 	log_msg(OTTS_LOG_INFO, "Terminating threads");
-	if (module_terminate_thread(flite_speak_thread) != 0)
-		exit(1);
+	if (module_terminate_thread(flite_speak_thread) != 0
+	    || (flite_prepare_semaphore != NULL
+		&& module_terminate_thread(flite_prepare_thread) != 0)) {
+		module_exit(1);
+		return;
+	}
 
 	g_free(flite_voice);
 
 	log_msg(OTTS_LOG_INFO, "Closing audio output");
 	opentts_audio_close(module_audio_id);
 
-	exit(status);
+	module_exit(status);
 }
 
 /* Internal functions */
 
+/* Must be called with flite_prepare_mutex locked */
+static void flite_discard_prepared(void)
+{
+	g_free(flite_prepared_message);
+	g_free(flite_prepared_part);
+	if (flite_prepared_wave != NULL)
+		delete_wave(flite_prepared_wave);
+	flite_prepared_message = NULL;
+	flite_prepared_part = NULL;
+	flite_prepared_wave = NULL;
+	flite_prepare_generation++;
+}
+
+void *_flite_prepare(void *nothing)
+{
+	char *buf;
+	char *message;
+	unsigned int generation;
+	unsigned int pos;
+	int bytes;
+	cst_wave *wav;
+
+	set_speaking_thread_parameters();
+
+	while (1) {
+		sem_wait(flite_prepare_semaphore);
+
+		pthread_mutex_lock(&flite_prepare_mutex);
+		if (flite_prepared_message == NULL
+		    || flite_prepared_wave != NULL) {
+			pthread_mutex_unlock(&flite_prepare_mutex);
+			continue;
+		}
+		message = g_strdup(flite_prepared_message);
+		generation = flite_prepare_generation;
+		pthread_mutex_unlock(&flite_prepare_mutex);
+
+		buf = g_malloc(FliteMaxChunkLength + 1);
+		pos = 0;
+		bytes = module_get_message_part(message, buf, &pos,
+						FliteMaxChunkLength,
+						FliteDelimiters);
+		g_free(message);
+		if (bytes <= 0) {
+			g_free(buf);
+			continue;
+		}
+		buf[bytes] = 0;
+
+		pthread_mutex_lock(&flite_synth_mutex);
+		wav = flite_text_to_wave(buf, flite_voice);
+		pthread_mutex_unlock(&flite_synth_mutex);
+
+		pthread_mutex_lock(&flite_prepare_mutex);
+		if (wav != NULL && generation == flite_prepare_generation) {
+			log_msg(OTTS_LOG_DEBUG, "Prepared '%s'", buf);
+			flite_prepared_part = buf;
+			flite_prepared_pos = pos;
+			flite_prepared_wave = wav;
+		} else {
+			/* A newer PREPARE or SPEAK came meanwhile */
+			if (wav != NULL)
+				delete_wave(wav);
+			g_free(buf);
+		}
+		pthread_mutex_unlock(&flite_prepare_mutex);
+	}
+
+	return NULL;
+}
+
 void flite_strip_silence(AudioTrack * track)
 {
 	int playlen, skip;
@@ -267,6 +423,7 @@ void *_flite_speak(void *nothing)
 {
 	AudioTrack track;
 	cst_wave *wav;
+	cst_wave *first_wave;
 	unsigned int pos;
 	char *buf;
 	int bytes;
@@ -293,6 +450,8 @@ void *_flite_speak(void *nothing)
 		buf =
 		    (char *)g_malloc((FliteMaxChunkLength + 1) * sizeof(char));
 		pos = 0;
+		first_wave = flite_first_wave;
+		flite_first_wave = NULL;
 		module_report_event_begin();
 		while (1) {
 			if (flite_stopped) {
@@ -302,10 +461,20 @@ void *_flite_speak(void *nothing)
 				module_report_event_stop();
 				break;
 			}
-			bytes =
-			    module_get_message_part(*flite_message, buf, &pos,
-						    FliteMaxChunkLength,
-						    FliteDelimiters);
+			if (first_wave != NULL) {
+				/* Synthesized ahead of time by _flite_prepare() */
+				bytes = strlen(flite_first_part);
+				memcpy(buf, flite_first_part, bytes);
+				pos = flite_first_pos;
+				g_free(flite_first_part);
+				flite_first_part = NULL;
+			} else {
+				bytes =
+				    module_get_message_part(*flite_message, buf,
+							    &pos,
+							    FliteMaxChunkLength,
+							    FliteDelimiters);
+			}
 
 			if (bytes < 0) {
 				log_msg(OTTS_LOG_DEBUG, "End of message");
@@ -332,9 +501,18 @@ void *_flite_speak(void *nothing)
 			if (bytes > 0) {
 				log_msg(OTTS_LOG_DEBUG, "Speaking in child...");
 
-				log_msg(OTTS_LOG_NOTICE,
-					"Trying to synthesize text");
-				wav = flite_text_to_wave(buf, flite_voice);
+				if (first_wave != NULL) {
+					wav = first_wave;
+					first_wave = NULL;
+				} else {
+					log_msg(OTTS_LOG_NOTICE,
+						"Trying to synthesize text");
+					pthread_mutex_lock(&flite_synth_mutex);
+					wav = flite_text_to_wave(buf,
+								 flite_voice);
+					pthread_mutex_unlock
+					    (&flite_synth_mutex);
+				}
 
 				if (wav == NULL) {
 					log_msg(OTTS_LOG_NOTICE,
@@ -412,6 +590,10 @@ void *_flite_speak(void *nothing)
 			}
 		}
 		flite_stopped = 0;
+		if (first_wave != NULL)
+			delete_wave(first_wave);
+		g_free(flite_first_part);
+		flite_first_part = NULL;
 		g_free(buf);
 	}
 
@@ -470,7 +652,8 @@ static otts_synth_plugin_t flite_plugin = {
 	fl_stop,
 	fl_list_voices,
 	fl_pause,
-	fl_close
+	fl_close,
+	fl_prepare
 };
 
 otts_synth_plugin_t * flite_plugin_get (void)
@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 #include <glib.h>
 #include <dotconf.h>
@@ -51,11 +54,28 @@ pthread_mutex_t module_stdout_mutex;
 configoption_t *module_dc_options;
 int module_num_dc_options;
 
+/*
+ * do_protocol answers the PROTOCOL command openttsd sends after INIT.
+ * The switch itself only happens once the reply has been sent.
+ */
+static gchar *do_protocol(char *cmd_line, int *new_protocol)
+{
+	int version = 0;
+
+	sscanf(cmd_line, "%*s %d", &version);
+	if (version != OTTS_MODPROTO_VERSION)
+		return g_strdup("303 ERROR INVALID PARAMETER OR VALUE");
+
+	*new_protocol = version;
+	return g_strdup_printf("200 OK PROTOCOL %d", version);
+}
+
 int dispatch_cmd(otts_synth_plugin_t *synth, char *cmd_line)
 {
 	char *cmd = NULL;
 	size_t cmd_len;
 	char *msg = NULL;
+	int new_protocol = 0;
 
 	cmd_len = strcspn(cmd_line, " \t\n\r\f");
 	cmd = g_strndup(cmd_line, cmd_len);
@@ -83,6 +103,8 @@ int dispatch_cmd(otts_synth_plugin_t *synth, char *cmd_line)
 		msg = do_loglevel(synth);
 	} else if (!strcasecmp("debug", cmd)) {
 		msg = do_debug(synth, cmd_line);
+	} else if (!strcasecmp("protocol", cmd)) {
+		msg = do_protocol(cmd_line, &new_protocol);
 	} else if (!strcasecmp("quit", cmd)) {
 		do_quit(synth);
 	} else {
@@ -92,20 +114,319 @@ int dispatch_cmd(otts_synth_plugin_t *synth, char *cmd_line)
 	}
 
 	if (msg != NULL) {
-		if (0 > printf("%s\n", msg)) {
+		if (0 > module_reply(msg)) {
 			log_msg(OTTS_LOG_CRIT, "Broken pipe, exiting...\n");
 			synth->close(2);
 		}
-		fflush(stdout);
 		g_free(msg);
 	}
 
+	if (new_protocol) {
+		log_msg(OTTS_LOG_NOTICE, "Switching to protocol version %d",
+			new_protocol);
+		module_protocol = new_protocol;
+	}
+
 	pthread_mutex_unlock(&module_stdout_mutex);
 	g_free(cmd);
 
 	return (0);
 }
 
+/*
+ * dispatch_frame is the binary protocol counterpart of dispatch_cmd.
+ * The data blocks come complete in the frame payload, so the do_*_data
+ * variants of the command handlers are used.  Returns -1 if the reply
+ * can't be sent to a module running inside openttsd, a module process
+ * exits instead.
+ */
+int dispatch_frame(otts_synth_plugin_t *synth, otts_frame_header_t * header,
+		   char *data)
+{
+	char *msg = NULL;
+	char *cmd_line;
+	int ret = 0;
+
+	pthread_mutex_lock(&module_stdout_mutex);
+	module_request_seq = header->seq;
+
+	switch (header->opcode) {
+	case OTTS_OP_SPEAK:
+		msg = do_message_data(synth, header->arg, data);
+		break;
+	case OTTS_OP_STOP:
+		do_stop(synth);
+		break;
+	case OTTS_OP_PAUSE:
+		do_pause(synth);
+		break;
+	case OTTS_OP_SET:
+		msg = do_set_data(synth, data);
+		break;
+	case OTTS_OP_AUDIO:
+		msg = do_audio_data(synth, data);
+		break;
+	case OTTS_OP_LOGLEVEL:
+		msg = do_loglevel_data(synth, data);
+		break;
+	case OTTS_OP_DEBUG:
+		cmd_line = g_strdup_printf("DEBUG %s", data);
+		msg = do_debug(synth, cmd_line);
+		g_free(cmd_line);
+		break;
+	case OTTS_OP_LIST_VOICES:
+		msg = do_list_voices(synth);
+		break;
+	case OTTS_OP_QUIT:
+		do_quit(synth);
+		break;
+	case OTTS_OP_PREPARE:
+		msg = do_prepare_data(synth, header->arg, data);
+		break;
+	default:
+		log_msg(OTTS_LOG_WARN, "Unknown frame opcode %d",
+			header->opcode);
+		msg = g_strdup("300 ERR UNKNOWN COMMAND");
+	}
+
+	if (msg != NULL) {
+		if (0 > module_reply(msg)) {
+			log_msg(OTTS_LOG_CRIT, "Broken pipe, exiting...\n");
+			/* Closing would take openttsd down with the plugin */
+			if (!module_in_process)
+				synth->close(2);
+			ret = -1;
+		}
+		g_free(msg);
+	}
+
+	pthread_mutex_unlock(&module_stdout_mutex);
+
+	return ret;
+}
+
+/*
+ * The cancel thread stops the synthesizer as soon as openttsd writes
+ * to the cancel descriptor.  It doesn't take module_stdout_mutex, so
+ * it isn't held up by the request being dispatched.  The STOP frame
+ * which follows takes care of anything queued in the meantime.
+ */
+static void *module_cancel_thread(void *data)
+{
+	otts_synth_plugin_t *synth = data;
+	char buf[16];
+	ssize_t n;
+
+	set_speaking_thread_parameters();
+
+	while (1) {
+		n = read(module_cancel_fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		log_msg(OTTS_LOG_INFO, "Cancel requested");
+		synth->stop();
+	}
+
+	return NULL;
+}
+
+static void module_start_cancel_thread(otts_synth_plugin_t *synth, int fd)
+{
+	pthread_t thread;
+
+	/* Older openttsd doesn't pass the descriptor */
+	if (fcntl(fd, F_GETFD) == -1)
+		return;
+
+	module_cancel_fd = fd;
+	if (pthread_create(&thread, NULL, module_cancel_thread, synth) != 0) {
+		log_msg(OTTS_LOG_WARN, "Can't create the cancel thread");
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/*
+ * Load the module and read its configuration file.  Returns -1 if the
+ * module can't be used.
+ */
+static int module_configure(otts_synth_plugin_t *synth, char *configfilename)
+{
+	configfile_t *configfile;
+	int ret;
+
+	module_num_dc_options = 0;
+	module_audio_id = 0;
+
+	ret = synth->load();
+	if (ret == -1)
+		return -1;
+
+	if (configfilename == NULL) {
+		log_msg(OTTS_LOG_WARN,
+			"No config file specified, using defaults...\n");
+		return 0;
+	}
+
+	/* Add the LAST option */
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "", 0, NULL, NULL, 0);
+
+	configfile =
+	    dotconf_create(configfilename, module_dc_options, 0,
+			   CASE_INSENSITIVE);
+	if (configfile) {
+		if (dotconf_command_loop(configfile) == 0) {
+			log_msg(OTTS_LOG_CRIT, "Error reading config file\n");
+			dotconf_cleanup(configfile);
+			return -1;
+		}
+		dotconf_cleanup(configfile);
+		log_msg(OTTS_LOG_NOTICE,
+			"Configuration (pre) has been read from \"%s\"\n",
+			configfilename);
+	} else {
+		log_msg(OTTS_LOG_ERR, "Can't read specified config file!\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Read frames from fd and dispatch them.  Returns -1 when openttsd
+ * closes either pipe.  QUIT only ends the loop for modules running
+ * inside openttsd, otherwise the module exits in do_quit().
+ */
+static int module_frame_loop(otts_synth_plugin_t *synth, int fd)
+{
+	otts_frame_header_t header;
+	char *data;
+	int ret;
+
+	while (1) {
+		ret = otts_frame_read(fd, &header, &data);
+		if (ret == -1)
+			return -1;
+
+		log_msg(OTTS_LOG_INFO, "FRAME: opcode %d, seq %u, %u bytes",
+			header.opcode, header.seq, header.length);
+
+		if (module_in_process && header.opcode == OTTS_OP_QUIT) {
+			g_free(data);
+			synth->stop();
+			pthread_mutex_lock(&module_stdout_mutex);
+			module_request_seq = header.seq;
+			module_reply("210 OK QUIT");
+			pthread_mutex_unlock(&module_stdout_mutex);
+			return 0;
+		}
+
+		ret = dispatch_frame(synth, &header, data);
+
+		g_free(data);
+		if (ret == -1)
+			return -1;
+	}
+}
+
+#ifdef OTTS_MODULE_PLUGIN
+
+/*
+ * module_plugin_main runs the module inside openttsd, on a thread
+ * openttsd starts for it.  There is no INIT and PROTOCOL handshake,
+ * the binary protocol is used on in_fd and out_fd right away and the
+ * result of the initialization is the reply to request 0.  The module
+ * logs to logfilename with its own copy of the logging code, see
+ * src/modules/Makefile.am, so LOGLEVEL and DEBUG only change its log.
+ *
+ * Nothing here may exit(), it would take openttsd down as well.  The
+ * errors end the thread instead and openttsd sees the closed pipes.
+ */
+int OTTS_MODULE_PLUGIN_MAIN(int in_fd, int out_fd, int cancel_fd,
+			    char *configfilename, char *logfilename)
+{
+	otts_synth_plugin_t *synth;
+	char *status_info = NULL;
+	char *reply;
+	int ret;
+
+	init_logging();
+	open_log(logfilename != NULL ? logfilename : "stderr", 3);
+
+	synth = synth_plugin_get();
+
+	module_in_process = 1;
+	module_out_fd = out_fd;
+	module_protocol = OTTS_MODPROTO_VERSION;
+
+	if (module_configure(synth, configfilename) == -1) {
+		ret = -1;
+		status_info = g_strdup("can't load the module");
+	} else {
+		ret = synth->init(&status_info);
+	}
+
+	if (status_info == NULL)
+		status_info = g_strdup("unknown, was not set by module");
+
+	if (ret != 0)
+		reply = g_strdup_printf("399 ERR CANT INIT MODULE: %s",
+					status_info);
+	else
+		reply = g_strdup_printf("299 OK LOADED SUCCESSFULLY: %s",
+					status_info);
+	g_free(status_info);
+
+	pthread_mutex_lock(&module_stdout_mutex);
+	module_request_seq = 0;
+	if (module_reply(reply) == -1)
+		ret = -1;
+	pthread_mutex_unlock(&module_stdout_mutex);
+	g_free(reply);
+
+	if (ret == 0) {
+		module_start_cancel_thread(synth, cancel_fd);
+		ret = module_frame_loop(synth, in_fd);
+	}
+
+	/* Threads of the module which are still running log nowhere */
+	close_debug_log();
+	close_log();
+
+	return ret == 0 ? 0 : -1;
+}
+
+#else /* OTTS_MODULE_PLUGIN */
+
+/*
+ * openttsd gives a module its pipes on the standard descriptors and
+ * the cancel pipe on OTTS_MODULE_CANCEL_FD, nothing else.  Any other
+ * open descriptor leaked from openttsd (a client socket, a pipe of
+ * another module) and keeps it open after openttsd closed it, so
+ * report and close it.
+ */
+static void check_inherited_fds(void)
+{
+	long max_fd;
+	int fd;
+
+	max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0 || max_fd > 1024)
+		max_fd = 1024;
+
+	for (fd = OTTS_MODULE_CANCEL_FD + 1; fd < max_fd; fd++) {
+		if (fcntl(fd, F_GETFD) == -1)
+			continue;
+		log_msg(OTTS_LOG_WARN,
+			"WARNING: Descriptor %d was inherited from openttsd, "
+			"closing it", fd);
+		close(fd);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	char *cmd_buf;
@@ -113,20 +434,18 @@ int main(int argc, char *argv[])
 	int ret_init;
 	size_t n;
 	char *configfilename;
-	configfile_t *configfile;
 	otts_synth_plugin_t *synth;
 	char *status_info = NULL;
 
 	g_thread_init(NULL);
 	init_logging();
 	open_log("stderr", 3);
+	check_inherited_fds();
 
 	synth = synth_plugin_get();
 
 	/* Initialize ltdl's list of preloaded audio backends. */
 	LTDL_SET_PRELOADED_SYMBOLS();
-	module_num_dc_options = 0;
-	module_audio_id = 0;
 
 	if (argc >= 2) {
 		configfilename = g_strdup(argv[1]);
@@ -134,40 +453,9 @@ int main(int argc, char *argv[])
 		configfilename = NULL;
 	}
 
-	ret = synth->load();
-	if (ret == -1)
+	if (module_configure(synth, configfilename) == -1)
 		synth->close(1);
-
-	if (configfilename != NULL) {
-		/* Add the LAST option */
-		module_dc_options = module_add_config_option(module_dc_options,
-							     &module_num_dc_options,
-							     "", 0, NULL, NULL,
-							     0);
-
-		configfile =
-		    dotconf_create(configfilename, module_dc_options, 0,
-				   CASE_INSENSITIVE);
-		if (configfile) {
-			if (dotconf_command_loop(configfile) == 0) {
-				log_msg(OTTS_LOG_CRIT,
-					"Error reading config file\n");
-				synth->close(1);
-			}
-			dotconf_cleanup(configfile);
-			log_msg(OTTS_LOG_NOTICE,
-				"Configuration (pre) has been read from \"%s\"\n",
-				configfilename);
-
-			g_free(configfilename);
-		} else {
-			log_msg(OTTS_LOG_ERR,
-				"Can't read specified config file!\n");
-		}
-	} else {
-		log_msg(OTTS_LOG_WARN,
-			"No config file specified, using defaults...\n");
-	}
+	g_free(configfilename);
 
 	ret_init = synth->init(&status_info);
 
@@ -209,7 +497,9 @@ int main(int argc, char *argv[])
 	g_free(status_info);
 	xfree(cmd_buf);
 
-	while (1) {
+	module_start_cancel_thread(synth, OTTS_MODULE_CANCEL_FD);
+
+	while (module_protocol != OTTS_MODPROTO_VERSION) {
 		cmd_buf = NULL;
 		n = 0;
 		ret = otts_getline(&cmd_buf, &n, stdin);
@@ -224,4 +514,17 @@ int main(int argc, char *argv[])
 
 		xfree(cmd_buf);
 	}
+
+	/*
+	 * openttsd doesn't send any frame before it has read our reply
+	 * to PROTOCOL, so nothing is left in the stdin buffer and we can
+	 * read the descriptor directly from now on.
+	 */
+	module_frame_loop(synth, 0);
+	log_msg(OTTS_LOG_CRIT, "Broken pipe, exiting... \n");
+	synth->close(2);
+
+	return 0;
 }
+
+#endif /* OTTS_MODULE_PLUGIN */
@@ -31,7 +31,7 @@
 #include<logging.h>
 #include "module_utils.h"
 
-static char *module_audio_pars[10];
+static char *module_audio_pars[11];
 
 void xfree(void *data)
 {
@@ -39,65 +39,131 @@ void xfree(void *data)
 		free(data);
 }
 
-gchar *do_message(otts_synth_plugin_t *synth, SPDMessageType msgtype)
-{
-	int ret;
-	char *cur_line;
-	GString *msg;
-	size_t n;
-	int nlines = 0;
+int module_protocol = 1;
+uint32_t module_request_seq;
+int module_out_fd = 1;
+int module_in_process = 0;
+int module_cancel_fd = -1;
 
-	msg = g_string_new("");
+/* When the message being spoken arrived, zero if there is none */
+static struct timeval module_timing_start;
 
-	printf("202 OK RECEIVING MESSAGE\n");
-	fflush(stdout);
+/*
+ * module_read_block reads the data block following a text protocol
+ * command, up to the line containing a single dot.  If unescape is set,
+ * lines with two dots are turned back into a single dot.
+ */
+static int module_read_block(GString * block, int unescape)
+{
+	char *line;
+	size_t n;
+	int ret;
 
 	while (1) {
-		cur_line = NULL;
+		line = NULL;
 		n = 0;
-		ret = otts_getline(&cur_line, &n, stdin);
-		nlines++;
+		ret = otts_getline(&line, &n, stdin);
 		if (ret == -1)
-			return g_strdup("401 ERROR INTERNAL");
-
-		if (!strcmp(cur_line, "..\n")) {
-			xfree(cur_line);
-			cur_line = strdup(".\n");
-		} else if (!strcmp(cur_line, ".\n")) {
-			/* Strip the trailing \n */
-			msg->str[strlen(msg->str) - 1] = 0;
-			xfree(cur_line);
+			return -1;
+
+		if (!strcmp(line, ".\n")) {
+			xfree(line);
 			break;
 		}
-		g_string_append(msg, cur_line);
-		xfree(cur_line);
+		if (unescape && !strcmp(line, "..\n"))
+			g_string_append(block, ".\n");
+		else
+			g_string_append(block, line);
+		xfree(line);
 	}
 
-	if ((msgtype != SPD_MSGTYPE_TEXT) && (nlines > 2)) {
+	return 0;
+}
+
+/*
+ * module_reply sends the final reply to the request being processed,
+ * either as a text line or as a REPLY frame.  It must be called with
+ * module_stdout_mutex locked.
+ */
+int module_reply(const char *reply)
+{
+	if (module_protocol == OTTS_MODPROTO_VERSION)
+		return otts_frame_write(module_out_fd, OTTS_OP_REPLY, atoi(reply),
+					module_request_seq, reply,
+					strlen(reply));
+
+	if (0 > printf("%s\n", reply))
+		return -1;
+	fflush(stdout);
+	return 0;
+}
+
+gchar *do_message_data(otts_synth_plugin_t *synth, SPDMessageType msgtype,
+		       const char *data)
+{
+	int ret;
+
+	if ((msgtype != SPD_MSGTYPE_TEXT) && (strchr(data, '\n') != NULL)) {
 		return g_strdup("305 DATA MORE THAN ONE LINE");
 	}
 
-	if ((msgtype == SPD_MSGTYPE_CHAR) && (!strcmp(msg->str, "space"))) {
-		g_string_free(msg, 1);
-		msg = g_string_new(" ");
-	}
+	if ((msgtype == SPD_MSGTYPE_CHAR) && (!strcmp(data, "space")))
+		data = " ";
 
 	/* no sure we need this check here at all */
-	if (msg->str == NULL || msg->str[0] == 0){
+	if (data[0] == 0) {
 		log_msg(OTTS_LOG_ERR, "requested data NULL or empty");
-		g_string_free(msg, TRUE);
 		return g_strdup("301 ERROR CANT SPEAK");
 	}
 
-	ret = synth->speak(msg->str, strlen(msg->str), msgtype);
+	gettimeofday(&module_timing_start, NULL);
+	opentts_audio_take_stats(NULL);
 
-	g_string_free(msg, 1);
+	ret = synth->speak((char *)data, strlen(data), msgtype);
 	if (ret <= 0)
 		return g_strdup("301 ERROR CANT SPEAK");
 
 	return g_strdup("200 OK SPEAKING");
 }
 
+gchar *do_prepare_data(otts_synth_plugin_t *synth, SPDMessageType msgtype,
+		       const char *data)
+{
+	if (synth->prepare == NULL)
+		return g_strdup("300 ERR PREPARE NOT SUPPORTED");
+
+	if (data[0] == 0 || synth->prepare((char *)data, strlen(data),
+					   msgtype) < 0)
+		return g_strdup("301 ERROR CANT PREPARE");
+
+	return g_strdup("200 OK PREPARED");
+}
+
+gchar *do_message(otts_synth_plugin_t *synth, SPDMessageType msgtype)
+{
+	GString *msg;
+	gchar *reply;
+
+	msg = g_string_new("");
+
+	printf("202 OK RECEIVING MESSAGE\n");
+	fflush(stdout);
+
+	if (module_read_block(msg, 1) == -1) {
+		g_string_free(msg, 1);
+		return g_strdup("401 ERROR INTERNAL");
+	}
+
+	/* Strip the trailing \n */
+	if (msg->len > 0)
+		g_string_truncate(msg, msg->len - 1);
+
+	reply = do_message_data(synth, msgtype, msg->str);
+	g_string_free(msg, 1);
+
+	return reply;
+}
+
 gchar *do_speak(otts_synth_plugin_t *synth)
 {
 	return do_message(synth, SPD_MSGTYPE_TEXT);
@@ -165,102 +231,92 @@ static int set_numeric_parameter(char *num_text, int *target,
 	return err;
 }
 
-gchar *do_set(otts_synth_plugin_t *synth)
+/*
+ * do_set_data applies the settings in data, one item=value pair per
+ * line.  The engine reconfiguration itself is left to the module,
+ * which compares msg_settings with msg_settings_old.
+ */
+gchar *do_set_data(otts_synth_plugin_t *synth, const char *data)
 {
 	char *cur_item = NULL;
 	char *cur_value = NULL;
-	char *line = NULL;
+	gchar **lines;
 	int ret;
-	size_t n;
+	int i;
 	int err = 0;		/* Error status */
 
-	printf("203 OK RECEIVING SETTINGS\n");
-	fflush(stdout);
+	lines = g_strsplit(data, "\n", 0);
+	for (i = 0; !err && lines[i] != NULL; i++) {
+		if (lines[i][0] == 0)
+			continue;
 
-	while (1) {
-		line = NULL;
-		n = 0;
-		ret = otts_getline(&line, &n, stdin);
-		if (ret == -1) {
+		cur_item = strtok(lines[i], "=");
+		if (cur_item == NULL) {
 			err = 1;
-			break;
+			continue;
 		}
-		if (!strcmp(line, ".\n")) {
-			xfree(line);
-			break;
+		cur_value = strtok(NULL, "\n");
+		if (cur_value == NULL) {
+			err = 1;
+			continue;
 		}
-		if (!err) {
-			cur_item = strtok(line, "=");
-			if (cur_item == NULL) {
-				err = 1;
-				xfree(line);
-				continue;
-			}
-			cur_value = strtok(NULL, "\n");
-			if (cur_value == NULL) {
-				err = 1;
-				xfree(line);
-				continue;
-			}
 
-			if (!strcmp(cur_item, "rate")) {
-				err =
-				    set_numeric_parameter(cur_value,
-							  &msg_settings.rate,
-							  OTTS_VOICE_RATE_MIN,
-							  OTTS_VOICE_RATE_MAX);
-			} else if (!strcmp(cur_item, "pitch")) {
-				err =
-				    set_numeric_parameter(cur_value,
-							  &msg_settings.pitch,
-							  OTTS_VOICE_PITCH_MIN,
-							  OTTS_VOICE_PITCH_MAX);
-			} else if (!strcmp(cur_item, "volume")) {
-				err =
-				    set_numeric_parameter(cur_value,
-							  &msg_settings.volume,
-							  OTTS_VOICE_VOLUME_MIN,
-							  OTTS_VOICE_VOLUME_MAX);
-			} else if (!strcmp(cur_item, "punctuation_mode")) {
-				ret = str2punct(cur_value);
-				if (ret != SPD_PUNCT_ERR)
-					msg_settings.punctuation_mode = ret;
-				else
-					err = 2;
-			} else if (!strcmp(cur_item, "spelling_mode")) {
-				ret = str2spell(cur_value);
-				if (ret != SPD_SPELL_ERR)
-					msg_settings.spelling_mode = ret;
-				else
-					err = 2;
-			} else if (!strcmp(cur_item, "cap_let_recogn")) {
-				ret = str2recogn(cur_value);
-				if (ret != SPD_CAP_ERR)
-					msg_settings.cap_let_recogn = ret;
-				else
-					err = 2;
-			} else if (!strcmp(cur_item, "voice")) {
-				ret = str2voice(cur_value);
-				msg_settings.voice_type = ret;
-			} else if (!strcmp(cur_item, "synthesis_voice")) {
-				g_free(msg_settings.voice.name);
-				if (!strcmp(cur_value, "NULL"))
-					msg_settings.voice.name = NULL;
-				else
-					msg_settings.voice.name =
-					    g_strdup(cur_value);
-			} else if (!strcmp(cur_item, "language")) {
-				g_free(msg_settings.voice.language);
-				if (!strcmp(cur_value, "NULL"))
-					msg_settings.voice.language = NULL;
-				else
-					msg_settings.voice.language =
-					    g_strdup(cur_value);
-			} else
-				err = 2;	/* Unknown parameter */
-		}
-		xfree(line);
+		if (!strcmp(cur_item, "rate")) {
+			err =
+			    set_numeric_parameter(cur_value,
+						  &msg_settings.rate,
+						  OTTS_VOICE_RATE_MIN,
+						  OTTS_VOICE_RATE_MAX);
+		} else if (!strcmp(cur_item, "pitch")) {
+			err =
+			    set_numeric_parameter(cur_value,
+						  &msg_settings.pitch,
+						  OTTS_VOICE_PITCH_MIN,
+						  OTTS_VOICE_PITCH_MAX);
+		} else if (!strcmp(cur_item, "volume")) {
+			err =
+			    set_numeric_parameter(cur_value,
+						  &msg_settings.volume,
+						  OTTS_VOICE_VOLUME_MIN,
+						  OTTS_VOICE_VOLUME_MAX);
+		} else if (!strcmp(cur_item, "punctuation_mode")) {
+			ret = str2punct(cur_value);
+			if (ret != SPD_PUNCT_ERR)
+				msg_settings.punctuation_mode = ret;
+			else
+				err = 2;
+		} else if (!strcmp(cur_item, "spelling_mode")) {
+			ret = str2spell(cur_value);
+			if (ret != SPD_SPELL_ERR)
+				msg_settings.spelling_mode = ret;
+			else
+				err = 2;
+		} else if (!strcmp(cur_item, "cap_let_recogn")) {
+			ret = str2recogn(cur_value);
+			if (ret != SPD_CAP_ERR)
+				msg_settings.cap_let_recogn = ret;
+			else
+				err = 2;
+		} else if (!strcmp(cur_item, "voice")) {
+			ret = str2voice(cur_value);
+			msg_settings.voice_type = ret;
+		} else if (!strcmp(cur_item, "synthesis_voice")) {
+			g_free(msg_settings.voice.name);
+			if (!strcmp(cur_value, "NULL"))
+				msg_settings.voice.name = NULL;
+			else
+				msg_settings.voice.name = g_strdup(cur_value);
+		} else if (!strcmp(cur_item, "language")) {
+			g_free(msg_settings.voice.language);
+			if (!strcmp(cur_value, "NULL"))
+				msg_settings.voice.language = NULL;
+			else
+				msg_settings.voice.language =
+				    g_strdup(cur_value);
+		} else
+			err = 2;	/* Unknown parameter */
 	}
+	g_strfreev(lines);
 
 	if (err == 0)
 		return g_strdup("203 OK SETTINGS RECEIVED");
@@ -272,6 +328,24 @@ gchar *do_set(otts_synth_plugin_t *synth)
 	return g_strdup("401 ERROR INTERNAL");	/* Can't be reached */
 }
 
+gchar *do_set(otts_synth_plugin_t *synth)
+{
+	GString *data;
+	gchar *reply;
+
+	printf("203 OK RECEIVING SETTINGS\n");
+	fflush(stdout);
+
+	data = g_string_new("");
+	if (module_read_block(data, 0) == -1)
+		reply = g_strdup("302 ERROR BAD SYNTAX");
+	else
+		reply = do_set_data(synth, data->str);
+	g_string_free(data, 1);
+
+	return reply;
+}
+
 /*
  * set_audio_parameter: sets module_audio_pars[parameter_index] to
  * current_value.
@@ -286,63 +360,56 @@ static void set_audio_parameter(char *cur_value, int parameter_index)
 		module_audio_pars[parameter_index] = g_strdup(cur_value);
 }
 
-gchar *do_audio(otts_synth_plugin_t *synth)
+gchar *do_audio_data(otts_synth_plugin_t *synth, const char *data)
 {
 	char *cur_item = NULL;
 	char *cur_value = NULL;
-	char *line = NULL;
-	int ret;
-	size_t n;
+	gchar **lines;
+	int i;
 	int err = 0;		/* Error status */
 	char *status;
 	char *msg;
 
-	printf("207 OK RECEIVING AUDIO SETTINGS\n");
-	fflush(stdout);
+	lines = g_strsplit(data, "\n", 0);
+	for (i = 0; !err && lines[i] != NULL; i++) {
+		if (lines[i][0] == 0)
+			continue;
 
-	while (1) {
-		line = NULL;
-		n = 0;
-		ret = otts_getline(&line, &n, stdin);
-		if (ret == -1) {
+		cur_item = strtok(lines[i], "=");
+		if (cur_item == NULL) {
 			err = 1;
-			break;
+			continue;
 		}
-		if (!strcmp(line, ".\n")) {
-			xfree(line);
-			break;
+		cur_value = strtok(NULL, "\n");
+		if (cur_value == NULL) {
+			err = 1;
+			continue;
 		}
-		if (!err) {
-			cur_item = strtok(line, "=");
-			if (cur_item == NULL) {
-				err = 1;
-				xfree(line);
-				continue;
-			}
-			cur_value = strtok(NULL, "\n");
-			if (cur_value == NULL) {
-				err = 1;
-				xfree(line);
-				continue;
-			}
 
-			if (!strcmp(cur_item, "audio_output_method"))
-				set_audio_parameter(cur_value, 0);
-			else if (!strcmp(cur_item, "audio_oss_device"))
-				set_audio_parameter(cur_value, 1);
-			else if (!strcmp(cur_item, "audio_alsa_device"))
-				set_audio_parameter(cur_value, 2);
-			else if (!strcmp(cur_item, "audio_nas_server"))
-				set_audio_parameter(cur_value, 3);
-			else if (!strcmp(cur_item, "audio_pulse_server"))
-				set_audio_parameter(cur_value, 4);
-			else if (!strcmp(cur_item, "audio_pulse_min_length"))
-				set_audio_parameter(cur_value, 5);
-			else
-				err = 2;	/* Unknown parameter */
-		}
-		xfree(line);
+		if (!strcmp(cur_item, "audio_output_method"))
+			set_audio_parameter(cur_value, 0);
+		else if (!strcmp(cur_item, "audio_oss_device"))
+			set_audio_parameter(cur_value, 1);
+		else if (!strcmp(cur_item, "audio_alsa_device"))
+			set_audio_parameter(cur_value, 2);
+		else if (!strcmp(cur_item, "audio_nas_server"))
+			set_audio_parameter(cur_value, 3);
+		else if (!strcmp(cur_item, "audio_pulse_server"))
+			set_audio_parameter(cur_value, 4);
+		else if (!strcmp(cur_item, "audio_pulse_min_length"))
+			set_audio_parameter(cur_value, 5);
+		else if (!strcmp(cur_item, "audio_resample_quality"))
+			set_audio_parameter(cur_value, 6);
+		else if (!strcmp(cur_item, "audio_pulse_target_length"))
+			set_audio_parameter(cur_value, 7);
+		else if (!strcmp(cur_item, "audio_pulse_min_request"))
+			set_audio_parameter(cur_value, 8);
+		else if (!strcmp(cur_item, "audio_alsa_mmap"))
+			set_audio_parameter(cur_value, 9);
+		else
+			err = 2;	/* Unknown parameter */
 	}
+	g_strfreev(lines);
 
 	if (err == 1)
 		return g_strdup("302 ERROR BAD SYNTAX");
@@ -359,69 +426,87 @@ gchar *do_audio(otts_synth_plugin_t *synth)
 	return msg;
 }
 
-gchar *do_loglevel(otts_synth_plugin_t *synth)
+gchar *do_audio(otts_synth_plugin_t *synth)
+{
+	GString *data;
+	gchar *reply;
+
+	printf("207 OK RECEIVING AUDIO SETTINGS\n");
+	fflush(stdout);
+
+	data = g_string_new("");
+	if (module_read_block(data, 0) == -1)
+		reply = g_strdup("302 ERROR BAD SYNTAX");
+	else
+		reply = do_audio_data(synth, data->str);
+	g_string_free(data, 1);
+
+	return reply;
+}
+
+gchar *do_loglevel_data(otts_synth_plugin_t *synth, const char *data)
 {
 	char *cur_item = NULL;
 	char *cur_value = NULL;
-	char *line = NULL;
-	int ret;
-	size_t n;
+	gchar **lines;
+	int i;
 	int number;
 	char *tptr;
 	int err = 0;		/* Error status */
-	char *msg;
 
-	printf("207 OK RECEIVING LOGLEVEL SETTINGS\n");
-	fflush(stdout);
+	lines = g_strsplit(data, "\n", 0);
+	for (i = 0; !err && lines[i] != NULL; i++) {
+		if (lines[i][0] == 0)
+			continue;
 
-	while (1) {
-		line = NULL;
-		n = 0;
-		ret = otts_getline(&line, &n, stdin);
-		if (ret == -1) {
+		cur_item = strtok(lines[i], "=");
+		if (cur_item == NULL) {
 			err = 1;
-			break;
+			continue;
 		}
-		if (!strcmp(line, ".\n")) {
-			xfree(line);
-			break;
+		cur_value = strtok(NULL, "\n");
+		if (cur_value == NULL) {
+			err = 1;
+			continue;
 		}
-		if (!err) {
-			cur_item = strtok(line, "=");
-			if (cur_item == NULL) {
-				err = 1;
-				xfree(line);
-				continue;
-			}
-			cur_value = strtok(NULL, "\n");
-			if (cur_value == NULL) {
-				err = 1;
-				xfree(line);
+
+		if (!strcmp(cur_item, "log_level")) {
+			number = strtol(cur_value, &tptr, 10);
+			if (tptr == cur_value) {
+				err = 2;
 				continue;
 			}
-
-			if (!strcmp(cur_item, "log_level")) {
-				number = strtol(cur_value, &tptr, 10);
-				if (tptr == cur_value) {
-					err = 2;
-					xfree(line);
-					continue;
-				}
-				open_log("stderr", number);
-			} else
-				err = 2;	/* Unknown parameter */
-		}
-		xfree(line);
+			/* Keep the log file, a plugin doesn't log to stderr */
+			open_log(NULL, number);
+		} else
+			err = 2;	/* Unknown parameter */
 	}
+	g_strfreev(lines);
 
 	if (err == 1)
 		return g_strdup("302 ERROR BAD SYNTAX");
 	if (err == 2)
 		return g_strdup("303 ERROR INVALID PARAMETER OR VALUE");
 
-	msg = g_strdup_printf("203 OK LOG LEVEL SET");
+	return g_strdup("203 OK LOG LEVEL SET");
+}
 
-	return msg;
+gchar *do_loglevel(otts_synth_plugin_t *synth)
+{
+	GString *data;
+	gchar *reply;
+
+	printf("207 OK RECEIVING LOGLEVEL SETTINGS\n");
+	fflush(stdout);
+
+	data = g_string_new("");
+	if (module_read_block(data, 0) == -1)
+		reply = g_strdup("302 ERROR BAD SYNTAX");
+	else
+		reply = do_loglevel_data(synth, data->str);
+	g_string_free(data, 1);
+
+	return reply;
 }
 
 gchar *do_debug(otts_synth_plugin_t *synth, char *cmd_buf)
@@ -453,6 +538,7 @@ gchar *do_debug(otts_synth_plugin_t *synth, char *cmd_buf)
 		log_msg(OTTS_LOG_NOTICE,
 			"Additional logging into specific path terminated");
 	} else {
+		g_strfreev(cmd);
 		return g_strdup("302 ERROR BAD SYNTAX");
 	}
 
@@ -500,8 +586,7 @@ gchar *do_list_voices(otts_synth_plugin_t *synth)
  * something */
 void do_quit(otts_synth_plugin_t *synth)
 {
-	printf("210 OK QUIT\n");
-	fflush(stdout);
+	module_reply("210 OK QUIT");
 	synth->close(0);
 	return;
 }
@@ -699,6 +784,10 @@ module_speak_thread_wfork(sem_t * semaphore, pid_t * process_pid,
 
 			log_msg(OTTS_LOG_NOTICE, "Starting child...\n");
 			(*child_function) (module_pipe, maxlen);
+			/* The child of a plugin must not run the exit
+			   handlers of openttsd */
+			if (module_in_process)
+				_exit(0);
 			exit(0);
 
 		default:
@@ -887,6 +976,12 @@ int module_parent_dp_read(TModuleDoublePipe dpipe, char *msg, size_t maxlen)
 	int bytes;
 	while ((bytes = read(dpipe.cp[0], msg, maxlen)) < 0) {
 		if (errno != EINTR) {
+			/* The parent of a plugin is openttsd itself, act as
+			   if the child stopped */
+			if (module_in_process) {
+				log_msg(OTTS_LOG_ERR, "Unable to read data");
+				return 0;
+			}
 			fatal("Unable to read data");
 		}
 	}
@@ -1034,38 +1129,113 @@ void module_send_asynchronous(char *text)
 	pthread_mutex_unlock(&module_stdout_mutex);
 }
 
-void module_report_index_mark(char *mark)
+/*
+ * module_send_event reports an event to openttsd, as a 7xx text reply
+ * or as an EVENT frame, depending on the negotiated protocol.
+ */
+static void module_send_event(int code, const char *text, const char *mark)
 {
 	char *reply;
-	log_msg(OTTS_LOG_INFO, "Event: Index mark %s", mark);
-	if (mark != NULL)
-		reply = g_strdup_printf("700-%s\n700 INDEX MARK\n", mark);
-	else
+
+	if (module_protocol != OTTS_MODPROTO_VERSION) {
+		if (mark != NULL)
+			reply = g_strdup_printf("%d-%s\n%d %s\n", code, mark,
+						code, text);
+		else
+			reply = g_strdup_printf("%d %s\n", code, text);
+		module_send_asynchronous(reply);
+		g_free(reply);
 		return;
+	}
 
-	module_send_asynchronous(reply);
+	pthread_mutex_lock(&module_stdout_mutex);
+	log_msg(OTTS_LOG_DEBUG, "Sending event: %d %s", code, text);
+	if (otts_frame_write(module_out_fd, OTTS_OP_EVENT, code, 0, mark,
+			     mark != NULL ? strlen(mark) : 0) == -1)
+		log_msg(OTTS_LOG_ERR, "Can't send event %d to openttsd", code);
+	pthread_mutex_unlock(&module_stdout_mutex);
+}
 
-	g_free(reply);
+void module_report_index_mark(char *mark)
+{
+	log_msg(OTTS_LOG_INFO, "Event: Index mark %s", mark);
+	if (mark == NULL)
+		return;
+
+	module_send_event(700, "INDEX MARK", mark);
 }
 
 void module_report_event_begin(void)
 {
-	module_send_asynchronous("701 BEGIN\n");
+	module_send_event(701, "BEGIN", NULL);
+}
+
+static long module_elapsed_ms(struct timeval *from, struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000
+	    + (to->tv_usec - from->tv_usec) / 1000;
+}
+
+/*
+ * Report how the synthesis of the message compares to its audio, as a
+ * 705 event with the payload "first_audio_ms synthesis_ms audio_ms":
+ * the time from the SPEAK request to the first audio, the time it took
+ * apart from playing the audio, and the duration of the audio.  Only
+ * modules playing through opentts_audio_play() know these, and only
+ * the binary protocol carries the event.
+ */
+static void module_report_timing(void)
+{
+	AudioStats stats;
+	struct timeval now;
+	long synth_ms;
+	char *payload;
+
+	opentts_audio_take_stats(&stats);
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&module_stdout_mutex);
+	if (module_protocol == OTTS_MODPROTO_VERSION
+	    && module_timing_start.tv_sec != 0
+	    && stats.first_play.tv_sec != 0) {
+		synth_ms = module_elapsed_ms(&module_timing_start, &now)
+		    - stats.play_ms;
+		payload = g_strdup_printf("%ld %ld %ld",
+					  module_elapsed_ms
+					  (&module_timing_start,
+					   &stats.first_play),
+					  synth_ms > 0 ? synth_ms : 0,
+					  stats.audio_ms);
+		if (otts_frame_write(module_out_fd, OTTS_OP_EVENT, 705, 0,
+				     payload, strlen(payload)) == -1)
+			log_msg(OTTS_LOG_ERR,
+				"Can't send timing event to openttsd");
+		g_free(payload);
+	}
+	module_timing_start.tv_sec = 0;
+	pthread_mutex_unlock(&module_stdout_mutex);
 }
 
 void module_report_event_end(void)
 {
-	module_send_asynchronous("702 END\n");
+	/* The end of the audio is still in the resampler */
+	opentts_audio_end(module_audio_id);
+	module_report_timing();
+	module_send_event(702, "END", NULL);
 }
 
 void module_report_event_stop(void)
 {
-	module_send_asynchronous("703 STOP\n");
+	/* The audio of a stopped message says nothing about the voice */
+	pthread_mutex_lock(&module_stdout_mutex);
+	module_timing_start.tv_sec = 0;
+	pthread_mutex_unlock(&module_stdout_mutex);
+	module_send_event(703, "STOP", NULL);
 }
 
 void module_report_event_pause(void)
 {
-	module_send_asynchronous("704 PAUSE\n");
+	module_send_event(704, "PAUSE", NULL);
 }
 
 /* --- CONFIGURATION --- */
@@ -1122,11 +1292,19 @@ int module_audio_init_spd(char **status_info)
 	int i = 0;
 
 	log_msg(OTTS_LOG_NOTICE, "Openning audio output system");
+
+	/* The server moves an idle module to another audio sink by
+	   sending new audio settings, drop the previous output first */
+	if (module_audio_id != NULL) {
+		opentts_audio_close(module_audio_id);
+		module_audio_id = NULL;
+	}
+
 	if (NULL == module_audio_pars[0]) {
 		*status_info =
 		    g_strdup
 		    ("Sound output method specified in configuration not supported. "
-		     "Please choose 'oss', 'alsa', 'nas', 'libao' or 'pulse'.");
+		     "Please choose 'oss', 'alsa', 'nas', 'libao', 'pulse' or 'pulse_async'.");
 		return -1;
 	}
 
@@ -1184,9 +1362,21 @@ void init_settings_tables(void)
 void inline fatal(char *msg)
 {
 	log_msg(OTTS_LOG_CRIT, msg);
+	/* Only the forked children of a plugin get here */
+	if (module_in_process)
+		_exit(1);
 	exit(1);
 }
 
+void module_exit(int status)
+{
+	if (module_in_process) {
+		log_msg(OTTS_LOG_NOTICE, "Module closed (status %d)", status);
+		return;
+	}
+	exit(status);
+}
+
 int ensure(int v,int m1,int m2)
 {
 	if (v<m1) return m1;
@@ -45,6 +45,7 @@
 #include <sys/sem.h>
 
 #include <def.h>
+#include <modproto.h>
 #include <opentts/opentts_types.h>
 #include "opentts/opentts_synth_plugin.h"
 #include "audio.h"
@@ -57,6 +58,17 @@ extern OTTS_MsgSettings msg_settings_old;
 extern pthread_mutex_t module_stdout_mutex;
 extern int LogLevel;
 
+/* Negotiated protocol version and the sequence number of the request
+   being processed (see modproto.h) */
+extern int module_protocol;
+extern uint32_t module_request_seq;
+
+/* Descriptor replies and events go to, whether the module runs as a
+   plugin inside openttsd and the cancel descriptor (see modproto.h) */
+extern int module_out_fd;
+extern int module_in_process;
+extern int module_cancel_fd;
+
 extern configoption_t *module_dc_options;
 extern int module_num_dc_options;
 
@@ -124,7 +136,13 @@ void module_sigblockusr(sigset_t * signal_set);
 void module_sigunblockusr(sigset_t * signal_set);
 void module_signal_end(void);
 
+int module_reply(const char *reply);
+
 gchar *do_message(otts_synth_plugin_t *synth, SPDMessageType msgtype);
+gchar *do_message_data(otts_synth_plugin_t *synth, SPDMessageType msgtype,
+		       const char *data);
+gchar *do_prepare_data(otts_synth_plugin_t *synth, SPDMessageType msgtype,
+		       const char *data);
 gchar *do_speak(otts_synth_plugin_t *synth);
 gchar *do_sound_icon(otts_synth_plugin_t *synth);
 gchar *do_char(otts_synth_plugin_t *synth);
@@ -133,8 +151,11 @@ void do_stop(otts_synth_plugin_t *synth);
 void do_pause(otts_synth_plugin_t *synth);
 gchar *do_list_voices(otts_synth_plugin_t *synth);
 gchar *do_set(otts_synth_plugin_t *synth);
+gchar *do_set_data(otts_synth_plugin_t *synth, const char *data);
 gchar *do_audio(otts_synth_plugin_t *synth);
+gchar *do_audio_data(otts_synth_plugin_t *synth, const char *data);
 gchar *do_loglevel(otts_synth_plugin_t *synth);
+gchar *do_loglevel_data(otts_synth_plugin_t *synth, const char *data);
 gchar *do_debug(otts_synth_plugin_t *synth, char *cmd_buf);
 void do_quit(otts_synth_plugin_t *synth);
 
@@ -338,7 +359,7 @@ configoption_t *module_add_config_option(configoption_t * options,
 #define DECLARE_DEBUG() \
     DOTCONF_CB(LogLevel ## _cb) \
     { \
-        open_log("stderr", cmd->data.value); \
+        open_log(NULL, cmd->data.value); \
         return NULL; \
     }
 
@@ -366,6 +387,10 @@ char *module_getvoice(char *language, SPDVoiceType voice);
 /* exit on fatal error with a message */
 void fatal(char *msg);
 
+/* exit at the end of the close() of a module, returns when the module
+   runs inside openttsd */
+void module_exit(int status);
+
 /* replace for stupid asserts */
 
 int ensure(int v,int m1,int m2);
@@ -57,6 +57,7 @@ openttsd_message *copy_message(openttsd_message * old)
 	    g_strdup(old->settings.msg_settings.voice.name);
 	new->settings.client_name = g_strdup(old->settings.client_name);
 	new->settings.output_module = g_strdup(old->settings.output_module);
+	new->settings.audio_sink = g_strdup(old->settings.audio_sink);
 	new->settings.index_mark = g_strdup(old->settings.index_mark);
 
 	return new;
@@ -70,6 +71,7 @@ void mem_free_fdset(TFDSetElement * fdset)
 	g_free(fdset->msg_settings.voice.language);
 	g_free(fdset->msg_settings.voice.name);
 	g_free(fdset->output_module);
+	g_free(fdset->audio_sink);
 	g_free(fdset->index_mark);
 }
 
@@ -37,6 +37,7 @@
 #include <fdsetconv.h>
 #include <logging.h>
 #include "configuration.h"
+#include "speaking.h"
 
 static TFDSetClientSpecific *cl_spec_section;
 
@@ -170,6 +171,7 @@ void free_config_options(configoption_t * opts, int *num)
 GLOBAL_FDSET_OPTION_CB_STR(DefaultModule, output_module)
 GLOBAL_FDSET_OPTION_CB_STR(DefaultLanguage, msg_settings.voice.language)
 GLOBAL_FDSET_OPTION_CB_STR(DefaultClientName, client_name)
+GLOBAL_FDSET_OPTION_CB_STR(DefaultAudioSink, audio_sink)
 
 GLOBAL_FDSET_OPTION_CB_STR(AudioOutputMethod, audio_output_method)
 GLOBAL_FDSET_OPTION_CB_STR(AudioOSSDevice, audio_oss_device)
@@ -177,6 +179,12 @@ GLOBAL_FDSET_OPTION_CB_STR(AudioALSADevice, audio_alsa_device)
 GLOBAL_FDSET_OPTION_CB_STR(AudioNASServer, audio_nas_server)
 GLOBAL_FDSET_OPTION_CB_STR(AudioPulseServer, audio_pulse_server)
 GLOBAL_FDSET_OPTION_CB_INT(AudioPulseMinLength, audio_pulse_min_length, 1, "")
+GLOBAL_FDSET_OPTION_CB_STR(AudioResampleQuality, audio_resample_quality)
+GLOBAL_FDSET_OPTION_CB_INT(AudioPulseTargetLength, audio_pulse_target_length,
+			   val >= 0, "Pulse target length can't be negative")
+GLOBAL_FDSET_OPTION_CB_INT(AudioPulseMinRequest, audio_pulse_min_request,
+			   val >= 0, "Pulse minimum request can't be negative")
+GLOBAL_FDSET_OPTION_CB_INT(AudioALSAMmap, audio_alsa_mmap, 1, "")
 
 GLOBAL_FDSET_OPTION_CB_INT(DefaultRate, msg_settings.rate,
                            (val >= OTTS_VOICE_RATE_MIN)
@@ -201,6 +209,13 @@ GLOBAL_SET_LOGLEVEL(LogLevel, log_level, (val >= 0)
 			&& (val <= 5), "Invalid log (verbosity) level!")
 OPTION_CB_INT(MaxHistoryMessages, max_history_messages, val >= 0,
 		      "Invalid parameter!")
+OPTION_CB_INT(ModuleTimeout, module_timeout, val >= 0,
+		      "Invalid module timeout!")
+OPTION_CB_INT(ModuleInitTimeout, module_init_timeout, val >= 0,
+		      "Invalid module initialization timeout!")
+OPTION_CB_INT(LazyModuleStartup, lazy_module_startup, 1, "")
+OPTION_CB_INT(ModuleIdleTimeout, module_idle_timeout, val >= 0,
+		      "Invalid module idle timeout!")
 
 DOTCONF_CB(cb_DefaultCapLetRecognition)
 {
@@ -307,6 +322,19 @@ DOTCONF_CB(cb_LanguageDefaultModule)
 	return NULL;
 }
 
+DOTCONF_CB(cb_AudioSink)
+{
+	if (cl_spec_section)
+		FATAL("This command isn't allowed in a client specific section!");
+	if (cmd->arg_count < 2)
+		FATAL("AudioSink needs a name and an audio output method");
+
+	speaking_sink_new(cmd->data.list[0], cmd->data.list[1],
+			  cmd->arg_count > 2 ? cmd->data.list[2] : NULL);
+
+	return NULL;
+}
+
 DOTCONF_CB(cb_LogFile)
 {
 	/* This option is DEPRECATED. If it is specified, get the directory. */
@@ -332,6 +360,21 @@ DOTCONF_CB(cb_LogDir)
 	return NULL;
 }
 
+DOTCONF_CB(cb_VoiceCacheDir)
+{
+	assert(cmd->data.str != NULL);
+
+	if (!strcmp(cmd->data.str, "none")) {
+		g_free(options.voice_cache_dir);
+		options.voice_cache_dir = NULL;
+	} else if (strcmp(cmd->data.str, "default")) {
+		g_free(options.voice_cache_dir);
+		options.voice_cache_dir = g_strdup(cmd->data.str);
+	}
+
+	return NULL;
+}
+
 DOTCONF_CB(cb_CustomLogFile)
 {
 	if (cmd->data.list[0] == NULL)
@@ -353,6 +396,9 @@ DOTCONF_CB(cb_AddModule)
 	char *module_prgname;
 	char *module_cfgfile;
 	char *module_dbgfile;
+	char *instance_name;
+	int pool_size = 1;
+	int i;
 
 	OutputModule *cur_mod;
 
@@ -365,25 +411,98 @@ DOTCONF_CB(cb_AddModule)
 	module_prgname = cmd->data.list[1];
 	module_cfgfile = cmd->data.list[2];
 
-	module_dbgfile = g_strdup_printf("%s/%s.log", options.log_dir,
-					 module_name);
+	/* An optional trailing number gives the size of the pool */
+	if (cmd->arg_count > 3 && isanum(cmd->data.list[cmd->arg_count - 1])) {
+		pool_size = atoi(cmd->data.list[cmd->arg_count - 1]);
+		if (pool_size < 1)
+			FATAL("Invalid module pool size under AddModule");
+	}
+
+	for (i = 0; i < pool_size; i++) {
+		instance_name = module_instance_name(module_name, i);
+		if (i == 0)
+			module_dbgfile = g_strdup_printf("%s/%s.log",
+							 options.log_dir,
+							 module_name);
+		else
+			module_dbgfile = g_strdup_printf("%s/%s.%d.log",
+							 options.log_dir,
+							 module_name, i);
+
+		if (options.lazy_module_startup)
+			cur_mod = create_dormant_module(instance_name,
+							module_prgname,
+							module_cfgfile,
+							module_dbgfile);
+		else
+			cur_mod = start_output_module(instance_name,
+						      module_prgname,
+						      module_cfgfile,
+						      module_dbgfile);
+		g_free(module_dbgfile);
+		if (cur_mod == NULL) {
+			log_msg(OTTS_LOG_NOTICE,
+				"Couldn't load specified output module");
+			g_free(instance_name);
+			continue;
+		}
+		g_free(cur_mod->pool_name);
+		cur_mod->pool_name = g_strdup(module_name);
+		cur_mod->pool_index = i;
+		cur_mod->pool_size = pool_size;
+
+		log_msg(OTTS_LOG_DEBUG,
+			"Module name=%s being inserted into hash table",
+			cur_mod->name);
+		assert(cur_mod->name != NULL);
+		g_hash_table_insert(output_modules, instance_name, cur_mod);
+	}
+
+	g_free(module_name);
 
-	cur_mod =
-	    load_output_module(module_name, module_prgname, module_cfgfile,
-			       module_dbgfile);
+	return NULL;
+}
+
+DOTCONF_CB(cb_ModuleStandby)
+{
+	assert(cmd->data.str != NULL);
+	module_want_standby(cmd->data.str);
+	return NULL;
+}
+
+/*
+ * AddModulePlugin loads a trusted module into openttsd itself, see
+ * load_plugin_module().  Plugins have a single copy of their state,
+ * so there are no pools of them.
+ */
+DOTCONF_CB(cb_AddModulePlugin)
+{
+	char *module_name;
+	char *module_logfile;
+	OutputModule *cur_mod;
+
+	if (cmd->arg_count < 2)
+		FATAL
+		    ("AddModulePlugin needs at least the module name and the plugin");
+
+	module_name = g_strdup(cmd->data.list[0]);
+	module_logfile = g_strdup_printf("%s/%s.log", options.log_dir,
+					 module_name);
+	cur_mod = load_plugin_module(module_name, cmd->data.list[1],
+				     cmd->arg_count > 2 ?
+				     cmd->data.list[2] : NULL, module_logfile);
+	g_free(module_logfile);
 	if (cur_mod == NULL) {
 		log_msg(OTTS_LOG_NOTICE,
-			"Couldn't load specified output module");
+			"Couldn't load specified output module plugin");
+		g_free(module_name);
 		return NULL;
 	}
 
-	log_msg(OTTS_LOG_DEBUG, "Module name=%s being inserted into hash table",
+	log_msg(OTTS_LOG_DEBUG,
+		"Module name=%s being inserted into hash table",
 		cur_mod->name);
-	assert(cur_mod->name != NULL);
-	g_hash_table_insert(output_modules, g_strdup(module_name), cur_mod);
-
-	g_free(module_dbgfile);
-	g_free(module_name);
+	g_hash_table_insert(output_modules, module_name, cur_mod);
 
 	return NULL;
 }
@@ -424,6 +543,7 @@ DOTCONF_CB(cb_BeginClient)
 	SET_PAR(ssml_mode, -1);
 	SET_PAR_STR(msg_settings.voice.language)
 	SET_PAR_STR(output_module)
+	SET_PAR_STR(audio_sink)
 
 	return NULL;
 }
@@ -473,6 +593,7 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(LocalhostAccessOnly, ARG_INT);
 	ADD_CONFIG_OPTION(LogFile, ARG_STR);
 	ADD_CONFIG_OPTION(LogDir, ARG_STR);
+	ADD_CONFIG_OPTION(VoiceCacheDir, ARG_STR);
 	ADD_CONFIG_OPTION(CustomLogFile, ARG_LIST);
 	ADD_CONFIG_OPTION(LogLevel, ARG_INT);
 	ADD_CONFIG_OPTION(DefaultModule, ARG_STR);
@@ -483,6 +604,10 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(DefaultLanguage, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultPriority, ARG_STR);
 	ADD_CONFIG_OPTION(MaxHistoryMessages, ARG_INT);
+	ADD_CONFIG_OPTION(ModuleTimeout, ARG_INT);
+	ADD_CONFIG_OPTION(ModuleInitTimeout, ARG_INT);
+	ADD_CONFIG_OPTION(LazyModuleStartup, ARG_TOGGLE);
+	ADD_CONFIG_OPTION(ModuleIdleTimeout, ARG_INT);
 	ADD_CONFIG_OPTION(DefaultPunctuationMode, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultClientName, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultVoiceType, ARG_STR);
@@ -490,6 +615,8 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(DefaultCapLetRecognition, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultPauseContext, ARG_INT);
 	ADD_CONFIG_OPTION(AddModule, ARG_LIST);
+	ADD_CONFIG_OPTION(AddModulePlugin, ARG_LIST);
+	ADD_CONFIG_OPTION(ModuleStandby, ARG_STR);
 
 	ADD_CONFIG_OPTION(AudioOutputMethod, ARG_STR);
 	ADD_CONFIG_OPTION(AudioOSSDevice, ARG_STR);
@@ -497,6 +624,12 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(AudioNASServer, ARG_STR);
 	ADD_CONFIG_OPTION(AudioPulseServer, ARG_STR);
 	ADD_CONFIG_OPTION(AudioPulseMinLength, ARG_INT);
+	ADD_CONFIG_OPTION(AudioResampleQuality, ARG_STR);
+	ADD_CONFIG_OPTION(AudioPulseTargetLength, ARG_INT);
+	ADD_CONFIG_OPTION(AudioPulseMinRequest, ARG_INT);
+	ADD_CONFIG_OPTION(AudioALSAMmap, ARG_TOGGLE);
+	ADD_CONFIG_OPTION(AudioSink, ARG_LIST);
+	ADD_CONFIG_OPTION(DefaultAudioSink, ARG_STR);
 
 	ADD_CONFIG_OPTION(BeginClient, ARG_STR);
 	ADD_CONFIG_OPTION(EndClient, ARG_NONE);
@@ -517,12 +650,14 @@ void load_default_global_set_options()
 	GlobalFDSet.client_name = g_strdup("unknown:unknown:unknown");
 	GlobalFDSet.msg_settings.voice.language = g_strdup(OPENTTSD_DEFAULT_LANGUAGE);
 	GlobalFDSet.output_module = NULL;
+	GlobalFDSet.audio_sink = NULL;
 	GlobalFDSet.msg_settings.voice_type = SPD_MALE1;
 	GlobalFDSet.msg_settings.cap_let_recogn = SPD_CAP_NONE;
 	GlobalFDSet.min_delay_progress = 2000;
 	GlobalFDSet.pause_context = 0;
 	GlobalFDSet.ssml_mode = SPD_DATA_TEXT;
 	GlobalFDSet.notification = SPD_NOTHING;
+	GlobalFDSet.notification_batch = 0;
 	GlobalFDSet.log_level = options.log_level;
 
 #ifdef __SUNPRO_C
@@ -536,8 +671,16 @@ void load_default_global_set_options()
 	GlobalFDSet.audio_nas_server = g_strdup("tcp/localhost:5450");
 	GlobalFDSet.audio_pulse_server = g_strdup("default");
 	GlobalFDSet.audio_pulse_min_length = 100;
+	GlobalFDSet.audio_resample_quality = g_strdup("none");
+	GlobalFDSet.audio_pulse_target_length = 20;
+	GlobalFDSet.audio_pulse_min_request = 5;
+	GlobalFDSet.audio_alsa_mmap = 0;
 
 	options.max_history_messages = 10000;
+	options.module_timeout = 10000;
+	options.module_init_timeout = 30000;
+	options.lazy_module_startup = 0;
+	options.module_idle_timeout = 0;
 
 	/*
 	 * Do not override options that were set from the command line.
@@ -46,9 +46,12 @@ typedef struct {
 
 	char *client_name;	/* Name of the client. */
 	char *output_module;	/* Output module name. (e.g. "festival", "flite", "apollo", ...) */
+	char *audio_sink;	/* Name of the audio sink to speak on, NULL for default */
 
 	SPDNotification notification;	/* Notification about start and stop of messages, about reached
 					   index marks and state (canceled, paused, resumed). */
+	int notification_batch;	/* Window in ms for batching index mark, begin and end
+				   notifications into one write, 0 to disable */
 
 	int reparted;
 	unsigned int min_delay_progress;
@@ -61,6 +64,10 @@ typedef struct {
 	char *audio_nas_server;
 	char *audio_pulse_server;
 	int audio_pulse_min_length;
+	char *audio_resample_quality;
+	int audio_pulse_target_length;
+	int audio_pulse_min_request;
+	int audio_alsa_mmap;
 	int log_level;
 
 	/* TODO: Should be moved out */
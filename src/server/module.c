@@ -37,15 +37,24 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <gmodule.h>
+#include <spawn.h>
 
 #include <getline.h>
+#include <modproto.h>
 #include <logging.h>
 #include "openttsd.h"
 #include "output.h"
+#include "voice_cache.h"
+#include "sem_functions.h"
+#include "speaking.h"
 
 static int send_initial_commands(OutputModule * module);
 static void start_module(OutputModule * module);
 
+static pthread_mutex_t module_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t module_start_cond = PTHREAD_COND_INITIALIZER;
+
 void destroy_module(OutputModule * module)
 {
 	g_free(module->name);
@@ -53,9 +62,32 @@ void destroy_module(OutputModule * module)
 	if (module->debugfilename)
 		g_free(module->debugfilename);
 	g_free(module->configfilename);
+	g_free(module->pool_name);
+	g_free(module->audio_sink);
+	g_free(module->timing_voice);
+	g_free(module->voice_cache_key);
+	if (module->voice_index != NULL)
+		g_hash_table_destroy(module->voice_index);
+	output_free_voices(module->voices);
+	g_free(module->voices_reply);
+	g_queue_foreach(module->requests, (GFunc) g_free, NULL);
+	g_queue_free(module->requests);
+	pthread_mutex_destroy(&module->write_mutex);
+	g_queue_foreach(module->events, (GFunc) g_free, NULL);
+	g_queue_free(module->events);
+	g_hash_table_destroy(module->settings);
 	g_free(module);
 }
 
+/* Instance 0 of a pool is named after the pool, the others get
+   their number appended */
+char *module_instance_name(const char *name, int index)
+{
+	if (index == 0)
+		return g_strdup(name);
+	return g_strdup_printf("%s#%d", name, index);
+}
+
 static OutputModule *create_module(char *name, char *prog, char *cfg_file,
 				   char *dbg_file)
 {
@@ -69,38 +101,150 @@ static OutputModule *create_module(char *name, char *prog, char *cfg_file,
 	module_conf_dir = g_strdup_printf("%s/modules/", options.conf_dir);
 	module->configfilename = get_path(cfg_file, module_conf_dir);
 	g_free(module_conf_dir);
+	module->protocol = 1;
+	module->seq = 0;
+	pthread_mutex_init(&module->write_mutex, NULL);
+	module->requests = g_queue_new();
+	module->events = g_queue_new();
+	module->settings = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, g_free);
+	module->pool_name = g_strdup(name);
+	module->pool_index = 0;
+	module->pool_size = 1;
+	module->busy = 0;
+	module->talking = 0;
+	module->can_prepare = 0;
+	module->prepared_id = 0;
+	module->in_process = 0;
+	module->pid = 0;
+	module->timing_voice = NULL;
+	module->dormant = 0;
+	module->starting = 0;
+	module->refreshing = 0;
+	module->voice_cache_key = NULL;
+	module->voices = NULL;
+	module->voice_index = NULL;
+	module->voices_reply = NULL;
+	module->idle_since = time(NULL);
+	module->cancel_pipe[0] = -1;
+	module->cancel_pipe[1] = -1;
 
 	return module;
 }
 
-OutputModule *load_output_module(char *mod_name, char *mod_prog,
-				 char *mod_cfgfile, char *mod_dbgfile)
+/*
+ * A pipe of the daemon.  Both ends are closed on exec, a module gets
+ * only the ends it is given on its standard descriptors.
+ */
+static int open_module_pipe(int fds[2])
 {
-	OutputModule *module;
-	int ret, pid;
+#ifdef HAVE_PIPE2
+	/* Modules are started in parallel, leave no window for a spawn */
+	return pipe2(fds, O_CLOEXEC);
+#else
+	if (pipe(fds) != 0)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+#endif
+}
 
-	if (mod_name == NULL)
-		return NULL;
+/*
+ * The write end doesn't block, a module which doesn't read the cancel
+ * descriptor can't hold openttsd up once the pipe is full.
+ */
+static int open_cancel_pipe(OutputModule * module)
+{
+	if (open_module_pipe(module->cancel_pipe) != 0)
+		return -1;
+	fcntl(module->cancel_pipe[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
 
-	module = create_module(mod_name, mod_prog, mod_cfgfile, mod_dbgfile);
+/* The sinks stop writing to the cancel pipe before it is closed */
+static void close_cancel_pipe(OutputModule * module)
+{
+	if (module->cancel_pipe[1] < 0)
+		return;
+	speaking_forget_cancel_fd(module->cancel_pipe[1]);
+	close(module->cancel_pipe[1]);
+	module->cancel_pipe[1] = -1;
+}
+
+/*
+ * Start the module binary with posix_spawn().  The file actions put
+ * the pipes on the standard descriptors and the cancel pipe on
+ * OTTS_MODULE_CANCEL_FD; every other descriptor of the daemon is
+ * close-on-exec and doesn't reach the module.  Returns the pid of the
+ * module or -1.
+ */
+static pid_t spawn_module_process(OutputModule * module)
+{
+	posix_spawn_file_actions_t actions;
+	char *argv[3];
+	pid_t pid;
+	int ret;
+
+	argv[0] = "";
+	argv[1] = module->configfilename;
+	argv[2] = NULL;
+
+	/* dup2() onto the same descriptor leaves close-on-exec set */
+	if (module->cancel_pipe[0] == OTTS_MODULE_CANCEL_FD)
+		fcntl(module->cancel_pipe[0], F_SETFD, 0);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, module->pipe_in[0], 0);
+	posix_spawn_file_actions_adddup2(&actions, module->pipe_out[1], 1);
+	if (module->stderr_redirect >= 0)
+		posix_spawn_file_actions_adddup2(&actions,
+						 module->stderr_redirect, 2);
+	/* After stderr, the log file may be open on the descriptor */
+	if (module->cancel_pipe[0] != OTTS_MODULE_CANCEL_FD)
+		posix_spawn_file_actions_adddup2(&actions,
+						 module->cancel_pipe[0],
+						 OTTS_MODULE_CANCEL_FD);
+
+	ret = posix_spawnp(&pid, module->filename, &actions, NULL, argv,
+			   environ);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (ret != 0) {
+		log_msg(OTTS_LOG_ERR, "Can't start module %s: %s",
+			module->filename, strerror(ret));
+		return -1;
+	}
+	return pid;
+}
+
+/*
+ * Start the binary of a module which has no process.  The module
+ * still has to be initialized with send_initial_commands().  Returns
+ * -1 if the process can't be started.
+ */
+static int spawn_module(OutputModule * module)
+{
+	int ret, pid;
 
-	if (!strcmp(mod_name, "testing")) {
+	if (!strcmp(module->name, "testing")) {
 		module->pipe_in[1] = 1;	/* redirect to stdin */
 		module->pipe_out[0] = 0;	/* redirect to stdout */
-		return module;
+		return 0;
 	}
 
-	if ((pipe(module->pipe_in) != 0) || (pipe(module->pipe_out) != 0)) {
+	if ((open_module_pipe(module->pipe_in) != 0)
+	    || (open_module_pipe(module->pipe_out) != 0)
+	    || (open_cancel_pipe(module) != 0)) {
 		log_msg(OTTS_LOG_NOTICE, "Can't open pipe! Module not loaded.");
-		destroy_module(module);
-		return NULL;
+		return -1;
 	}
 
 	/* Open the file for child stderr (logging) redirection */
 	if (module->debugfilename != NULL) {
 		module->stderr_redirect = open(module->debugfilename,
-					       O_WRONLY | O_CREAT | O_TRUNC,
-					       S_IRUSR | S_IWUSR);
+					       O_WRONLY | O_CREAT | O_TRUNC |
+					       O_CLOEXEC, S_IRUSR | S_IWUSR);
 		if (module->stderr_redirect == -1)
 			log_msg(OTTS_LOG_ERR,
 				"ERROR: Openning debug file for %s failed: (error=%d) %s",
@@ -120,31 +264,57 @@ OutputModule *load_output_module(char *mod_name, char *mod_prog,
 		log_msg(OTTS_LOG_WARN,
 			"Output module is logging to standard error output (stderr)");
 
-	pid = fork();
-	if (pid == -1) {
-		printf("Can't fork, error! Module not loaded.");
-		destroy_module(module);
-		return NULL;
+	/*
+	 * A system service started as root drops its privileges in the
+	 * child before the exec, and posix_spawn() has no file action
+	 * for setuid(), so this is the one case which still forks.  It
+	 * leaks no more than the spawn does: every descriptor of the
+	 * daemon, log files included, is close-on-exec, and start_module()
+	 * only sets up the same descriptors as spawn_module_process().
+	 */
+	if (options.mode == SYSTEM && getuid() == 0) {
+		pid = fork();
+		if (pid == 0)
+			start_module(module);
+		if (pid == -1)
+			log_msg(OTTS_LOG_ERR, "Can't fork: %s", strerror(errno));
+	} else {
+		pid = spawn_module_process(module);
 	}
 
-	if (pid == 0) {
-		start_module(module);
+	if (pid == -1) {
+		log_msg(OTTS_LOG_ERR, "Module %s not loaded.", module->name);
+		close(module->pipe_in[0]);
+		close(module->pipe_in[1]);
+		close(module->pipe_out[0]);
+		close(module->pipe_out[1]);
+		close(module->cancel_pipe[0]);
+		close(module->cancel_pipe[1]);
+		if (module->stderr_redirect >= 0)
+			close(module->stderr_redirect);
+		return -1;
 	}
 
 	module->pid = pid;
 	close(module->pipe_in[0]);
 	close(module->pipe_out[1]);
+	close(module->cancel_pipe[0]);
+	if (module->stderr_redirect >= 0) {
+		close(module->stderr_redirect);
+		module->stderr_redirect = -1;
+	}
 
-	usleep(100);		/* So that the other child has at least time to fail
-				   with the execlp */
+	/* Catch a module which has already exited */
 	ret = waitpid(module->pid, NULL, WNOHANG);
 	if (ret != 0) {
 		log_msg(OTTS_LOG_WARN,
 			"ERROR: Can't load output module %s with binary %s. "
 			"Bad filename in configuration?", module->name,
 			module->filename);
-		destroy_module(module);
-		return NULL;
+		close(module->pipe_in[1]);
+		close(module->pipe_out[0]);
+		close(module->cancel_pipe[1]);
+		return -1;
 	}
 
 	module->working = 1;
@@ -160,18 +330,686 @@ OutputModule *load_output_module(char *mod_name, char *mod_prog,
 	if (ret)
 		FATAL("Can't set line buffering, setvbuf failed.");
 
+	return 0;
+}
+
+static OutputModule *spawn_output_module(char *mod_name, char *mod_prog,
+					 char *mod_cfgfile, char *mod_dbgfile)
+{
+	OutputModule *module;
+
+	if (mod_name == NULL)
+		return NULL;
+
+	module = create_module(mod_name, mod_prog, mod_cfgfile, mod_dbgfile);
+	if (spawn_module(module) != 0) {
+		destroy_module(module);
+		return NULL;
+	}
+
+	return module;
+}
+
+/*
+ * Close the ends of the pipes of a module whose process has ended and
+ * forget what the process was told, so that the module can be
+ * spawned again in place.
+ */
+static void forget_module_process(OutputModule * module)
+{
+	if (module->stream_out != NULL)
+		fclose(module->stream_out);
+	else if (module->pipe_out[0] >= 0)
+		close(module->pipe_out[0]);
+	module->stream_out = NULL;
+	module->pipe_out[0] = -1;
+	close_cancel_pipe(module);
+
+	/* STOP and PAUSE frames are written under write_mutex only */
+	pthread_mutex_lock(&module->write_mutex);
+	if (module->pipe_in[1] >= 0)
+		close(module->pipe_in[1]);
+	module->pipe_in[1] = -1;
+	module->seq = 0;
+	g_queue_foreach(module->requests, (GFunc) g_free, NULL);
+	g_queue_clear(module->requests);
+	module->prepared_id = 0;
+	pthread_mutex_unlock(&module->write_mutex);
+
+	module->pid = 0;
+	module->protocol = 1;
+	g_queue_foreach(module->events, (GFunc) g_free, NULL);
+	g_queue_clear(module->events);
+	g_hash_table_remove_all(module->settings);
+	g_free(module->audio_sink);
+	module->audio_sink = NULL;
+	module->can_prepare = 0;
+	module->busy = 0;
+}
+
+/*
+ * Get rid of the process of a module which failed to initialize.  The
+ * module is marked as not working by the caller, see module_started().
+ */
+static void kill_output_module(OutputModule * module)
+{
+	pid_t pid = module->pid;
+
+	kill(pid, SIGKILL);
+	forget_module_process(module);
+	waitpid_with_timeout(pid, NULL, 0, 1000);
+}
+
+OutputModule *load_output_module(char *mod_name, char *mod_prog,
+				 char *mod_cfgfile, char *mod_dbgfile)
+{
+	OutputModule *module;
+
+	module = spawn_output_module(mod_name, mod_prog, mod_cfgfile,
+				     mod_dbgfile);
+	if (module == NULL || !strcmp(mod_name, "testing"))
+		return module;
+
 	if (0 != send_initial_commands(module)) {
+		kill_output_module(module);
+		destroy_module(module);
+		return NULL;
+	}
+
+	return module;
+}
+
+/*
+ * The module started in the background is initialized, or it failed
+ * to.  Whoever sees it started also sees whether it works.  The speak
+ * threads postponed the messages for the module while it was
+ * starting, they are woken up to try again.
+ */
+static void module_started(OutputModule * module, int failed)
+{
+	pthread_mutex_lock(&module_start_mutex);
+	if (failed)
 		module->working = 0;
-		kill(module->pid, SIGKILL);
+	module->starting = 0;
+	pthread_cond_broadcast(&module_start_cond);
+	pthread_mutex_unlock(&module_start_mutex);
+
+	speaking_semaphore_post();
+}
+
+static void *module_init_thread(void *data)
+{
+	OutputModule *module = data;
+	int failed = 0;
+
+	/* A dormant module being woken up has no process yet */
+	if (module->pid == 0 && spawn_module(module) != 0) {
+		log_msg(OTTS_LOG_ERR, "ERROR: Can't start output module %s",
+			module->name);
+		failed = 1;
+	} else if (send_initial_commands(module) != 0) {
+		log_msg(OTTS_LOG_ERR, "ERROR: Output module %s failed to start",
+			module->name);
+		kill_output_module(module);
+		failed = 1;
+	}
+	module_started(module, failed);
+
+	return NULL;
+}
+
+/*
+ * Start a module and initialize it on a thread of its own, so that
+ * the modules start at the same time and openttsd doesn't wait for
+ * the slowest of them to accept clients.  Until it is initialized,
+ * the module is marked as starting, see wait_for_output_module().  A
+ * module which fails to initialize is left registered as not
+ * working, the same as a module which crashed.
+ */
+OutputModule *start_output_module(char *mod_name, char *mod_prog,
+				  char *mod_cfgfile, char *mod_dbgfile)
+{
+	OutputModule *module;
+	pthread_t thread;
+
+	module = spawn_output_module(mod_name, mod_prog, mod_cfgfile,
+				     mod_dbgfile);
+	if (module == NULL || !strcmp(mod_name, "testing"))
+		return module;
+
+	module->starting = 1;
+	if (pthread_create(&thread, NULL, module_init_thread, module) != 0) {
+		log_msg(OTTS_LOG_WARN,
+			"Can't create a thread to start module %s, starting it now",
+			module->name);
+		module->starting = 0;
+		if (0 != send_initial_commands(module)) {
+			kill_output_module(module);
+			destroy_module(module);
+			return NULL;
+		}
+		return module;
+	}
+	pthread_detach(thread);
+
+	return module;
+}
+
+/*
+ * Wait until a module started by start_output_module() is initialized.
+ * The refresh of its voice list isn't waited for, the cached list is
+ * good to use meanwhile.  Don't wait with the output layer locked,
+ * it would hold up all the other modules.
+ */
+void wait_for_output_module(OutputModule * module)
+{
+	pthread_mutex_lock(&module_start_mutex);
+	while (module->starting)
+		pthread_cond_wait(&module_start_cond, &module_start_mutex);
+	pthread_mutex_unlock(&module_start_mutex);
+}
+
+/*
+ * Wait until no thread of the module's startup uses it any more, so
+ * that it can be freed.  The voice list refresh takes the output
+ * layer lock, this must not be called with the lock held.
+ */
+static void wait_for_module_threads(OutputModule * module)
+{
+	pthread_mutex_lock(&module_start_mutex);
+	while (module->starting || module->refreshing)
+		pthread_cond_wait(&module_start_cond, &module_start_mutex);
+	pthread_mutex_unlock(&module_start_mutex);
+}
+
+/* The instance of a pool taking the place of another one */
+static void copy_pool(OutputModule * to, OutputModule * from)
+{
+	g_free(to->pool_name);
+	to->pool_name = g_strdup(from->pool_name);
+	to->pool_index = from->pool_index;
+	to->pool_size = from->pool_size;
+}
+
+/*
+ * Warm standby modules.  For the pools named by ModuleStandby, a spare
+ * module is started and initialized in the background.  When an
+ * instance of the pool fails, the spare takes its place right away
+ * instead of a new module being started, and another spare is started
+ * in the background.
+ */
+static pthread_mutex_t standby_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *standby_pools;	/* Pool name to its spare, NULL
+					   while there is none ready */
+static GList *retired_modules;	/* Failed modules a spare replaced,
+				   see reap_retired_modules() */
+
+typedef struct {
+	char *pool_name;
+	char *filename;
+	char *configfilename;
+	char *debugfilename;
+} standby_args_t;
+
+static void *standby_thread(void *data)
+{
+	standby_args_t *args = data;
+	OutputModule *module;
+	gpointer spare;
+	int ret = -1;
+
+	module = spawn_output_module(args->pool_name, args->filename,
+				     args->configfilename, args->debugfilename);
+	/* Nobody else knows the spare yet, it doesn't need the starting
+	   flag */
+	if (module != NULL)
+		ret = send_initial_commands(module);
+	if (ret != 0) {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Standby for output module %s failed to start",
+			args->pool_name);
+		if (module != NULL) {
+			kill_output_module(module);
+			destroy_module(module);
+		}
+		module = NULL;
+	}
+
+	if (module != NULL) {
+		pthread_mutex_lock(&standby_mutex);
+		if (standby_pools != NULL
+		    && g_hash_table_lookup_extended(standby_pools,
+						    args->pool_name, NULL,
+						    &spare) && spare == NULL) {
+			g_hash_table_insert(standby_pools,
+					    g_strdup(args->pool_name), module);
+			log_msg(OTTS_LOG_NOTICE,
+				"Standby for output module %s is ready",
+				args->pool_name);
+			module = NULL;
+		}
+		pthread_mutex_unlock(&standby_mutex);
+		/* The configuration changed meanwhile */
+		if (module != NULL)
+			unload_output_module(module);
+	}
+
+	g_free(args->pool_name);
+	g_free(args->filename);
+	g_free(args->configfilename);
+	g_free(args->debugfilename);
+	g_free(args);
+
+	return NULL;
+}
+
+/* Start a spare for the pool of module in the background */
+static void spawn_standby(OutputModule * module)
+{
+	standby_args_t *args;
+	pthread_t thread;
+
+	args = g_malloc(sizeof(standby_args_t));
+	args->pool_name = g_strdup(module->pool_name);
+	args->filename = g_strdup(module->filename);
+	args->configfilename = g_strdup(module->configfilename);
+	/* The spare doesn't truncate the log of the running module.  It
+	   takes over the name of the log of the module it replaces, see
+	   swap_in_standby(). */
+	args->debugfilename = module->debugfilename != NULL ?
+	    g_strdup_printf("%s/%s.standby.log", options.log_dir,
+			    module->pool_name) : NULL;
+
+	if (pthread_create(&thread, NULL, standby_thread, args) != 0) {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Can't start a standby for output module %s",
+			module->pool_name);
+		g_free(args->pool_name);
+		g_free(args->filename);
+		g_free(args->configfilename);
+		g_free(args->debugfilename);
+		g_free(args);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/* Keep a spare for the module pool name, see start_standby_modules() */
+void module_want_standby(const char *name)
+{
+	pthread_mutex_lock(&standby_mutex);
+	if (standby_pools == NULL)
+		standby_pools = g_hash_table_new_full(g_str_hash, g_str_equal,
+						      g_free, NULL);
+	if (!g_hash_table_lookup_extended(standby_pools, name, NULL, NULL))
+		g_hash_table_insert(standby_pools, g_strdup(name), NULL);
+	pthread_mutex_unlock(&standby_mutex);
+}
+
+/* Start the spares of the pools asked for in the configuration */
+void start_standby_modules(void)
+{
+	GList *gl, *l;
+	OutputModule *module;
+	gboolean wanted;
+
+	gl = g_hash_table_get_values(output_modules);
+	for (l = gl; l != NULL; l = l->next) {
+		module = l->data;
+		if (module->pool_index != 0 || module->in_process)
+			continue;
+		pthread_mutex_lock(&standby_mutex);
+		wanted = standby_pools != NULL
+		    && g_hash_table_lookup_extended(standby_pools,
+						    module->pool_name, NULL,
+						    NULL);
+		pthread_mutex_unlock(&standby_mutex);
+		if (wanted)
+			spawn_standby(module);
+	}
+	g_list_free(gl);
+}
+
+/*
+ * Put the spare of the pool of a failed module in its place in
+ * output_modules.  Returns the spare, or NULL if there is none ready.
+ * The failed module is killed and retired, the speaking threads may
+ * still refer to it.  Called with the output layer locked.
+ */
+OutputModule *swap_in_standby(OutputModule * failed)
+{
+	OutputModule *spare = NULL;
+	char *old_log;
+
+	if (failed->in_process)
+		return NULL;
+
+	pthread_mutex_lock(&standby_mutex);
+	if (standby_pools != NULL)
+		spare = g_hash_table_lookup(standby_pools, failed->pool_name);
+	if (spare != NULL)
+		g_hash_table_insert(standby_pools,
+				    g_strdup(failed->pool_name), NULL);
+	pthread_mutex_unlock(&standby_mutex);
+	if (spare == NULL)
+		return NULL;
+
+	log_msg(OTTS_LOG_NOTICE,
+		"Replacing the failed output module %s by its standby",
+		failed->name);
+	g_free(spare->name);
+	spare->name = g_strdup(failed->name);
+	copy_pool(spare, failed);
+	g_hash_table_replace(output_modules, spare->name, spare);
+	output_count_module_restart(spare->name);
+
+	/* The spare logs under the name of the module it replaces, the
+	   log of the failed module is kept beside it */
+	if (spare->debugfilename != NULL && failed->debugfilename != NULL) {
+		old_log = g_strdup_printf("%s.old", failed->debugfilename);
+		rename(failed->debugfilename, old_log);
+		rename(spare->debugfilename, failed->debugfilename);
+		g_free(old_log);
+		g_free(spare->debugfilename);
+		spare->debugfilename = g_strdup(failed->debugfilename);
+	}
+
+	kill(failed->pid, SIGKILL);
+	pthread_mutex_lock(&standby_mutex);
+	retired_modules = g_list_prepend(retired_modules, failed);
+	pthread_mutex_unlock(&standby_mutex);
+
+	spawn_standby(spare);
+
+	return spare;
+}
+
+static void destroy_retired_module(OutputModule * module)
+{
+	if (module->pid != 0)
 		waitpid(module->pid, NULL, WNOHANG);
+	forget_module_process(module);
+	destroy_module(module);
+}
+
+/*
+ * Reap the processes of the failed modules spares took the place of.
+ * The modules themselves, with their pipes, are kept until openttsd
+ * exits.  A speaking thread or the STOP and CANCEL paths may still
+ * hold a pointer to one outside of any lock, so there is no point at
+ * which freeing it would be known to be safe.  A module is only left
+ * behind when it fails, so there are few of them.  Called with the
+ * output layer locked, regularly from output_idle_reaper().
+ */
+void reap_retired_modules(void)
+{
+	OutputModule *module;
+	GList *gl;
+
+	pthread_mutex_lock(&standby_mutex);
+	for (gl = retired_modules; gl != NULL; gl = gl->next) {
+		module = gl->data;
+		/* The process may already be reaped by waitpid(-1) */
+		if (module->pid != 0 && waitpid(module->pid, NULL, WNOHANG) != 0)
+			module->pid = 0;
+	}
+	pthread_mutex_unlock(&standby_mutex);
+}
+
+/*
+ * Free all the failed modules spares took the place of.  Only called
+ * with the speaking threads stopped.
+ */
+void destroy_retired_modules(void)
+{
+	GList *gl;
+
+	pthread_mutex_lock(&standby_mutex);
+	gl = retired_modules;
+	retired_modules = NULL;
+	pthread_mutex_unlock(&standby_mutex);
+
+	g_list_foreach(gl, (GFunc) destroy_retired_module, NULL);
+	g_list_free(gl);
+}
+
+static void unload_standby(gpointer key, gpointer value, gpointer user)
+{
+	if (value != NULL)
+		unload_output_module(value);
+}
+
+/* Stop all spares and forget which pools have one */
+void standby_modules_terminate(void)
+{
+	GHashTable *pools;
+
+	pthread_mutex_lock(&standby_mutex);
+	pools = standby_pools;
+	standby_pools = NULL;
+	pthread_mutex_unlock(&standby_mutex);
+
+	if (pools != NULL) {
+		g_hash_table_foreach(pools, unload_standby, NULL);
+		g_hash_table_destroy(pools);
+	}
+	destroy_retired_modules();
+}
+
+/*
+ * A dormant module is registered under its name without running.
+ * It is started by start_dormant_module() on the first request for
+ * it, see LazyModuleStartup and ModuleIdleTimeout.
+ */
+OutputModule *create_dormant_module(char *mod_name, char *mod_prog,
+				    char *mod_cfgfile, char *mod_dbgfile)
+{
+	OutputModule *module;
+
+	if (mod_name == NULL)
+		return NULL;
+
+	module = create_module(mod_name, mod_prog, mod_cfgfile, mod_dbgfile);
+	module->dormant = 1;
+	module->working = 0;
+	module->pipe_in[1] = -1;
+	module->pipe_out[0] = -1;
+	module->stream_out = NULL;
+
+	return module;
+}
+
+/*
+ * Wake a dormant module up.  It is spawned and initialized in place on
+ * a thread of its own, the same way start_output_module() does it, so
+ * the caller doesn't wait for the process with the global locks held.
+ * The module is marked as starting meanwhile, see module_started().
+ * Called with the output layer locked.  Returns -1 if the thread
+ * can't be created, the module stays dormant then.
+ */
+int start_dormant_module(OutputModule * module)
+{
+	pthread_t thread;
+
+	assert(module->dormant);
+
+	log_msg(OTTS_LOG_NOTICE, "Starting output module %s on demand",
+		module->name);
+	module->dormant = 0;
+	module->working = 1;
+	module->starting = 1;
+	if (pthread_create(&thread, NULL, module_init_thread, module) != 0) {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Can't create a thread to start module %s",
+			module->name);
+		module->starting = 0;
+		module->working = 0;
+		module->dormant = 1;
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * Stop a module which hasn't been used for a while.  It stays
+ * registered, dormant, in the same place: the speak threads, the
+ * pool and the client lookups may still hold it.  Called with the
+ * output layer locked.
+ */
+int stop_idle_module(OutputModule * module)
+{
+	assert(!module->in_process);
+
+	output_close(module);
+	forget_module_process(module);
+	module->working = 0;
+	module->dormant = 1;
+
+	return 0;
+}
+
+typedef struct {
+	otts_module_plugin_main_t plugin_main;
+	int in_fd;
+	int out_fd;
+	int cancel_fd;
+	char *configfilename;
+	char *logfilename;
+} plugin_thread_args_t;
+
+static void *plugin_module_thread(void *data)
+{
+	plugin_thread_args_t *args = data;
+
+	args->plugin_main(args->in_fd, args->out_fd, args->cancel_fd,
+			  args->configfilename, args->logfilename);
+
+	/* openttsd sees the end of file from now on */
+	close(args->in_fd);
+	close(args->out_fd);
+	close(args->cancel_fd);
+	g_free(args->configfilename);
+	g_free(args->logfilename);
+	g_free(args);
+
+	return NULL;
+}
+
+/*
+ * Load an output module built as a plugin and run it on a thread of
+ * its own.  It still talks the binary protocol over a pair of pipes
+ * rather than being called directly: the requests queued on the
+ * module, the replies and the events it sends back and the cancel
+ * descriptor are then handled by the same code as for a module
+ * process.  What is saved is the process switch and the copy through
+ * the kernel scheduler, not the pipe itself.  The plugin writes its
+ * own log to mod_logfile and stays loaded until openttsd exits.
+ *
+ * Nothing watches over a plugin.  Its thread can't be killed, so a
+ * plugin which hangs only gets marked as not working once its
+ * requests time out, and it stays out of use until openttsd is
+ * restarted.  Use AddModule for synthesizers which aren't trusted to
+ * behave.
+ */
+OutputModule *load_plugin_module(char *mod_name, char *mod_plugin,
+				 char *mod_cfgfile, char *mod_logfile)
+{
+	OutputModule *module;
+	GModule *plugin;
+	gpointer plugin_main;
+	plugin_thread_args_t *args;
+	pthread_t thread;
+	int ret;
+
+	if (mod_name == NULL)
+		return NULL;
+
+	module = create_module(mod_name, mod_plugin, mod_cfgfile, mod_logfile);
+	module->in_process = 1;
+	module->stream_out = NULL;
+	module->stderr_redirect = -1;
+
+	log_msg(OTTS_LOG_WARN,
+		"Initializing output module %s with plugin %s and configuration %s",
+		module->name, module->filename, module->configfilename);
+
+	plugin = g_module_open(module->filename, G_MODULE_BIND_LOCAL);
+	if (plugin == NULL) {
+		log_msg(OTTS_LOG_ERR, "ERROR: Can't load output module %s: %s",
+			module->name, g_module_error());
+		destroy_module(module);
+		return NULL;
+	}
+	if (!g_module_symbol(plugin, OTTS_MODULE_PLUGIN_MAIN_STR,
+			     &plugin_main)) {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: %s is not an output module plugin: %s",
+			module->filename, g_module_error());
+		g_module_close(plugin);
+		destroy_module(module);
+		return NULL;
+	}
+	/* Threads of the module may outlive the module thread */
+	g_module_make_resident(plugin);
+
+	if ((open_module_pipe(module->pipe_in) != 0)
+	    || (open_module_pipe(module->pipe_out) != 0)
+	    || (open_cancel_pipe(module) != 0)) {
+		log_msg(OTTS_LOG_NOTICE, "Can't open pipe! Module not loaded.");
+		destroy_module(module);
+		return NULL;
+	}
+
+	args = g_malloc(sizeof(plugin_thread_args_t));
+	args->plugin_main = (otts_module_plugin_main_t) plugin_main;
+	args->in_fd = module->pipe_in[0];
+	args->out_fd = module->pipe_out[1];
+	args->cancel_fd = module->cancel_pipe[0];
+	args->configfilename = g_strdup(module->configfilename);
+	args->logfilename = g_strdup(module->debugfilename);
+
+	ret = pthread_create(&thread, NULL, plugin_module_thread, args);
+	if (ret != 0) {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Can't create thread for output module %s",
+			module->name);
+		close(module->pipe_in[0]);
+		close(module->pipe_in[1]);
+		close(module->pipe_out[0]);
+		close(module->pipe_out[1]);
+		close(module->cancel_pipe[0]);
+		close(module->cancel_pipe[1]);
+		g_free(args->configfilename);
+		g_free(args->logfilename);
+		g_free(args);
+		destroy_module(module);
+		return NULL;
+	}
+	pthread_detach(thread);
+
+	module->working = 1;
+	if (0 != send_initial_commands(module)) {
+		module->working = 0;
+		/* The module thread ends on the end of file */
+		close(module->pipe_in[1]);
+		close(module->pipe_out[0]);
+		close(module->cancel_pipe[1]);
 		destroy_module(module);
 		return NULL;
 	}
 
+	log_msg(OTTS_LOG_WARN, "Module %s loaded in-process.", module->name);
+
 	return module;
 }
 
-int send_initial_commands(OutputModule * module)
+/*
+ * Initialize a module running as a process of its own with the text
+ * protocol and switch it to the binary protocol if it supports it.
+ */
+static int init_module_process(OutputModule * module)
 {
 	FILE *f;
 	size_t n = 0;
@@ -188,8 +1026,19 @@ int send_initial_commands(OutputModule * module)
 	}
 
 	reply = g_string_new("\n---------------\n");
-	f = fdopen(dup(module->pipe_out[0]), "r");
+	f = fdopen(fcntl(module->pipe_out[0], F_DUPFD_CLOEXEC, 0), "r");
+	/* Unbuffered, so that polling the descriptor tells the truth */
+	setvbuf(f, NULL, _IONBF, 0);
 	while (1) {
+		if (output_poll_module(module, options.module_init_timeout)
+		    != 1) {
+			log_msg(OTTS_LOG_ERR,
+				"ERROR: Output module %s didn't initialize in time",
+				module->name);
+			fclose(f);
+			g_string_free(reply, 1);
+			return -1;
+		}
 		ret = otts_getline(&rep_line, &n, f);
 		if (ret <= 0) {
 			log_msg(OTTS_LOG_ERR,
@@ -233,6 +1082,55 @@ int send_initial_commands(OutputModule * module)
 		return -1;
 	}
 	g_string_free(reply, 1);
+	fclose(f);
+
+	/* Switch to the binary protocol if the module supports it */
+	output_negotiate_protocol(module);
+
+	return 0;
+}
+
+static void *voices_refresh_thread(void *data)
+{
+	OutputModule *module = data;
+
+	output_refresh_voices(module);
+
+	pthread_mutex_lock(&module_start_mutex);
+	module->refreshing = 0;
+	pthread_cond_broadcast(&module_start_cond);
+	pthread_mutex_unlock(&module_start_mutex);
+
+	return NULL;
+}
+
+/* Read the voice list of a module again once it has started */
+static void refresh_voices(OutputModule * module)
+{
+	pthread_t thread;
+
+	module->refreshing = 1;
+	if (pthread_create(&thread, NULL, voices_refresh_thread, module) != 0) {
+		log_msg(OTTS_LOG_WARN,
+			"Can't refresh the voices of %s, using the cached ones",
+			module->name);
+		module->refreshing = 0;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+int send_initial_commands(OutputModule * module)
+{
+	SPDVoice **voices;
+	int ret;
+
+	if (module->in_process)
+		ret = output_plugin_initialized(module);
+	else
+		ret = init_module_process(module);
+	if (ret != 0)
+		return -1;
 
 	if (options.debug) {
 		log_msg(OTTS_LOG_INFO,
@@ -257,9 +1155,15 @@ int send_initial_commands(OutputModule * module)
 		return -1;
 	}
 
-	/* Get a list of supported voices */
-	_output_get_voices(module);
-	fclose(f);
+	/* Get a list of supported voices, the cached one is checked
+	   against the module in the background */
+	voices = voice_cache_load(module);
+	if (voices != NULL) {
+		output_set_voices(module, voices);
+		refresh_voices(module);
+	}
+	else if (_output_get_voices(module) == 0)
+		voice_cache_store(module);
 	return 0;
 }
 
@@ -293,6 +1197,15 @@ static void start_module(OutputModule * module)
 		ret = dup2(module->stderr_redirect, 2);
 	}
 
+	/* After stderr, the log file may be open on the descriptor */
+	close(module->cancel_pipe[1]);
+	if (module->cancel_pipe[0] != OTTS_MODULE_CANCEL_FD) {
+		ret = dup2(module->cancel_pipe[0], OTTS_MODULE_CANCEL_FD);
+		close(module->cancel_pipe[0]);
+	} else {
+		fcntl(OTTS_MODULE_CANCEL_FD, F_SETFD, 0);
+	}
+
 	if (module->configfilename) {
 		execlp(module->filename, "", module->configfilename, (char *)0);
 	} else {
@@ -309,45 +1222,80 @@ int unload_output_module(OutputModule * module)
 
 	log_msg(OTTS_LOG_NOTICE, "Unloading module name=%s", module->name);
 
+	wait_for_module_threads(module);
+
 	output_close(module);
 
+	pthread_mutex_lock(&module->write_mutex);
 	close(module->pipe_in[1]);
+	module->pipe_in[1] = -1;
+	pthread_mutex_unlock(&module->write_mutex);
 	close(module->pipe_out[0]);
+	close_cancel_pipe(module);
 
 	destroy_module(module);
 
 	return 0;
 }
 
+/*
+ * Restart a module which stopped working.  It is swapped for its
+ * standby if it has one, otherwise its process is spawned again in
+ * place.  Runs in the signal handling thread with the speak threads
+ * stopped.
+ */
 int reload_output_module(OutputModule * old_module)
 {
-	OutputModule *new_module;
+	OutputModule *spare;
+	int failed = 0;
 
 	assert(old_module != NULL);
 	assert(old_module->name != NULL);
 
-	if (old_module->working)
+	/* A dormant module is started when it is needed */
+	if (old_module->working || old_module->dormant)
+		return 0;
+
+	if (old_module->in_process) {
+		/* The thread of a hung plugin can't be stopped and the
+		   plugin has only one instance of its state */
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Output module %s runs in-process, it can't be restarted",
+			old_module->name);
+		return -1;
+	}
+
+	wait_for_module_threads(old_module);
+
+	/* The module table only changes under the output layer lock */
+	pthread_mutex_lock(&output_layer_mutex);
+	spare = swap_in_standby(old_module);
+	if (spare == NULL)
+		old_module->starting = 1;
+	pthread_mutex_unlock(&output_layer_mutex);
+	if (spare != NULL)
 		return 0;
 
 	log_msg(OTTS_LOG_NOTICE, "Reloading output module %s",
 		old_module->name);
 
 	output_close(old_module);
-	close(old_module->pipe_in[1]);
-	close(old_module->pipe_out[0]);
+	forget_module_process(old_module);
 
-	new_module = load_output_module(old_module->name, old_module->filename,
-					old_module->configfilename,
-					old_module->debugfilename);
-	if (new_module == NULL) {
+	if (spawn_module(old_module) != 0) {
+		failed = 1;
+	} else if (send_initial_commands(old_module) != 0) {
+		kill_output_module(old_module);
+		failed = 1;
+	}
+	module_started(old_module, failed);
+	if (failed) {
 		log_msg(OTTS_LOG_NOTICE,
 			"Can't load module %s while reloading modules.",
 			old_module->name);
 		return -1;
 	}
-
-	g_hash_table_replace(output_modules, new_module->name, new_module);
-	destroy_module(old_module);
+	output_count_module_restart(old_module->name);
 
 	return 0;
 }
@@ -26,7 +26,12 @@
 #define MODULE_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <glib.h>
 
 #include "opentts/opentts_types.h"
 
@@ -37,19 +42,67 @@ typedef struct {
 	char *debugfilename;
 	int pipe_in[2];
 	int pipe_out[2];
+	int cancel_pipe[2];	/* Out-of-band stop requests, see modproto.h */
 	FILE *stream_out;
 	int stderr_redirect;
 	pid_t pid;
 	int working;
 	SPDVoice **voices;
+	GHashTable *voice_index;	/* Lower case name to entry of voices */
+	char *voices_reply;	/* voices as a LIST SYNTHESIS_VOICES reply */
+	int protocol;		/* Negotiated protocol version, see modproto.h */
+	uint32_t seq;		/* Sequence number of the last request sent */
+	pthread_mutex_t write_mutex;	/* Serializes frames written to pipe_in */
+	GQueue *requests;	/* Requests still waiting for their reply */
+	GQueue *events;		/* Events read while waiting for a reply */
+	GHashTable *settings;	/* Last settings the module acknowledged */
+	char *pool_name;	/* Name of the pool, the name of instance 0 */
+	int pool_index;		/* Instance number within the pool */
+	int pool_size;		/* Number of instances in the pool */
+	int busy;		/* Speaking a message */
+	int talking;		/* output_speak() waits for a reply with
+				   the output layer unlocked */
+	struct timeval busy_since;
+	char *audio_sink;	/* Sink the audio output is set up for, NULL
+				   for the global audio settings */
+	int can_prepare;	/* The module accepts PREPARE frames */
+	guint prepared_id;	/* Id of the message sent with PREPARE last,
+				   under write_mutex */
+	int in_process;		/* Plugin running on a thread of openttsd,
+				   pid is 0 then */
+	char *timing_voice;	/* Voice of the message being spoken, for
+				   the timing statistics */
+	int dormant;		/* Registered but not running, started on
+				   the first request for it */
+	time_t idle_since;	/* When the module last finished speaking */
+	int starting;		/* Being initialized in the background */
+	int refreshing;		/* Voice list being read in the background */
+	char *voice_cache_key;	/* Binary and configuration the module was
+				   started with, see voice_cache.c */
 } OutputModule;
 
 OutputModule *load_output_module(char *mod_name, char *mod_prog,
 				 char *mod_cfgfile, char *mod_dbgfile);
+OutputModule *load_plugin_module(char *mod_name, char *mod_plugin,
+				 char *mod_cfgfile, char *mod_logfile);
+OutputModule *start_output_module(char *mod_name, char *mod_prog,
+				  char *mod_cfgfile, char *mod_dbgfile);
+void wait_for_output_module(OutputModule * module);
+OutputModule *create_dormant_module(char *mod_name, char *mod_prog,
+				    char *mod_cfgfile, char *mod_dbgfile);
+int start_dormant_module(OutputModule * module);
+int stop_idle_module(OutputModule * module);
 int unload_output_module(OutputModule * module);
 int reload_output_module(OutputModule * old_module);
 int output_module_debug(OutputModule * module);
 int output_module_nodebug(OutputModule * module);
 void destroy_module(OutputModule * module);
+char *module_instance_name(const char *name, int index);
+void module_want_standby(const char *name);
+void start_standby_modules(void);
+OutputModule *swap_in_standby(OutputModule * failed);
+void reap_retired_modules(void);
+void destroy_retired_modules(void);
+void standby_modules_terminate(void);
 
 #endif
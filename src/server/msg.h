@@ -37,6 +37,7 @@
 #define OK_PAUSED				"211 OK PAUSED\r\n"
 #define OK_RESUMED				"212 OK RESUMED\r\n"
 #define OK_CANCELED				"213 OK CANCELED\r\n"
+#define OK_AUDIO_SINK_SET			"214 OK AUDIO SINK SET\r\n"
 #define OK_TABLE_SET                            "215 OK TABLE SET\r\n"
 #define OK_OUTPUT_MODULE_SET                    "216 OK OUTPUT MODULE SET\r\n"
 #define OK_PAUSE_CONTEXT_SET                    "217 OK PAUSE CONTEXT SET\r\n"
@@ -79,6 +80,10 @@
 #define C_OK_MODULES                            "250"
 #define OK_GET                                  "251 OK GET RETURNED\r\n"
 #define C_OK_GET                                "251"
+#define OK_MODULE_STATS_SENT                    "252 OK MODULE STATISTICS SENT\r\n"
+#define C_OK_MODULE_STATS                       "252"
+#define OK_MODULE_TIMING_SENT                   "253 OK MODULE TIMING SENT\r\n"
+#define C_OK_MODULE_TIMING                      "253"
 
 #define OK_INSIDE_BLOCK                         "260 OK INSIDE BLOCK\r\n"
 #define OK_OUTSIDE_BLOCK                        "261 OK OUTSIDE BLOCK\r\n"
@@ -119,6 +124,7 @@
 #define ERR_COULDNT_SET_SSML_MODE               "315 ERR COULDNT SET SSML MODE\r\n"
 #define ERR_COULDNT_SET_NOTIFICATION            "316 ERR COULDNT SET NOTIFICATION\r\n"
 #define ERR_COULDNT_SET_DEBUGGING               "317 ERR COULDNT SET DEBUGGING\r\n"
+#define ERR_COULDNT_SET_AUDIO_SINK              "318 ERR COULDNT SET AUDIO SINK\r\n"
 
 #define ERR_NO_SND_ICONS                        "320 ERR NO SOUND ICONS\r\n"
 #define ERR_CANT_REPORT_VOICES                  "321 ERR MODULE CANT REPORT VOICES\r\n"
@@ -59,6 +59,7 @@
 #include "sighandler.h"
 #include "speaking.h"
 #include "set.h"
+#include "output.h"
 #include "options.h"
 #include "server.h"
 #include "openttsd.h"
@@ -82,16 +83,19 @@ void destroy_pid_file();
 int server_socket;
 
 /* Pipes for inter-thread communication. */
-int speaking_pipe[2];
 static int server_pipe[2];
 
 /* For additional synchronization amongst our three threads. */
 pthread_mutex_t thread_controller;
 
-/* Thread identifiers for our two threads. */
-pthread_t speak_thread;
+/* Thread identifier of the signal handler, the speak threads
+   are kept with their sinks. */
 pthread_t sighandler_thread;
 
+/* Thread stopping the modules which are idle for ModuleIdleTimeout
+   and freeing the failed modules a standby replaced */
+static pthread_t idle_reaper_thread;
+
 /* This is set when the speaking thread is started. */
 gboolean speak_thread_started = FALSE;
 
@@ -218,6 +222,8 @@ int connection_new(int server_socket)
 			"Error: Can't handle connection request of a new client");
 		return -1;
 	}
+	/* Don't let the output modules inherit the connection */
+	fcntl(client_socket, F_SETFD, FD_CLOEXEC);
 
 	/* We add the associated client_socket to the descriptor set. */
 	FD_SET(client_socket, &readfds);
@@ -286,6 +292,11 @@ int connection_destroy(int fd)
 	log_msg(OTTS_LOG_INFO, "Removing client from the fd->uid table.");
 	g_hash_table_remove(fd_uid, &fd);
 
+	/* Don't deliver pending events to a client reusing this fd */
+	report_batch_discard(fd);
+	if (fdset_element != NULL)
+		output_forget_client(fdset_element->uid);
+
 	log_msg(OTTS_LOG_INFO, "Closing clients file descriptor %d", fd);
 
 	if (close(fd) != 0)
@@ -364,6 +375,9 @@ void module_debug(gpointer key, gpointer value, gpointer user)
 		return;
 	}
 
+	/* A starting module picks options.debug up itself */
+	if (module->starting)
+		return;
 	output_module_debug(module);
 
 	return;
@@ -379,22 +393,51 @@ void module_nodebug(gpointer key, gpointer value, gpointer user)
 		return;
 	}
 
+	if (module->starting)
+		return;
 	output_module_nodebug(module);
 
 	return;
 }
 
+/*
+ * Call func for each module with the output layer locked.  A module
+ * output_speak() is talking to with the output layer unlocked is
+ * waited for, its replies mustn't be read by anyone else.
+ */
+static void modules_foreach_idle(GHFunc func)
+{
+	OutputModule *module;
+	GList *names, *gl;
+
+	names = output_get_module_names(0);
+	for (gl = names; gl != NULL; gl = gl->next) {
+		while (1) {
+			pthread_mutex_lock(&output_layer_mutex);
+			module = g_hash_table_lookup(output_modules, gl->data);
+			if (module == NULL || !module->talking)
+				break;
+			pthread_mutex_unlock(&output_layer_mutex);
+			usleep(10 * 1000);	/* Sleep 10 ms */
+		}
+		if (module != NULL)
+			func(gl->data, module, NULL);
+		pthread_mutex_unlock(&output_layer_mutex);
+	}
+	g_list_foreach(names, (GFunc) g_free, NULL);
+	g_list_free(names);
+}
+
 void modules_debug(void)
 {
 	/* Redirect output to debug for all modules */
-	g_hash_table_foreach(output_modules, module_debug, NULL);
-
+	modules_foreach_idle(module_debug);
 }
 
 void modules_nodebug(void)
 {
 	/* Redirect output to normal for all modules */
-	g_hash_table_foreach(output_modules, module_nodebug, NULL);
+	modules_foreach_idle(module_nodebug);
 }
 
 /* --- openttsd START/EXIT FUNCTIONS --- */
@@ -412,6 +455,7 @@ static void options_init(void)
 	options.conf_file = NULL;
 	options.opentts_dir = NULL;
 	options.log_dir = NULL;
+	options.voice_cache_dir = NULL;
 	options.debug = 0;
 	options.debug_destination = NULL;
 	options.mode = OPENTTSD_DEFAULT_MODE;
@@ -420,6 +464,7 @@ static void options_init(void)
 static void init()
 {
 	int START_NUM_FD = 16;
+	pthread_mutexattr_t mutex_attr;
 	int ret;
 	int i;
 
@@ -427,25 +472,17 @@ static void init()
 	status.max_gid = 0;
 
 	/* Initialize inter-thread comm pipes */
-	if (pipe(speaking_pipe)) {
-		log_msg(OTTS_LOG_ERR, "Speaking pipe creation failed (%s)",
-			strerror(errno));
-		FATAL("Can't create pipe");
-	}
-
 	if (pipe(server_pipe)) {
 		log_msg(OTTS_LOG_ERR, "Server pipe creation failed (%s)",
 			strerror(errno));
 		FATAL("Can't create pipe");
 	}
+	fcntl(server_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(server_pipe[1], F_SETFD, FD_CLOEXEC);
 
-	/* Initialize the OpenTTS daemon's priority queue */
-	MessageQueue = g_malloc0(sizeof(queue_t));
-	if (MessageQueue == NULL)
-		FATAL("Couldn't alocate memmory for MessageQueue.");
-
-	/* Initialize lists */
-	MessagePausedList = NULL;
+	/* The default sink with its priority queues, further sinks
+	   come from the configuration */
+	speaking_sink_new("default", NULL, NULL);
 
 	/* Initialize hash tables */
 	fd_settings =
@@ -469,9 +506,6 @@ static void init()
 		openttsd_sockets[i].o_buf = 0;
 	}
 
-	pause_requested = 0;
-	resume_requested = 0;
-
 	/* Perform some functionality tests */
 	if (g_module_supported() == FALSE)
 		DIE("Loadable modules not supported by current platform.\n");
@@ -490,7 +524,12 @@ static void init()
 	if (ret != 0)
 		DIE("Mutex initialization failed");
 
-	ret = pthread_mutex_init(&output_layer_mutex, NULL);
+	/* Recursive, so that a module can be started on demand while
+	   the output layer is locked */
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+	ret = pthread_mutex_init(&output_layer_mutex, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
 	if (ret != 0)
 		DIE("Mutex initialization failed");
 
@@ -507,6 +546,12 @@ static void init()
 		}
 	}
 
+	/* Only a user's openttsd has a place for the voice cache
+	   unless the configuration gives one */
+	if (options.voice_cache_dir == NULL && options.mode != SYSTEM)
+		options.voice_cache_dir =
+		    g_strdup_printf("%s/cache/", options.opentts_dir);
+
 	if (!options.debug_destination) {
 		options.debug_destination =
 		    g_strdup_printf("%s/log/debug", options.opentts_dir);
@@ -517,8 +562,6 @@ static void init()
 	log_msg(OTTS_LOG_INFO, "Reading openttsd's configuration from %s",
 		options.conf_file);
 	configure();
-
-	last_p5_block = NULL;
 }
 
 /*
@@ -536,6 +579,7 @@ void configure(void)
 
 	/* Clean previous configuration */
 	assert(output_modules != NULL);
+	standby_modules_terminate();
 	g_hash_table_foreach_remove(output_modules, modules_terminate, NULL);
 
 	/* Make sure there aren't any more child processes left */
@@ -579,6 +623,8 @@ void configure(void)
 
 	free_config_options(configoptions, &num_options);
 
+	start_standby_modules();
+
 	/* Check for output modules */
 	if (g_hash_table_size(output_modules) == 0)
 		DIE("No speech output modules were loaded - aborting...");
@@ -618,14 +664,26 @@ static void quit(void)
 	g_hash_table_destroy(fd_settings);
 
 	if (speak_thread_started) {
-		log_msg(OTTS_LOG_INFO, "Closing speak() thread...");
-		ret = pthread_cancel(speak_thread);
-		if (ret != 0)
-			FATAL("Speak thread failed to cancel!\n");
+		GList *sinks;
+		GList *gl;
+		speak_sink_t *sink;
+
+		log_msg(OTTS_LOG_INFO, "Closing speak() threads...");
+		sinks = speaking_get_sinks();
+		for (gl = sinks; gl != NULL; gl = gl->next) {
+			sink = gl->data;
+			if (!sink->thread_started)
+				continue;
+			ret = pthread_cancel(sink->thread);
+			if (ret != 0)
+				FATAL("Speak thread failed to cancel!\n");
 
-		ret = pthread_join(speak_thread, NULL);
-		if (ret != 0)
-			FATAL("Speak thread failed to join!\n");
+			ret = pthread_join(sink->thread, NULL);
+			if (ret != 0)
+				FATAL("Speak thread failed to join!\n");
+			sink->thread_started = FALSE;
+		}
+		g_list_free(sinks);
 	}
 
 	ret = pthread_join(sighandler_thread, NULL);
@@ -635,6 +693,7 @@ static void quit(void)
 
 	log_msg(OTTS_LOG_WARN, "Closing open output modules...");
 	/*  Call the close() function of each registered output module. */
+	standby_modules_terminate();
 	g_hash_table_foreach_remove(output_modules, modules_terminate, NULL);
 	g_hash_table_destroy(output_modules);
 
@@ -743,6 +802,7 @@ int make_local_socket(const char *filename)
 	if (sock < 0) {
 		FATAL("Can't create local socket");
 	}
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
 
 	/* Bind a name to the socket. */
 	name.sun_family = AF_UNIX;
@@ -776,6 +836,7 @@ int make_inet_socket(const int port)
 	if (server_socket < 0) {
 		FATAL("Can't create inet socket");
 	}
+	fcntl(server_socket, F_SETFD, FD_CLOEXEC);
 
 	/* Set REUSEADDR flag */
 	const int flag = 1;
@@ -813,15 +874,30 @@ int make_inet_socket(const int port)
 /* Thread creation. */
 gboolean start_speak_thread(void)
 {
+	GList *sinks;
+	GList *gl;
+	speak_sink_t *sink;
 	int ret;
 
-	log_msg(OTTS_LOG_INFO, "Creating new thread for speak()");
-	ret = pthread_create(&speak_thread, NULL, speak, NULL);
-	if (ret != 0) {
-		speak_thread_started = FALSE;
-		log_msg(OTTS_LOG_CRIT, "Speak thread failed!\n");
-	} else
-		speak_thread_started = TRUE;
+	/* One thread for every sink, the ones added by reloading the
+	   configuration included */
+	speak_thread_started = TRUE;
+	sinks = speaking_get_sinks();
+	for (gl = sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		if (sink->thread_started)
+			continue;
+		log_msg(OTTS_LOG_INFO, "Creating new thread for speak() on sink %s",
+			sink->name);
+		ret = pthread_create(&sink->thread, NULL, speak, sink);
+		if (ret != 0) {
+			speak_thread_started = FALSE;
+			log_msg(OTTS_LOG_CRIT, "Speak thread failed!\n");
+			break;
+		}
+		sink->thread_started = TRUE;
+	}
+	g_list_free(sinks);
 
 	return speak_thread_started;
 }
@@ -1091,6 +1167,13 @@ int main(int argc, char *argv[])
 		FATAL("Unable to start the speaking thread.");
 	}
 
+	log_msg(OTTS_LOG_INFO, "Creating new thread for stopping idle modules.");
+	ret = pthread_create(&idle_reaper_thread, NULL, output_idle_reaper,
+			     NULL);
+	if (ret != 0)
+		log_msg(OTTS_LOG_ERR,
+			"Idle module thread failed, idle modules won't be stopped");
+
 	pthread_mutex_unlock(&thread_controller);
 
 	FD_ZERO(&readfds);
@@ -1200,6 +1283,7 @@ static TFDSetElement *default_fd_set(void)
 	new->msg_settings.voice.language =
 	    g_strdup(GlobalFDSet.msg_settings.voice.language);
 	new->output_module = g_strdup(GlobalFDSet.output_module);
+	new->audio_sink = g_strdup(GlobalFDSet.audio_sink);
 	new->client_name = g_strdup(GlobalFDSet.client_name);
 	new->msg_settings.voice_type = GlobalFDSet.msg_settings.voice_type;
 	new->msg_settings.voice.name = NULL;
@@ -1211,6 +1295,7 @@ static TFDSetElement *default_fd_set(void)
 	new->pause_context = GlobalFDSet.pause_context;
 	new->ssml_mode = GlobalFDSet.ssml_mode;
 	new->notification = GlobalFDSet.notification;
+	new->notification_batch = GlobalFDSet.notification_batch;
 
 	new->active = 1;
 	new->hist_cur_uid = -1;
@@ -94,6 +94,7 @@ struct {
 	char *conf_dir;
 	char *opentts_dir;
 	char *log_dir;
+	char *voice_cache_dir;	/* NULL when the voice lists aren't cached */
 	int debug;
 	char *debug_destination;
 	char *debug_logfile;
@@ -101,6 +102,10 @@ struct {
 	char *custom_log_filename;
 	openttsd_mode mode;
 	int max_history_messages;	/* Maximum of messages in history before they expire */
+	int module_timeout;	/* Milliseconds to wait for a module reply, 0 = forever */
+	int module_init_timeout;	/* The same for INIT and LIST_VOICES */
+	int lazy_module_startup;	/* Start modules on their first use */
+	int module_idle_timeout;	/* Seconds before stopping an unused module, 0 = never */
 } options;
 
 struct {
@@ -110,8 +115,8 @@ struct {
 	int num_fds;		/* Number of available allocated sockets */
 } status;
 
-/* We create two additional threads: signal-handler and speaking. */
-extern pthread_t speak_thread;
+/* We create additional threads: signal-handler and one speaking
+   thread for every audio sink. */
 extern pthread_t sighandler_thread;
 extern gboolean speak_thread_started;
 
@@ -135,26 +140,15 @@ GHashTable *language_default_modules;
 /* Table of relations between client file descriptors and their uids */
 GHashTable *fd_uid;
 
-/* Main priority queue for messages */
-queue_t *MessageQueue;
-/* List of messages from paused clients waiting for resume */
-GList *MessagePausedList;
-
 /* List of different entries of client-specific configuration */
 GList *client_specific_settings;
 
-/* Saves the last received priority progress message */
-GList *last_p5_block;
-
 /* Global default settings */
 TFDSetElement GlobalFDSet;
 
 /* Variables for socket communication */
 fd_set readfds;
 
-/* Inter thread comm pipe */
-extern int speaking_pipe[2];
-
 /* Arrays needed for receiving data over socket */
 typedef struct {
 	int awaiting_data;
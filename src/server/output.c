@@ -30,6 +30,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <assert.h>
 
@@ -40,10 +43,13 @@
 #include <fdsetconv.h>
 #include <getline.h>
 #include <logging.h>
+#include <modproto.h>
 #include "speaking.h"
-#include <getline.h>
+#include "index_marking.h"
 #include "parse.h"
 #include "output.h"
+#include "msg.h"
+#include "voice_cache.h"
 
 #ifdef TEMP_FAILURE_RETRY	/* GNU libc */
 #define safe_write(fd, buf, count) TEMP_FAILURE_RETRY(write(fd, buf, count))
@@ -63,19 +69,30 @@ static inline ssize_t safe_write(int fd, const void *buf, size_t count)
 }
 #endif /* TEMP_FAILURE_RETRY */
 
-void output_set_speaking_monitor(openttsd_message * msg, OutputModule * output)
+void output_set_speaking_monitor(openttsd_message * msg, OutputModule * output,
+				 speak_sink_t * sink)
 {
 	/* Set the speaking-monitor so that we know who is speaking */
-	speaking_module = output;
-	speaking_uid = msg->settings.uid;
-	speaking_gid = msg->settings.reparted;
+	sink->module = output;
+	sink->uid = msg->settings.uid;
+	sink->gid = msg->settings.reparted;
+	speaking_set_cancel_fd(sink, output->cancel_pipe[1]);
 }
 
+static OutputModule *output_wake_module(const char *name);
+static OutputModule *output_replace_failed(const char *name);
+
 OutputModule *get_output_module_by_name(char *name)
 {
 	OutputModule *output;
 
+	/* A module which is still starting is returned as it is, the
+	   caller mustn't wait for it with the output layer locked */
 	output = g_hash_table_lookup(output_modules, name);
+	if (output != NULL && output->dormant)
+		output = output_wake_module(name);
+	else if (output != NULL && !output->working)
+		output = output_replace_failed(name);
 	if (output != NULL && output->working)
 		return output;
 
@@ -92,8 +109,12 @@ OutputModule *get_output_module_by_name(char *name)
    Only if not even dummy output module is working
    (serious issues), it will log an error message and return
    a NULL pointer.
+
+   Called with the output layer locked.
 */
 
+static OutputModule *output_pool_instance(OutputModule * output, int uid);
+
 OutputModule *get_output_module(const openttsd_message * message)
 {
 	OutputModule *output;
@@ -108,7 +129,7 @@ OutputModule *get_output_module(const openttsd_message * message)
 
 	output = get_output_module_by_name(message->settings.output_module);
 	if (output != NULL)
-		return output;
+		return output_pool_instance(output, message->settings.uid);
 
 	log_msg(OTTS_LOG_WARN,
 	        "Didn't find prefered output module, try using default");
@@ -120,7 +141,7 @@ OutputModule *get_output_module(const openttsd_message * message)
 	if (GlobalFDSet.output_module != NULL)
 		output = get_output_module_by_name (GlobalFDSet.output_module);
 	if (output != NULL)
-		return output;
+		return output_pool_instance(output, message->settings.uid);
 
 	log_msg(OTTS_LOG_NOTICE,
 	        "Couldn't load default output module, trying other modules");
@@ -132,7 +153,9 @@ OutputModule *get_output_module(const openttsd_message * message)
 		if (0 == strcmp(output->name, "dummy"))
 			continue;
 
-		if (output->working) {
+		if (output->dormant)
+			output = output_wake_module(output->name);
+		if (output != NULL && output->working) {
 			log_msg(OTTS_LOG_NOTICE,
 			        "Output module %s seems to be working, using it",
 			        gl->data);
@@ -158,6 +181,13 @@ OutputModule *get_output_module(const openttsd_message * message)
 	return NULL;
 }
 
+/*
+ * A module which is starting belongs to the thread initializing it,
+ * nothing else talks to it until module_started() clears the flag.
+ * The functions the initialization uses don't take the output layer
+ * lock, so the modules start at the same time without holding up
+ * the others.
+ */
 void
 static output_lock(void)
 {
@@ -174,25 +204,484 @@ static output_unlock(void)
   {  output_unlock(); \
     return (value); }
 
-GString *output_read_reply(OutputModule * output)
+/*
+ * Start the module registered under name if it is dormant.  It is
+ * started in the background and returned marked as starting, or NULL
+ * if it can't be started.
+ */
+static OutputModule *output_wake_module(const char *name)
+{
+	OutputModule *output;
+
+	output_lock();
+	output = g_hash_table_lookup(output_modules, name);
+	if (output != NULL && output->dormant
+	    && start_dormant_module(output) != 0)
+		output = NULL;
+	output_unlock();
+
+	return output;
+}
+
+/* Put the standby of a failed module in its place if there is one */
+static OutputModule *output_replace_failed(const char *name)
+{
+	OutputModule *output;
+	OutputModule *spare;
+
+	output_lock();
+	output = g_hash_table_lookup(output_modules, name);
+	if (output != NULL && !output->working && !output->dormant
+	    && !output->starting) {
+		spare = swap_in_standby(output);
+		if (spare != NULL)
+			output = spare;
+	}
+	output_unlock();
+
+	return output;
+}
+
+/*
+ * Stop the output modules which haven't spoken for ModuleIdleTimeout
+ * seconds.  They are started again on the next request for them.
+ */
+static void output_reap_idle_modules(void)
+{
+	OutputModule *output;
+	GList *gl, *l;
+	time_t now;
+
+	output_lock();
+	now = time(NULL);
+	gl = g_hash_table_get_values(output_modules);
+	for (l = gl; l != NULL; l = l->next) {
+		output = l->data;
+		if (!output->working || output->starting || output->refreshing
+		    || output->busy || output->in_process)
+			continue;
+		if (now - output->idle_since < options.module_idle_timeout)
+			continue;
+		log_msg(OTTS_LOG_NOTICE,
+			"Output module %s has been idle for %ld seconds, stopping it",
+			output->name, (long)(now - output->idle_since));
+		stop_idle_module(output);
+	}
+	g_list_free(gl);
+	output_unlock();
+}
+
+void *output_idle_reaper(void *data)
+{
+	while (1) {
+		sleep(OUTPUT_IDLE_CHECK_PERIOD);
+		if (options.module_idle_timeout > 0)
+			output_reap_idle_modules();
+		output_lock();
+		reap_retired_modules();
+		output_unlock();
+	}
+
+	return NULL;
+}
+
+/* STOP and PAUSE get here without the output layer lock */
+static void output_broken_pipe(OutputModule * output)
+{
+	log_msg(OTTS_LOG_WARN, "Error: Broken pipe to module.");
+	output_lock();
+	output->working = 0;
+	output_check_module(output);
+	output_unlock();
+}
+
+/* Watchdog and load counters, kept by module name so that they
+   survive reloading the module */
+typedef struct {
+	unsigned int timeouts;
+	unsigned int restarts;
+	unsigned long messages;
+	unsigned long busy_ms;
+} output_module_stats_t;
+
+static GHashTable *module_stats;
+static pthread_mutex_t module_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static output_module_stats_t *output_module_stats(const char *name)
+{
+	output_module_stats_t *stats;
+
+	if (module_stats == NULL)
+		module_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, g_free);
+	stats = g_hash_table_lookup(module_stats, name);
+	if (stats == NULL) {
+		stats = g_malloc0(sizeof(output_module_stats_t));
+		g_hash_table_insert(module_stats, g_strdup(name), stats);
+	}
+
+	return stats;
+}
+
+void output_count_module_restart(const char *name)
+{
+	pthread_mutex_lock(&module_stats_mutex);
+	output_module_stats(name)->restarts++;
+	pthread_mutex_unlock(&module_stats_mutex);
+}
+
+void output_get_module_stats(const char *name, unsigned int *timeouts,
+			     unsigned int *restarts, unsigned long *messages,
+			     unsigned long *busy_ms)
+{
+	output_module_stats_t *stats;
+
+	pthread_mutex_lock(&module_stats_mutex);
+	stats = output_module_stats(name);
+	*timeouts = stats->timeouts;
+	*restarts = stats->restarts;
+	*messages = stats->messages;
+	*busy_ms = stats->busy_ms;
+	pthread_mutex_unlock(&module_stats_mutex);
+}
+
+/* Synthesis timing reported by the modules in 705 events, kept by
+   module (pool) and voice */
+static GHashTable *timing_stats;
+
+static void output_record_timing(OutputModule * output, const char *data)
+{
+	output_timing_stats_t *stats;
+	long first_ms, synth_ms, audio_ms;
+	char *key;
+
+	if (sscanf(data, "%ld %ld %ld", &first_ms, &synth_ms, &audio_ms) != 3
+	    || first_ms < 0 || synth_ms < 0 || audio_ms < 0) {
+		log_msg2(2, "output_module",
+			 "ERROR: Bad timing event from output module %s: %s",
+			 output->name, data);
+		return;
+	}
+	log_msg2(5, "output_module",
+		 "Timing of %s: first audio %ld ms, synthesis %ld ms, audio %ld ms",
+		 output->name, first_ms, synth_ms, audio_ms);
+
+	key = g_strdup_printf("%s %s", output->pool_name,
+			      output->timing_voice != NULL ?
+			      output->timing_voice : "unknown");
+
+	pthread_mutex_lock(&module_stats_mutex);
+	if (timing_stats == NULL)
+		timing_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, g_free);
+	stats = g_hash_table_lookup(timing_stats, key);
+	if (stats == NULL) {
+		stats = g_malloc0(sizeof(output_timing_stats_t));
+		stats->module = g_strdup(output->pool_name);
+		stats->voice = g_strdup(output->timing_voice != NULL ?
+					output->timing_voice : "unknown");
+		g_hash_table_insert(timing_stats, key, stats);
+	} else {
+		g_free(key);
+	}
+	stats->messages++;
+	stats->first_audio_ms += first_ms;
+	stats->synthesis_ms += synth_ms;
+	stats->audio_ms += audio_ms;
+	pthread_mutex_unlock(&module_stats_mutex);
+}
+
+static void output_copy_timing_stats(gpointer key, gpointer value,
+				     gpointer user_data)
+{
+	GList **list = user_data;
+
+	*list = g_list_prepend(*list, g_memdup(value,
+					       sizeof(output_timing_stats_t)));
+}
+
+static gint output_compare_timing_stats(gconstpointer a, gconstpointer b)
+{
+	const output_timing_stats_t *x = a;
+	const output_timing_stats_t *y = b;
+	int ret;
+
+	ret = strcmp(x->module, y->module);
+	return ret != 0 ? ret : strcmp(x->voice, y->voice);
+}
+
+/*
+ * Return a copy of the timing statistics, sorted by module and voice.
+ * The module and voice names in the copies are shared with the
+ * statistics, which are never freed.  Free the list with g_list_free()
+ * after freeing its elements.
+ */
+GList *output_get_timing_stats(void)
+{
+	GList *list = NULL;
+
+	pthread_mutex_lock(&module_stats_mutex);
+	if (timing_stats != NULL)
+		g_hash_table_foreach(timing_stats, output_copy_timing_stats,
+				     &list);
+	pthread_mutex_unlock(&module_stats_mutex);
+
+	return g_list_sort(list, output_compare_timing_stats);
+}
+
+static long output_elapsed_ms(struct timeval *start);
+
+static void output_module_start(OutputModule * output)
+{
+	output->busy = 1;
+	gettimeofday(&output->busy_since, NULL);
+
+	pthread_mutex_lock(&module_stats_mutex);
+	output_module_stats(output->name)->messages++;
+	pthread_mutex_unlock(&module_stats_mutex);
+}
+
+void output_module_done(OutputModule * output)
+{
+	long busy;
+
+	if (output == NULL)
+		return;
+	output_lock();
+	if (!output->busy) {
+		output_unlock();
+		return;
+	}
+	output->busy = 0;
+	output->idle_since = time(NULL);
+	busy = output_elapsed_ms(&output->busy_since);
+	output_unlock();
+
+	pthread_mutex_lock(&module_stats_mutex);
+	output_module_stats(output->name)->busy_ms += busy;
+	pthread_mutex_unlock(&module_stats_mutex);
+}
+
+/*
+ * The names of the registered modules, or of the module pools only,
+ * copied under the output layer lock.  Free the names and the list.
+ */
+GList *output_get_module_names(int pools_only)
+{
+	OutputModule *output;
+	GList *names = NULL;
+	GList *gl, *l;
+
+	output_lock();
+	gl = g_hash_table_get_values(output_modules);
+	for (l = gl; l != NULL; l = l->next) {
+		output = l->data;
+		if (pools_only && output->pool_index != 0)
+			continue;
+		names = g_list_prepend(names, g_strdup(output->name));
+	}
+	g_list_free(gl);
+	output_unlock();
+
+	return names;
+}
+
+/* The pool instance each client used last, by uid.  The speak
+   threads and the main thread share it, it is only used with the
+   output layer locked. */
+static GHashTable *client_instances;
+
+void output_forget_client(int uid)
+{
+	output_lock();
+	if (client_instances != NULL)
+		g_hash_table_remove(client_instances, GINT_TO_POINTER(uid));
+	output_unlock();
+}
+
+/*
+ * Choose the instance of a module pool to speak a message of client
+ * uid.  The instance the client used last is kept as long as it is
+ * working, even while it is busy, which keeps the module's settings
+ * cache warm.  Otherwise the idle instance which spoke the fewest
+ * messages is taken.  A client only moves to another instance when
+ * its last one stopped working, so its messages are never spoken out
+ * of order, and the message prepared on its instance is still there
+ * for the next one.
+ */
+static OutputModule *output_pool_instance(OutputModule * output, int uid)
+{
+	OutputModule *instance;
+	OutputModule *best = NULL;
+	OutputModule *last = NULL;
+	unsigned long best_messages = 0;
+	unsigned long messages;
+	gpointer last_index;
+	char *name;
+	int dormant = -1;
+	int i;
+
+	if (output->pool_index != 0 || output->pool_size <= 1)
+		return output;
+
+	if (client_instances == NULL)
+		client_instances = g_hash_table_new(g_direct_hash,
+						    g_direct_equal);
+	last_index = g_hash_table_lookup(client_instances,
+					 GINT_TO_POINTER(uid));
+
+	pthread_mutex_lock(&module_stats_mutex);
+	for (i = 0; i < output->pool_size; i++) {
+		name = module_instance_name(output->pool_name, i);
+		instance = g_hash_table_lookup(output_modules, name);
+		g_free(name);
+		if (instance != NULL && instance->dormant && dormant == -1)
+			dormant = i;
+		if (instance == NULL || !instance->working
+		    || instance->starting)
+			continue;
+		if (last_index != NULL && GPOINTER_TO_INT(last_index) == i + 1)
+			last = instance;
+		if (instance->busy)
+			continue;
+		messages = output_module_stats(instance->name)->messages;
+		if (best == NULL || messages < best_messages) {
+			best = instance;
+			best_messages = messages;
+		}
+	}
+	pthread_mutex_unlock(&module_stats_mutex);
+
+	if (last != NULL)
+		best = last;
+
+	/* Start another instance when all the running ones are busy */
+	if (best == NULL && dormant != -1) {
+		name = module_instance_name(output->pool_name, dormant);
+		instance = output_wake_module(name);
+		g_free(name);
+		if (instance != NULL && instance->working)
+			best = instance;
+	}
+
+	if (best == NULL)
+		return output;
+
+	g_hash_table_replace(client_instances, GINT_TO_POINTER(uid),
+			     GINT_TO_POINTER(best->pool_index + 1));
+	log_msg(OTTS_LOG_DEBUG, "Using instance %s of pool %s", best->name,
+		output->pool_name);
+
+	return best;
+}
+
+/*
+ * The module didn't answer in time.  Kill it and let the signal
+ * handling thread respawn it the same way as on SIGUSR1, outside of
+ * the output layer and with the speak thread stopped.
+ */
+static void output_module_timeout(OutputModule * output)
+{
+	log_msg(OTTS_LOG_ERR,
+		"ERROR: Output module %s timed out, killing it (pid %d)",
+		output->name, output->pid);
+
+	pthread_mutex_lock(&module_stats_mutex);
+	output_module_stats(output->name)->timeouts++;
+	pthread_mutex_unlock(&module_stats_mutex);
+
+	/* A plugin thread can't be killed, the module stays unusable */
+	if (!output->in_process)
+		kill(output->pid, SIGKILL);
+	output->working = 0;
+	kill(getpid(), SIGUSR1);
+}
+
+static long output_elapsed_ms(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000
+	    + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/*
+ * Wait until the module has something to say, at most timeout
+ * milliseconds counted from start.  A timeout of 0 waits forever.
+ * If unlocked is set, the output layer lock is released meanwhile,
+ * see output_speak().  Returns 1 if there is data to read, 0 if the
+ * module timed out (and was killed) and -1 on error.
+ */
+static int output_wait_reply(OutputModule * output, int timeout,
+			     struct timeval *start, int unlocked)
+{
+	struct pollfd pfd;
+	long remaining;
+	int ret;
+
+	if (timeout <= 0 && !unlocked)
+		return 1;
+
+	pfd.fd = output->pipe_out[0];
+	pfd.events = POLLIN;
+	if (unlocked)
+		output_unlock();
+	do {
+		remaining = -1;
+		if (timeout > 0) {
+			remaining = timeout - output_elapsed_ms(start);
+			if (remaining < 0)
+				remaining = 0;
+		}
+		ret = poll(&pfd, 1, remaining);
+	} while (ret == -1 && errno == EINTR);
+	if (unlocked)
+		output_lock();
+
+	if (ret == 0) {
+		output_module_timeout(output);
+		return 0;
+	}
+	if (ret < 0) {
+		output_broken_pipe(output);
+		return -1;
+	}
+
+	return 1;
+}
+
+int output_poll_module(OutputModule * output, int timeout)
+{
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	return output_wait_reply(output, timeout, &start, 0);
+}
+
+static GString *output_read_reply_timeout(OutputModule * output, int timeout,
+					  int unlocked)
 {
 	GString *rstr;
 	int bytes;
 	char *line = NULL;
 	size_t N = 0;
 	gboolean errors = FALSE;
+	struct timeval start;
 
 	rstr = g_string_new("");
+	gettimeofday(&start, NULL);
 
 	/* Wait for activity on the socket, when there is some,
 	   read all the message line by line */
 	do {
+		if (output_wait_reply(output, timeout, &start, unlocked) != 1) {
+			errors = TRUE;
+			break;
+		}
 		bytes = otts_getline(&line, &N, output->stream_out);
 		if (bytes == -1) {
-			log_msg(OTTS_LOG_WARN, "Error: Broken pipe to module.");
-			output->working = 0;
-			speaking_module = NULL;
-			output_check_module(output);
+			output_broken_pipe(output);
 			errors = TRUE;	/* Broken pipe */
 		} else {
 			log_msg(OTTS_LOG_DEBUG,
@@ -214,6 +703,275 @@ GString *output_read_reply(OutputModule * output)
 	return rstr;
 }
 
+GString *output_read_reply(OutputModule * output)
+{
+	return output_read_reply_timeout(output, options.module_timeout, 0);
+}
+
+/* Translate an EVENT frame into the index mark names used by
+   output_module_is_speaking().  Timing events are recorded here and
+   yield no index mark. */
+static char *output_event_to_index_mark(OutputModule * output,
+					otts_frame_header_t * header,
+					char *data)
+{
+	switch (header->arg) {
+	case 700:
+		return g_strdup(data);
+	case 701:
+		return g_strdup("__spd_begin");
+	case 702:
+		return g_strdup("__spd_end");
+	case 703:
+		return g_strdup("__spd_stopped");
+	case 704:
+		return g_strdup("__spd_paused");
+	case 705:
+		output_record_timing(output, data);
+		return NULL;
+	default:
+		log_msg2(2, "output_module",
+			 "ERROR: Unknown event %d received from output module",
+			 header->arg);
+		return NULL;
+	}
+}
+
+/* A request sent with the binary protocol whose reply is outstanding */
+typedef struct {
+	uint32_t seq;
+	int opcode;
+	struct timeval sent;
+} output_request_t;
+
+/*
+ * Write one frame to the module, with its write_mutex held.  Frames
+ * are written under the module's write_mutex only, not the output
+ * layer lock, so STOP and PAUSE can be sent while another thread waits
+ * for a reply.  Requests the module answers are recorded in
+ * output->requests; their sequence number is stored in *seq if seq is
+ * not NULL.  Returns -1 on a broken pipe and -2 if the process of the
+ * module was stopped meanwhile, see forget_module_process().
+ */
+static int output_write_frame(OutputModule * output, int opcode, int arg,
+			      const char *data, size_t len, uint32_t * seq)
+{
+	output_request_t *request;
+	uint32_t frame_seq;
+
+	if (output->pipe_in[1] < 0)
+		return -2;
+
+	frame_seq = ++output->seq;
+	if (otts_frame_write(output->pipe_in[1], opcode, arg, frame_seq,
+			     data, len) == -1)
+		return -1;
+	if (opcode != OTTS_OP_STOP && opcode != OTTS_OP_PAUSE) {
+		request = g_malloc(sizeof(output_request_t));
+		request->seq = frame_seq;
+		request->opcode = opcode;
+		gettimeofday(&request->sent, NULL);
+		g_queue_push_tail(output->requests, request);
+	}
+	log_msg2(5, "output_module",
+		 "Frame sent to output module: opcode %d arg %d seq %u (%u bytes)",
+		 opcode, arg, frame_seq, (unsigned)len);
+
+	if (seq != NULL)
+		*seq = frame_seq;
+	return 0;
+}
+
+/* Handle what output_write_frame() returned, after write_mutex is
+   released */
+static int output_frame_result(OutputModule * output, int ret)
+{
+	if (ret == -1)
+		output_broken_pipe(output);
+	return ret == 0 ? 0 : -1;
+}
+
+static int output_send_frame(OutputModule * output, int opcode, int arg,
+			     const char *data, size_t len, uint32_t * seq)
+{
+	int ret;
+
+	pthread_mutex_lock(&output->write_mutex);
+	ret = output_write_frame(output, opcode, arg, data, len, seq);
+	pthread_mutex_unlock(&output->write_mutex);
+
+	return output_frame_result(output, ret);
+}
+
+/*
+ * Match a reply with the request it answers.  Returns the opcode of
+ * the request or -1 if there is none.
+ */
+static int output_reply_request(OutputModule * output,
+				otts_frame_header_t * header)
+{
+	output_request_t *request;
+	int opcode = -1;
+
+	pthread_mutex_lock(&output->write_mutex);
+	/* Replies come in the order of the requests */
+	while ((request = g_queue_pop_head(output->requests)) != NULL) {
+		if (request->seq == header->seq)
+			opcode = request->opcode;
+		g_free(request);
+		if (opcode != -1)
+			break;
+	}
+	pthread_mutex_unlock(&output->write_mutex);
+
+	return opcode;
+}
+
+/*
+ * Milliseconds left until the oldest request the module didn't answer
+ * yet is older than ModuleTimeout, 0 if it already is, or -1 if
+ * nothing is outstanding or there is no timeout.
+ */
+int output_request_timeout(OutputModule * output)
+{
+	output_request_t *request;
+	long remaining = -1;
+
+	if (output == NULL || options.module_timeout <= 0)
+		return -1;
+
+	pthread_mutex_lock(&output->write_mutex);
+	request = g_queue_peek_head(output->requests);
+	if (request != NULL) {
+		remaining = options.module_timeout
+		    - output_elapsed_ms(&request->sent);
+		if (remaining < 0)
+			remaining = 0;
+	}
+	pthread_mutex_unlock(&output->write_mutex);
+
+	return remaining;
+}
+
+/*
+ * Kill the module if the oldest request it didn't answer yet is older
+ * than ModuleTimeout.  The replies to SPEAK and the other requests
+ * nobody waits for are read by the speak thread, which calls this
+ * from its poll() loop.  Returns -1 if the module timed out.
+ */
+int output_check_requests(OutputModule * output)
+{
+	if (output_request_timeout(output) != 0)
+		return 0;
+
+	output_lock();
+	if (output->working)
+		output_module_timeout(output);
+	OL_RET(-1)
+}
+
+/*
+ * Handle the reply to a request nobody waits for.  Returns -1 if the
+ * module refused to speak the current message, 0 otherwise.
+ */
+static int output_handle_async_reply(OutputModule * output,
+				     otts_frame_header_t * header, char *data)
+{
+	int opcode;
+
+	opcode = output_reply_request(output, header);
+	log_msg2(5, "output_module", "Reply from output module: |%s| (%d)",
+		 data, opcode);
+	if (data[0] == '2')
+		return 0;
+
+	log_msg(OTTS_LOG_WARN,
+		"Error: Module %s refused request (opcode %d): %s",
+		output->name, opcode, data);
+	if (opcode == OTTS_OP_SET) {
+		/* We don't know which settings the module has now */
+		g_hash_table_remove_all(output->settings);
+	} else if (opcode == OTTS_OP_SPEAK) {
+		return -1;
+	} else if (opcode == OTTS_OP_PREPARE && !strncmp(data, "300", 3)) {
+		/* The module can't synthesize ahead, don't ask again */
+		output->can_prepare = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Read frames until the reply to request seq arrives.  Events the
+ * module sends in the meantime are kept in output->events for
+ * output_module_is_speaking().
+ */
+static GString *output_read_frame_reply(OutputModule * output, uint32_t seq,
+					int timeout)
+{
+	otts_frame_header_t header;
+	char *data;
+	char *index_mark;
+	GString *reply;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		if (output_wait_reply(output, timeout, &start,
+				      output->talking) != 1)
+			return NULL;
+		if (otts_frame_read(output->pipe_out[0], &header, &data) == -1) {
+			output_broken_pipe(output);
+			return NULL;
+		}
+
+		if (header.opcode == OTTS_OP_EVENT) {
+			index_mark = output_event_to_index_mark(output,
+								&header, data);
+			if (index_mark != NULL)
+				g_queue_push_tail(output->events, index_mark);
+		} else if (header.opcode == OTTS_OP_REPLY
+			   && header.seq == seq) {
+			output_reply_request(output, &header);
+			reply = g_string_new(data);
+			g_free(data);
+			return reply;
+		} else if (header.opcode == OTTS_OP_REPLY) {
+			if (output_handle_async_reply(output, &header, data))
+				g_queue_push_tail(output->events, NULL);
+		} else {
+			log_msg2(2, "output_module",
+				 "Unexpected frame from output module: opcode %d seq %u",
+				 header.opcode, header.seq);
+		}
+		g_free(data);
+	}
+}
+
+static int output_reply_status(GString * response)
+{
+	switch (response->str[0]) {
+	case '3':
+		log_msg(OTTS_LOG_WARN,
+			"Error: Module reported error in request from openttsd (code 3xx): %s.",
+			response->str);
+		return -2;	/* User (openttsd) side error */
+
+	case '4':
+		log_msg(OTTS_LOG_WARN,
+			"Error: Module reported error in itself (code 4xx): %s",
+			response->str);
+		return -3;	/* Module side error */
+
+	case '2':
+		return 0;
+	default:		/* unknown response */
+		log_msg(OTTS_LOG_NOTICE,
+			"Unknown response from output module!");
+		return -3;
+	}
+}
+
 int output_send_data(char *cmd, OutputModule * output, int wfr)
 {
 	int ret;
@@ -225,86 +983,184 @@ int output_send_data(char *cmd, OutputModule * output, int wfr)
 		return -1;
 
 	ret = safe_write(output->pipe_in[1], cmd, strlen(cmd));
-	fflush(NULL);
 	if (ret == -1) {
-		log_msg(OTTS_LOG_WARN, "Error: Broken pipe to module.");
-		output->working = 0;
-		speaking_module = NULL;
-		output_check_module(output);
+		output_broken_pipe(output);
 		return -1;	/* Broken pipe */
 	}
 	log_msg2(5, "output_module", "Command sent to output module: |%s| (%d)",
 		 cmd, wfr);
 
 	if (wfr) {		/* wait for reply? */
-		int ret = 0;
-		response = output_read_reply(output);
+		response = output_read_reply_timeout(output,
+						     options.module_timeout,
+						     wfr == 2
+						     && output->talking);
 		if (response == NULL)
 			return -1;
 
 		log_msg2(5, "output_module", "Reply from output module: |%s|",
 			 response->str);
 
-		switch (response->str[0]) {
-		case '3':
-			log_msg(OTTS_LOG_WARN,
-				"Error: Module reported error in request from openttsd (code 3xx): %s.",
-				response->str);
-			ret = -2;	/* User (openttsd) side error */
-			break;
+		ret = output_reply_status(response);
+		g_string_free(response, TRUE);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the line which completes a text request and wait for the final
+ * reply.  While output_speak() talks to a module, this reply is waited
+ * for with the output layer unlocked.  The module answers the first
+ * line of a request before it reads the rest, so those replies are
+ * still waited for with the lock held: a STOP written by another
+ * thread can't end up in the middle of the data.
+ */
+static int output_send_last(char *cmd, OutputModule * output)
+{
+	return output_send_data(cmd, output, 2);
+}
+
+/*
+ * Send a request consisting of a command and an optional data block
+ * and wait for the final reply.  With the text protocol, the data
+ * block follows the command line and is terminated by a line with a
+ * single dot.  With the binary protocol it is the payload of a single
+ * frame.  Returns 0 or the negative error codes of output_send_data().
+ */
+static int output_send_request(OutputModule * output, int opcode,
+			       char *cmd, char *data)
+{
+	GString *response;
+	uint32_t seq;
+	int ret;
+
+	if (output->protocol == OTTS_MODPROTO_VERSION) {
+		ret = output_send_frame(output, opcode, 0, data,
+					data != NULL ? strlen(data) : 0, &seq);
+		if (ret < 0)
+			return ret;
+		response = output_read_frame_reply(output, seq,
+						   options.module_timeout);
+		if (response == NULL)
+			return -1;
+		log_msg2(5, "output_module", "Reply from output module: |%s|",
+			 response->str);
+		ret = output_reply_status(response);
+		g_string_free(response, TRUE);
+		return ret;
+	}
+
+	ret = output_send_data(cmd, output, 1);
+	if (ret < 0 || data == NULL)
+		return ret;
+	ret = output_send_data(data, output, 0);
+	if (ret < 0)
+		return ret;
+	return output_send_last(".\n", output);
+}
+
+/* Called by the thread starting the module */
+int output_negotiate_protocol(OutputModule * output)
+{
+	char *cmd;
+	int ret;
+
+	cmd = g_strdup_printf("PROTOCOL %d\n", OTTS_MODPROTO_VERSION);
+	ret = output_send_data(cmd, output, 1);
+	g_free(cmd);
+	if (ret == 0) {
+		output->protocol = OTTS_MODPROTO_VERSION;
+		output->can_prepare = 1;
+		log_msg(OTTS_LOG_INFO,
+			"Output module %s uses protocol version %d",
+			output->name, output->protocol);
+	} else {
+		log_msg(OTTS_LOG_INFO,
+			"Output module %s only supports the text protocol",
+			output->name);
+	}
+	return ret == -1 ? -1 : 0;
+}
 
-		case '4':
-			log_msg(OTTS_LOG_WARN,
-				"Error: Module reported error in itself (code 4xx): %s",
-				response->str);
-			ret = -3;	/* Module side error */
-			break;
+/*
+ * Plugin modules use the binary protocol from the start and send the
+ * result of their initialization as the reply to request 0.  Called
+ * before the module is registered.
+ */
+int output_plugin_initialized(OutputModule * output)
+{
+	GString *reply;
+	int ret;
 
-		case '2':
-			ret = 0;
-			break;
-		default:	/* unknown response */
-			log_msg(OTTS_LOG_NOTICE,
-				"Unknown response from output module!");
-			ret = -3;
-			break;
-		}
-		g_string_free(response, TRUE);
-		return ret;
+	output->protocol = OTTS_MODPROTO_VERSION;
+	output->can_prepare = 1;
+	reply = output_read_frame_reply(output, 0,
+					options.module_init_timeout);
+	if (reply == NULL) {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Output module %s didn't initialize in time",
+			output->name);
+		return -1;
 	}
 
-	return 0;
+	if (reply->str[0] == '2') {
+		log_msg(OTTS_LOG_WARN, "Module %s started sucessfully: %s",
+			output->name, reply->str);
+		ret = 0;
+	} else {
+		log_msg(OTTS_LOG_ERR,
+			"ERROR: Module %s failed to initialize: %s",
+			output->name, reply->str);
+		ret = -1;
+	}
+	g_string_free(reply, TRUE);
+
+	return ret;
 }
 
+/*
+ * Read the voice list of the module.  Called by the thread starting
+ * the module, or with the output layer locked.
+ */
 int _output_get_voices(OutputModule * module)
 {
 	SPDVoice **voice_dscr;
 	GString *reply;
 	gchar **lines;
+	uint32_t seq;
 	gchar **atoms;
 	int i;
 	int ret = 0;
 	gboolean errors = FALSE;
 
-	output_lock();
-
 	if (module == NULL) {
 		log_msg(OTTS_LOG_ERR,
 			"ERROR: Can't list voices for broken output module");
-		OL_RET(-1);
+		return -1;
+	}
+	if (module->protocol == OTTS_MODPROTO_VERSION) {
+		if (output_send_frame(module, OTTS_OP_LIST_VOICES, 0, NULL, 0,
+				      &seq) == 0)
+			reply = output_read_frame_reply(module, seq,
+							options.module_init_timeout);
+		else
+			reply = NULL;
+	} else {
+		output_send_data("LIST_VOICES\n", module, 0);
+		reply = output_read_reply_timeout(module,
+						  options.module_init_timeout,
+						  0);
 	}
-	output_send_data("LIST_VOICES\n", module, 0);
-	reply = output_read_reply(module);
 
-	if (reply == NULL) {
-		output_unlock();
-		voice_dscr = NULL;
+	if (reply == NULL)
 		return -1;
-	}
 	//TODO: only 256 voices supported here
 	lines = g_strsplit(reply->str, "\n", 256);
 	g_string_free(reply, TRUE);
-	voice_dscr = g_malloc(256 * sizeof(SPDVoice *));
+	/* Zeroed, a bad line leaves no garbage for output_free_voices() */
+	voice_dscr = g_malloc0(256 * sizeof(SPDVoice *));
 	for (i = 0; !errors && (lines[i] != NULL); i++) {
 		log_msg(OTTS_LOG_ERR, "LINE here:|%s|", lines[i]);
 		if (strlen(lines[i]) <= 4) {
@@ -338,24 +1194,134 @@ int _output_get_voices(OutputModule * module)
 	voice_dscr[i] = NULL;
 	g_strfreev(lines);
 
-	module->voices = voice_dscr;
+	output_set_voices(module, voice_dscr);
 
-	output_unlock();
 	return ret;
 }
 
-SPDVoice **output_list_voices(char *module_name)
+/*
+ * Read the voice list of a module which is already in use, once it
+ * is idle, and store it in the voice cache.  Nobody waits for the
+ * refresh, the cached list stays in use until it is replaced.
+ * Returns -1 if the module stops working or doesn't become idle
+ * within a minute.
+ */
+int output_refresh_voices(OutputModule * output)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < 600; i++) {
+		output_lock();
+		if (!output->working)
+			OL_RET(-1)
+		if (!output->starting && !output->busy) {
+			ret = _output_get_voices(output);
+			if (ret == 0)
+				voice_cache_store(output);
+			OL_RET(ret)
+		}
+		output_unlock();
+		usleep(100 * 1000);	/* Sleep 100 ms */
+	}
+
+	log_msg(OTTS_LOG_WARN,
+		"Output module %s is busy, its voice list wasn't refreshed",
+		output->name);
+	return -1;
+}
+
+void output_free_voices(SPDVoice ** voices)
+{
+	int i;
+
+	if (voices == NULL)
+		return;
+	for (i = 0; voices[i] != NULL; i++) {
+		g_free(voices[i]->name);
+		g_free(voices[i]->language);
+		g_free(voices[i]->variant);
+		g_free(voices[i]);
+	}
+	g_free(voices);
+}
+
+/*
+ * Set the voice list of a module, index its voices by name and
+ * serialize the reply to LIST SYNTHESIS_VOICES.  Voice names are
+ * indexed in lower case, since the server lower cases the names
+ * clients set.  The list and the reply replace and free the previous
+ * ones, so they are only used under the output layer lock once the
+ * module is started.
+ */
+void output_set_voices(OutputModule * module, SPDVoice ** voices)
+{
+	GString *reply;
+	int i;
+
+	if (module->voice_index != NULL)
+		g_hash_table_destroy(module->voice_index);
+	output_free_voices(module->voices);
+	module->voices = voices;
+
+	module->voice_index = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    g_free, NULL);
+	reply = g_string_new("");
+	for (i = 0; voices != NULL && voices[i] != NULL; i++) {
+		g_hash_table_insert(module->voice_index,
+				    g_ascii_strdown(voices[i]->name, -1),
+				    voices[i]);
+		g_string_append_printf(reply, C_OK_VOICES "-%s %s %s\r\n",
+				       voices[i]->name, voices[i]->language,
+				       voices[i]->variant);
+	}
+	g_string_append(reply, OK_VOICE_LIST_SENT);
+	g_free(module->voices_reply);
+	module->voices_reply = g_string_free(reply, FALSE);
+}
+
+/* Find a voice of the module by its name, in any case */
+SPDVoice *output_find_voice(OutputModule * module, const char *name)
+{
+	SPDVoice *voice;
+	char *key;
+
+	if (module->voice_index == NULL || name == NULL)
+		return NULL;
+
+	key = g_ascii_strdown(name, -1);
+	voice = g_hash_table_lookup(module->voice_index, key);
+	g_free(key);
+
+	return voice;
+}
+
+/* The reply to LIST SYNTHESIS_VOICES for the module, to be freed */
+char *output_list_voices(char *module_name)
 {
 	OutputModule *module;
+	char *reply;
+
 	if (module_name == NULL)
 		return NULL;
+
+	/* A refresh may replace the reply meanwhile */
+	output_lock();
 	module = get_output_module_by_name(module_name);
-	if (module == NULL) {
+	while (module != NULL && module->starting) {
+		/* The module reads its voice list while it starts */
+		output_unlock();
+		wait_for_output_module(module);
+		output_lock();
+		module = get_output_module_by_name(module_name);
+	}
+	if (module == NULL || module->voices_reply == NULL) {
 		log_msg(OTTS_LOG_ERR, "ERROR: Can't list voices for module %s",
 			module_name);
-		return NULL;
+		OL_RET(NULL)
 	}
-	return module->voices;
+	reply = g_strdup(module->voices_reply);
+	OL_RET(reply)
 }
 
 #define SEND_CMD_N(cmd) \
@@ -395,13 +1361,67 @@ SPDVoice **output_list_voices(char *module_name)
     } \
     g_free(val);
 
-int output_send_settings(openttsd_message * msg, OutputModule * output)
+/*
+ * Return the lines of settings (item=value, one per line) which differ
+ * from what the module acknowledged last, or NULL if there are none.
+ * Modules keep their settings between messages, so it is enough to
+ * send the changes.
+ */
+static GString *output_settings_delta(OutputModule * output, char *settings)
+{
+	GString *delta;
+	gchar **lines;
+	gchar *sent;
+	size_t key_len;
+	int i;
+
+	delta = g_string_new("");
+	lines = g_strsplit(settings, "\n", 0);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (lines[i][0] == 0)
+			continue;
+		key_len = strcspn(lines[i], "=");
+		lines[i][key_len] = 0;
+		sent = g_hash_table_lookup(output->settings, lines[i]);
+		lines[i][key_len] = '=';
+		if (sent == NULL || strcmp(sent, lines[i]))
+			g_string_append_printf(delta, "%s\n", lines[i]);
+	}
+	g_strfreev(lines);
+
+	if (delta->len == 0) {
+		g_string_free(delta, 1);
+		return NULL;
+	}
+	return delta;
+}
+
+/* Remember the settings in delta as acknowledged by the module */
+static void output_settings_commit(OutputModule * output, char *delta)
+{
+	gchar **lines;
+	int i;
+
+	lines = g_strsplit(delta, "\n", 0);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (lines[i][0] == 0)
+			continue;
+		g_hash_table_replace(output->settings,
+				     g_strndup(lines[i],
+					       strcspn(lines[i], "=")),
+				     g_strdup(lines[i]));
+	}
+	g_strfreev(lines);
+}
+
+/* The settings of msg the module needs, one item=value per line */
+static GString *output_settings_string(openttsd_message * msg,
+				       OutputModule * output)
 {
 	GString *set_str;
+	SPDVoice *voice;
 	char *val;
-	int err;
 
-	log_msg(OTTS_LOG_INFO, "Module set parameters.");
 	set_str = g_string_new("");
 	g_string_append_printf(set_str, "pitch=%d\n",
 			       msg->settings.msg_settings.pitch);
@@ -421,19 +1441,49 @@ int output_send_settings(openttsd_message * msg, OutputModule * output)
 		g_string_append_printf(set_str, "language=NULL\n");
 	}
 	if (msg->settings.msg_settings.voice.name != NULL) {
+		/* The module gets the name the way it spells it */
+		voice = output_find_voice(output,
+					  msg->settings.msg_settings.voice.name);
 		g_string_append_printf(set_str, "synthesis_voice=%s\n",
+				       voice != NULL ? voice->name :
 				       msg->settings.msg_settings.voice.name);
 	} else {
 		g_string_append_printf(set_str, "synthesis_voice=NULL\n");
 	}
 
-	SEND_CMD_N("SET");
-	SEND_DATA_N(set_str->str);
-	SEND_CMD_N(".");
+	return set_str;
+}
+
+int output_send_settings(openttsd_message * msg, OutputModule * output)
+{
+	GString *set_str;
+	GString *delta;
+	int err;
 
+	log_msg(OTTS_LOG_INFO, "Module set parameters.");
+	set_str = output_settings_string(msg, output);
+	delta = output_settings_delta(output, set_str->str);
 	g_string_free(set_str, 1);
+	if (delta == NULL) {
+		log_msg(OTTS_LOG_DEBUG, "Module settings unchanged.");
+		return 0;
+	}
 
-	return 0;
+	/* With the binary protocol, a refused SET is handled when the
+	   reply arrives, see output_handle_async_reply() */
+	if (output->protocol == OTTS_MODPROTO_VERSION)
+		err = output_send_frame(output, OTTS_OP_SET, 0, delta->str,
+					delta->len, NULL);
+	else
+		err = output_send_request(output, OTTS_OP_SET, "SET\n",
+					  delta->str);
+	if (err < 0)
+		g_hash_table_remove_all(output->settings);
+	else
+		output_settings_commit(output, delta->str);
+	g_string_free(delta, 1);
+
+	return err < 0 ? err : 0;
 }
 
 #undef ADD_SET_INT
@@ -461,16 +1511,80 @@ int output_send_audio_settings(OutputModule * output)
 	ADD_SET_STR(audio_nas_server);
 	ADD_SET_STR(audio_pulse_server);
 	ADD_SET_INT(audio_pulse_min_length);
+	ADD_SET_STR(audio_resample_quality);
+	ADD_SET_INT(audio_pulse_target_length);
+	ADD_SET_INT(audio_pulse_min_request);
+	ADD_SET_INT(audio_alsa_mmap);
 
-	SEND_CMD_N("AUDIO");
-	SEND_DATA_N(set_str->str);
-	SEND_CMD_N(".");
-
+	err = output_send_request(output, OTTS_OP_AUDIO, "AUDIO\n",
+				  set_str->str);
 	g_string_free(set_str, 1);
 
+	return err < 0 ? err : 0;
+}
+
+#define ADD_SINK_SET_STR(name, sink_method) \
+    if (device != NULL && !strcmp(method, sink_method)) { \
+       g_string_append_printf(set_str, #name"=%s\n", device); \
+    } else ADD_SET_STR(name)
+
+/*
+ * Point the audio output of the module to the sink it is going to
+ * speak on.  Sinks without their own audio settings use the global
+ * ones, the device of the sink replaces the device or server of its
+ * audio output method.
+ */
+static int output_send_sink_audio_settings(OutputModule * output,
+					   speak_sink_t * sink)
+{
+	GString *set_str;
+	char *method;
+	char *device;
+	int err;
+
+	if (sink->audio_output_method == NULL && output->audio_sink == NULL)
+		return 0;
+	if (output->audio_sink != NULL
+	    && !strcmp(output->audio_sink, sink->name))
+		return 0;
+
+	if (sink->audio_output_method == NULL) {
+		err = output_send_audio_settings(output);
+	} else {
+		method = sink->audio_output_method;
+		device = sink->audio_device;
+
+		log_msg(OTTS_LOG_INFO, "Module %s speaks on sink %s.",
+			output->name, sink->name);
+		set_str = g_string_new("");
+		g_string_append_printf(set_str, "audio_output_method=%s\n",
+				       method);
+		ADD_SINK_SET_STR(audio_oss_device, "oss");
+		ADD_SINK_SET_STR(audio_alsa_device, "alsa");
+		ADD_SINK_SET_STR(audio_nas_server, "nas");
+		ADD_SINK_SET_STR(audio_pulse_server, "pulse");
+		ADD_SET_INT(audio_pulse_min_length);
+		ADD_SET_STR(audio_resample_quality);
+		ADD_SET_INT(audio_pulse_target_length);
+		ADD_SET_INT(audio_pulse_min_request);
+		ADD_SET_INT(audio_alsa_mmap);
+
+		err = output_send_request(output, OTTS_OP_AUDIO, "AUDIO\n",
+					  set_str->str);
+		g_string_free(set_str, 1);
+	}
+	if (err < 0)
+		return err;
+
+	g_free(output->audio_sink);
+	output->audio_sink = sink->audio_output_method != NULL ?
+	    g_strdup(sink->name) : NULL;
+
 	return 0;
 }
 
+#undef ADD_SINK_SET_STR
+
 int output_send_loglevel_setting(OutputModule * output)
 {
 	GString *set_str;
@@ -480,18 +1594,20 @@ int output_send_loglevel_setting(OutputModule * output)
 	set_str = g_string_new("");
 	ADD_SET_INT(log_level);
 
-	SEND_CMD_N("LOGLEVEL");
-	SEND_DATA_N(set_str->str);
-	SEND_CMD_N(".");
-
+	err = output_send_request(output, OTTS_OP_LOGLEVEL, "LOGLEVEL\n",
+				  set_str->str);
 	g_string_free(set_str, 1);
 
-	return 0;
+	return err < 0 ? err : 0;
 }
 
 #undef ADD_SET_INT
 #undef ADD_SET_STR
 
+/*
+ * Called with the output layer locked, or by the thread starting the
+ * module.
+ */
 int output_send_debug(OutputModule * output, int flag, char *log_path)
 {
 	char *cmd_str;
@@ -500,121 +1616,349 @@ int output_send_debug(OutputModule * output, int flag, char *log_path)
 	log_msg(OTTS_LOG_INFO, "Module sending debug flag %d with file %s",
 		flag, log_path);
 
-	output_lock();
 	if (flag) {
-		cmd_str = g_strdup_printf("DEBUG ON %s \n", log_path);
-		err = output_send_data(cmd_str, output, 1);
+		if (output->protocol == OTTS_MODPROTO_VERSION) {
+			cmd_str = g_strdup_printf("ON %s", log_path);
+			err = output_send_request(output, OTTS_OP_DEBUG, NULL,
+						  cmd_str);
+		} else {
+			cmd_str = g_strdup_printf("DEBUG ON %s \n", log_path);
+			err = output_send_data(cmd_str, output, 1);
+		}
 		g_free(cmd_str);
 		if (err) {
 			log_msg(OTTS_LOG_NOTICE,
 				"ERROR: Can't set debugging on for output module %s",
 				output->name);
-			OL_RET(-1);
+			return -1;
 		}
 	} else {
-		err = output_send_data("DEBUG OFF \n", output, 1);
+		if (output->protocol == OTTS_MODPROTO_VERSION)
+			err = output_send_request(output, OTTS_OP_DEBUG, NULL,
+						  "OFF");
+		else
+			err = output_send_data("DEBUG OFF \n", output, 1);
 		if (err) {
 			log_msg(OTTS_LOG_NOTICE,
 				"ERROR: Can't switch debugging off for output module %s",
 				output->name);
-			OL_RET(-1);
+			return -1;
 		}
 
 	}
 
-	OL_RET(0);
+	return 0;
 }
 
-int output_speak(openttsd_message * msg)
+/* Send msg and its settings to output, see output_speak() */
+static int output_speak_message(openttsd_message * msg,
+				OutputModule * output, speak_sink_t * sink)
 {
-	OutputModule *output;
 	int err;
 	int ret;
 
-	if (msg == NULL)
-		return -1;
+	/* Insert index marks into textual messages */
+	if (msg->settings.type == SPD_MSGTYPE_TEXT)
+		insert_index_marks(msg, msg->settings.ssml_mode);
 
-	output_lock();
+	/* Frames carry the text verbatim, only the text protocol
+	   needs the dot escaping */
+	if (output->protocol != OTTS_MODPROTO_VERSION)
+		msg->buf = escape_dot(msg->buf);
+	msg->bytes = -1;
 
-	/* Determine which output module should be used */
-	output = get_output_module(msg);
-	if (output == NULL) {
-		log_msg(OTTS_LOG_NOTICE, "Output module doesn't work...");
-		OL_RET(-1)
-	}
+	output_set_speaking_monitor(msg, output, sink);
 
-	msg->buf = escape_dot(msg->buf);
-	msg->bytes = -1;
+	g_free(output->timing_voice);
+	if (msg->settings.msg_settings.voice.name != NULL)
+		output->timing_voice =
+		    g_strdup(msg->settings.msg_settings.voice.name);
+	else
+		output->timing_voice =
+		    voice2str(msg->settings.msg_settings.voice_type);
 
-	output_set_speaking_monitor(msg, output);
+	ret = output_send_sink_audio_settings(output, sink);
+	if (ret != 0)
+		return ret;
 
 	ret = output_send_settings(msg, output);
 	if (ret != 0)
-		OL_RET(ret);
+		return ret;
 
 	log_msg(OTTS_LOG_INFO, "Module speak!");
 
+	/* With the binary protocol, the reply is collected together
+	   with the events */
+	if (output->protocol == OTTS_MODPROTO_VERSION)
+		return output_send_frame(output, OTTS_OP_SPEAK,
+					 msg->settings.type, msg->buf,
+					 strlen(msg->buf), NULL);
+
 	switch (msg->settings.type) {
 	case SPD_MSGTYPE_TEXT:
-		SEND_CMD("SPEAK") break;
+		SEND_CMD_N("SPEAK") break;
 	case SPD_MSGTYPE_SOUND_ICON:
-		SEND_CMD("SOUND_ICON");
+		SEND_CMD_N("SOUND_ICON");
 		break;
 	case SPD_MSGTYPE_CHAR:
-		SEND_CMD("CHAR");
+		SEND_CMD_N("CHAR");
 		break;
 	case SPD_MSGTYPE_KEY:
-		SEND_CMD("KEY");
+		SEND_CMD_N("KEY");
 		break;
 	default:
 		log_msg(OTTS_LOG_WARN,
 			"Invalid message type in output_speak()!");
 	}
 
-	SEND_DATA(msg->buf)
-	    SEND_CMD("\n.")
+	SEND_DATA_N(msg->buf)
+	err = output_send_last("\n.\n", output);
+	if (err < 0)
+		return err;
 
-	    OL_RET(0)
+	return 0;
 }
 
-int output_stop()
+int output_speak(openttsd_message * msg, speak_sink_t * sink)
 {
-	int err;
 	OutputModule *output;
+	int ret;
+
+	if (msg == NULL)
+		return -1;
+
+	output_lock();
+
+	/* Determine which output module should be used */
+	output = get_output_module(msg);
+	if (output == NULL) {
+		log_msg(OTTS_LOG_NOTICE, "Output module doesn't work...");
+		OL_RET(-1)
+	}
+
+	/* One module instance speaks on one sink at a time.  A module
+	   which is starting gets the message once it is started, see
+	   module_started(). */
+	if (output->busy || output->starting)
+		OL_RET(-4)
+
+	/*
+	 * The module is busy from now on, which keeps the other speak
+	 * threads, the voice list refresh and the idle reaper off it.
+	 * While it is talking, the replies which may take long are
+	 * waited for with the output layer unlocked, see
+	 * output_send_last().
+	 */
+	output->busy = 1;
+	output->talking = 1;
+	ret = output_speak_message(msg, output, sink);
+	output->talking = 0;
+	if (ret == 0)
+		output_module_start(output);
+	else
+		output->busy = 0;
+
+	OL_RET(ret)
+}
+
+/*
+ * Send msg, the message expected to be spoken next, to the module which
+ * is speaking now, so that it can synthesize it in advance.  This only
+ * pays off if that module also gets to speak msg, with the settings it
+ * has now; in any other case nothing is sent.  Modules which can't
+ * prepare messages refuse the first PREPARE and get no more.
+ */
+int output_prepare(openttsd_message * msg, OutputModule * output)
+{
+	openttsd_message marked;
+	GString *set_str;
+	GString *delta;
+	gpointer last_index;
+	int ret;
+
+	if (msg == NULL || output == NULL)
+		return -1;
 
 	output_lock();
 
-	if (speaking_module == NULL) {
-		OL_RET(0);
+	if (!output->working || output->protocol != OTTS_MODPROTO_VERSION
+	    || !output->can_prepare)
+		OL_RET(0)
+	if (msg->settings.output_module == NULL
+	    || strcmp(msg->settings.output_module, output->pool_name))
+		OL_RET(0)
+	if (output->pool_size > 1) {
+		/* Only the instance the client used last is picked again */
+		last_index = client_instances == NULL ? NULL :
+		    g_hash_table_lookup(client_instances,
+					GINT_TO_POINTER(msg->settings.uid));
+		if (GPOINTER_TO_INT(last_index) != output->pool_index + 1)
+			OL_RET(0)
+	}
+
+	set_str = output_settings_string(msg, output);
+	delta = output_settings_delta(output, set_str->str);
+	g_string_free(set_str, 1);
+	if (delta != NULL) {
+		g_string_free(delta, 1);
+		OL_RET(0)
+	}
+
+	/* The same text output_speak() is going to send */
+	marked = *msg;
+	marked.buf = g_strdup(msg->buf);
+	if (marked.settings.type == SPD_MSGTYPE_TEXT)
+		insert_index_marks(&marked, marked.settings.ssml_mode);
+
+	/* A STOP sent meanwhile resets prepared_id under write_mutex */
+	pthread_mutex_lock(&output->write_mutex);
+	if (output->prepared_id != msg->id) {
+		log_msg(OTTS_LOG_INFO, "Module prepare!");
+		ret = output_write_frame(output, OTTS_OP_PREPARE,
+					 marked.settings.type, marked.buf,
+					 strlen(marked.buf), NULL);
+		if (ret == 0)
+			output->prepared_id = msg->id;
 	} else {
-		output = speaking_module;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&output->write_mutex);
+	g_free(marked.buf);
+
+	OL_RET(output_frame_result(output, ret))
+}
+
+/*
+ * Ask a module to stop speaking through the write end of its cancel
+ * pipe.  It takes no lock, so it can run ahead of the regular stop
+ * path, which still has to follow with output_stop().  The caller
+ * makes sure the descriptor isn't closed meanwhile, see
+ * speaking_silence().
+ */
+void output_cancel(int cancel_fd)
+{
+	char buf = 'C';
+
+	log_msg(OTTS_LOG_INFO, "Module cancel!");
+	/* A full pipe already carries a request the module didn't read */
+	if (safe_write(cancel_fd, &buf, 1) == -1
+	    && errno != EAGAIN)
+		log_msg(OTTS_LOG_WARN, "Can't write to the cancel pipe: %s",
+			strerror(errno));
+}
+
+int output_stop(OutputModule * output)
+{
+	int err;
+	int ret;
+
+	if (output == NULL || !output->working)
+		return 0;
+
+	/* With the binary protocol, STOP doesn't wait for the output
+	   layer, which may be busy with a request to the same module */
+	if (output->protocol == OTTS_MODPROTO_VERSION) {
+		log_msg(OTTS_LOG_INFO, "Module stop!");
+		pthread_mutex_lock(&output->write_mutex);
+		/* The module drops what it prepared */
+		output->prepared_id = 0;
+		ret = output_write_frame(output, OTTS_OP_STOP, 0, NULL, 0,
+					 NULL);
+		pthread_mutex_unlock(&output->write_mutex);
+		return output_frame_result(output, ret);
 	}
 
+	output_lock();
+
 	log_msg(OTTS_LOG_INFO, "Module stop!");
 	SEND_DATA("STOP\n");
 
 	OL_RET(0)
 }
 
-size_t output_pause()
+size_t output_pause(OutputModule * output)
 {
-	static int err;
-	static OutputModule *output;
+	int err;
 
-	output_lock();
+	if (output == NULL || !output->working)
+		return 0;
 
-	if (speaking_module == NULL) {
-		OL_RET(0);
-	} else {
-		output = speaking_module;
+	if (output->protocol == OTTS_MODPROTO_VERSION) {
+		log_msg(OTTS_LOG_INFO, "Module pause!");
+		return output_send_frame(output, OTTS_OP_PAUSE, 0, NULL, 0,
+					 NULL);
 	}
 
+	output_lock();
+
 	log_msg(OTTS_LOG_INFO, "Module pause!");
 	SEND_DATA("PAUSE\n");
 
 	OL_RET(0)
 }
 
+int output_has_pending_events(OutputModule * output)
+{
+	int pending;
+
+	if (output == NULL)
+		return 0;
+
+	output_lock();
+	pending = !g_queue_is_empty(output->events);
+	OL_RET(pending);
+}
+
+/*
+ * Binary protocol counterpart of output_module_is_speaking(), called
+ * with the output layer locked.  A NULL entry in output->events stands
+ * for a SPEAK request the module refused.
+ */
+static int output_module_next_event(OutputModule * output, char **index_mark)
+{
+	otts_frame_header_t header;
+	char *data;
+
+	if (!g_queue_is_empty(output->events)) {
+		*index_mark = g_queue_pop_head(output->events);
+		return *index_mark != NULL ? 0 : -1;
+	}
+
+	if (otts_frame_read(output->pipe_out[0], &header, &data) == -1) {
+		output_broken_pipe(output);
+		*index_mark = NULL;
+		return -1;
+	}
+
+	if (header.opcode == OTTS_OP_EVENT) {
+		*index_mark = output_event_to_index_mark(output, &header,
+							 data);
+		g_free(data);
+		if (*index_mark == NULL && header.arg == 705)
+			*index_mark = g_strdup("no");
+		return *index_mark != NULL ? 0 : -5;
+	}
+
+	if (header.opcode != OTTS_OP_REPLY) {
+		log_msg2(2, "output_module",
+			 "Unexpected frame from output module: opcode %d seq %u",
+			 header.opcode, header.seq);
+		*index_mark = g_strdup("no");
+		g_free(data);
+		return 0;
+	}
+
+	/* Replies carry no index mark */
+	if (output_handle_async_reply(output, &header, data)) {
+		*index_mark = NULL;
+		g_free(data);
+		return -1;
+	}
+	*index_mark = g_strdup("no");
+	g_free(data);
+	return 0;
+}
+
 int output_module_is_speaking(OutputModule * output, char **index_mark)
 {
 	GString *response;
@@ -630,6 +1974,9 @@ int output_module_is_speaking(OutputModule * output, char **index_mark)
 		OL_RET(-1);
 	}
 
+	if (output->protocol == OTTS_MODPROTO_VERSION)
+		OL_RET(output_module_next_event(output, index_mark));
+
 	response = output_read_reply(output);
 	if (response == NULL) {
 		*index_mark = NULL;
@@ -720,21 +2067,6 @@ int output_module_is_speaking(OutputModule * output, char **index_mark)
 	OL_RET(retcode)
 }
 
-int output_is_speaking(char **index_mark)
-{
-	int err;
-	OutputModule *output;
-
-	output = speaking_module;
-
-	err = output_module_is_speaking(output, index_mark);
-	if (err < 0) {
-		*index_mark = NULL;
-	}
-
-	return err;
-}
-
 /* Wait until the child _pid_ returns with timeout. Calls waitpid() each 100ms
  until timeout is exceeded. This is not exact and you should not rely on the 
  exact time waited. */
@@ -764,17 +2096,29 @@ int output_close(OutputModule * module)
 	if (output == NULL)
 		return -1;
 
+	/* Nothing runs for a dormant module */
+	if (output->dormant)
+		return 0;
+
 	output_lock();
 
 	assert(output->name != NULL);
 	log_msg(OTTS_LOG_NOTICE, "Closing module \"%s\"...", output->name);
-	if (output->working) {
+	if (output->working && output->protocol == OTTS_MODPROTO_VERSION) {
+		output_send_frame(output, OTTS_OP_STOP, 0, NULL, 0, NULL);
+		output_send_request(output, OTTS_OP_QUIT, NULL, NULL);
+		usleep(100);
+	} else if (output->working) {
 		SEND_DATA("STOP\n");
 		SEND_CMD("QUIT");
 		usleep(100);
 		/* So that the module has some time to exit() correctly */
 	}
 
+	/* The thread of a plugin module has ended after QUIT */
+	if (output->in_process)
+		OL_RET(0)
+
 	log_msg(OTTS_LOG_INFO, "Waiting for module pid %d", module->pid);
 	ret = waitpid_with_timeout(module->pid, NULL, 0, 1000);
 	if (ret > 0) {
@@ -816,7 +2160,11 @@ int output_check_module(OutputModule * output)
 	log_msg(OTTS_LOG_NOTICE, "Output module working status: %d (pid:%d)",
 		output->working, output->pid);
 
-	if (output->working == 0) {
+	if (output->working == 0 && output->in_process) {
+		log_msg(OTTS_LOG_WARN,
+			"In-process output module %s stopped responding.",
+			output->name);
+	} else if (output->working == 0) {
 		/* Investigate on why it crashed */
 		ret = waitpid(output->pid, &status, WNOHANG);
 		if (ret == 0) {
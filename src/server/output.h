@@ -24,6 +24,7 @@
 #define OUTPUT_H
 #include <glib.h>
 
+#include <modproto.h>
 #include "opentts/opentts_types.h"
 #include "openttsd.h"
 #include "speaking.h"
@@ -31,19 +32,49 @@
 
 OutputModule *get_output_module(const openttsd_message * message);
 
-int output_speak(openttsd_message * msg);
-int output_stop();
-size_t output_pause();
-int output_is_speaking(char **index_mark);
+int output_speak(openttsd_message * msg, speak_sink_t * sink);
+void output_cancel(int cancel_fd);
+int output_stop(OutputModule * output);
+size_t output_pause(OutputModule * output);
+int output_prepare(openttsd_message * msg, OutputModule * output);
 int output_send_debug(OutputModule * output, int flag, char *logfile_path);
 
 int output_check_module(OutputModule * output);
 
+/* Seconds between two looks for idle modules */
+#define OUTPUT_IDLE_CHECK_PERIOD 10
+void *output_idle_reaper(void *data);
+
 char *escape_dot(char *otext);
 
-void output_set_speaking_monitor(openttsd_message * msg, OutputModule * output);
+void output_set_speaking_monitor(openttsd_message * msg, OutputModule * output,
+				 speak_sink_t * sink);
 GString *output_read_reply(OutputModule * output);
 int output_send_data(char *cmd, OutputModule * output, int wfr);
+int output_negotiate_protocol(OutputModule * output);
+int output_plugin_initialized(OutputModule * output);
+int output_has_pending_events(OutputModule * output);
+int output_poll_module(OutputModule * output, int timeout);
+int output_request_timeout(OutputModule * output);
+int output_check_requests(OutputModule * output);
+void output_count_module_restart(const char *name);
+/* Synthesis timing of a module and voice, the sums over its messages */
+typedef struct {
+	char *module;
+	char *voice;
+	unsigned long messages;
+	unsigned long first_audio_ms;
+	unsigned long synthesis_ms;
+	unsigned long audio_ms;
+} output_timing_stats_t;
+
+GList *output_get_timing_stats(void);
+void output_get_module_stats(const char *name, unsigned int *timeouts,
+			     unsigned int *restarts, unsigned long *messages,
+			     unsigned long *busy_ms);
+void output_module_done(OutputModule * output);
+void output_forget_client(int uid);
+GList *output_get_module_names(int pools_only);
 int output_send_settings(openttsd_message * msg, OutputModule * output);
 int output_send_audio_settings(OutputModule * output);
 int output_send_loglevel_setting(OutputModule * output);
@@ -51,6 +82,10 @@ int output_module_is_speaking(OutputModule * output, char **index_mark);
 int waitpid_with_timeout(pid_t pid, int *status_ptr, int options,
 			 size_t timeout);
 int output_close(OutputModule * module);
-SPDVoice **output_list_voices(char *module_name);
+char *output_list_voices(char *module_name);
+void output_set_voices(OutputModule * module, SPDVoice ** voices);
+void output_free_voices(SPDVoice ** voices);
+SPDVoice *output_find_voice(OutputModule * module, const char *name);
 int _output_get_voices(OutputModule * module);
+int output_refresh_voices(OutputModule * output);
 #endif
@@ -585,6 +585,17 @@ char *parse_set(const char *buf, const int bytes, const int fd)
 		if (ret)
 			return g_strdup(ERR_COULDNT_SET_OUTPUT_MODULE);
 		return g_strdup(OK_OUTPUT_MODULE_SET);
+	} else if (TEST_CMD(set_sub, "audio_sink")) {
+		char *audio_sink;
+		NOT_ALLOWED_INSIDE_BLOCK();
+		GET_PARAM_STR(audio_sink, 3, CONV_DOWN);
+
+		SSIP_SET_COMMAND(audio_sink);
+		g_free(audio_sink);
+
+		if (ret)
+			return g_strdup(ERR_COULDNT_SET_AUDIO_SINK);
+		return g_strdup(OK_AUDIO_SINK_SET);
 	} else if (TEST_CMD(set_sub, "cap_let_recogn")) {
 		SPDCapitalLetters capital_letter_recognition;
 		char *recognition;
@@ -652,6 +663,18 @@ char *parse_set(const char *buf, const int bytes, const int fd)
 		ret = set_notification_self(fd, scope, par);
 		g_free(scope);
 
+		if (ret)
+			return g_strdup(ERR_COULDNT_SET_NOTIFICATION);
+		return g_strdup(OK_NOTIFICATION_SET);
+	} else if (TEST_CMD(set_sub, "notification_batch")) {
+		int window;
+
+		if (who != 0)
+			return g_strdup(ERR_PARAMETER_INVALID);
+
+		GET_PARAM_INT(window, 3);
+
+		ret = set_notification_batch_self(fd, window);
 		if (ret)
 			return g_strdup(ERR_COULDNT_SET_NOTIFICATION);
 		return g_strdup(OK_NOTIFICATION_SET);
@@ -674,6 +697,7 @@ char *parse_stop(const char *buf, const int bytes, const int fd)
 	GET_PARAM_STR(who_s, 1, CONV_DOWN);
 
 	if (TEST_CMD(who_s, "all")) {
+		speaking_silence(0);
 		pthread_mutex_lock(&element_free_mutex);
 		speaking_stop_all();
 		pthread_mutex_unlock(&element_free_mutex);
@@ -681,6 +705,7 @@ char *parse_stop(const char *buf, const int bytes, const int fd)
 		uid = get_client_uid_by_fd(fd);
 		if (uid == 0)
 			return g_strdup(ERR_INTERNAL);
+		speaking_silence(uid);
 		pthread_mutex_lock(&element_free_mutex);
 		speaking_stop(uid);
 		pthread_mutex_unlock(&element_free_mutex);
@@ -690,6 +715,7 @@ char *parse_stop(const char *buf, const int bytes, const int fd)
 
 		if (uid <= 0)
 			return g_strdup(ERR_ID_NOT_EXIST);
+		speaking_silence(uid);
 		pthread_mutex_lock(&element_free_mutex);
 		speaking_stop(uid);
 		pthread_mutex_unlock(&element_free_mutex);
@@ -711,11 +737,13 @@ char *parse_cancel(const char *buf, const int bytes, const int fd)
 	GET_PARAM_STR(who_s, 1, CONV_DOWN);
 
 	if (TEST_CMD(who_s, "all")) {
+		speaking_silence(0);
 		speaking_cancel_all();
 	} else if (TEST_CMD(who_s, "self")) {
 		uid = get_client_uid_by_fd(fd);
 		if (uid == 0)
 			return g_strdup(ERR_INTERNAL);
+		speaking_silence(uid);
 		speaking_cancel(uid);
 	} else if (isanum(who_s)) {
 		uid = atoi(who_s);
@@ -723,6 +751,7 @@ char *parse_cancel(const char *buf, const int bytes, const int fd)
 
 		if (uid <= 0)
 			return g_strdup(ERR_ID_NOT_EXIST);
+		speaking_silence(uid);
 		speaking_cancel(uid);
 	} else {
 		g_free(who_s);
@@ -745,26 +774,18 @@ char *parse_pause(const char *buf, const int bytes, const int fd)
 	   to allow the speaking loop detect the request for pause */
 
 	if (TEST_CMD(who_s, "all")) {
-		pause_requested = 1;
-		pause_requested_fd = fd;
-		speaking_semaphore_post();
+		speaking_request_pause(fd, 0);
 	} else if (TEST_CMD(who_s, "self")) {
 		uid = get_client_uid_by_fd(fd);
 		if (uid == 0)
 			return g_strdup(ERR_INTERNAL);
-		pause_requested = 2;
-		pause_requested_fd = fd;
-		pause_requested_uid = uid;
-		speaking_semaphore_post();
+		speaking_request_pause(fd, uid);
 	} else if (isanum(who_s)) {
 		uid = atoi(who_s);
 		g_free(who_s);
 		if (uid <= 0)
 			return g_strdup(ERR_ID_NOT_EXIST);
-		pause_requested = 2;
-		pause_requested_fd = fd;
-		pause_requested_uid = uid;
-		speaking_semaphore_post();
+		speaking_request_pause(fd, uid);
 	} else {
 		g_free(who_s);
 		return g_strdup(ERR_PARAMETER_INVALID);
@@ -881,16 +902,18 @@ char *parse_list(const char *buf, const int bytes, const int fd)
 	} else if (TEST_CMD(list_type, "output_modules")) {
 		GString *result;
 		char *helper;
-		GList *gl = g_hash_table_get_keys(output_modules);
-		int i, len;
+		/* List a module pool only once */
+		GList *gl = output_get_module_names(1);
+		GList *l;
 
 		result = g_string_new("");
-		len = g_list_length(gl);
-		log_msg(OTTS_LOG_DEBUG, "G LIST LENGHT IS %d", len);
-		for (i = 0; i < len; i++) {
+		log_msg(OTTS_LOG_DEBUG, "G LIST LENGHT IS %d",
+			g_list_length(gl));
+		for (l = gl; l != NULL; l = l->next)
 			g_string_append_printf(result, C_OK_MODULES "-%s\r\n",
-			                       (char *)g_list_nth_data(gl, i));
-		}
+			                       (char *)l->data);
+		g_list_foreach(gl, (GFunc) g_free, NULL);
+		g_list_free(gl);
 		g_string_append(result, OK_MODULES_LIST_SENT);
 		helper = result->str;
 		g_string_free(result, 0);
@@ -899,10 +922,7 @@ char *parse_list(const char *buf, const int bytes, const int fd)
 		char *module_name;
 		int uid;
 		TFDSetElement *settings;
-		SPDVoice **voices;
-		GString *result;
-		int i;
-		char *helper;
+		char *voices;
 
 		uid = get_client_uid_by_fd(fd);
 		settings = get_client_settings_by_uid(uid);
@@ -911,21 +931,61 @@ char *parse_list(const char *buf, const int bytes, const int fd)
 		module_name = settings->output_module;
 		if (module_name == NULL)
 			return g_strdup(ERR_NO_OUTPUT_MODULE);
+		/* The reply is serialized when the voices are loaded */
 		voices = output_list_voices(module_name);
 		if (voices == NULL)
 			return g_strdup(ERR_CANT_REPORT_VOICES);
+		return voices;
+	} else if (TEST_CMD(list_type, "module_statistics")) {
+		GString *result;
+		char *helper;
+		GList *gl = output_get_module_names(0);
+		GList *l;
+		unsigned int timeouts, restarts;
+		unsigned long messages, busy_ms;
 
 		result = g_string_new("");
-		for (i = 0;; i++) {
-			if (voices[i] == NULL)
-				break;
+		for (l = gl; l != NULL; l = l->next) {
+			output_get_module_stats(l->data, &timeouts, &restarts,
+						&messages, &busy_ms);
+			g_string_append_printf(result,
+					       C_OK_MODULE_STATS
+					       "-%s %u %u %lu %lu\r\n",
+					       (char *)l->data, timeouts,
+					       restarts, messages, busy_ms);
+		}
+		g_list_foreach(gl, (GFunc) g_free, NULL);
+		g_list_free(gl);
+		g_string_append(result, OK_MODULE_STATS_SENT);
+		helper = result->str;
+		g_string_free(result, 0);
+		return helper;
+	} else if (TEST_CMD(list_type, "module_timing")) {
+		GString *result;
+		char *helper;
+		GList *gl = output_get_timing_stats();
+		GList *l;
+		output_timing_stats_t *stats;
+
+		result = g_string_new("");
+		for (l = gl; l != NULL; l = l->next) {
+			stats = l->data;
 			g_string_append_printf(result,
-					       C_OK_VOICES "-%s %s %s\r\n",
-					       voices[i]->name,
-					       voices[i]->language,
-					       voices[i]->variant);
+					       C_OK_MODULE_TIMING
+					       "-%s %s %lu %lu %lu %lu %.3f\r\n",
+					       stats->module, stats->voice,
+					       stats->messages,
+					       stats->first_audio_ms /
+					       stats->messages,
+					       stats->synthesis_ms,
+					       stats->audio_ms,
+					       stats->audio_ms > 0 ?
+					       (double)stats->synthesis_ms /
+					       stats->audio_ms : 0.0);
+			g_free(stats);
 		}
-		g_string_append(result, OK_VOICE_LIST_SENT);
+		g_list_free(gl);
+		g_string_append(result, OK_MODULE_TIMING_SENT);
 		helper = result->str;
 		g_string_free(result, 0);
 		return helper;
@@ -27,14 +27,11 @@
 #include <config.h>
 #endif
 
-#include <unistd.h>
-
 #include "openttsd.h"
+#include "speaking.h"
 #include "sem_functions.h"
 
 void speaking_semaphore_post(void)
 {
-	char buf[1];
-	buf[0] = 42;
-	write(speaking_pipe[1], buf, 1);
+	speaking_wake_sinks();
 }
@@ -84,6 +84,8 @@ queue_message(openttsd_message * new, int fd, int history_flag,
 {
 	TFDSetElement *settings;
 	openttsd_message *hist_msg, *message_copy;
+	speak_sink_t *sink;
+	queue_t *queue;
 	int id;
 	GList *element;
 
@@ -121,6 +123,7 @@ queue_message(openttsd_message * new, int fd, int history_flag,
 		COPY_SET_STR(output_module);
 		COPY_SET_STR(msg_settings.voice.language);
 		COPY_SET_STR(msg_settings.voice.name);
+		COPY_SET_STR(audio_sink);
 
 		/* And we set the global id (note that this is really global, not
 		 * depending on the particular client, but unique) */
@@ -148,39 +151,42 @@ queue_message(openttsd_message * new, int fd, int history_flag,
 		pthread_mutex_unlock(&element_free_mutex);
 	}
 
+	sink = speaking_get_sink(new->settings.audio_sink);
+	queue = sink->queue;
+
 	pthread_mutex_lock(&element_free_mutex);
 	/* Put the element new to queue according to it's priority. */
 	check_locked(&element_free_mutex);
 	switch (settings->priority) {
 	case SPD_IMPORTANT:
-		MessageQueue->p1 = g_list_append(MessageQueue->p1, new);
+		queue->p1 = g_list_append(queue->p1, new);
 		break;
 	case SPD_MESSAGE:
-		MessageQueue->p2 = g_list_append(MessageQueue->p2, new);
+		queue->p2 = g_list_append(queue->p2, new);
 		break;
 	case SPD_TEXT:
-		MessageQueue->p3 = g_list_append(MessageQueue->p3, new);
+		queue->p3 = g_list_append(queue->p3, new);
 		break;
 	case SPD_NOTIFICATION:
-		MessageQueue->p4 = g_list_append(MessageQueue->p4, new);
+		queue->p4 = g_list_append(queue->p4, new);
 		break;
 	case SPD_PROGRESS:
-		MessageQueue->p5 = g_list_append(MessageQueue->p5, new);
+		queue->p5 = g_list_append(queue->p5, new);
 		/* clear last_p5_block if we get new block or no block message */
-		element = g_list_last(last_p5_block);
+		element = g_list_last(sink->last_p5_block);
 		if (!element || !element->data
 		    || ((openttsd_message *) (element->data))->settings.
 		    reparted != new->settings.reparted) {
-			g_list_foreach(last_p5_block, (GFunc) mem_free_message,
-				       NULL);
-			g_list_free(last_p5_block);
-			last_p5_block = NULL;
+			g_list_foreach(sink->last_p5_block,
+				       (GFunc) mem_free_message, NULL);
+			g_list_free(sink->last_p5_block);
+			sink->last_p5_block = NULL;
 		}
 		/* insert message */
 		message_copy = copy_message(new);
 		if (message_copy != NULL)
-			last_p5_block =
-			    g_list_append(last_p5_block, message_copy);
+			sink->last_p5_block =
+			    g_list_append(sink->last_p5_block, message_copy);
 
 		break;
 	default:
@@ -194,7 +200,7 @@ queue_message(openttsd_message * new, int fd, int history_flag,
 	   not the best approach possible. Especially the part that
 	   calls output_stop() should be moved to speaking.c speak()
 	   function in future */
-	resolve_priorities(settings->priority);
+	resolve_priorities(sink, settings->priority);
 	pthread_mutex_unlock(&element_free_mutex);
 
 	speaking_semaphore_post();
@@ -36,6 +36,7 @@
 #include "alloc.h"
 #include "msg.h"
 #include "set.h"
+#include "speaking.h"
 
 int set_priority_self(int fd, SPDPriority priority)
 {
@@ -294,6 +295,7 @@ void update_cl_settings(gpointer data, gpointer user_data)
 	CHECK_SET_PAR(ssml_mode, -1)
 	CHECK_SET_PAR_STR(msg_settings.voice.language)
 	CHECK_SET_PAR_STR(output_module)
+	CHECK_SET_PAR_STR(audio_sink)
 
 	return;
 }
@@ -355,6 +357,29 @@ int set_output_module_uid(int uid, char *output_module)
 	return 0;
 }
 
+SET_SELF_ALL(char *, audio_sink)
+
+int set_audio_sink_uid(int uid, char *audio_sink)
+{
+	TFDSetElement *settings;
+
+	settings = get_client_settings_by_uid(uid);
+	if (settings == NULL)
+		return 1;
+	if (audio_sink == NULL)
+		return 1;
+
+	/* Only configured sinks can be chosen */
+	if (strcmp(speaking_get_sink(audio_sink)->name, audio_sink))
+		return 1;
+
+	log_msg(OTTS_LOG_DEBUG, "Setting audio sink to %s", audio_sink);
+
+	settings->audio_sink = set_param_str(settings->audio_sink, audio_sink);
+
+	return 0;
+}
+
 SET_SELF_ALL(int, pause_context)
 
 int set_pause_context_uid(int uid, int pause_context)
@@ -458,6 +483,26 @@ int set_notification_self(int fd, char *type, int val)
 
 }
 
+int set_notification_batch_self(int fd, int window)
+{
+	TFDSetElement *settings;
+	int uid;
+
+	if ((window < 0) || (window > 1000))
+		return 1;
+
+	uid = get_client_uid_by_fd(fd);
+	if (uid == 0)
+		return 1;
+
+	settings = get_client_settings_by_uid(uid);
+	if (settings == NULL)
+		return 1;
+
+	settings->notification_batch = window;
+	return 0;
+}
+
 int get_client_uid_by_fd(int fd)
 {
 	int *uid;
@@ -48,6 +48,7 @@ int set_synthesis_voice_uid(int uid, char *synthesis_voice);
 int set_punctuation_mode_uid(int uid, SPDPunctuation punctuation);
 int set_capital_letter_recognition_uid(int uid, SPDCapitalLetters recogn);
 int set_output_module_uid(int uid, char *output_module);
+int set_audio_sink_uid(int uid, char *audio_sink);
 int set_ssml_mode_uid(int uid, SPDDataMode ssml_mode);
 int set_pause_context_uid(int uid, int pause_context);
 int set_debug_uid(int uid, int debug);
@@ -62,6 +63,7 @@ int set_punct_mode_self(int fd, SPDPunctuation punct);
 int set_cap_let_recog_self(int fd, SPDCapitalLetters recog);
 int set_spelling_self(int fd, SPDSpelling spelling);
 int set_output_module_self(int fd, char *output_module);
+int set_audio_sink_self(int fd, char *audio_sink);
 int set_client_name_self(int fd, char *client_name);
 int set_voice_self(int fd, char *voice);
 int set_synthesis_voice_self(int fd, char *synthesis_voice);
@@ -69,6 +71,7 @@ int set_punctuation_mode_self(int fd, SPDPunctuation punctuation);
 int set_capital_letter_recognition_self(int fd, SPDCapitalLetters recogn);
 int set_ssml_mode_self(int fd, SPDDataMode ssml_mode);
 int set_notification_self(int fd, char *type, int val);
+int set_notification_batch_self(int fd, int window);
 int set_pause_context_self(int fd, int pause_context);
 int set_debug_self(int fd, int debug);
 int set_debug_destination_self(int fd, char *debug_destination);
@@ -82,6 +85,7 @@ int set_punct_mode_all(SPDPunctuation punct);
 int set_cap_let_recog_all(SPDCapitalLetters recog);
 int set_spelling_all(SPDSpelling spelling);
 int set_output_module_all(char *output_module);
+int set_audio_sink_all(char *audio_sink);
 int set_voice_all(char *voice);
 int set_synthesis_voice_all(char *synthesis_voice);
 int set_punctuation_mode_all(SPDPunctuation punctuation);
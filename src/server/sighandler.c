@@ -135,6 +135,11 @@ void init_blocked_sig_set(void)
 
 static void reload_dead_modules(void)
 {
+	/* Reap the processes of failed modules a standby replaced */
+	pthread_mutex_lock(&output_layer_mutex);
+	reap_retired_modules();
+	pthread_mutex_unlock(&output_layer_mutex);
+
 	/* Reload dead modules */
 	g_hash_table_foreach(output_modules, modules_reload, NULL);
 
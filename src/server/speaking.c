@@ -31,7 +31,10 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <pthread.h>
 #include <glib.h>
@@ -49,37 +52,143 @@
 #include "sem_functions.h"
 #include "speaking.h"
 
-static openttsd_message *current_message = NULL;
-static SPDPriority current_priority = SPD_TEXT;
-static gboolean thread_must_stop = FALSE;
 static pthread_mutex_t speak_stop_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static int SPEAKING = 0;
-int poll_count;
+/* All sinks, the default one first.  Sinks are never freed. */
+static GList *speak_sinks = NULL;
+static pthread_mutex_t speak_sinks_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Helper functions. */
-static void speaking_module_cleanup(void);
+static void speaking_module_cleanup(speak_sink_t * sink);
+static void speaking_prepare_next(speak_sink_t * sink);
+static void speaking_stop_sink(speak_sink_t * sink, int uid);
+
+speak_sink_t *speaking_sink_new(const char *name, const char *method,
+				const char *device)
+{
+	speak_sink_t *sink;
+	GList *gl;
+
+	pthread_mutex_lock(&speak_sinks_mutex);
+	for (gl = speak_sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		if (!strcmp(sink->name, name)) {
+			g_free(sink->audio_output_method);
+			g_free(sink->audio_device);
+			sink->audio_output_method = g_strdup(method);
+			sink->audio_device = g_strdup(device);
+			pthread_mutex_unlock(&speak_sinks_mutex);
+			return sink;
+		}
+	}
+
+	sink = g_malloc0(sizeof(speak_sink_t));
+	sink->name = g_strdup(name);
+	sink->audio_output_method = g_strdup(method);
+	sink->audio_device = g_strdup(device);
+	sink->queue = g_malloc0(sizeof(queue_t));
+	sink->current_priority = SPD_TEXT;
+	sink->cancel_fd = -1;
+	if (pipe(sink->pipe)) {
+		log_msg(OTTS_LOG_ERR, "Speaking pipe creation failed (%s)",
+			strerror(errno));
+		FATAL("Can't create pipe");
+	}
+	fcntl(sink->pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sink->pipe[1], F_SETFD, FD_CLOEXEC);
+	speak_sinks = g_list_append(speak_sinks, sink);
+	pthread_mutex_unlock(&speak_sinks_mutex);
+
+	log_msg(OTTS_LOG_INFO, "Audio sink %s created", name);
+
+	return sink;
+}
+
+speak_sink_t *speaking_get_sink(const char *name)
+{
+	speak_sink_t *sink = NULL;
+	GList *gl;
+
+	pthread_mutex_lock(&speak_sinks_mutex);
+	assert(speak_sinks != NULL);
+	if (name != NULL)
+		for (gl = speak_sinks; gl != NULL; gl = gl->next)
+			if (!strcmp(((speak_sink_t *) gl->data)->name, name)) {
+				sink = gl->data;
+				break;
+			}
+	if (sink == NULL)
+		sink = speak_sinks->data;
+	pthread_mutex_unlock(&speak_sinks_mutex);
+
+	return sink;
+}
+
+GList *speaking_get_sinks(void)
+{
+	GList *sinks;
+
+	pthread_mutex_lock(&speak_sinks_mutex);
+	sinks = g_list_copy(speak_sinks);
+	pthread_mutex_unlock(&speak_sinks_mutex);
+
+	return sinks;
+}
+
+void speaking_wake_sinks(void)
+{
+	char buf[1];
+	GList *gl;
+
+	buf[0] = 42;
+	pthread_mutex_lock(&speak_sinks_mutex);
+	for (gl = speak_sinks; gl != NULL; gl = gl->next)
+		write(((speak_sink_t *) gl->data)->pipe[1], buf, 1);
+	pthread_mutex_unlock(&speak_sinks_mutex);
+}
+
+void speaking_set_cancel_fd(speak_sink_t * sink, int fd)
+{
+	pthread_mutex_lock(&speak_sinks_mutex);
+	sink->cancel_fd = fd;
+	pthread_mutex_unlock(&speak_sinks_mutex);
+}
+
+void speaking_forget_cancel_fd(int fd)
+{
+	GList *gl;
+
+	pthread_mutex_lock(&speak_sinks_mutex);
+	for (gl = speak_sinks; gl != NULL; gl = gl->next)
+		if (((speak_sink_t *) gl->data)->cancel_fd == fd)
+			((speak_sink_t *) gl->data)->cancel_fd = -1;
+	pthread_mutex_unlock(&speak_sinks_mutex);
+}
 
 /*
   Speak() is responsible for getting right text from right
   queue in right time and saying it loud through the corresponding
-  synthetiser.  This runs in a separate thread.
+  synthetiser.  One such thread runs for every sink.
 */
 void *speak(void *data)
 {
+	speak_sink_t *sink = data;
 	openttsd_message *message = NULL;
 	int ret;
 	struct pollfd *poll_fds;	/* Descriptors to poll */
 	struct pollfd main_pfd;
 	struct pollfd helper_pfd;
 	int revents;
+	int pending_events;
+	int timeout;
+	int request_timeout;
 
 	/* Block all signals and set thread states */
 	set_speak_thread_attributes();
 
 	poll_fds = g_malloc(2 * sizeof(struct pollfd));
 
-	main_pfd.fd = speaking_pipe[0];
+	main_pfd.fd = sink->pipe[0];
 	main_pfd.events = POLLIN;
 	main_pfd.revents = 0;
 
@@ -89,13 +198,36 @@ void *speak(void *data)
 
 	poll_fds[0] = main_pfd;
 	poll_fds[1] = helper_pfd;
-	poll_count = 1;
+	sink->poll_count = 1;
 
 	while (1) {
-		ret = poll(poll_fds, poll_count, -1);
+		/* Events queued while waiting for a module reply must not
+		   wait for more activity on the pipe */
+		pending_events = sink->poll_count > 1
+		    && output_has_pending_events(sink->module);
+		timeout = pending_events ? 0 : report_batch_timeout();
+		/* Wake up in time for a module which doesn't answer */
+		if (sink->poll_count > 1) {
+			request_timeout = output_request_timeout(sink->module);
+			if (request_timeout >= 0
+			    && (timeout < 0 || request_timeout < timeout))
+				timeout = request_timeout;
+		}
+		ret = poll(poll_fds, sink->poll_count, timeout);
+		report_batch_flush_expired();
+		if (sink->poll_count > 1 && ret == 0
+		    && output_check_requests(sink->module) != 0) {
+			log_msg(OTTS_LOG_ERR,
+				"The current output module didn't answer in time.");
+			speaking_module_cleanup(sink);
+			continue;
+		}
+		if (ret == 0 && !pending_events)
+			continue;	/* Only the batching window expired */
 		log_msg(OTTS_LOG_DEBUG,
-			"Poll in speak() returned socket activity, main_pfd revents=%d, poll_pfd revents=%d",
-			poll_fds[0].revents, poll_fds[1].revents);
+			"Poll in speak() of sink %s returned %d, main_pfd revents=%d, poll_pfd revents=%d",
+			sink->name, ret, poll_fds[0].revents,
+			poll_fds[1].revents);
 		if ((revents = poll_fds[0].revents)) {
 			if (revents & POLLIN) {
 				char buf[100];
@@ -104,62 +236,66 @@ void *speak(void *data)
 				read(poll_fds[0].fd, buf, 1);
 			}
 		}
-		if (poll_count > 1) {
+		if (sink->poll_count > 1) {
 			if ((revents = poll_fds[1].revents)) {
 				if (revents & POLLHUP) {
 					/* The speaking module terminated */
 					/* abnormally.  Clean up. */
 					log_msg(OTTS_LOG_ERR,
 						"The current output module failed.");
-					speaking_module_cleanup();
+					speaking_module_cleanup(sink);
 				} else if ((revents & POLLIN)
 					   || (revents & POLLPRI)) {
 					log_msg(OTTS_LOG_DEBUG,
 						"wait_for_poll: activity on output_module");
 					/* Check if sb is speaking or they are all silent. 
 					 * If some synthesizer is speaking, we must wait. */
-					is_sb_speaking();
+					is_sb_speaking(sink);
 				}
+			} else if (pending_events) {
+				is_sb_speaking(sink);
 			}
 		}
 
 		/* Handle pause requests */
-		if (pause_requested) {
+		if (sink->pause_requested) {
 			log_msg(OTTS_LOG_INFO, "Trying to pause...");
-			if (pause_requested == 1)
-				speaking_pause_all(pause_requested_fd);
-			if (pause_requested == 2)
-				speaking_pause(pause_requested_fd,
-					       pause_requested_uid);
+			if (sink->pause_requested == 1)
+				speaking_pause_all(sink,
+						   sink->pause_requested_fd);
+			if (sink->pause_requested == 2)
+				speaking_pause(sink, sink->pause_requested_fd,
+					       sink->pause_requested_uid);
 			log_msg(OTTS_LOG_INFO, "Paused...");
-			pause_requested = 0;
+			sink->pause_requested = 0;
 			continue;
 		}
 
-		if (SPEAKING) {
+		if (sink->speaking) {
 			log_msg(OTTS_LOG_DEBUG,
 				"Continuing because already speaking in speak()");
+			speaking_prepare_next(sink);
 			continue;
 		}
 
 		/* Handle resume requests */
-		if (resume_requested) {
+		if (sink->resume_requested) {
 			GList *gl;
 
 			log_msg(OTTS_LOG_DEBUG, "Resume requested");
 
 			/* Is there any message after resume? */
-			if (g_list_length(MessagePausedList) != 0) {
+			if (g_list_length(sink->paused_list) != 0) {
 				while (1) {
 					pthread_mutex_lock(&element_free_mutex);
 					gl = g_list_find_custom
-					    (MessagePausedList, (void *)NULL,
+					    (sink->paused_list, (void *)NULL,
 					     message_nto_speak);
 					log_msg(OTTS_LOG_DEBUG,
 						"Message insterted back to the queues!");
-					MessagePausedList =
+					sink->paused_list =
 					    g_list_remove_link
-					    (MessagePausedList, gl);
+					    (sink->paused_list, gl);
 					pthread_mutex_unlock
 					    (&element_free_mutex);
 					if ((gl != NULL) && (gl->data != NULL)) {
@@ -172,12 +308,12 @@ void *speak(void *data)
 				}
 			}
 			log_msg(OTTS_LOG_DEBUG, "End of resume processing");
-			resume_requested = 0;
+			sink->resume_requested = 0;
 		}
 
 		pthread_mutex_lock(&speak_stop_mutex);
-		if (thread_must_stop == TRUE) {
-			thread_must_stop = FALSE;
+		if (sink->thread_must_stop == TRUE) {
+			sink->thread_must_stop = FALSE;
 			pthread_mutex_unlock(&speak_stop_mutex);
 			break;
 		} else
@@ -190,32 +326,33 @@ void *speak(void *data)
 
 		check_locked(&element_free_mutex);
 
-		if ((g_list_length(last_p5_block) != 0)
-		    && (g_list_length(MessageQueue->p5) == 0)) {
+		if ((g_list_length(sink->last_p5_block) != 0)
+		    && (g_list_length(sink->queue->p5) == 0)) {
 			/* Transfer messages from last_p5_block to priority SPD_MESSAGE queue */
-			while (g_list_length(last_p5_block) != 0) {
+			while (g_list_length(sink->last_p5_block) != 0) {
 				GList *item;
-				item = g_list_first(last_p5_block);
+				item = g_list_first(sink->last_p5_block);
 				message = item->data;
 				check_locked(&element_free_mutex);
-				MessageQueue->p2 =
-				    g_list_insert_sorted(MessageQueue->p2,
+				sink->queue->p2 =
+				    g_list_insert_sorted(sink->queue->p2,
 							 message, sortbyuid);
-				last_p5_block =
-				    g_list_remove_link(last_p5_block, item);
+				sink->last_p5_block =
+				    g_list_remove_link(sink->last_p5_block,
+						       item);
 			}
 			assert(message != NULL);
-			current_priority = SPD_MESSAGE;
-			stop_priority_older_than(SPD_TEXT, message->id);
-			stop_priority(SPD_NOTIFICATION);
-			stop_priority(SPD_PROGRESS);
+			sink->current_priority = SPD_MESSAGE;
+			stop_priority_older_than(sink, SPD_TEXT, message->id);
+			stop_priority(sink, SPD_NOTIFICATION);
+			stop_priority(sink, SPD_PROGRESS);
 			check_locked(&element_free_mutex);
 			pthread_mutex_unlock(&element_free_mutex);
 			speaking_semaphore_post();
 			continue;
 		} else {
 			/* Extract the right message from priority queue */
-			message = get_message_from_queues();
+			message = get_message_from_queues(sink);
 			if (message == NULL) {
 				pthread_mutex_unlock(&element_free_mutex);
 				log_msg(OTTS_LOG_DEBUG,
@@ -225,28 +362,54 @@ void *speak(void *data)
 		}
 
 		/* Isn't the parent client of this message paused? 
-		 * If it is, insert the message to the MessagePausedList. */
+		 * If it is, insert the message to the paused list. */
 		if (message_nto_speak(message, NULL)) {
 			log_msg(OTTS_LOG_INFO,
 				"Inserting message to paused list...");
-			MessagePausedList =
-			    g_list_append(MessagePausedList, message);
+			sink->paused_list =
+			    g_list_append(sink->paused_list, message);
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
 
-		/* Insert index marks into textual messages */
-		if (message->settings.type == SPD_MSGTYPE_TEXT) {
-			insert_index_marks(message,
-					   message->settings.ssml_mode);
-		}
-
-		/* Write the message to the output layer. */
-		ret = output_speak(message);
+		/* Write the message to the output layer.  It also inserts
+		   the index marks, once the module is known to be free.
+		   The message is out of the queues, element_free_mutex
+		   isn't held meanwhile so that STOP and CANCEL don't wait
+		   for the module's replies.  They only mark the message,
+		   see speaking_stop_sink(). */
+		sink->sending = message;
+		sink->stop_sending = 0;
+		pthread_mutex_unlock(&element_free_mutex);
+		ret = output_speak(message, sink);
+		pthread_mutex_lock(&element_free_mutex);
+		sink->sending = NULL;
 		log_msg(OTTS_LOG_INFO, "Message sent to output module");
+		if (ret == -4 && sink->stop_sending) {
+			/* Stopped before any module got it */
+			if (message->settings.notification & SPD_CANCEL)
+				report_cancel(message);
+			mem_free_message(message);
+			pthread_mutex_unlock(&element_free_mutex);
+			continue;
+		}
 		if (ret == -1) {
+			/* output_speak() already checked a module which
+			   failed while it talked to it */
 			log_msg(OTTS_LOG_WARN, "Error: Output module failed");
-			output_check_module(get_output_module(message));
+			pthread_mutex_unlock(&element_free_mutex);
+			continue;
+		}
+		if (ret == -4) {
+			/* The module is speaking on another sink, retry
+			   when it reports the end of that message */
+			log_msg(OTTS_LOG_DEBUG,
+				"Output module busy, message postponed");
+			speaking_set_queue(sink, sink->current_priority,
+					   g_list_prepend(speaking_get_queue
+							  (sink,
+							   sink->current_priority),
+							  message));
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
@@ -257,67 +420,102 @@ void *speak(void *data)
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
-		SPEAKING = 1;
+		sink->speaking = 1;
 
-		if (speaking_module != NULL) {
-			poll_count = 2;
-			helper_pfd.fd = speaking_module->pipe_out[0];
+		if (sink->module != NULL) {
+			sink->poll_count = 2;
+			helper_pfd.fd = sink->module->pipe_out[0];
 			poll_fds[1] = helper_pfd;
 		}
 
-		/* Set the id of the client who is speaking. */
-		speaking_uid = message->settings.uid;
-		if (current_message != NULL)
-			if (!current_message->settings.paused_while_speaking)
-				mem_free_message(current_message);
-		current_message = message;
+		if (sink->current_message != NULL)
+			if (!sink->current_message->settings.
+			    paused_while_speaking)
+				mem_free_message(sink->current_message);
+		sink->current_message = message;
 
 		/* Check if the last priority 5 message wasn't said yet */
-		if (last_p5_block != NULL) {
+		if (sink->last_p5_block != NULL) {
 			GList *elem;
 			openttsd_message *p5_message;
-			elem = g_list_last(last_p5_block);
+			elem = g_list_last(sink->last_p5_block);
 			if (elem != NULL) {
 				p5_message = (openttsd_message *) elem->data;
 				if (p5_message->settings.reparted ==
 				    message->settings.reparted) {
-					g_list_foreach(last_p5_block,
+					g_list_foreach(sink->last_p5_block,
 						       (GFunc) mem_free_message,
 						       NULL);
-					g_list_free(last_p5_block);
-					last_p5_block = NULL;
+					g_list_free(sink->last_p5_block);
+					sink->last_p5_block = NULL;
 				}
 			}
 		}
 
+		/* STOP or CANCEL came while the message was being sent */
+		if (sink->stop_sending)
+			speaking_stop_sink(sink, message->settings.uid);
+
 		pthread_mutex_unlock(&element_free_mutex);
 	}
 
 	g_free(poll_fds);
-	poll_count = 0;
-	speaking_module = NULL;
-	SPEAKING = 0;
+	sink->poll_count = 0;
+	sink->module = NULL;
+	sink->speaking = 0;
 
 	return NULL;
 }
 
 /*
 	 * This function is called from the signal-handling thread.
-	 * It stops the speaking thread and joins it.
+	 * It stops the speaking threads and joins them.
 	 */
 
 void stop_speak_thread(void)
 {
+	speak_sink_t *sink;
+	GList *sinks;
+	GList *gl;
 	int ret;
 
+	sinks = speaking_get_sinks();
 	pthread_mutex_lock(&speak_stop_mutex);
-	thread_must_stop = TRUE;
+	for (gl = sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		if (sink->thread_started)
+			sink->thread_must_stop = TRUE;
+	}
 	speaking_semaphore_post();
 	pthread_mutex_unlock(&speak_stop_mutex);
-	ret = pthread_join(speak_thread, NULL);
 
-	if (ret != 0)
-		FATAL("Unable to join speaking thread.");
+	for (gl = sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		if (!sink->thread_started)
+			continue;
+		ret = pthread_join(sink->thread, NULL);
+		if (ret != 0)
+			FATAL("Unable to join speaking thread.");
+		sink->thread_started = FALSE;
+	}
+	g_list_free(sinks);
+}
+
+void speaking_request_pause(int fd, int uid)
+{
+	speak_sink_t *sink;
+	GList *sinks;
+	GList *gl;
+
+	sinks = speaking_get_sinks();
+	for (gl = sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		sink->pause_requested_fd = fd;
+		sink->pause_requested_uid = uid;
+		sink->pause_requested = uid == 0 ? 1 : 2;
+	}
+	g_list_free(sinks);
+	speaking_semaphore_post();
 }
 
 int reload_message(openttsd_message * msg)
@@ -406,19 +604,27 @@ int reload_message(openttsd_message * msg)
 	return 0;
 }
 
-void speaking_stop(int uid)
+static void speaking_stop_sink(speak_sink_t * sink, int uid)
 {
 	openttsd_message *msg;
 	GList *gl;
 	GList *queue;
 	signed int gid = -1;
 
+	/* The speak thread stops the message it is sending itself once
+	   the output layer is done with it */
+	if (sink->sending != NULL) {
+		if (uid == 0 || sink->sending->settings.uid == uid)
+			sink->stop_sending = 1;
+		return;
+	}
+
 	/* Only act if the currently speaking client is the specified one */
-	if (get_speaking_client_uid() == uid) {
-		output_stop();
+	if (get_speaking_client_uid(sink) == uid) {
+		output_stop(sink->module);
 
 		/* Get the queue where the message being spoken came from */
-		queue = speaking_get_queue(current_priority);
+		queue = speaking_get_queue(sink, sink->current_priority);
 		if (queue == NULL)
 			return;
 
@@ -439,7 +645,8 @@ void speaking_stop(int uid)
 		while (1) {
 			gl = g_list_last(queue);
 			if (gl == NULL) {
-				speaking_set_queue(current_priority, queue);
+				speaking_set_queue(sink, sink->current_priority,
+						   queue);
 				return;
 			}
 			if (gl->data == NULL)
@@ -453,23 +660,66 @@ void speaking_stop(int uid)
 				assert(gl->data != NULL);
 				mem_free_message(gl->data);
 			} else {
-				speaking_set_queue(current_priority, queue);
+				speaking_set_queue(sink, sink->current_priority,
+						   queue);
 				return;
 			}
 		}
 	}
 }
 
-void speaking_stop_all()
+/*
+ * Silence the sinks the client is speaking on, or all sinks if uid is
+ * 0, through the cancel channel of their modules.  STOP and CANCEL
+ * call it before they wait for element_free_mutex, so that the module
+ * is silenced right away.  The module of a sink
+ * isn't looked at, only the cancel descriptor kept with the sink,
+ * which is forgotten under speak_sinks_mutex before it is closed.
+ */
+void speaking_silence(int uid)
+{
+	speak_sink_t *sink;
+	GList *gl;
+
+	pthread_mutex_lock(&speak_sinks_mutex);
+	for (gl = speak_sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		if (!sink->speaking || sink->cancel_fd < 0)
+			continue;
+		if (uid != 0 && sink->uid != uid)
+			continue;
+		output_cancel(sink->cancel_fd);
+	}
+	pthread_mutex_unlock(&speak_sinks_mutex);
+}
+
+void speaking_stop(int uid)
+{
+	GList *sinks;
+	GList *gl;
+
+	/* The client may have moved to another sink while speaking */
+	sinks = speaking_get_sinks();
+	for (gl = sinks; gl != NULL; gl = gl->next)
+		speaking_stop_sink(gl->data, uid);
+	g_list_free(sinks);
+}
+
+static void speaking_stop_all_sink(speak_sink_t * sink)
 {
 	openttsd_message *msg;
 	GList *gl;
 	GList *queue;
 	int gid = -1;
 
-	output_stop();
+	if (sink->sending != NULL) {
+		sink->stop_sending = 1;
+		return;
+	}
+
+	output_stop(sink->module);
 
-	queue = speaking_get_queue(current_priority);
+	queue = speaking_get_queue(sink, sink->current_priority);
 	if (queue == NULL)
 		return;
 
@@ -488,7 +738,7 @@ void speaking_stop_all()
 	while (1) {
 		gl = g_list_last(queue);
 		if (gl == NULL) {
-			speaking_set_queue(current_priority, queue);
+			speaking_set_queue(sink, sink->current_priority, queue);
 			return;
 		}
 		if (OPENTTSD_DEBUG)
@@ -500,33 +750,61 @@ void speaking_stop_all()
 			assert(gl->data != NULL);
 			mem_free_message(gl->data);
 		} else {
-			speaking_set_queue(current_priority, queue);
+			speaking_set_queue(sink, sink->current_priority, queue);
 			return;
 		}
 	}
 }
 
+void speaking_stop_all()
+{
+	GList *sinks;
+	GList *gl;
+
+	sinks = speaking_get_sinks();
+	for (gl = sinks; gl != NULL; gl = gl->next)
+		speaking_stop_all_sink(gl->data);
+	g_list_free(sinks);
+}
+
 void speaking_cancel(int uid)
 {
+	GList *sinks;
+	GList *gl;
+
+	sinks = speaking_get_sinks();
 	pthread_mutex_lock(&element_free_mutex);
-	speaking_stop(uid);
-	stop_from_uid(uid);
+	for (gl = sinks; gl != NULL; gl = gl->next) {
+		speaking_stop_sink(gl->data, uid);
+		stop_from_uid(gl->data, uid);
+	}
 	pthread_mutex_unlock(&element_free_mutex);
+	g_list_free(sinks);
 }
 
 void speaking_cancel_all()
 {
-	output_stop();
+	speak_sink_t *sink;
+	GList *sinks;
+	GList *gl;
+
+	sinks = speaking_get_sinks();
+	for (gl = sinks; gl != NULL; gl = gl->next)
+		output_stop(((speak_sink_t *) gl->data)->module);
 	pthread_mutex_lock(&element_free_mutex);
-	stop_priority(SPD_IMPORTANT);
-	stop_priority(SPD_MESSAGE);
-	stop_priority(SPD_TEXT);
-	stop_priority(SPD_NOTIFICATION);
-	stop_priority(SPD_PROGRESS);
+	for (gl = sinks; gl != NULL; gl = gl->next) {
+		sink = gl->data;
+		stop_priority(sink, SPD_IMPORTANT);
+		stop_priority(sink, SPD_MESSAGE);
+		stop_priority(sink, SPD_TEXT);
+		stop_priority(sink, SPD_NOTIFICATION);
+		stop_priority(sink, SPD_PROGRESS);
+	}
 	pthread_mutex_unlock(&element_free_mutex);
+	g_list_free(sinks);
 }
 
-int speaking_pause_all(int fd)
+int speaking_pause_all(speak_sink_t * sink, int fd)
 {
 	int err = 0;
 	int i;
@@ -536,7 +814,7 @@ int speaking_pause_all(int fd)
 		uid = get_client_uid_by_fd(i);
 		if (uid == 0)
 			continue;
-		err += speaking_pause(i, uid);
+		err += speaking_pause(sink, i, uid);
 	}
 
 	if (err > 0)
@@ -545,7 +823,7 @@ int speaking_pause_all(int fd)
 		return 0;
 }
 
-int speaking_pause(int fd, int uid)
+int speaking_pause(speak_sink_t * sink, int fd, int uid)
 {
 	TFDSetElement *settings;
 	int ret;
@@ -561,19 +839,19 @@ int speaking_pause(int fd, int uid)
 	}
 	settings->paused = 1;
 
-	if (speaking_uid != uid) {
-		log_msg(OTTS_LOG_DEBUG, "given uid %d not speaking_uid",
-			speaking_uid, uid);
+	if (sink->uid != uid) {
+		log_msg(OTTS_LOG_DEBUG, "given uid %d not speaking_uid %d",
+			uid, sink->uid);
 		return 0;
 	}
 
-	if (SPEAKING) {
-		if (current_message == NULL) {
+	if (sink->speaking) {
+		if (sink->current_message == NULL) {
 			log_msg(OTTS_LOG_DEBUG, "current_message is null");
 			return 0;
 		}
 
-		ret = output_pause();
+		ret = output_pause(sink->module);
 		if (ret < 0) {
 			log_msg(OTTS_LOG_DEBUG, "output_pause returned %d",
 				ret);
@@ -582,10 +860,10 @@ int speaking_pause(int fd, int uid)
 
 		log_msg(OTTS_LOG_DEBUG,
 			"Including current message into the message paused list");
-		current_message->settings.paused = 2;
-		current_message->settings.paused_while_speaking = 1;
-		MessagePausedList =
-		    g_list_append(MessagePausedList, current_message);
+		sink->current_message->settings.paused = 2;
+		sink->current_message->settings.paused_while_speaking = 1;
+		sink->paused_list =
+		    g_list_append(sink->paused_list, sink->current_message);
 	}
 
 	return 0;
@@ -613,6 +891,8 @@ int speaking_resume_all()
 int speaking_resume(int uid)
 {
 	TFDSetElement *settings;
+	GList *sinks;
+	GList *gl;
 
 	/* Find settings for this particular client */
 	settings = get_client_settings_by_uid(uid);
@@ -621,7 +901,10 @@ int speaking_resume(int uid)
 	/* Set it to speak again. */
 	settings->paused = 0;
 
-	resume_requested = 1;
+	sinks = speaking_get_sinks();
+	for (gl = sinks; gl != NULL; gl = gl->next)
+		((speak_sink_t *) gl->data)->resume_requested = 1;
+	g_list_free(sinks);
 	speaking_semaphore_post();
 
 	return 0;
@@ -643,6 +926,246 @@ int socket_send_msg(int fd, char *msg)
 	return 0;
 }
 
+/*
+ * Batching of event notifications.
+ *
+ * Clients which opted in with SET SELF NOTIFICATION_BATCH get their
+ * index mark, begin and end events collected in a report_batch_t of
+ * their own and written in one go once their batching window
+ * expires.  The speak threads of all the sinks limit their poll()
+ * timeout to the earliest window and flush the expired batches.
+ *
+ * batches_mutex only guards the table and the buffers, nothing is
+ * written to a client with it held.  Every event for a client with a
+ * batch goes through its out queue, which one thread at a time writes
+ * under the send_mutex of the client.  A slow client thus only holds
+ * up the threads reporting to it, and the order of its events never
+ * changes.  Clients which never asked for batching have no batch and
+ * get their events written right away.
+ */
+typedef struct {
+	int fd;
+	int refs;		/* Threads using it outside batches_mutex */
+	int discarded;		/* The client is gone */
+	GString *buffer;	/* The events of the open window */
+	struct timeval deadline;
+	GQueue *out;		/* Events to write, in order */
+	pthread_mutex_t send_mutex;
+} report_batch_t;
+
+static GHashTable *batches = NULL;	/* fd to its report_batch_t */
+static volatile gint batch_clients = 0;	/* Entries in batches */
+static pthread_mutex_t batches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The batch of client fd, created if create.  Must be called with
+   batches_mutex locked. */
+static report_batch_t *report_batch_get(int fd, int create)
+{
+	report_batch_t *batch = NULL;
+
+	if (batches != NULL)
+		batch = g_hash_table_lookup(batches, GINT_TO_POINTER(fd));
+	if (batch != NULL || !create)
+		return batch;
+
+	if (batches == NULL)
+		batches = g_hash_table_new(g_direct_hash, g_direct_equal);
+	batch = g_malloc0(sizeof(report_batch_t));
+	batch->fd = fd;
+	batch->buffer = g_string_sized_new(256);
+	batch->out = g_queue_new();
+	pthread_mutex_init(&batch->send_mutex, NULL);
+	g_hash_table_insert(batches, GINT_TO_POINTER(fd), batch);
+	g_atomic_int_inc(&batch_clients);
+
+	return batch;
+}
+
+/* Must be called with batches_mutex locked */
+static void report_batch_unref(report_batch_t * batch)
+{
+	if (--batch->refs > 0 || !batch->discarded)
+		return;
+	g_string_free(batch->buffer, TRUE);
+	g_queue_foreach(batch->out, (GFunc) g_free, NULL);
+	g_queue_free(batch->out);
+	pthread_mutex_destroy(&batch->send_mutex);
+	g_free(batch);
+}
+
+/* Queue the events of the open window for writing.  Must be called
+   with batches_mutex locked. */
+static void report_batch_close_window(report_batch_t * batch)
+{
+	if (batch->buffer->len == 0)
+		return;
+	g_queue_push_tail(batch->out, g_string_free(batch->buffer, FALSE));
+	batch->buffer = g_string_sized_new(256);
+}
+
+/* Write the queued events to the client.  Must be called with a
+   reference to batch and batches_mutex unlocked. */
+static int report_batch_write(report_batch_t * batch)
+{
+	char *cmd;
+	int ret = 0;
+
+	pthread_mutex_lock(&batch->send_mutex);
+	while (1) {
+		pthread_mutex_lock(&batches_mutex);
+		cmd = g_queue_pop_head(batch->out);
+		pthread_mutex_unlock(&batches_mutex);
+		if (cmd == NULL)
+			break;
+		if (socket_send_msg(batch->fd, cmd))
+			ret = -1;
+		g_free(cmd);
+	}
+	pthread_mutex_unlock(&batch->send_mutex);
+
+	return ret;
+}
+
+static int report_event(openttsd_message * msg, char *cmd, int batchable)
+{
+	report_batch_t *batch;
+	int window;
+	int ret;
+
+	window = batchable ? msg->settings.notification_batch : 0;
+	if (window <= 0 && g_atomic_int_get(&batch_clients) == 0)
+		return socket_send_msg(msg->settings.fd, cmd);
+
+	pthread_mutex_lock(&batches_mutex);
+	batch = report_batch_get(msg->settings.fd, window > 0);
+	if (batch == NULL) {
+		pthread_mutex_unlock(&batches_mutex);
+		return socket_send_msg(msg->settings.fd, cmd);
+	}
+
+	if (window > 0) {
+		if (batch->buffer->len == 0) {
+			gettimeofday(&batch->deadline, NULL);
+			batch->deadline.tv_usec += window * 1000;
+			batch->deadline.tv_sec +=
+			    batch->deadline.tv_usec / 1000000;
+			batch->deadline.tv_usec %= 1000000;
+		}
+		g_string_append(batch->buffer, cmd);
+		pthread_mutex_unlock(&batches_mutex);
+		return 0;
+	}
+
+	/* Any other event goes after the events batched so far */
+	report_batch_close_window(batch);
+	g_queue_push_tail(batch->out, g_strdup(cmd));
+	batch->refs++;
+	pthread_mutex_unlock(&batches_mutex);
+
+	ret = report_batch_write(batch);
+
+	pthread_mutex_lock(&batches_mutex);
+	report_batch_unref(batch);
+	pthread_mutex_unlock(&batches_mutex);
+
+	return ret;
+}
+
+int report_batch_timeout(void)
+{
+	GHashTableIter iter;
+	report_batch_t *batch;
+	gpointer value;
+	struct timeval now, first;
+	long timeout;
+	int pending = 0;
+
+	if (g_atomic_int_get(&batch_clients) == 0)
+		return -1;
+
+	pthread_mutex_lock(&batches_mutex);
+	if (batches != NULL) {
+		g_hash_table_iter_init(&iter, batches);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			batch = value;
+			if (batch->buffer->len == 0)
+				continue;
+			if (!pending || timercmp(&batch->deadline, &first, <))
+				first = batch->deadline;
+			pending = 1;
+		}
+	}
+	pthread_mutex_unlock(&batches_mutex);
+	if (!pending)
+		return -1;
+
+	gettimeofday(&now, NULL);
+	timeout = (first.tv_sec - now.tv_sec) * 1000
+	    + (first.tv_usec - now.tv_usec) / 1000;
+
+	return timeout > 0 ? timeout : 0;
+}
+
+void report_batch_flush_expired(void)
+{
+	GHashTableIter iter;
+	report_batch_t *batch;
+	gpointer value;
+	struct timeval now;
+	GList *expired = NULL;
+	GList *gl;
+
+	if (g_atomic_int_get(&batch_clients) == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&batches_mutex);
+	if (batches != NULL) {
+		g_hash_table_iter_init(&iter, batches);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			batch = value;
+			if (batch->buffer->len == 0
+			    || timercmp(&now, &batch->deadline, <))
+				continue;
+			report_batch_close_window(batch);
+			batch->refs++;
+			expired = g_list_prepend(expired, batch);
+		}
+	}
+	pthread_mutex_unlock(&batches_mutex);
+
+	for (gl = expired; gl != NULL; gl = gl->next)
+		if (report_batch_write(gl->data))
+			log_msg(OTTS_LOG_ERR,
+				"ERROR: Can't report batched events!");
+
+	pthread_mutex_lock(&batches_mutex);
+	for (gl = expired; gl != NULL; gl = gl->next)
+		report_batch_unref(gl->data);
+	pthread_mutex_unlock(&batches_mutex);
+	g_list_free(expired);
+}
+
+void report_batch_discard(int fd)
+{
+	report_batch_t *batch;
+
+	pthread_mutex_lock(&batches_mutex);
+	batch = report_batch_get(fd, 0);
+	if (batch != NULL) {
+		g_hash_table_remove(batches, GINT_TO_POINTER(fd));
+		g_atomic_int_add(&batch_clients, -1);
+		batch->discarded = 1;
+		g_string_truncate(batch->buffer, 0);
+		g_queue_foreach(batch->out, (GFunc) g_free, NULL);
+		g_queue_clear(batch->out);
+		/* Freed now, or by the last thread writing to it */
+		batch->refs++;
+		report_batch_unref(batch);
+	}
+	pthread_mutex_unlock(&batches_mutex);
+}
+
 int report_index_mark(openttsd_message * msg, char *index_mark)
 {
 	char *cmd;
@@ -653,7 +1176,7 @@ int report_index_mark(openttsd_message * msg, char *index_mark)
 			      EVENT_INDEX_MARK_C "-%s\r\n"
 			      EVENT_INDEX_MARK,
 			      msg->id, msg->settings.uid, index_mark);
-	ret = socket_send_msg(msg->settings.fd, cmd);
+	ret = report_event(msg, cmd, 1);
 	g_free(cmd);
 	if (ret) {
 		log_msg(OTTS_LOG_ERR, "ERROR: Can't report index mark!");
@@ -662,7 +1185,7 @@ int report_index_mark(openttsd_message * msg, char *index_mark)
 	return 0;
 }
 
-#define REPORT_STATE(state, ssip_code, ssip_msg) \
+#define REPORT_STATE(state, ssip_code, ssip_msg, batchable) \
   int \
   report_ ## state (openttsd_message *msg) \
   { \
@@ -670,7 +1193,7 @@ int report_index_mark(openttsd_message * msg, char *index_mark)
     int ret; \
     cmd = g_strdup_printf(ssip_code"-%d\r\n"ssip_code"-%d\r\n"ssip_msg, \
 	     msg->id, msg->settings.uid); \
-    ret = socket_send_msg(msg->settings.fd, cmd); \
+    ret = report_event(msg, cmd, batchable); \
     if (ret){ \
       log_msg(OTTS_LOG_WARN, "ERROR: Can't report index mark!"); \
       return -1; \
@@ -679,110 +1202,124 @@ int report_index_mark(openttsd_message * msg, char *index_mark)
     return 0; \
   }
 
-REPORT_STATE(begin, EVENT_BEGIN_C, EVENT_BEGIN)
-    REPORT_STATE(end, EVENT_END_C, EVENT_END)
-    REPORT_STATE(pause, EVENT_PAUSED_C, EVENT_PAUSED)
-    REPORT_STATE(resume, EVENT_RESUMED_C, EVENT_RESUMED)
-    REPORT_STATE(cancel, EVENT_CANCELED_C, EVENT_CANCELED)
+REPORT_STATE(begin, EVENT_BEGIN_C, EVENT_BEGIN, 1)
+    REPORT_STATE(end, EVENT_END_C, EVENT_END, 1)
+    REPORT_STATE(pause, EVENT_PAUSED_C, EVENT_PAUSED, 0)
+    REPORT_STATE(resume, EVENT_RESUMED_C, EVENT_RESUMED, 0)
+    REPORT_STATE(cancel, EVENT_CANCELED_C, EVENT_CANCELED, 0)
 
-int is_sb_speaking(void)
+int is_sb_speaking(speak_sink_t * sink)
 {
 	int ret;
 	char *index_mark;
 	TFDSetElement *settings;
 
-	log_msg(OTTS_LOG_DEBUG, "is_sb_speaking(), SPEAKING=%d", SPEAKING);
+	log_msg(OTTS_LOG_DEBUG, "is_sb_speaking(), sink %s speaking=%d",
+		sink->name, sink->speaking);
 
 	/* Determine if the current module is still speaking */
-	if (speaking_module != NULL) {
-		if (current_message == NULL) {
+	if (sink->module != NULL) {
+		if (sink->current_message == NULL) {
 			log_msg(OTTS_LOG_ERR,
 				"Error: Current message is NULL in is_sb_speaking()");
 			return -1;
 		}
-		settings = &(current_message->settings);
-
-		ret = output_is_speaking(&index_mark);
-		if (index_mark == NULL)
-			return SPEAKING = 0;
+		settings = &(sink->current_message->settings);
+
+		ret = output_module_is_speaking(sink->module, &index_mark);
+		if (ret < 0)
+			index_mark = NULL;
+		if (index_mark == NULL) {
+			output_module_done(sink->module);
+			sink->module = NULL;
+			sink->poll_count = 1;
+			/* Other sinks may wait for this module */
+			speaking_semaphore_post();
+			return sink->speaking = 0;
+		}
 
 		if (!strcmp(index_mark, "no")) {
 			g_free(index_mark);
-			return SPEAKING;
+			return sink->speaking;
 		}
 
 		log_msg(OTTS_LOG_DEBUG, "INDEX MARK: %s", index_mark);
 
 		if (!strcmp(index_mark, SD_MARK_BODY "begin")) {
-			SPEAKING = 1;
+			sink->speaking = 1;
 			if (!settings->paused_while_speaking) {
 				if (settings->notification & SPD_BEGIN)
-					report_begin(current_message);
+					report_begin(sink->current_message);
 			} else {
 				if (settings->notification & SPD_RESUME)
-					report_resume(current_message);
+					report_resume(sink->current_message);
 				settings->paused_while_speaking = 0;
 			}
 		} else if (!strcmp(index_mark, SD_MARK_BODY "end")) {
-			SPEAKING = 0;
-			poll_count = 1;
+			output_module_done(sink->module);
+			sink->speaking = 0;
+			sink->poll_count = 1;
 			if (settings->notification & SPD_END)
-				report_end(current_message);
+				report_end(sink->current_message);
 			speaking_semaphore_post();
 		} else if (!strcmp(index_mark, SD_MARK_BODY "paused")) {
-			SPEAKING = 0;
-			poll_count = 1;
+			output_module_done(sink->module);
+			sink->speaking = 0;
+			sink->poll_count = 1;
 			if (settings->notification & SPD_PAUSE)
-				report_pause(current_message);
+				report_pause(sink->current_message);
 			/* We don't want to free this message in speak() since we will
 			   later copy it in resume() */
-			current_message = NULL;
+			sink->current_message = NULL;
+			/* Other sinks may wait for this module */
+			speaking_semaphore_post();
 		} else if (!strcmp(index_mark, SD_MARK_BODY "stopped")) {
-			SPEAKING = 0;
-			poll_count = 1;
+			output_module_done(sink->module);
+			sink->speaking = 0;
+			sink->poll_count = 1;
 			if (settings->notification & SPD_CANCEL)
-				report_cancel(current_message);
+				report_cancel(sink->current_message);
 			speaking_semaphore_post();
 		} else if (index_mark != NULL) {
 			if (strncmp(index_mark, SD_MARK_BODY, SD_MARK_BODY_LEN)) {
 				if (settings->notification & SPD_INDEX_MARKS)
-					report_index_mark(current_message,
+					report_index_mark(sink->current_message,
 							  index_mark);
 			} else {
 				log_msg(OTTS_LOG_DEBUG,
 					"Setting current index_mark for the message to %s",
 					index_mark);
-				if (current_message->settings.index_mark !=
-				    NULL)
-					g_free(current_message->settings.
+				if (sink->current_message->settings.
+				    index_mark != NULL)
+					g_free(sink->current_message->settings.
 					       index_mark);
-				current_message->settings.index_mark =
+				sink->current_message->settings.index_mark =
 				    g_strdup(index_mark);
 			}
 
 		}
 		g_free(index_mark);
 	} else {
-		log_msg(OTTS_LOG_DEBUG, "Speaking module is NULL, SPEAKING==%d",
-			SPEAKING);
-		SPEAKING = 0;
+		log_msg(OTTS_LOG_DEBUG, "Speaking module is NULL, speaking==%d",
+			sink->speaking);
+		sink->speaking = 0;
 	}
 
-	if (SPEAKING == 0)
-		speaking_module = NULL;
+	if (sink->speaking == 0)
+		sink->module = NULL;
 
-	return SPEAKING;
+	return sink->speaking;
 }
 
-int get_speaking_client_uid(void)
+int get_speaking_client_uid(speak_sink_t * sink)
 {
 	int speaking = 0;
-	if (SPEAKING == 0) {
-		speaking_uid = 0;
+	if (sink->speaking == 0) {
+		sink->uid = 0;
 		return 0;
 	}
-	if (speaking_uid != 0) {
-		speaking = speaking_uid;
+	if (sink->uid != 0) {
+		speaking = sink->uid;
 	}
 	return speaking;
 }
@@ -837,36 +1374,37 @@ GList *empty_queue_by_time(GList * queue, unsigned int uid)
 	return queue;
 }
 
-int stop_priority(SPDPriority priority)
+int stop_priority(speak_sink_t * sink, SPDPriority priority)
 {
 	GList *queue;
 
-	queue = speaking_get_queue(priority);
+	queue = speaking_get_queue(sink, priority);
 
-	if (current_priority == priority) {
-		output_stop();
+	if (sink->current_priority == priority) {
+		output_stop(sink->module);
 	}
 
 	queue = empty_queue(queue);
 
-	speaking_set_queue(priority, queue);
+	speaking_set_queue(sink, priority, queue);
 
 	return 0;
 }
 
-int stop_priority_older_than(SPDPriority priority, unsigned int uid)
+int stop_priority_older_than(speak_sink_t * sink, SPDPriority priority,
+			     unsigned int uid)
 {
 	GList *queue;
 
-	queue = speaking_get_queue(priority);
+	queue = speaking_get_queue(sink, priority);
 
-	if (current_priority == priority) {
-		output_stop();
+	if (sink->current_priority == priority) {
+		output_stop(sink->module);
 	}
 
 	queue = empty_queue_by_time(queue, uid);
 
-	speaking_set_queue(priority, queue);
+	speaking_set_queue(sink, priority, queue);
 
 	return 0;
 }
@@ -882,14 +1420,16 @@ GList *stop_priority_from_uid(GList * queue, const int uid)
 	return ret;
 }
 
-void stop_from_uid(const int uid)
+void stop_from_uid(speak_sink_t * sink, const int uid)
 {
+	queue_t *queue = sink->queue;
+
 	check_locked(&element_free_mutex);
-	MessageQueue->p1 = stop_priority_from_uid(MessageQueue->p1, uid);
-	MessageQueue->p2 = stop_priority_from_uid(MessageQueue->p2, uid);
-	MessageQueue->p3 = stop_priority_from_uid(MessageQueue->p3, uid);
-	MessageQueue->p4 = stop_priority_from_uid(MessageQueue->p4, uid);
-	MessageQueue->p5 = stop_priority_from_uid(MessageQueue->p5, uid);
+	queue->p1 = stop_priority_from_uid(queue->p1, uid);
+	queue->p2 = stop_priority_from_uid(queue->p2, uid);
+	queue->p3 = stop_priority_from_uid(queue->p3, uid);
+	queue->p4 = stop_priority_from_uid(queue->p4, uid);
+	queue->p5 = stop_priority_from_uid(queue->p5, uid);
 }
 
 /* Determines if this messages is to be spoken
@@ -937,7 +1477,7 @@ void set_speak_thread_attributes()
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 }
 
-void stop_priority_except_first(SPDPriority priority)
+void stop_priority_except_first(speak_sink_t * sink, SPDPriority priority)
 {
 	GList *queue;
 	GList *gl;
@@ -945,7 +1485,7 @@ void stop_priority_except_first(SPDPriority priority)
 	GList *gl_next;
 	int gid;
 
-	queue = speaking_get_queue(priority);
+	queue = speaking_get_queue(sink, priority);
 
 	gl = g_list_last(queue);
 
@@ -957,16 +1497,16 @@ void stop_priority_except_first(SPDPriority priority)
 	msg = (openttsd_message *) gl->data;
 	if (msg->settings.reparted <= 0) {
 		queue = g_list_remove_link(queue, gl);
-		speaking_set_queue(priority, queue);
+		speaking_set_queue(sink, priority, queue);
 
-		stop_priority(priority);
+		stop_priority(sink, priority);
 		/* Fill the queue with the list containing only the first message */
-		speaking_set_queue(priority, gl);
+		speaking_set_queue(sink, priority, gl);
 	} else {
 		gid = msg->settings.reparted;
 
-		if (current_priority == priority && speaking_gid != gid) {
-			output_stop();
+		if (sink->current_priority == priority && sink->gid != gid) {
+			output_stop(sink->module);
 		}
 
 		gl = g_list_first(queue);
@@ -981,68 +1521,69 @@ void stop_priority_except_first(SPDPriority priority)
 			}
 			gl = gl_next;
 		}
-		speaking_set_queue(priority, queue);
+		speaking_set_queue(sink, priority, queue);
 	}
 
 	return;
 }
 
-void resolve_priorities(SPDPriority priority)
+void resolve_priorities(speak_sink_t * sink, SPDPriority priority)
 {
 	/* for the priority algorithm see
 	   http://cvs.freebsoft.org/doc/speechd/ssip_10.html#SEC11 */
 	switch (priority) {
 	case SPD_IMPORTANT:
 		/* stop current */
-		if (SPEAKING && current_priority != SPD_IMPORTANT)
-			output_stop();
+		if (sink->speaking && sink->current_priority != SPD_IMPORTANT)
+			output_stop(sink->module);
 
 		/* cancel all messages */
-		stop_priority(SPD_NOTIFICATION);
-		stop_priority(SPD_PROGRESS);
+		stop_priority(sink, SPD_NOTIFICATION);
+		stop_priority(sink, SPD_PROGRESS);
 		break;
 
 	case SPD_MESSAGE:
 		/* stop current */
-		if (SPEAKING && current_priority != SPD_IMPORTANT
-		    && current_priority != SPD_MESSAGE)
-			output_stop();
+		if (sink->speaking && sink->current_priority != SPD_IMPORTANT
+		    && sink->current_priority != SPD_MESSAGE)
+			output_stop(sink->module);
 
 		/* cancel all messages */
-		stop_priority(SPD_TEXT);
-		stop_priority(SPD_NOTIFICATION);
-		stop_priority(SPD_PROGRESS);
+		stop_priority(sink, SPD_TEXT);
+		stop_priority(sink, SPD_NOTIFICATION);
+		stop_priority(sink, SPD_PROGRESS);
 		break;
 
 	case SPD_TEXT:
-		stop_priority_except_first(SPD_TEXT);
+		stop_priority_except_first(sink, SPD_TEXT);
 
 		/* cancel all messages */
-		stop_priority(SPD_NOTIFICATION);
-		stop_priority(SPD_PROGRESS);
+		stop_priority(sink, SPD_NOTIFICATION);
+		stop_priority(sink, SPD_PROGRESS);
 		break;
 
 	case SPD_NOTIFICATION:
-		stop_priority_except_first(SPD_NOTIFICATION);
-		if (SPEAKING && current_priority != SPD_NOTIFICATION)
-			stop_priority(SPD_NOTIFICATION);
+		stop_priority_except_first(sink, SPD_NOTIFICATION);
+		if (sink->speaking
+		    && sink->current_priority != SPD_NOTIFICATION)
+			stop_priority(sink, SPD_NOTIFICATION);
 		break;
 
 	case SPD_PROGRESS:
-		stop_priority(SPD_NOTIFICATION);
-		if (SPEAKING) {
+		stop_priority(sink, SPD_NOTIFICATION);
+		if (sink->speaking) {
 			GList *gl;
 			check_locked(&element_free_mutex);
-			gl = g_list_last(MessageQueue->p5);
+			gl = g_list_last(sink->queue->p5);
 			check_locked(&element_free_mutex);
-			MessageQueue->p5 =
-			    g_list_remove_link(MessageQueue->p5, gl);
+			sink->queue->p5 =
+			    g_list_remove_link(sink->queue->p5, gl);
 			if (gl != NULL) {
 				check_locked(&element_free_mutex);
-				MessageQueue->p5 =
-				    empty_queue(MessageQueue->p5);
+				sink->queue->p5 =
+				    empty_queue(sink->queue->p5);
 				if (gl->data != NULL) {
-					MessageQueue->p5 = gl;
+					sink->queue->p5 = gl;
 				}
 			}
 		}
@@ -1051,7 +1592,7 @@ void resolve_priorities(SPDPriority priority)
 	}
 }
 
-openttsd_message *get_message_from_queues()
+openttsd_message *get_message_from_queues(speak_sink_t * sink)
 {
 	GList *gl;
 	SPDPriority prio;
@@ -1059,7 +1600,7 @@ openttsd_message *get_message_from_queues()
 	/* We will descend through priorities to say more important
 	   messages first. */
 	for (prio = SPD_IMPORTANT; prio <= SPD_PROGRESS; prio++) {
-		GList *current_queue = speaking_get_queue(prio);
+		GList *current_queue = speaking_get_queue(sink, prio);
 		check_locked(&element_free_mutex);
 		gl = g_list_first(current_queue);
 
@@ -1069,10 +1610,10 @@ openttsd_message *get_message_from_queues()
 				gl = g_list_next(gl);
 				continue;
 			}
-			speaking_set_queue(prio,
+			speaking_set_queue(sink, prio,
 					   g_list_remove_link(current_queue,
 							      gl));
-			current_priority = prio;
+			sink->current_priority = prio;
 			return (openttsd_message *) gl->data;
 		}
 	}
@@ -1080,7 +1621,7 @@ openttsd_message *get_message_from_queues()
 	return NULL;
 }
 
-GList *speaking_get_queue(SPDPriority priority)
+GList *speaking_get_queue(speak_sink_t * sink, SPDPriority priority)
 {
 	GList *queue = NULL;
 
@@ -1089,19 +1630,19 @@ GList *speaking_get_queue(SPDPriority priority)
 	check_locked(&element_free_mutex);
 	switch (priority) {
 	case SPD_IMPORTANT:
-		queue = MessageQueue->p1;
+		queue = sink->queue->p1;
 		break;
 	case SPD_MESSAGE:
-		queue = MessageQueue->p2;
+		queue = sink->queue->p2;
 		break;
 	case SPD_TEXT:
-		queue = MessageQueue->p3;
+		queue = sink->queue->p3;
 		break;
 	case SPD_NOTIFICATION:
-		queue = MessageQueue->p4;
+		queue = sink->queue->p4;
 		break;
 	case SPD_PROGRESS:
-		queue = MessageQueue->p5;
+		queue = sink->queue->p5;
 		break;
 	case SPD_PRIORITY_ERR:
 		/* Should never get here.  See above assertion. */
@@ -1111,26 +1652,27 @@ GList *speaking_get_queue(SPDPriority priority)
 	return queue;
 }
 
-void speaking_set_queue(SPDPriority priority, GList * queue)
+void speaking_set_queue(speak_sink_t * sink, SPDPriority priority,
+			GList * queue)
 {
 	assert(priority != SPD_PRIORITY_ERR);
 
 	check_locked(&element_free_mutex);
 	switch (priority) {
 	case SPD_IMPORTANT:
-		MessageQueue->p1 = queue;
+		sink->queue->p1 = queue;
 		break;
 	case SPD_MESSAGE:
-		MessageQueue->p2 = queue;
+		sink->queue->p2 = queue;
 		break;
 	case SPD_TEXT:
-		MessageQueue->p3 = queue;
+		sink->queue->p3 = queue;
 		break;
 	case SPD_NOTIFICATION:
-		MessageQueue->p4 = queue;
+		sink->queue->p4 = queue;
 		break;
 	case SPD_PROGRESS:
-		MessageQueue->p5 = queue;
+		sink->queue->p5 = queue;
 		break;
 	case SPD_PRIORITY_ERR:
 		/* Not reached.  See previous assertion. */
@@ -1153,8 +1695,36 @@ gint sortbyuid(gconstpointer a, gconstpointer b)
 	return msg1->id - msg2->id;
 }
 
+/*
+ * Let the module synthesize the message which is going to be spoken
+ * after the current one while the current one is playing.  Should the
+ * queues change in the meantime, the module drops the result when a
+ * different message comes.
+ */
+static void speaking_prepare_next(speak_sink_t * sink)
+{
+	openttsd_message *next = NULL;
+	SPDPriority prio;
+	GList *gl;
+
+	if (sink->module == NULL)
+		return;
+
+	pthread_mutex_lock(&element_free_mutex);
+	for (prio = SPD_IMPORTANT; prio <= SPD_PROGRESS && next == NULL; prio++)
+		for (gl = speaking_get_queue(sink, prio); gl != NULL;
+		     gl = g_list_next(gl))
+			if (!message_nto_speak(gl->data, NULL)) {
+				next = gl->data;
+				break;
+			}
+	if (next != NULL)
+		output_prepare(next, sink->module);
+	pthread_mutex_unlock(&element_free_mutex);
+}
+
 /* Clean up after abnormal termination of the current output module. */
-static void speaking_module_cleanup(void)
+static void speaking_module_cleanup(speak_sink_t * sink)
 {
 
 	/*
@@ -1163,13 +1733,13 @@ static void speaking_module_cleanup(void)
 	 * appropriate queue, instead?
 	 */
 
-	if (current_message != NULL) {
-		if (SPEAKING
-		    && (current_message->settings.notification & SPD_END))
-			report_end(current_message);
-		if (!current_message->settings.paused_while_speaking)
-			mem_free_message(current_message);
-		current_message = NULL;
+	if (sink->current_message != NULL) {
+		if (sink->speaking
+		    && (sink->current_message->settings.notification & SPD_END))
+			report_end(sink->current_message);
+		if (!sink->current_message->settings.paused_while_speaking)
+			mem_free_message(sink->current_message);
+		sink->current_message = NULL;
 	}
 
 	/*
@@ -1178,9 +1748,11 @@ static void speaking_module_cleanup(void)
 	 * to 1, so we won't try to poll this module's file descriptor
 	 * again.
 	 */
-	SPEAKING = 0;
-	if (speaking_module != NULL)
-		speaking_module->working = 0;
-	speaking_module = NULL;
-	poll_count = 1;
+	sink->speaking = 0;
+	if (sink->module != NULL) {
+		output_module_done(sink->module);
+		sink->module->working = 0;
+	}
+	sink->module = NULL;
+	sink->poll_count = 1;
 }
@@ -26,21 +26,67 @@
 #ifndef SPEAKING_H
 #define SPEAKING_H
 
+#include <pthread.h>
 #include <glib.h>
 
 #include "opentts/opentts_types.h"
 #include "openttsd.h"
 #include "module.h"
 
-OutputModule *speaking_module;
-int speaking_uid;
-int speaking_gid;
-
-/* Pause and resume handling */
-int pause_requested;
-int pause_requested_fd;
-int pause_requested_uid;
-int resume_requested;
+/*
+ * An audio sink plays one message at a time.  Every sink has its own
+ * priority queues, its own current message and its own speak thread,
+ * so messages routed to different sinks are synthesized and played
+ * at the same time.  Clients choose their sink with
+ * SET SELF AUDIO_SINK; the sink called "default" always exists.
+ */
+typedef struct {
+	char *name;
+	char *audio_output_method;	/* NULL means the global settings */
+	char *audio_device;
+	queue_t *queue;
+	GList *paused_list;	/* Messages from paused clients */
+	GList *last_p5_block;	/* The last received progress block */
+	openttsd_message *current_message;
+	SPDPriority current_priority;
+	int speaking;
+	int poll_count;
+	OutputModule *module;	/* The module speaking current_message */
+	int cancel_fd;		/* Its cancel pipe, under speak_sinks_mutex */
+	int uid;		/* The client who is speaking */
+	int gid;
+	int pipe[2];		/* Wakes up the speak thread */
+	openttsd_message *sending;	/* Being given to output_speak() */
+	int stop_sending;	/* STOP or CANCEL hit it meanwhile */
+	pthread_t thread;
+	gboolean thread_started;
+	gboolean thread_must_stop;
+
+	/* Pause and resume handling */
+	int pause_requested;
+	int pause_requested_fd;
+	int pause_requested_uid;
+	int resume_requested;
+} speak_sink_t;
+
+/* Create the sink, or update the audio settings of an existing one */
+speak_sink_t *speaking_sink_new(const char *name, const char *method,
+				const char *device);
+
+/* Find a sink by name, falling back to the default sink */
+speak_sink_t *speaking_get_sink(const char *name);
+
+/* A copy of the list of all sinks, to be freed with g_list_free() */
+GList *speaking_get_sinks(void);
+
+/* Wake up the speak threads of all sinks */
+void speaking_wake_sinks(void);
+
+/* Remember the write end of the cancel pipe of the module of sink */
+void speaking_set_cancel_fd(speak_sink_t * sink, int fd);
+
+/* Stop using a cancel pipe which is about to be closed */
+void speaking_forget_cancel_fd(int fd);
 
 /* Speak() is responsible for getting right text from right
  * queue in right time and saying it loud through corresponding
@@ -51,34 +97,35 @@ void *speak(void *data);
 /* This function runs in the signal-handling thread. */
 void stop_speak_thread(void);
 
+/* Ask the speak threads to pause a client (uid) or all clients (0) */
+void speaking_request_pause(int fd, int uid);
+
 /* Put this message into queue again, stripping index marks etc. */
 int reload_message(openttsd_message * msg);
 
 /* Speech flow control functions */
+void speaking_silence(int uid);
 void speaking_stop(int uid);
 void speaking_stop_all();
 
 void speaking_cancel(int uid);
 void speaking_cancel_all();
 
-int speaking_pause(int fd, int uid);
-int speaking_pause_all(int fd);
+int speaking_pause(speak_sink_t * sink, int fd, int uid);
+int speaking_pause_all(speak_sink_t * sink, int fd);
 
 int speaking_resume(int uid);
 int speaking_resume_all();
 
 /* Internal speech flow control functions */
 
-/* If there is someone speaking on some output
- * module, return 1, otherwise 0. */
-int is_sb_speaking();
+/* If there is someone speaking on the sink, return 1, otherwise 0. */
+int is_sb_speaking(speak_sink_t * sink);
 
 /* Stops speaking and cancels currently spoken message.*/
-void stop_speaking_active_module();
+int stop_priority(speak_sink_t * sink, SPDPriority priority);
 
-int stop_priority(SPDPriority priority);
-
-void stop_from_uid(int uid);
+void stop_from_uid(speak_sink_t * sink, int uid);
 
 /* Decides if the message should (not) be spoken now */
 gint message_nto_speak(gconstpointer, gconstpointer);
@@ -86,17 +133,17 @@ gint message_nto_speak(gconstpointer, gconstpointer);
 void set_speak_thread_attributes();
 
 /* Do priority interaction */
-void resolve_priorities(SPDPriority priority);
+void resolve_priorities(speak_sink_t * sink, SPDPriority priority);
 
 /* Queue interaction helper functions */
-openttsd_message *get_message_from_queues();
-GList *speaking_get_queue(SPDPriority priority);
-void speaking_set_queue(SPDPriority priority, GList * queue);
+openttsd_message *get_message_from_queues(speak_sink_t * sink);
+GList *speaking_get_queue(speak_sink_t * sink, SPDPriority priority);
+void speaking_set_queue(speak_sink_t * sink, SPDPriority priority,
+			GList * queue);
 gint sortbyuid(gconstpointer a, gconstpointer b);
 
-/* Get the unique id of the client who is speaking
- * on some output module */
-int get_speaking_client_uid();
+/* Get the unique id of the client who is speaking on the sink */
+int get_speaking_client_uid(speak_sink_t * sink);
 
 int socket_send_msg(int fd, char *msg);
 int report_index_mark(openttsd_message * msg, char *index_mark);
@@ -106,11 +153,17 @@ int report_pause(openttsd_message * msg);
 int report_resume(openttsd_message * msg);
 int report_cancel(openttsd_message * msg);
 
+/* Batched notifications (SET SELF NOTIFICATION_BATCH) */
+int report_batch_timeout(void);
+void report_batch_flush_expired(void);
+void report_batch_discard(int fd);
+
 GList *empty_queue(GList * queue);
 GList *empty_queue_by_time(GList * queue, unsigned int uid);
 
-int stop_priority_older_than(SPDPriority priority, unsigned int uid);
+int stop_priority_older_than(speak_sink_t * sink, SPDPriority priority,
+			     unsigned int uid);
 GList *stop_priority_from_uid(GList * queue, const int uid);
-void stop_priority_except_first(SPDPriority priority);
+void stop_priority_except_first(speak_sink_t * sink, SPDPriority priority);
 
 #endif /* SPEAKING_H */
@@ -0,0 +1,210 @@
+/*
+ * voice_cache.c - On-disk cache of the voice lists of the output modules
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * The voice list of a module is kept in a file named after the
+ * checksum of the paths of the module binary and its configuration.
+ * The first line of the file identifies what the list was read from:
+ * the device, inode, size and modification time of the binary and the
+ * checksum of the contents of the configuration file.  A file whose
+ * first line doesn't match the module as it was started is never
+ * used, so no list is served after the module or its configuration
+ * changed.  The voices follow, one per line, as "name language
+ * variant", the same as in the replies to LIST_VOICES.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <logging.h>
+#include "openttsd.h"
+#include "output.h"
+#include "voice_cache.h"
+
+#define VOICE_CACHE_VERSION "opentts-voices-1"
+
+static char *voice_cache_file(OutputModule * module)
+{
+	char *paths;
+	char *checksum;
+	char *file;
+
+	if (options.voice_cache_dir == NULL)
+		return NULL;
+
+	paths = g_strdup_printf("%s\n%s", module->filename,
+				module->configfilename != NULL ?
+				module->configfilename : "");
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, paths, -1);
+	file = g_strdup_printf("%s/%s.voices", options.voice_cache_dir,
+			       checksum);
+	g_free(checksum);
+	g_free(paths);
+
+	return file;
+}
+
+static char *voice_cache_key(OutputModule * module)
+{
+	struct stat st;
+	char *config;
+	char *config_checksum;
+	char *key;
+	gsize length;
+
+	if (stat(module->filename, &st) != 0)
+		return NULL;
+
+	if (module->configfilename != NULL
+	    && g_file_get_contents(module->configfilename, &config, &length,
+				   NULL)) {
+		config_checksum =
+		    g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+						(guchar *) config, length);
+		g_free(config);
+	} else {
+		config_checksum = g_strdup("none");
+	}
+
+	key = g_strdup_printf(VOICE_CACHE_VERSION " %lu %lu %ld %ld %s %s",
+			      (unsigned long)st.st_dev,
+			      (unsigned long)st.st_ino, (long)st.st_size,
+			      (long)st.st_mtime, config_checksum,
+			      module->filename);
+	g_free(config_checksum);
+
+	return key;
+}
+
+/*
+ * Read the voice list of the module from its cache file.  Returns
+ * NULL if there is no valid list for the module as it was started.
+ * The identity of the module is remembered for voice_cache_store().
+ */
+SPDVoice **voice_cache_load(OutputModule * module)
+{
+	SPDVoice **voices;
+	char *file;
+	char *contents;
+	gchar **lines;
+	gchar **atoms;
+	int i, n;
+
+	g_free(module->voice_cache_key);
+	module->voice_cache_key = voice_cache_key(module);
+	if (module->voice_cache_key == NULL)
+		return NULL;
+
+	file = voice_cache_file(module);
+	if (file == NULL)
+		return NULL;
+	if (!g_file_get_contents(file, &contents, NULL, NULL)) {
+		g_free(file);
+		return NULL;
+	}
+
+	lines = g_strsplit(contents, "\n", 0);
+	g_free(contents);
+	if (lines[0] == NULL || strcmp(lines[0], module->voice_cache_key)) {
+		log_msg(OTTS_LOG_INFO, "Voice cache %s of module %s is out of date",
+			file, module->name);
+		g_strfreev(lines);
+		g_free(file);
+		return NULL;
+	}
+
+	voices = g_malloc((g_strv_length(lines) + 1) * sizeof(SPDVoice *));
+	voices[0] = NULL;
+	for (i = 1, n = 0; lines[i] != NULL; i++) {
+		if (lines[i][0] == '\0')
+			continue;
+		atoms = g_strsplit(lines[i], " ", 3);
+		if (atoms[0] == NULL || atoms[1] == NULL || atoms[2] == NULL) {
+			log_msg(OTTS_LOG_ERR, "ERROR: Bad line in voice cache %s",
+				file);
+			g_strfreev(atoms);
+			g_strfreev(lines);
+			g_free(file);
+			output_free_voices(voices);
+			return NULL;
+		}
+		voices[n] = g_malloc(sizeof(SPDVoice));
+		voices[n]->name = g_strdup(atoms[0]);
+		voices[n]->language = g_strdup(atoms[1]);
+		voices[n]->variant = g_strdup(atoms[2]);
+		voices[++n] = NULL;
+		g_strfreev(atoms);
+	}
+	g_strfreev(lines);
+
+	log_msg(OTTS_LOG_INFO, "Read %d voices of module %s from %s", n,
+		module->name, file);
+	g_free(file);
+
+	return voices;
+}
+
+/* Write the voice list of the module to its cache file */
+int voice_cache_store(OutputModule * module)
+{
+	GString *contents;
+	GError *error = NULL;
+	char *file;
+	int i;
+
+	if (module->voices == NULL || module->voice_cache_key == NULL)
+		return -1;
+
+	file = voice_cache_file(module);
+	if (file == NULL)
+		return -1;
+
+	contents = g_string_new(module->voice_cache_key);
+	g_string_append_c(contents, '\n');
+	for (i = 0; module->voices[i] != NULL; i++)
+		g_string_append_printf(contents, "%s %s %s\n",
+				       module->voices[i]->name,
+				       module->voices[i]->language,
+				       module->voices[i]->variant);
+
+	g_mkdir_with_parents(options.voice_cache_dir, S_IRWXU);
+	/* The file is replaced atomically, a reader never sees half of it */
+	if (!g_file_set_contents(file, contents->str, contents->len, &error)) {
+		log_msg(OTTS_LOG_WARN, "Can't write voice cache %s: %s", file,
+			error->message);
+		g_error_free(error);
+		g_string_free(contents, TRUE);
+		g_free(file);
+		return -1;
+	}
+
+	g_string_free(contents, TRUE);
+	g_free(file);
+	return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * voice_cache.h - On-disk cache of the voice lists of the output modules
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef VOICE_CACHE_H
+#define VOICE_CACHE_H
+
+#include "opentts/opentts_types.h"
+#include "module.h"
+
+SPDVoice **voice_cache_load(OutputModule * module);
+int voice_cache_store(OutputModule * module);
+
+#endif
@@ -0,0 +1,326 @@
+/*
+ * audio_dsp.c - Check and measure the sample processing kernels
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Compares every set of kernels the processor supports with the plain
+ * C one on random samples, for all lengths up to a few vectors and at
+ * unaligned offsets, and checks the resampler on a sine wave.
+ * Usage: audio_dsp [--bench [megasamples]]
+ * With --bench, it also prints the throughput of each set next to the
+ * loops the audio output used before, and of each resample quality.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <opentts/opentts_types.h>
+#include <audio_dsp.h>
+#include <audio_resample.h>
+
+#define MAX_LEN 100
+#define BENCH_LEN 4096
+
+static int failures;
+
+static void fail(const char *kernels, const char *what, int len, int offset)
+{
+	printf("FAIL: %s %s, length %d, offset %d\n", kernels, what, len,
+	       offset);
+	failures++;
+}
+
+static void random_samples(int16_t * samples, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		samples[i] = (rand() & 0xffff) - 32768;
+	/* Always try the extremes */
+	if (n > 2) {
+		samples[0] = INT16_MIN;
+		samples[1] = INT16_MAX;
+	}
+}
+
+static void check_kernels(const otts_dsp_kernels_t * ref,
+			  const otts_dsp_kernels_t * k)
+{
+	static const int gains[] = { 0, 1, 2047, OTTS_DSP_GAIN_UNITY / 2,
+		OTTS_DSP_GAIN_UNITY - 1, OTTS_DSP_GAIN_UNITY,
+		3 * OTTS_DSP_GAIN_UNITY, 32767
+	};
+	int16_t in[MAX_LEN + 8];
+	int16_t a[2 * MAX_LEN + 8], b[2 * MAX_LEN + 8];
+	float fa[MAX_LEN + 8], fb[MAX_LEN + 8];
+	int len, offset;
+	size_t g;
+
+	for (len = 0; len <= MAX_LEN; len++) {
+		for (offset = 0; offset < 4; offset++) {
+			random_samples(in + offset, len);
+
+			memcpy(a, in + offset, len * sizeof(int16_t));
+			memcpy(b + offset, in + offset, len * sizeof(int16_t));
+			ref->swap16(a, len);
+			k->swap16(b + offset, len);
+			if (memcmp(a, b + offset, len * sizeof(int16_t)))
+				fail(k->name, "swap16", len, offset);
+
+			for (g = 0; g < sizeof(gains) / sizeof(gains[0]); g++) {
+				ref->scale16(a, in + offset, len, gains[g]);
+				k->scale16(b + offset, in + offset, len,
+					   gains[g]);
+				if (memcmp(a, b + offset, len * sizeof(int16_t)))
+					fail(k->name, "scale16", len, offset);
+			}
+
+			/* In place */
+			memcpy(b + offset, in + offset, len * sizeof(int16_t));
+			k->scale16(b + offset, b + offset, len, 3000);
+			ref->scale16(a, in + offset, len, 3000);
+			if (memcmp(a, b + offset, len * sizeof(int16_t)))
+				fail(k->name, "scale16 in place", len, offset);
+
+			ref->mono_to_stereo16(a, in + offset, len);
+			k->mono_to_stereo16(b + offset, in + offset, len);
+			if (memcmp(a, b + offset, 2 * len * sizeof(int16_t)))
+				fail(k->name, "mono_to_stereo16", len, offset);
+
+			ref->s16_to_float(fa, in + offset, len);
+			k->s16_to_float(fb + offset, in + offset, len);
+			if (memcmp(fa, fb + offset, len * sizeof(float)))
+				fail(k->name, "s16_to_float", len, offset);
+		}
+	}
+}
+
+/* The reference for the results, independent of the kernels */
+static void check_scalar(const otts_dsp_kernels_t * k)
+{
+	int16_t s[4] = { 0x1234, -2, 20000, -20000 };
+	float f[2];
+
+	k->swap16(s, 1);
+	if ((uint16_t) s[0] != 0x3412)
+		fail(k->name, "swap16 value", 1, 0);
+	k->scale16(s + 1, s + 1, 3, 2 * OTTS_DSP_GAIN_UNITY);
+	if (s[1] != -4 || s[2] != INT16_MAX || s[3] != INT16_MIN)
+		fail(k->name, "scale16 value", 3, 0);
+	s[0] = INT16_MIN;
+	s[1] = 16384;
+	k->s16_to_float(f, s, 2);
+	if (f[0] != -1.0f || f[1] != 0.5f)
+		fail(k->name, "s16_to_float value", 2, 0);
+
+	if (otts_dsp_volume_gain(OTTS_VOICE_VOLUME_MAX) != OTTS_DSP_GAIN_UNITY
+	    || otts_dsp_volume_gain(OTTS_VOICE_VOLUME_MIN) != 0)
+		fail(k->name, "volume gain", 0, 0);
+}
+
+static void sine(int16_t * samples, int n, double freq, int rate)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		samples[i] = 16384 * sin(2 * M_PI * freq * i / rate);
+}
+
+/*
+ * Convert one second of a 1 kHz sine wave, in pieces of odd sizes, and
+ * compare the result with the sine wave at the new rate.  The pieces
+ * must add up to one second and the error must be small.
+ */
+static void check_resampler(otts_resample_quality_t quality, int in_rate,
+			    int out_rate, double max_error)
+{
+	otts_resampler_t *r;
+	int16_t *in, *out, *expected;
+	int error = 0;
+	char what[64];
+	int n = 0;
+	int done, piece;
+	int i;
+
+	r = otts_resampler_new(quality, 1, in_rate, out_rate);
+	in = malloc(in_rate * sizeof(int16_t));
+	out = malloc(otts_resampler_max_out(r, in_rate) * sizeof(int16_t)
+		     + otts_resampler_max_out(r, 0) * sizeof(int16_t));
+	expected = malloc(out_rate * sizeof(int16_t));
+	sine(in, in_rate, 1000, in_rate);
+	sine(expected, out_rate, 1000, out_rate);
+
+	for (done = 0, piece = 1; done < in_rate; done += piece, piece += 37) {
+		if (piece > in_rate - done)
+			piece = in_rate - done;
+		n += otts_resampler_process(r, out + n, in + done, piece);
+	}
+	n += otts_resampler_flush(r, out + n);
+
+	snprintf(what, sizeof(what), "resample %d to %d", in_rate, out_rate);
+	if (n < out_rate - 1 || n > out_rate + 1)
+		fail(what, "length", n, quality);
+
+	/* Leave out the ends, where the filter reaches past the input */
+	for (i = 100; i < out_rate - 100 && i < n; i++)
+		if (abs(out[i] - expected[i]) > error)
+			error = abs(out[i] - expected[i]);
+	if (error > max_error * 16384)
+		fail(what, "error", error, quality);
+
+	otts_resampler_free(r);
+	free(in);
+	free(out);
+	free(expected);
+}
+
+static void check_resample(void)
+{
+	/* Largest error for each quality, relative to the amplitude */
+	static const double max_error[] = { 0, 0.03, 0.005, 0.001 };
+	otts_resample_quality_t q;
+
+	if (otts_resample_quality("best") != OTTS_RESAMPLE_BEST
+	    || otts_resample_quality("bad") != -1)
+		fail("resample", "quality names", 0, 0);
+
+	for (q = OTTS_RESAMPLE_FAST; q <= OTTS_RESAMPLE_BEST; q++) {
+		check_resampler(q, 16000, 44100, max_error[q]);
+		check_resampler(q, 22050, 44100, max_error[q]);
+		check_resampler(q, 48000, 44100, max_error[q]);
+		check_resampler(q, 44100, 16000, max_error[q]);
+	}
+}
+
+/* The loops of the audio output before the kernels */
+static void old_scale16(int16_t * out, const int16_t * in, size_t n,
+			int volume)
+{
+	float real_volume = (float)(volume - OTTS_VOICE_VOLUME_MIN)
+	    / (float)(OTTS_VOICE_VOLUME_MAX - OTTS_VOICE_VOLUME_MIN);
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = in[i] * real_volume;
+}
+
+static void old_swap16(int16_t * samples, size_t n)
+{
+	unsigned char *out_ptr, *out_end, c;
+
+	out_ptr = (unsigned char *)samples;
+	out_end = out_ptr + n * 2;
+	while (out_ptr < out_end) {
+		c = out_ptr[0];
+		out_ptr[0] = out_ptr[1];
+		out_ptr[1] = c;
+		out_ptr += 2;
+	}
+}
+
+static double seconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#define BENCH(label, name, call) \
+	do { \
+		double t = seconds(); \
+		for (r = 0; r < rounds; r++) \
+			call; \
+		t = seconds() - t; \
+		printf("%-18s %-6s %8.0f Msamples/s\n", label, name, \
+		       (double)rounds * BENCH_LEN / t / 1e6); \
+	} while (0)
+
+static void bench(long megasamples)
+{
+	static int16_t in[BENCH_LEN], out[2 * BENCH_LEN];
+	static float fout[BENCH_LEN];
+	const otts_dsp_kernels_t *k;
+	long rounds = megasamples * 1000000 / BENCH_LEN;
+	long r;
+	int i;
+
+	random_samples(in, BENCH_LEN);
+
+	BENCH("swap16", "old", old_swap16(in, BENCH_LEN));
+	for (i = 0; (k = otts_dsp_kernels(i)) != NULL; i++)
+		BENCH("swap16", k->name, k->swap16(in, BENCH_LEN));
+
+	BENCH("scale16", "old", old_scale16(out, in, BENCH_LEN, 50));
+	for (i = 0; (k = otts_dsp_kernels(i)) != NULL; i++)
+		BENCH("scale16", k->name,
+		      k->scale16(out, in, BENCH_LEN, 3000));
+
+	for (i = 0; (k = otts_dsp_kernels(i)) != NULL; i++)
+		BENCH("mono_to_stereo16", k->name,
+		      k->mono_to_stereo16(out, in, BENCH_LEN));
+
+	for (i = 0; (k = otts_dsp_kernels(i)) != NULL; i++)
+		BENCH("s16_to_float", k->name,
+		      k->s16_to_float(fout, in, BENCH_LEN));
+
+	for (i = OTTS_RESAMPLE_FAST; i <= OTTS_RESAMPLE_BEST; i++) {
+		static const char *names[] = { "", "fast", "medium", "best" };
+		otts_resampler_t *rs = otts_resampler_new(i, 1, 16000, 44100);
+		static int16_t rout[3 * BENCH_LEN + 256];
+
+		rounds /= 10;
+		BENCH("resample 16k-44k", names[i],
+		      otts_resampler_process(rs, rout, in, BENCH_LEN));
+		rounds *= 10;
+		otts_resampler_free(rs);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const otts_dsp_kernels_t *k;
+	int i;
+
+	srand(1);
+	check_scalar(otts_dsp_kernels(0));
+	for (i = 1; (k = otts_dsp_kernels(i)) != NULL; i++) {
+		printf("Checking the %s kernels\n", k->name);
+		check_kernels(otts_dsp_kernels(0), k);
+	}
+	printf("Using the %s kernels\n", otts_dsp()->name);
+	check_resample();
+
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+		bench(argc > 2 ? atol(argv[2]) : 200);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * cancel_latency.c - Measure the time from CANCEL to the end of speech
+ *
+ * Copyright (C) 2010 OpenTTS Developers
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Speaks a message with the dummy module, cancels it while it is
+ * playing and measures how long it takes until openttsd reports the
+ * cancel.  Usage: cancel_latency [limit in ms] [rounds]
+ * The test fails if the median latency is above the limit (10 ms by
+ * default).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <opentts/libopentts.h>
+
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static int state_begin;
+static int state_end;
+static struct timeval end_time;
+
+static void end_of_speech(size_t msg_id, size_t client_id,
+			  SPDNotificationType type)
+{
+	pthread_mutex_lock(&state_mutex);
+	gettimeofday(&end_time, NULL);
+	state_end = type;
+	pthread_cond_signal(&state_cond);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+static void begin_of_speech(size_t msg_id, size_t client_id,
+			    SPDNotificationType type)
+{
+	pthread_mutex_lock(&state_mutex);
+	state_begin = 1;
+	pthread_cond_signal(&state_cond);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+static int wait_for(int *state, int seconds)
+{
+	struct timespec timeout;
+	int ret = 0;
+
+	timeout.tv_sec = time(NULL) + seconds;
+	timeout.tv_nsec = 0;
+
+	pthread_mutex_lock(&state_mutex);
+	while (*state == 0 && ret == 0)
+		ret = pthread_cond_timedwait(&state_cond, &state_mutex,
+					     &timeout);
+	pthread_mutex_unlock(&state_mutex);
+
+	return ret == 0 ? 0 : -1;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+	SPDConnection *conn;
+	struct timeval cancel_time;
+	long *latency;
+	long limit = 10;
+	int rounds = 20;
+	int measured = 0;
+	int i;
+
+	if (argc > 1)
+		limit = atol(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	if (rounds < 1)
+		rounds = 1;
+	latency = calloc(rounds, sizeof(long));
+
+	printf("Start of the test.\n");
+
+	conn = spd_open("cancel_latency", NULL, NULL, SPD_MODE_THREADED);
+	if (conn == NULL) {
+		printf("Can't connect to openttsd\n");
+		exit(1);
+	}
+
+	conn->callback_begin = begin_of_speech;
+	conn->callback_end = end_of_speech;
+	conn->callback_cancel = end_of_speech;
+	spd_set_notification_on(conn, SPD_BEGIN);
+	spd_set_notification_on(conn, SPD_END);
+	spd_set_notification_on(conn, SPD_CANCEL);
+
+	if (spd_set_output_module(conn, "dummy") != 0) {
+		printf("Can't select the dummy module\n");
+		exit(1);
+	}
+
+	for (i = 0; i < rounds; i++) {
+		state_begin = 0;
+		state_end = 0;
+
+		if (spd_say(conn, SPD_MESSAGE, "Cancel latency test") == -1) {
+			printf("Can't send the message\n");
+			exit(1);
+		}
+		if (wait_for(&state_begin, 5) != 0) {
+			printf("The message didn't start speaking\n");
+			exit(1);
+		}
+
+		/* Let the audio output get going */
+		usleep(200000);
+
+		gettimeofday(&cancel_time, NULL);
+		spd_cancel(conn);
+		if (wait_for(&state_end, 5) != 0) {
+			printf("No notification after CANCEL\n");
+			exit(1);
+		}
+
+		if (state_end != SPD_CANCEL) {
+			/* The message was over before we canceled it */
+			printf("Round %d: message ended before the cancel\n",
+			       i);
+			continue;
+		}
+
+		latency[measured] =
+		    (end_time.tv_sec - cancel_time.tv_sec) * 1000000 +
+		    (end_time.tv_usec - cancel_time.tv_usec);
+		printf("Round %d: %ld us\n", i, latency[measured]);
+		measured++;
+	}
+
+	spd_close(conn);
+
+	if (measured == 0) {
+		printf("The dummy module finished every message before it "
+		       "could be canceled, nothing measured.\n");
+		exit(0);
+	}
+
+	qsort(latency, measured, sizeof(long), compare_long);
+	printf("Cancel latency: median %ld us, worst %ld us (%d rounds)\n",
+	       latency[measured / 2], latency[measured - 1], measured);
+
+	if (latency[measured / 2] > limit * 1000) {
+		printf("FAILED: the median is above %ld ms\n", limit);
+		exit(1);
+	}
+
+	printf("End of the test.\n");
+	exit(0);
+}